@@ -25,14 +25,17 @@
 #define VARINT_BITS_PER_BYTE 7
 #define VARINT_HIGH_VALUE ( 1 << VARINT_BITS_PER_BYTE )
 
+/* Longest valid encoding of 64 bits */
+#define VARINT_MAX_BYTES 10
+
 static inline void encode_varint_u64(uint64_t v,
                                      unsigned char **buf, ssize_t *left)
 {
   unsigned char *c = *buf;
-  
+
   while (v >= VARINT_HIGH_VALUE && *left > 0)
     {
-      *c++ = v % VARINT_HIGH_VALUE + VARINT_HIGH_VALUE;
+      *c++ = (v & (VARINT_HIGH_VALUE - 1)) | VARINT_HIGH_VALUE;
       (*left)--;
       v >>= VARINT_BITS_PER_BYTE;
     }
@@ -48,43 +51,95 @@ static inline void encode_varint_u64(uint64_t v,
     }
 }
 
+/* With 8 bytes to look at, we can find the end of the varint (the
+ * first byte without the highest bit set) in one go, and then squeeze
+ * out the continuation bits in three steps, instead of a byte at a
+ * time. That covers everything below 2^56; the rest (and the tail of
+ * the buffer) is decoded a byte at a time. */
+#if defined(__GNUC__) && defined(__BYTE_ORDER__)        \
+  && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define VARINT_SWAR
+#endif
+
 static inline bool decode_varint_u64(unsigned char **buf, ssize_t *left,
                                      uint64_t *v)
 {
-  /* Find first byte without highest bit set, and increment beyond that. */
-  unsigned char *s, *e;
+  unsigned char *c = *buf;
+  uint64_t r = 0;
+  int shift = 0;
 
-  *v = 0;
-  e = s = *buf;
-  while (*left > 0 && (*e & VARINT_HIGH_VALUE))
+  if (*left <= 0)
+    return false;
+  /* Most of them are a single byte. */
+  if (*c < VARINT_HIGH_VALUE)
     {
-      e++;
+      *v = *c;
+      *buf = c + 1;
       (*left)--;
+      return true;
     }
-  if (*left <= 0)
-    return false;
-  /* Ok, 'e' points now at highest order bits. So mark the end, and
-   * then iterate from e to s, shifting bits as we go.. */
-  *buf = e + 1;
-  (*left)--;
-  *v = *e;
-  while (e > s)
+#ifdef VARINT_SWAR
+  if (*left >= 8)
     {
-      e--;
-      *v = (*v << VARINT_BITS_PER_BYTE) + *e % VARINT_HIGH_VALUE;
+      uint64_t w, stop;
+      int n;
+
+      memcpy(&w, c, sizeof(w));
+      stop = ~w & 0x8080808080808080ULL;
+      if (stop)
+        {
+          n = __builtin_ctzll(stop) / 8 + 1;
+          if (n < 8)
+            w &= (1ULL << (8 * n)) - 1;
+          w &= 0x7f7f7f7f7f7f7f7fULL;
+          w = (w & 0x007f007f007f007fULL) | ((w & 0x7f007f007f007f00ULL) >> 1);
+          w = (w & 0x00003fff00003fffULL) | ((w & 0x3fff00003fff0000ULL) >> 2);
+          w = (w & 0x000000000fffffffULL) | ((w & 0x0fffffff00000000ULL) >> 4);
+          *v = w;
+          *buf = c + n;
+          *left -= n;
+          return true;
+        }
     }
-  return true;
+#endif /* VARINT_SWAR */
+  while (*left > 0)
+    {
+      unsigned char b = *c++;
+
+      (*left)--;
+      /* (The 10th byte has room for just the top bit.) */
+      if (shift == 63 && b > 1)
+        return false;
+      r |= (uint64_t)(b & (VARINT_HIGH_VALUE - 1)) << shift;
+      if (b < VARINT_HIGH_VALUE)
+        {
+          *v = r;
+          *buf = c;
+          return true;
+        }
+      shift += VARINT_BITS_PER_BYTE;
+      if (shift >= VARINT_MAX_BYTES * VARINT_BITS_PER_BYTE)
+        return false;
+    }
+  return false;
+}
+
+/* Zigzag: 0 = 0, -1 = 1, 1 = 2, -2 = 3, 2 = 4 .. (done with bit
+ * operations, so that the whole int64 range works) */
+static inline uint64_t zigzag_encode_s64(int64_t v)
+{
+  return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+static inline int64_t zigzag_decode_s64(uint64_t v)
+{
+  return (int64_t)((v >> 1) ^ -(v & 1));
 }
 
 static inline void encode_varint_s64(int64_t v,
                                      unsigned char **buf, ssize_t *left)
 {
-  /* 0 = 0, 1 = 2, 2 = 4 */
-  if (v >= 0)
-    encode_varint_u64(v * 2, buf, left); 
-  else
-    /* -1 = 1, -2 = 3 */
-    encode_varint_u64(-v * 2 - 1, buf, left);
+  encode_varint_u64(zigzag_encode_s64(v), buf, left);
 }
 
 static inline bool decode_varint_s64(unsigned char **buf, ssize_t *left,
@@ -94,10 +149,7 @@ static inline bool decode_varint_s64(unsigned char **buf, ssize_t *left,
 
   if (!decode_varint_u64(buf, left, &v2))
     return false;
-  if (v2 % 2 == 0)
-    *v = v2 / 2;
-  else
-    *v = (int64_t) -v2 / 2 - 1;
+  *v = zigzag_decode_s64(v2);
   return true;
 }
 
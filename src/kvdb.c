@@ -19,6 +19,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 static kvdb_init_s _key_init[] = {
   {.n = KEY_APP, .s = APP_STRING},
@@ -34,30 +35,87 @@ static kvdb_init_s _app_init[] = {
 static kvdb_init_s _stmt_init[] =
   {
     {.n = STMT_INSERT_LOG,
-     .s = "INSERT INTO log (oid, key, value, time_added, last_modified) "
-     "VALUES(?1, ?2, ?3, ?4, ?5)"},
+     .s = "INSERT INTO log (oid, key, value, time_added, last_modified, ext, "
+     "type) VALUES(?1, ?2, ?3, ?4, ?5, ?6, ?7)"},
     {.n = STMT_INSERT_APP_CLASS,
-     .s = "INSERT INTO app_class (app, class, oid) VALUES(?1, ?2, ?3)"},
+     .s = "INSERT OR IGNORE INTO app_class (app_id, class_id, oid) "
+     "VALUES(?1, ?2, ?3)"},
+    {.n = STMT_SELECT_APP_ID,
+     .s = "SELECT id FROM app_names WHERE name=?1"},
+    {.n = STMT_INSERT_APP_ID,
+     .s = "INSERT INTO app_names (name) VALUES(?1)"},
+    {.n = STMT_SELECT_CLASS_ID,
+     .s = "SELECT id FROM class_names WHERE name=?1"},
+    {.n = STMT_INSERT_CLASS_ID,
+     .s = "INSERT INTO class_names (name) VALUES(?1)"},
     {.n = STMT_DELETE_CS,
      .s = "DELETE FROM cs WHERE oid=?1 and key=?2"},
     {.n = STMT_INSERT_CS,
-     .s = "INSERT INTO cs (oid, key, value, last_modified) "
-     "VALUES(?1, ?2, ?3, ?4)"},
+     .s = "INSERT INTO cs (oid, key, value, last_modified, ext, type) "
+     "VALUES(?1, ?2, ?3, ?4, ?5, ?6)"},
     {.n = STMT_SELECT_CS_BY_OID,
-     .s = "SELECT key, value, last_modified FROM cs WHERE oid=?1"},
-    {.n = STMT_SELECT_CS_BY_KEY,
-     .s = "SELECT oid FROM cs WHERE key=?1"},
+     .s = "SELECT key, value, last_modified, ext, type FROM cs WHERE oid=?1"},
+    /* (Values other than app/class are not even looked at; the
+     * row itself is only visited for those.) */
+    {.n = STMT_SELECT_CS_KEYS_BY_OID,
+     .s = "SELECT key, CASE WHEN key IN ('" APP_STRING "', '" CLASS_STRING
+     "') THEN value END, CASE WHEN key IN ('" APP_STRING "', '" CLASS_STRING
+     "') THEN type END FROM cs WHERE oid=?1"},
+    {.n = STMT_SELECT_CS_BY_OID_KEY,
+     .s = "SELECT value, last_modified, ext, type FROM cs "
+     "WHERE oid=?1 AND key=?2"},
+    {.n = STMT_SELECT_CS_ROWID_BY_OID_KEY,
+     .s = "SELECT rowid, CASE WHEN ext THEN value END FROM cs "
+     "WHERE oid=?1 AND key=?2"},
     {.n = STMT_SELECT_LOG_BY_TA,
-     .s = "SELECT last_modified, oid, key, value "
-     "FROM log WHERE time_added >= ?1 ORDER BY time_added DESC"},
+     .s = "SELECT oid, key, value, time_added, ext, type "
+     "FROM log WHERE time_added >= ?1 ORDER BY time_added"},
     {.n = STMT_SELECT_LOG_BY_TA_OWN,
-     "SELECT oid, key, value, last_modified FROM log "
+     "SELECT oid, key, value, time_added, ext, type FROM log "
      "WHERE time_added >= ?1 AND time_added == last_modified "
-     "ORDER BY time_added DESC"
+     "ORDER BY time_added"
     },
     {.n = STMT_SELECT_LOG_BY_LM_OID_KEY_VALUE,
      "SELECT oid FROM log "
      "WHERE last_modified=?1 AND oid=?2 AND key=?3 AND value=?4"},
+    {.n = STMT_SELECT_LOG_ROWID_AFTER,
+     .s = "SELECT rowid FROM log WHERE rowid > ?1 "
+     "ORDER BY rowid LIMIT 1 OFFSET ?2"},
+    /* (Versions set within the same millisecond are in rowid order.
+     * An entry with fewer than ?4 versions from it on has NULL to
+     * compare against, and stays.) */
+    {.n = STMT_DELETE_LOG_SUPERSEDED,
+     .s = "DELETE FROM log WHERE rowid > ?1 AND rowid <= ?2 "
+     "AND time_added < ?3 AND (?4 = 0 OR (last_modified, rowid) < "
+     "(SELECT l.last_modified, l.rowid FROM log l "
+     "WHERE l.oid=log.oid AND l.key=log.key "
+     "ORDER BY l.last_modified DESC, l.rowid DESC LIMIT 1 OFFSET ?4 - 1)) "
+     /* (Nor does the version in effect at a checkpoint; that is, until
+      * the next one.) */
+     "AND NOT EXISTS (SELECT 1 FROM log_checkpoints c "
+     "WHERE c.time >= log.last_modified AND c.time < coalesce("
+     "(SELECT l.last_modified FROM log l "
+     "WHERE l.oid=log.oid AND l.key=log.key "
+     "AND (l.last_modified, l.rowid) > (log.last_modified, log.rowid) "
+     "ORDER BY l.last_modified, l.rowid LIMIT 1), 9223372036854775807))"},
+    {.n = STMT_SELECT_LOG_AT,
+     .s = "SELECT oid, key, value, time_added, ext, type FROM log "
+     "WHERE oid=?1 AND key=?2 AND last_modified <= ?3 "
+     "ORDER BY last_modified DESC, rowid DESC LIMIT 1"},
+    {.n = STMT_INSERT_LOG_CHECKPOINT,
+     .s = "INSERT OR IGNORE INTO log_checkpoints (time) VALUES (?1)"},
+    {.n = STMT_UPDATE_LOG_SEGMENT,
+     .s = "INSERT OR REPLACE INTO log_segments (seq, size, records) "
+     "VALUES(?1, ?2, ?3)"},
+    {.n = STMT_INSERT_LOG_INDEX,
+     .s = "INSERT OR IGNORE INTO log_index (time_added, seq, offset, record) "
+     "VALUES(?1, ?2, ?3, ?4)"},
+    {.n = STMT_SELECT_LOG_INDEX_BY_TA,
+     .s = "SELECT seq, offset, record FROM log_index "
+     "WHERE time_added <= ?1 ORDER BY time_added DESC LIMIT 1"},
+    {.n = STMT_SELECT_LOG_SEGMENTS,
+     .s = "SELECT seq, size, records FROM log_segments "
+     "WHERE seq >= ?1 ORDER BY seq"},
     {.n = -1}
   };
 
@@ -105,10 +163,78 @@ static const char *_schema_upgrades[] = {
 
   /* Make sure nop entry works too */
   "",
+
+  /* Query planner statistics (see kvdb_analyze) */
+  "CREATE TABLE search_index_stats(name, rows, histogram);"
+  ,
+
+  /* Search index key indexes on (keyish, oid); done by
+     _kvdb_index_upgrade_keys. */
+  "",
+
+  /* Intern app and class names to small integers, and store app_class
+   * clustered by (app_id, class_id, oid). */
+  "CREATE TABLE app_names (id INTEGER PRIMARY KEY, name UNIQUE);"
+  "CREATE TABLE class_names (id INTEGER PRIMARY KEY, name UNIQUE);"
+  "INSERT INTO app_names (name) SELECT DISTINCT app FROM app_class;"
+  "INSERT INTO class_names (name) SELECT DISTINCT class FROM app_class;"
+  "CREATE TABLE app_class_ids (app_id, class_id, oid, "
+  "PRIMARY KEY (app_id, class_id, oid)) WITHOUT ROWID;"
+  "INSERT OR IGNORE INTO app_class_ids "
+  "SELECT a.id, c.id, ac.oid FROM app_class ac, app_names a, class_names c "
+  "WHERE a.name=ac.app AND c.name=ac.class;"
+  "DROP TABLE app_class;"
+  "ALTER TABLE app_class_ids RENAME TO app_class;"
+  ,
+
+  /* Bookkeeping for the segment file log backend (see
+   * kvdb_log_segment.c) */
+  "CREATE TABLE log_segments (seq INTEGER PRIMARY KEY, size, records);"
+  "CREATE TABLE log_index (time_added INTEGER PRIMARY KEY, "
+  "seq, offset, record);"
+  ,
+
+  /* Values stored in the blob directory (see kvdb_blob.c) have ext
+   * set, and their digest as the value. */
+  "ALTER TABLE cs ADD COLUMN ext;"
+  "ALTER TABLE log ADD COLUMN ext;"
+  ,
+
+  /* Values are stored as their own SQLite type (integers and doubles
+   * natively, strings as text), with the kvdb_type in type. Rows
+   * from before have it NULL, and a binary value. */
+  "ALTER TABLE cs ADD COLUMN type;"
+  "ALTER TABLE log ADD COLUMN type;"
+  ,
+
+  /* Versions of a value in time order, for log compaction (see
+   * kvdb_compact) */
+  "CREATE INDEX i_log_oid_key_lm ON log (oid, key, last_modified);"
+  ,
+
+  /* Times of the history checkpoints (see kvdb_o_get_at) */
+  "CREATE TABLE log_checkpoints (time INTEGER PRIMARY KEY);"
+  ,
 };
 
 #define LATEST_SCHEMA ((int) (sizeof(_schema_upgrades) / sizeof(const char *)))
 
+/* Upgrade step that is done in C rather than SQL. */
+#define SCHEMA_INDEX_KEYS 3
+
+/* Indexes from above that the write path itself does not use; these
+ * do not exist in bulk mode. */
+static struct {
+  const char *name;
+  const char *on;
+} _deferred_indexes[] = {
+  {"i_cs_key", "cs (key)"},
+  {"i_log_ta", "log (time_added)"},
+  {"i_log_lm_oid_key", "log (last_modified, oid, key)"},
+  {"i_log_oid_key_lm", "log (oid, key, last_modified)"},
+  {NULL, NULL}
+};
+
 void _kvdb_set_err(kvdb k, char *err)
 {
   if (k->err)
@@ -180,7 +306,7 @@ bool _kvdb_run_stmt_keep(kvdb k, sqlite3_stmt *stmt)
   return _kvdb_run_stmt_int(k, stmt, false);
 }
 
-static int _kvdb_get_int(kvdb k, const char *q, int default_value)
+int _kvdb_get_int(kvdb k, const char *q, int default_value)
 {
   sqlite3_stmt *stmt = _prep_stmt(k, q);
   int rc;
@@ -275,6 +401,11 @@ static bool _kvdb_upgrade(kvdb k)
           return false;
         }
     }
+  if (schema == SCHEMA_INDEX_KEYS && !_kvdb_index_upgrade_keys(k))
+    {
+      _rollback(k);
+      return false;
+    }
   KVDEBUG("upgrade succeeded");
   stmt = _prep_stmt(k, "UPDATE db_state SET value=?1 WHERE key='version'");
   schema++;
@@ -331,7 +462,291 @@ _kvdb_o_compare(void *v1, void *v2, void *ctx)
   return memcmp(&o1->oid, &o2->oid, KVDB_OID_SIZE) == 0;
 }
 
-bool kvdb_create(const char *path, kvdb *r_k)
+kvdb_o _kvdb_cache_get(kvdb k, const void *oid)
+{
+  kvdb_cache_shard_s *cs = &k->cache[_kvdb_o_shard(oid)];
+  struct kvdb_o_struct dummy;
+  kvdb_o o;
+
+  memcpy(&dummy.oid, oid, KVDB_OID_SIZE);
+  if (k->options.threadsafe)
+    pthread_mutex_lock(&cs->lock);
+  o = ihash_get(cs->ih, &dummy);
+  if (k->options.threadsafe)
+    pthread_mutex_unlock(&cs->lock);
+  return o;
+}
+
+/* Add o to the cache. If another thread got there first, o is freed
+ * and the cached one is returned instead. */
+kvdb_o _kvdb_cache_add(kvdb k, kvdb_o o)
+{
+  kvdb_cache_shard_s *cs = &k->cache[o->shard];
+  kvdb_o r;
+
+  if (k->options.threadsafe)
+    pthread_mutex_lock(&cs->lock);
+  r = ihash_get(cs->ih, o);
+  if (!r)
+    {
+      ihash ih = ihash_insert(cs->ih, o);
+      if (ih)
+        {
+          cs->ih = ih;
+          r = o;
+        }
+    }
+  if (k->options.threadsafe)
+    pthread_mutex_unlock(&cs->lock);
+  if (r != o)
+    _kvdb_o_free(o);
+  return r;
+}
+
+static bool _kvdb_init_locks(kvdb k)
+{
+  pthread_mutexattr_t attr;
+  int i;
+
+  INIT_LIST_HEAD(&k->readers);
+  INIT_LIST_HEAD(&k->reader_lh);
+  /* Recursive, as e.g. index maintenance reads the very object being
+   * set, and SQL helpers nest. */
+  if (pthread_mutexattr_init(&attr))
+    return false;
+  pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+  pthread_mutex_init(&k->db_lock, &attr);
+  for (i = 0 ; i < KVDB_CACHE_SHARDS ; i++)
+    pthread_mutex_init(&k->cache[i].lock, &attr);
+  pthread_mutexattr_destroy(&attr);
+  pthread_mutex_init(&k->readers_lock, NULL);
+  return true;
+}
+
+/* Called for new keys, before they are visible to anyone else. */
+static void _kvdb_key_init(const char *name, void *ctx)
+{
+  kvdb_key key = (void *)name - sizeof(struct kvdb_key_struct);
+
+  INIT_LIST_HEAD(&key->index_lh);
+}
+
+void kvdb_options_init(kvdb_options o, kvdb_preset preset)
+{
+  memset(o, 0, sizeof(*o));
+  switch (preset)
+    {
+    case KVDB_PRESET_DEFAULT:
+      break;
+    case KVDB_PRESET_BULK_LOAD:
+      o->cache_size_kb = 256 * 1024;
+      o->journal_mode = KVDB_JOURNAL_WAL;
+      o->synchronous = KVDB_SYNC_OFF;
+      o->temp_store = KVDB_TEMP_STORE_MEMORY;
+      break;
+    case KVDB_PRESET_MOBILE:
+      o->page_size = 4096;
+      o->cache_size_kb = 1024;
+      o->journal_mode = KVDB_JOURNAL_WAL;
+      o->synchronous = KVDB_SYNC_NORMAL;
+      o->vacuum_interval = 16;
+      o->vacuum_pages = 64;
+      o->compact_interval = 16;
+      o->compact_rows = 1024;
+      break;
+    case KVDB_PRESET_SERVER:
+      o->cache_size_kb = 64 * 1024;
+      o->mmap_size = 1024 * 1024 * 1024;
+      o->journal_mode = KVDB_JOURNAL_WAL;
+      o->synchronous = KVDB_SYNC_NORMAL;
+      o->temp_store = KVDB_TEMP_STORE_MEMORY;
+      o->vacuum_interval = 256;
+      o->compact_interval = 256;
+      o->compact_rows = 65536;
+      break;
+    }
+}
+
+static const char *_journal_modes[] = {
+  NULL, "DELETE", "TRUNCATE", "PERSIST", "MEMORY", "WAL", "OFF"
+};
+
+/* Set the pragmas the options ask for. Readers skip the ones that
+ * would modify the file. */
+static bool _kvdb_apply_options(kvdb k)
+{
+  kvdb_options o = &k->options;
+  char buf[64];
+
+  if (!k->read_only)
+    {
+      if (o->page_size)
+        {
+          sprintf(buf, "PRAGMA page_size=%d", o->page_size);
+          SQLITE_EXEC(buf);
+        }
+      if (o->journal_mode)
+        {
+          /* Switching to WAL initializes the file, after which the
+           * first schema upgrade would be too late to enable
+           * auto_vacuum; so for new (empty) files, do it first. */
+          if (_kvdb_get_int(k, "PRAGMA page_count", -1) == 0)
+            SQLITE_EXEC("PRAGMA auto_vacuum = 2");
+          sprintf(buf, "PRAGMA journal_mode=%s",
+                  _journal_modes[o->journal_mode]);
+          SQLITE_EXEC(buf);
+        }
+    }
+  if (o->synchronous)
+    {
+      sprintf(buf, "PRAGMA synchronous=%d", o->synchronous - 1);
+      SQLITE_EXEC(buf);
+    }
+  if (o->cache_size_kb)
+    {
+      /* (Negative is in kilobytes, positive in pages.) */
+      sprintf(buf, "PRAGMA cache_size=%d", -o->cache_size_kb);
+      SQLITE_EXEC(buf);
+    }
+  if (o->mmap_size)
+    {
+      sprintf(buf, "PRAGMA mmap_size=%lld", (long long) o->mmap_size);
+      SQLITE_EXEC(buf);
+    }
+  if (o->temp_store)
+    {
+      sprintf(buf, "PRAGMA temp_store=%d", o->temp_store);
+      SQLITE_EXEC(buf);
+    }
+  return true;
+}
+
+/* Copy the main database of k to (or from) the file in path. */
+static bool _kvdb_backup(kvdb k, const char *path, bool to_file)
+{
+  sqlite3 *db;
+  sqlite3_backup *b;
+  int rc;
+
+  rc = sqlite3_open_v2(path, &db,
+                       to_file ? SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE
+                       : SQLITE_OPEN_READONLY, NULL);
+  if (rc)
+    {
+      _kvdb_set_err(k, "unable to open snapshot");
+      sqlite3_close(db);
+      return false;
+    }
+  if (!to_file)
+    {
+      /* An in-memory destination has to have the same page size. */
+      sqlite3_stmt *s;
+      char buf[64];
+
+      if (sqlite3_prepare_v2(db, "PRAGMA page_size", -1, &s, NULL) == SQLITE_OK
+          && sqlite3_step(s) == SQLITE_ROW)
+        {
+          sprintf(buf, "PRAGMA page_size=%d", sqlite3_column_int(s, 0));
+          SQLITE_EXEC2(buf, );
+        }
+      sqlite3_finalize(s);
+    }
+  b = to_file ? sqlite3_backup_init(db, "main", k->db, "main")
+    : sqlite3_backup_init(k->db, "main", db, "main");
+  if (!b)
+    {
+      _kvdb_set_err_from_sqlite2(k, "backup");
+      sqlite3_close(db);
+      return false;
+    }
+  rc = sqlite3_backup_step(b, -1);
+  sqlite3_backup_finish(b);
+  sqlite3_close(db);
+  if (rc != SQLITE_DONE)
+    {
+      _kvdb_set_err(k, "snapshot copy failed");
+      return false;
+    }
+  return true;
+}
+
+static bool _kvdb_bulk_begin(kvdb k)
+{
+  char buf[128];
+  int i;
+
+  for (i = 0 ; _deferred_indexes[i].name ; i++)
+    {
+      sprintf(buf, "DROP INDEX IF EXISTS %s", _deferred_indexes[i].name);
+      SQLITE_EXEC(buf);
+    }
+  SQLITE_EXEC("CREATE TABLE IF NOT EXISTS bulk_app_class "
+              "(app_id, class_id, oid)");
+  if (!(k->stmt_bulk_app_class =
+        _prep_stmt(k, "INSERT INTO bulk_app_class (app_id, class_id, oid) "
+                   "VALUES (?1, ?2, ?3)")))
+    return false;
+  if (!_kvdb_index_set_bulk(k, true))
+    return false;
+  k->bulk = true;
+  return true;
+}
+
+/* Build the deferred indexes, and move the collected rows (sorted) to
+ * app_class. Nothing to do if there was no bulk load (bulk_app_class
+ * goes in the same transaction as the indexes that were dropped). */
+static bool _kvdb_bulk_finish(kvdb k)
+{
+  char buf[128];
+  int i;
+
+  sqlite3_finalize(k->stmt_bulk_app_class);
+  k->stmt_bulk_app_class = NULL;
+  k->bulk = false;
+  if (!_kvdb_get_int(k, "SELECT count(*) FROM sqlite_master "
+                     "WHERE name='bulk_app_class'", 0))
+    return true;
+  SQLITE_EXEC("INSERT OR IGNORE INTO app_class (app_id, class_id, oid) "
+              "SELECT app_id, class_id, oid FROM bulk_app_class "
+              "ORDER BY app_id, class_id, oid");
+  for (i = 0 ; _deferred_indexes[i].name ; i++)
+    {
+      sprintf(buf, "CREATE INDEX IF NOT EXISTS %s ON %s",
+              _deferred_indexes[i].name, _deferred_indexes[i].on);
+      SQLITE_EXEC(buf);
+    }
+  if (!_kvdb_index_set_bulk(k, false))
+    return false;
+  SQLITE_EXEC("DROP TABLE bulk_app_class");
+  return true;
+}
+
+bool kvdb_bulk_begin(kvdb k)
+{
+  bool r = true;
+
+  if (!_kvdb_writable(k))
+    return false;
+  _kvdb_lock(k);
+  if (!k->bulk)
+    r = _kvdb_bulk_begin(k);
+  _kvdb_unlock(k);
+  return r;
+}
+
+bool kvdb_bulk_end(kvdb k)
+{
+  bool r = true;
+
+  _kvdb_lock(k);
+  if (k->bulk)
+    r = _kvdb_bulk_finish(k);
+  _kvdb_unlock(k);
+  return r;
+}
+
+static bool _kvdb_open(const char *path, kvdb_options options,
+                       bool read_only, kvdb *r_k)
 {
   int i;
   int rc;
@@ -344,7 +759,29 @@ bool kvdb_create(const char *path, kvdb *r_k)
   *r_k = k;
   if (!k)
     return false;
-  rc = sqlite3_open(path, &k->db);
+  k->read_only = read_only;
+  if (options)
+    k->options = *options;
+  if (read_only)
+    k->options.async_commit = false;
+  if (k->options.async_commit)
+    k->options.threadsafe = true;
+  if (!_kvdb_init_locks(k))
+    {
+      free(k);
+      *r_k = NULL;
+      return false;
+    }
+  k->path = strdup(path);
+  if (!k->path)
+    {
+      _kvdb_set_err(k, "strdup failed");
+      goto fail;
+    }
+  rc = sqlite3_open_v2(path, &k->db,
+                       read_only ? SQLITE_OPEN_READONLY
+                       : SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE,
+                       NULL);
   if (rc)
     {
       _kvdb_set_err_from_sqlite(k);
@@ -352,7 +789,39 @@ fail:
       kvdb_destroy(k);
       return false;
     }
+  sqlite3_busy_timeout(k->db, KVDB_BUSY_TIMEOUT_MS);
+  if (strcmp(path, KVDB_MEMORY) == 0)
+    {
+      /* Nothing to share with readers, or to journal on disk. */
+      k->options.journal_mode = KVDB_JOURNAL_MEMORY;
+      k->options.log_backend = KVDB_LOG_SQLITE;
+      if (k->options.snapshot_path
+          && access(k->options.snapshot_path, R_OK) == 0
+          && !_kvdb_backup(k, k->options.snapshot_path, false))
+        goto fail;
+    }
+  else
+    {
+      k->options.snapshot_path = NULL;
+      if (!_kvdb_blob_init(k))
+        goto fail;
+    }
+  /* (Before the upgrade, as e.g. page size can be set only before
+   * there is anything in the file.) */
+  if (!_kvdb_apply_options(k))
+    goto fail;
   int schema;
+  if (read_only)
+    {
+      /* Readers cannot upgrade; the writer has to do it. */
+      schema = _kvdb_get_schema(k);
+      if (schema != LATEST_SCHEMA)
+        {
+          _kvdb_set_err(k, "reader with non-latest schema");
+          goto fail;
+        }
+      goto schema_done;
+    }
   while ((schema = _kvdb_get_schema(k)) < LATEST_SCHEMA)
     {
       if (!_kvdb_upgrade(k))
@@ -393,31 +862,36 @@ fail:
   if (*hname && hname[strlen(hname)-1] == '\n')
     hname[strlen(hname)-1] = 0;
   KVDEBUG("got name %s", hname);
-  k->ss_app = stringset_create(sizeof(struct kvdb_app_struct), NULL, NULL);
+ schema_done:
+  k->ss_app = stringset_create(offsetof(struct kvdb_app_struct, name),
+                               NULL, NULL);
   if (!k->ss_app)
     {
       _kvdb_set_err(k, "stringset_create failed");
       goto fail;
     }
-  k->ss_class = stringset_create(sizeof(struct kvdb_class_struct), NULL, NULL);
+  k->ss_class = stringset_create(offsetof(struct kvdb_class_struct, name),
+                                 NULL, NULL);
   if (!k->ss_class)
     {
       _kvdb_set_err(k, "stringset_create failed");
       goto fail;
     }
-  k->ss_key = stringset_create(sizeof(struct kvdb_key_struct), NULL, NULL);
+  k->ss_key = stringset_create(sizeof(struct kvdb_key_struct),
+                               _kvdb_key_init, NULL);
   if (!k->ss_key)
     {
       _kvdb_set_err(k, "stringset_create failed");
       goto fail;
     }
 
-  k->oid_ih = ihash_create(_kvdb_o_hash_value, _kvdb_o_compare, NULL);
-  if (!k->oid_ih)
-    {
-      _kvdb_set_err(k, "oid_ih create failed");
-      goto fail;
-    }
+  for (i = 0 ; i < KVDB_CACHE_SHARDS ; i++)
+    if (!(k->cache[i].ih = ihash_create(_kvdb_o_hash_value, _kvdb_o_compare,
+                                        NULL)))
+      {
+        _kvdb_set_err(k, "cache ihash create failed");
+        goto fail;
+      }
 
   /* Initialize the pointer structures from local data */
 
@@ -448,32 +922,162 @@ fail:
     KVASSERT(k->apps[i], "missing app %d", i);
 
   /* Init submodules */
+  INIT_LIST_HEAD(&k->indexes);
   if (!_kvdb_index_init(k))
     goto fail;
 
-  if (!_kvdb_io_init(k))
+  k->log_ops = &_kvdb_log_sqlite_ops;
+  if (!_kvdb_log_segment_init(k))
     goto fail;
 
-  /* Start transaction - commit call commits changes. */
+  /* (Readers have no use for the monotonous time.) */
+  if (!read_only && !_kvdb_io_init(k))
+    goto fail;
+
+  /* Finish whatever bulk load was interrupted. */
+  if (!read_only && !_kvdb_bulk_finish(k))
+    goto fail;
+
+  /* Start transaction - commit call commits changes. For readers,
+   * this is the snapshot they see until the next commit. */
   _begin(k);
+
+  if (k->options.async_commit && !_kvdb_flush_init(k))
+    goto fail;
   return true;
 }
 
+bool kvdb_create(const char *path, kvdb *r_k)
+{
+  return _kvdb_open(path, NULL, false, r_k);
+}
+
+bool kvdb_create_with_options(const char *path, kvdb_options options,
+                              kvdb *r_k)
+{
+  return _kvdb_open(path, options, false, r_k);
+}
+
+bool kvdb_open_reader(kvdb k, kvdb *r_k)
+{
+  if (k->options.journal_mode != KVDB_JOURNAL_WAL)
+    {
+      *r_k = NULL;
+      _kvdb_set_err(k, "readers require WAL mode");
+      return false;
+    }
+  return _kvdb_open(k->path, &k->options, true, r_k);
+}
+
+/* What is left of k once it (and every reader of it) is gone. */
+static void _kvdb_free(kvdb k)
+{
+  if (k->reader_key_valid)
+    pthread_key_delete(k->reader_key);
+  pthread_mutex_destroy(&k->readers_lock);
+  free(k);
+}
+
+static void _thread_reader_destroy(void *v)
+{
+  kvdb r = v;
+  kvdb k = r->parent;
+  bool last;
+
+  pthread_mutex_lock(&k->readers_lock);
+  list_del(&r->reader_lh);
+  pthread_mutex_unlock(&k->readers_lock);
+  kvdb_destroy(r);
+  pthread_mutex_lock(&k->readers_lock);
+  last = k->destroyed && list_empty(&k->readers);
+  pthread_mutex_unlock(&k->readers_lock);
+  if (last)
+    _kvdb_free(k);
+}
+
+kvdb kvdb_thread_reader(kvdb k)
+{
+  kvdb r = NULL;
+
+  pthread_mutex_lock(&k->readers_lock);
+  if (!k->reader_key_valid)
+    {
+      if (pthread_key_create(&k->reader_key, _thread_reader_destroy))
+        {
+          _kvdb_set_err(k, "pthread_key_create failed");
+          goto done;
+        }
+      k->reader_key_valid = true;
+    }
+  r = pthread_getspecific(k->reader_key);
+  if (r)
+    goto done;
+  if (!kvdb_open_reader(k, &r))
+    goto done;
+  if (pthread_setspecific(k->reader_key, r))
+    {
+      kvdb_destroy(r);
+      r = NULL;
+      goto done;
+    }
+  r->parent = k;
+  list_add(&r->reader_lh, &k->readers);
+ done:
+  pthread_mutex_unlock(&k->readers_lock);
+  return r;
+}
+
 static bool _ih_free_iterator(void *o, void *context)
 {
   _kvdb_o_free(o);
   return true;
 }
 
+static void _kvdb_cache_flush(kvdb k, bool destroy)
+{
+  int i;
+
+  for (i = 0 ; i < KVDB_CACHE_SHARDS ; i++)
+    {
+      kvdb_cache_shard_s *cs = &k->cache[i];
+
+      if (!cs->ih)
+        continue;
+      if (k->options.threadsafe)
+        pthread_mutex_lock(&cs->lock);
+      ihash_iterate(cs->ih, _ih_free_iterator, NULL);
+      ihash_destroy(cs->ih);
+      cs->ih = destroy ? NULL
+        : ihash_create(_kvdb_o_hash_value, _kvdb_o_compare, NULL);
+      if (k->options.threadsafe)
+        pthread_mutex_unlock(&cs->lock);
+    }
+}
+
 void kvdb_destroy(kvdb k)
 {
-  _rollback(k);
+  kvdb r;
+  bool last;
+  int i;
+
   KVASSERT(k, "no object to kvdb_destroy");
-  if (k->oid_ih)
+
+  /* Our own per-thread reader goes now. Other threads may be using
+   * theirs, so those go only as the threads exit; they have their
+   * own connection, and need just readers_lock of ours. */
+  if (k->reader_key_valid && (r = pthread_getspecific(k->reader_key)))
     {
-      ihash_iterate(k->oid_ih, _ih_free_iterator, NULL);
-      ihash_destroy(k->oid_ih);
+      pthread_setspecific(k->reader_key, NULL);
+      _thread_reader_destroy(r);
     }
+
+  _kvdb_flush_stop(k);
+  sqlite3_finalize(k->stmt_bulk_app_class);
+
+  _rollback(k);
+  if (k->log_ops && k->log_ops->destroy)
+    k->log_ops->destroy(k);
+  _kvdb_cache_flush(k, true);
   if (k->ss_app)
     stringset_destroy(k->ss_app);
   if (k->ss_class)
@@ -484,7 +1088,19 @@ void kvdb_destroy(kvdb k)
     sqlite3_close(k->db);
   if (k->err)
     free(k->err);
-  free(k);
+  if (k->path)
+    free(k->path);
+  if (k->blob_dir)
+    free(k->blob_dir);
+  pthread_mutex_destroy(&k->db_lock);
+  for (i = 0 ; i < KVDB_CACHE_SHARDS ; i++)
+    pthread_mutex_destroy(&k->cache[i].lock);
+  pthread_mutex_lock(&k->readers_lock);
+  k->destroyed = true;
+  last = list_empty(&k->readers);
+  pthread_mutex_unlock(&k->readers_lock);
+  if (last)
+    _kvdb_free(k);
 }
 
 const char *kvdb_strerror(kvdb k)
@@ -496,61 +1112,350 @@ const char *kvdb_strerror(kvdb k)
   return k->err;
 }
 
+bool _kvdb_writable(kvdb k)
+{
+  if (!k->read_only)
+    return true;
+  _kvdb_set_err(k, "write to a read-only kvdb");
+  return false;
+}
+
+static bool _kvdb_reader_refresh(kvdb k)
+{
+  int i;
+  bool r;
+
+  /* Move to the current snapshot. The writer may have defined new
+   * indexes meanwhile. */
+  _kvdb_lock(k);
+  _commit(k);
+  _begin(k);
+  r = _kvdb_index_init(k);
+  _kvdb_unlock(k);
+
+  /* Forget everything based on the old one. */
+  _kvdb_cache_flush(k, false);
+  for (i = 0 ; i < KVDB_CACHE_SHARDS ; i++)
+    if (!k->cache[i].ih)
+      {
+        _kvdb_set_err(k, "cache ihash create failed");
+        return false;
+      }
+  return r;
+}
+
 bool kvdb_commit(kvdb k)
 {
+  if (k->read_only)
+    return _kvdb_reader_refresh(k);
+  if (k->flusher)
+    return kvdb_commit_wait(k, kvdb_commit_async(k));
+  return _kvdb_commit(k);
+}
+
+/* Remove what the retention limits no longer keep from the log,
+ * looking at up to rows entries (0 = all). */
+static bool _compact(kvdb k, kvdb_time_t exported, int rows,
+                     int64_t *removed)
+{
+  kvdb_options o = &k->options;
+  kvdb_time_t before = INT64_MAX;
+
+  *removed = 0;
+  if (!k->log_ops->compact
+      || (!o->log_keep_versions && !o->log_keep_ms
+          && !o->log_keep_unexported))
+    return true;
+  if (o->log_keep_ms)
+    before = kvdb_time() - o->log_keep_ms;
+  if (o->log_keep_unexported && exported < before)
+    before = exported;
+  return k->log_ops->compact(k, before, o->log_keep_versions, rows, removed);
+}
+
+/* Record a history checkpoint, if one is due; compaction keeps the
+ * version of every value that was in effect at one. */
+static bool _checkpoint(kvdb k)
+{
+  sqlite3_stmt *s;
+  kvdb_time_t now = kvdb_monotonous_time(k);
+  int rc;
+
+  if (!k->checkpoint_time)
+    {
+      SQLITE_CALL(sqlite3_prepare_v2(k->db,
+                                     "SELECT max(time) FROM log_checkpoints",
+                                     -1, &s, NULL));
+      rc = sqlite3_step(s);
+      if (rc == SQLITE_ROW)
+        k->checkpoint_time = sqlite3_column_int64(s, 0);
+      sqlite3_finalize(s);
+      if (rc != SQLITE_ROW)
+        {
+          _kvdb_set_err_from_sqlite2(k, "log_checkpoints");
+          return false;
+        }
+    }
+  if (now - k->checkpoint_time < k->options.checkpoint_interval_ms)
+    return true;
+  s = k->stmts[STMT_INSERT_LOG_CHECKPOINT];
+  SQLITE_CALL(sqlite3_reset(s));
+  SQLITE_CALL(sqlite3_bind_int64(s, 1, now));
+  if (!_kvdb_run_stmt_keep(k, s))
+    return false;
+  k->checkpoint_time = now;
+  return true;
+}
+
+bool _kvdb_commit(kvdb k)
+{
+  kvdb_time_t exported = 0;
+  int64_t removed = 0;
+  int vacuum_pages = k->options.vacuum_pages;
+  bool vacuum = false;
+  bool r = true;
+
   /* Give import/export module chance to do 'stuff' */
   _kvdb_io_pre_commit(k);
 
-  /* Push current ops to disk. */
-  _commit(k);
+  /* (Objects lock themselves before k, so this cannot wait until
+   * compaction.) */
+  if (k->options.log_keep_unexported)
+    exported = _kvdb_io_export_time(k);
+
+  _kvdb_lock(k);
+
+  /* The log segment has to be on disk before its size is. */
+  if (k->log_ops->pre_commit && !k->log_ops->pre_commit(k))
+    {
+      _kvdb_unlock(k);
+      return false;
+    }
+
+  /* (The planner statistics go along with the changes they reflect.) */
+  if (!_kvdb_index_save_stats(k))
+    KVDEBUG("saving index statistics failed");
+
+  /* Push current ops to disk. A failed COMMIT has either rolled the
+   * changes back, or left the transaction open (in which case they go
+   * along with the next commit instead). */
+  if (!_kvdb_run_stmt(k, _prep_stmt(k, "COMMIT")))
+    {
+      KVDEBUG("commit failed: %s", kvdb_strerror(k));
+      if (sqlite3_get_autocommit(k->db))
+        _begin(k);
+      _kvdb_unlock(k);
+      return false;
+    }
+
+  if (k->options.checkpoint_interval_ms && !_checkpoint(k))
+    KVDEBUG("history checkpoint failed");
+
+  /* History goes a batch at a time along with the commits (so, with
+   * async_commit, in the background), or all of it for kvdb_compact.
+   * Not during a bulk load, though: without the log's indexes, it
+   * would scan the log for every entry (a pending kvdb_compact
+   * happens at the first commit after kvdb_bulk_end). */
+  if (k->bulk)
+    ;
+  else if (k->compact_all)
+    {
+      k->compact_all = false;
+      k->commits_since_compact = 0;
+      vacuum_pages = 0;
+      if (!_compact(k, exported, 0, &removed))
+        r = false;
+      vacuum = true;
+    }
+  else if (k->options.compact_interval
+           && ++k->commits_since_compact >= k->options.compact_interval)
+    {
+      k->commits_since_compact = 0;
+      if (!_compact(k, exported, k->options.compact_rows, &removed))
+        KVDEBUG("log compaction failed");
+    }
+
+  /* auto_vacuum is incremental, so free pages are returned only when
+   * asked for. */
+  if (removed
+      || (k->options.vacuum_interval
+          && ++k->commits_since_vacuum >= k->options.vacuum_interval))
+    vacuum = true;
+  if (vacuum)
+    {
+      char buf[64];
+
+      k->commits_since_vacuum = 0;
+      sprintf(buf, "PRAGMA incremental_vacuum(%d)", vacuum_pages);
+      SQLITE_EXEC2(buf, KVDEBUG("incremental vacuum failed"));
+    }
+
+  /* (Between transactions, so that the copy is consistent.) */
+  if (k->options.snapshot_path
+      && !_kvdb_backup(k, k->options.snapshot_path, true))
+    {
+      _begin(k);
+      _kvdb_unlock(k);
+      return false;
+    }
 
   /* Start transaction - commit call commits changes. */
   _begin(k);
 
-  return true;
+  _kvdb_unlock(k);
+  return r;
+}
+
+bool kvdb_compact(kvdb k)
+{
+  if (!_kvdb_writable(k))
+    return false;
+  /* (The next commit does it; with async_commit, in the background
+   * thread, like any other.) */
+  _kvdb_lock(k);
+  k->compact_all = true;
+  _kvdb_unlock(k);
+  return kvdb_commit(k);
+}
+
+bool kvdb_snapshot(kvdb k, const char *path)
+{
+  bool r;
+
+  if (!kvdb_commit(k))
+    return false;
+  _kvdb_lock(k);
+  r = _kvdb_backup(k, path, true);
+  _kvdb_unlock(k);
+  return r;
+}
+
+/* Look up (or allocate) the persistent id of an app/class name. */
+static int64_t _kvdb_name_id_locked(kvdb k, int select_stmt, int insert_stmt,
+                                    const char *name)
+{
+  sqlite3_stmt *s = k->stmts[select_stmt];
+  int64_t id = 0;
+  int rc;
+
+  SQLITE_CALLR2(sqlite3_reset(s), 0);
+  SQLITE_CALLR2(sqlite3_bind_text(s, 1, name, -1, SQLITE_STATIC), 0);
+  rc = sqlite3_step(s);
+  if (rc == SQLITE_ROW)
+    id = sqlite3_column_int64(s, 0);
+  SQLITE_CALLR2(sqlite3_reset(s), 0);
+  if (id || rc != SQLITE_DONE)
+    return id;
+  /* Readers cannot add names; -1 matches nothing (but is looked up
+   * again next time, in case the writer has added it since). */
+  if (k->read_only)
+    return -1;
+  s = k->stmts[insert_stmt];
+  SQLITE_CALLR2(sqlite3_reset(s), 0);
+  SQLITE_CALLR2(sqlite3_bind_text(s, 1, name, -1, SQLITE_STATIC), 0);
+  if (!_kvdb_run_stmt_keep(k, s))
+    return 0;
+  return sqlite3_last_insert_rowid(k->db);
+}
+
+/* The id is the same no matter who resolves it, so racing threads
+ * just store the same value. */
+static bool _kvdb_name_id(kvdb k, int select_stmt, int insert_stmt,
+                          const char *name, int64_t *id)
+{
+  int64_t v = __atomic_load_n(id, __ATOMIC_RELAXED);
+
+  if (v > 0)
+    return true;
+  _kvdb_lock(k);
+  v = _kvdb_name_id_locked(k, select_stmt, insert_stmt, name);
+  _kvdb_unlock(k);
+  __atomic_store_n(id, v, __ATOMIC_RELAXED);
+  return v != 0;
+}
+
+/* Find (or add) the stringset entry for name, and return its extra
+ * data. (Stringsets do their own locking, if any.) */
+static void *_kvdb_intern(stringset ss, const char *name)
+{
+  const char *s = stringset_get_or_insert(ss, name);
+
+  return s ? stringset_get_data_from_string(ss, s) : NULL;
 }
 
 kvdb_app kvdb_define_app(kvdb k, const char *name)
 {
+  kvdb_app app;
+
   if (!name)
     return NULL;
-  const char *s = stringset_get_or_insert(k->ss_app, name);
-  if (s)
-    return stringset_get_data_from_string(k->ss_app, s);
-  return NULL;
+  app = _kvdb_intern(k->ss_app, name);
+  if (!app
+      || !_kvdb_name_id(k, STMT_SELECT_APP_ID, STMT_INSERT_APP_ID, name,
+                        &app->id))
+    return NULL;
+  return app;
 }
 
 kvdb_class kvdb_define_class(kvdb k, const char *name)
 {
+  kvdb_class cl;
+
   if (!name)
     return NULL;
-  const char *s = stringset_get_or_insert(k->ss_class, name);
-  if (s)
-    return stringset_get_data_from_string(k->ss_class, s);
-  return NULL;
+  cl = _kvdb_intern(k->ss_class, name);
+  if (!cl
+      || !_kvdb_name_id(k, STMT_SELECT_CLASS_ID, STMT_INSERT_CLASS_ID, name,
+                        &cl->id))
+    return NULL;
+  return cl;
+}
+
+bool kvdb_class_prefetch_key(kvdb k, kvdb_class cl, kvdb_key key)
+{
+  bool r = true;
+  int i;
+
+  _kvdb_lock(k);
+  if (!key)
+    {
+      cl->prefetch_all = true;
+      goto done;
+    }
+  for (i = 0 ; i < cl->n_prefetch ; i++)
+    if (cl->prefetch[i] == key)
+      goto done;
+  if (cl->n_prefetch == KVDB_CLASS_PREFETCH_SIZE)
+    {
+      _kvdb_set_err(k, "too many prefetched keys");
+      r = false;
+      goto done;
+    }
+  cl->prefetch[cl->n_prefetch++] = key;
+ done:
+  _kvdb_unlock(k);
+  return r;
 }
 
 kvdb_key kvdb_define_key(kvdb k, const char *name, kvdb_type t)
 {
   kvdb_key key;
+  kvdb_type old = KVDB_NULL;
 
   if (!name)
     return NULL;
-  const char *s = stringset_get_or_insert(k->ss_key, name);
-  if (!s)
+  key = _kvdb_intern(k->ss_key, name);
+  if (!key)
     return NULL;
-  key = stringset_get_data_from_string(k->ss_key, s);
-  if (!key->index_lh.next)
-    INIT_LIST_HEAD(&key->index_lh);
-  if (t != KVDB_NULL)
+  if (t == KVDB_NULL)
+    return key;
+  /* Untyped key gets the type of its first typed definition. */
+  if (!__atomic_compare_exchange_n(&key->type, &old, t, false,
+                                   __ATOMIC_RELAXED, __ATOMIC_RELAXED)
+      && old != t)
     {
-      if (key->type != KVDB_NULL
-          && key->type != t)
-        {
-          KVDEBUG("attempted to redefine key type - punting");
-          return NULL;
-        }
-      key->type = t;
+      KVDEBUG("attempted to redefine key type - punting");
+      return NULL;
     }
   return key;
 }
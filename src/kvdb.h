@@ -36,9 +36,184 @@ bool kvdb_init();
  *
  * Create (or get) database from the file in path. The return value is
  * whether the operation succeeded or not.
+ *
+ * With KVDB_MEMORY as the path, the database lives only in memory
+ * (see also snapshot_path within kvdb_options); it has no readers.
  */
 bool kvdb_create(const char *path, kvdb *k);
 
+#define KVDB_MEMORY ":memory:"
+
+/* SQLite tuning knobs. The zero value of each means 'SQLite
+ * default' (i.e. the pragma is not touched at all). */
+
+typedef enum {
+  KVDB_JOURNAL_DEFAULT,
+  KVDB_JOURNAL_DELETE,
+  KVDB_JOURNAL_TRUNCATE,
+  KVDB_JOURNAL_PERSIST,
+  KVDB_JOURNAL_MEMORY,
+  /* Write-ahead logging. Required for kvdb_open_reader; readers then
+   * do not block the writer (or vice versa). */
+  KVDB_JOURNAL_WAL,
+  /* No rollback at all; a crash mid-commit may corrupt the file. */
+  KVDB_JOURNAL_OFF
+} kvdb_journal_mode;
+
+typedef enum {
+  KVDB_SYNC_DEFAULT,
+  KVDB_SYNC_OFF,
+  KVDB_SYNC_NORMAL,
+  KVDB_SYNC_FULL,
+  KVDB_SYNC_EXTRA
+} kvdb_sync_mode;
+
+typedef enum {
+  KVDB_TEMP_STORE_DEFAULT,
+  KVDB_TEMP_STORE_FILE,
+  KVDB_TEMP_STORE_MEMORY
+} kvdb_temp_store;
+
+typedef enum {
+  /* History in the log table of the database */
+  KVDB_LOG_SQLITE,
+  /* History appended to segment files next to the database
+   * (<path>-log/); writes are sequential appends, and export is a
+   * plain file copy. */
+  KVDB_LOG_SEGMENTS
+} kvdb_log_backend;
+
+typedef struct kvdb_options_struct {
+  /* Page size in bytes; only takes effect when the file is created. */
+  int page_size;
+
+  /* Page cache size (per connection) in kilobytes. */
+  int cache_size_kb;
+
+  /* How much of the file to access via mmap, in bytes. */
+  int64_t mmap_size;
+
+  kvdb_journal_mode journal_mode;
+  kvdb_sync_mode synchronous;
+  kvdb_temp_store temp_store;
+
+  /* Return up to vacuum_pages (0 = all) free pages to the file system
+   * every vacuum_interval commits (0 = never). */
+  int vacuum_interval;
+  int vacuum_pages;
+
+  /* Retention of history (see kvdb_compact). An entry of the log is
+   * kept while it is one of the log_keep_versions latest ones of its
+   * object and key, while it was added less than log_keep_ms ago,
+   * and, with log_keep_unexported, until kvdb_export has written it
+   * out; once none of the limits in use (non-zero) keeps it, it is
+   * removed. With none of them in use, nothing ever is. Up to
+   * compact_rows entries (0 = all) are looked at every
+   * compact_interval commits (0 = only by kvdb_compact), and the
+   * pages freed are returned to the file system right away.
+   *
+   * Every checkpoint_interval_ms (0 = never), the time is recorded
+   * as a history checkpoint, and the version of each value in effect
+   * then is kept regardless, so that kvdb_o_get_at still knows the
+   * state at the checkpoint.
+   *
+   * The segment log backend removes whole segments, and only by
+   * time; with log_keep_versions in use, it keeps everything, and it
+   * does not keep anything for checkpoints. */
+  int log_keep_versions;
+  int64_t log_keep_ms;
+  bool log_keep_unexported;
+  int compact_interval;
+  int compact_rows;
+  int64_t checkpoint_interval_ms;
+
+  /* Allow use of the same kvdb (and its objects) from multiple
+   * threads at once. Object cache is split to independently locked
+   * shards, and statements on the shared SQLite connection are
+   * serialized; use per-thread readers (kvdb_thread_reader) for
+   * concurrent queries. Values that other threads may set have to be
+   * read with the copying getters (kvdb_o_copy_int64 and so on). */
+  bool threadsafe;
+
+  /* Commit in a background thread, grouping together every commit
+   * requested meanwhile (see kvdb_commit_async). Implies threadsafe.
+   * The group is committed once commit_interval_ms has passed since
+   * the first change within it, or once commit_bytes (if non-zero)
+   * of values have been written; changes nobody asked to commit are
+   * therefore also committed within commit_interval_ms. */
+  bool async_commit;
+  int commit_interval_ms;
+  int64_t commit_bytes;
+
+  /* Where the history goes; chosen when the database is created (an
+   * existing log is never moved). Segments are rolled over after
+   * log_segment_size bytes (0 = 16MB). */
+  kvdb_log_backend log_backend;
+  int64_t log_segment_size;
+
+  /* In-memory (KVDB_MEMORY) databases only: start from the contents
+   * of this file, if it exists, and write everything to it on every
+   * kvdb_commit (see kvdb_snapshot). */
+  const char *snapshot_path;
+
+  /* Binary values of at least blob_threshold bytes (0 = none) are
+   * stored just once, in files named by their SHA-256 digest within
+   * <path>-blobs, and cs and the log refer to them by the digest.
+   * Exports ship them alongside the log files, each blob once. (Not
+   * for in-memory databases.) */
+  int64_t blob_threshold;
+} *kvdb_options;
+
+typedef enum {
+  /* SQLite defaults everywhere */
+  KVDB_PRESET_DEFAULT,
+
+  /* Initial import of lots of data: big cache, no syncing at all,
+   * and no vacuuming. A process crash loses at most the latest
+   * commits, but an OS crash or power loss may corrupt the database,
+   * so after one, the load should be started over from scratch. */
+  KVDB_PRESET_BULK_LOAD,
+
+  /* Small memory and storage footprint; WAL with NORMAL sync (a
+   * crash loses at most the last commits), small cache, and free
+   * pages returned to the system regularly. */
+  KVDB_PRESET_MOBILE,
+
+  /* Lots of memory and concurrent readers; WAL with NORMAL sync,
+   * large cache, mmap of the first gigabyte, and temporary tables
+   * in memory. */
+  KVDB_PRESET_SERVER
+} kvdb_preset;
+
+/** Initialize options to the given preset. The individual fields
+ * may be tweaked afterwards. */
+void kvdb_options_init(kvdb_options options, kvdb_preset preset);
+
+/** Create (or get) database with non-default options. NULL options
+ * is equivalent to kvdb_create.
+ */
+bool kvdb_create_with_options(const char *path, kvdb_options options,
+                              kvdb *k);
+
+/** Open an additional read-only handle to the same database.
+ *
+ * The writer k has to be in KVDB_JOURNAL_WAL mode. The reader sees a consistent
+ * snapshot of what was committed when it was opened; kvdb_commit on
+ * the reader moves it to the most recently committed state (and
+ * invalidates every object retrieved through it so far). Each handle
+ * should be used by one thread at a time. Destroy with kvdb_destroy.
+ */
+bool kvdb_open_reader(kvdb k, kvdb *reader);
+
+/** Get the calling thread's own reader of k.
+ *
+ * The reader is opened on first use (see kvdb_open_reader), and is
+ * owned by k; it is destroyed when the thread exits. kvdb_destroy of
+ * k destroys just the calling thread's reader; the others stay usable
+ * until their threads exit. NULL is returned on failure.
+ */
+kvdb kvdb_thread_reader(kvdb k);
+
 /** Destroy the database (object).
  *
  * This frees the database object and everything associated with
@@ -98,6 +273,9 @@ typedef enum {
 
 #define KVDB_INDEX_NAME_SIZE 16
 
+/* How many keys a class may have prefetched */
+#define KVDB_CLASS_PREFETCH_SIZE 8
+
 typedef struct kvdb_oid_struct {
   unsigned char oid[KVDB_OID_SIZE];
 } *kvdb_oid;
@@ -127,6 +305,16 @@ kvdb_app kvdb_define_app(kvdb k, const char *name);
 /** Define class. */
 kvdb_class kvdb_define_class(kvdb k, const char *name);
 
+/** Load the value of the key whenever an object of the class is
+ * retrieved.
+ *
+ * By default only the set of keys of an object is read by
+ * kvdb_get_o_by_id, and each value is read the first time it is
+ * asked for. With a NULL key, every value of the class' objects is
+ * loaded up front. (At most KVDB_CLASS_PREFETCH_SIZE keys per class.)
+ */
+bool kvdb_class_prefetch_key(kvdb k, kvdb_class cl, kvdb_key key);
+
 /** Define key.
  *
  * The kvdb_type given is the only allowed type for that data from
@@ -145,6 +333,15 @@ kvdb_index kvdb_define_index(kvdb k,
                              const char *name,
                              kvdb_index_type index_type);
 
+/** Refresh query planner statistics.
+ *
+ * This recounts the rows of every search index and rebuilds their
+ * value histograms (and runs SQLite ANALYZE as well). Row counts are
+ * maintained incrementally afterwards, but histograms only change
+ * when this is called again, so call it after large changes in data.
+ */
+bool kvdb_analyze(kvdb k);
+
 /** Create KVDB query object. */
 kvdb_query kvdb_create_q(kvdb k);
 
@@ -181,6 +378,80 @@ void kvdb_q_add_index2(kvdb_query q, kvdb_index i);
 void kvdb_q_set_match_app_class(kvdb_query q, kvdb_app app, kvdb_class cl);
 void kvdb_q_order_by(kvdb_query q, kvdb_index i, bool ascending);
 
+/** Limit the number of results of a query.
+ *
+ * At most limit objects are returned, after skipping the first offset
+ * ones. For paging through large result sets, prefer a cursor (which
+ * seeks directly to where the previous page ended) to large offsets.
+ */
+void kvdb_q_set_limit(kvdb_query q, int limit, int offset);
+
+/* Position within a (paginated) query. The content is opaque; it is
+ * exposed only so that callers can keep cursors around (and
+ * e.g. serialize them as resume tokens). */
+typedef struct kvdb_q_cursor_struct {
+  bool valid;
+  struct kvdb_typed_value_struct keyish;
+  struct kvdb_oid_struct oid;
+} *kvdb_q_cursor;
+
+static inline void kvdb_q_cursor_init(kvdb_q_cursor c)
+{
+  memset(c, 0, sizeof(*c));
+}
+
+/** Use keyset pagination with the given cursor.
+ *
+ * Results start after the position stored in the cursor (if any), and
+ * the cursor is updated as objects are returned, so a new query with
+ * same criteria and the same cursor continues where this one
+ * stopped. The results are ordered by the kvdb_q_order_by index (if
+ * any), and then by oid. The cursor must outlive the query.
+ */
+void kvdb_q_set_cursor(kvdb_query q, kvdb_q_cursor c);
+
+/** Match the state as of time t (see kvdb_time) instead of the
+ * current one.
+ *
+ * Index bounds, ordering and aggregates apply to the values the
+ * objects had then, as kvdb_o_get_at would return them; only objects
+ * that existed then are returned (or counted). The objects themselves
+ * are the current ones, so use kvdb_o_get_at to read what they had.
+ * The search indexes do not know the past, so this reads the log for
+ * every candidate object. Fails (and the query stays as it was) if
+ * the log is in segment files (KVDB_LOG_SEGMENTS).
+ */
+bool kvdb_q_set_time(kvdb_query q, kvdb_time_t t);
+
+typedef enum {
+  KVDB_AGGREGATE_COUNT,
+  KVDB_AGGREGATE_MIN,
+  KVDB_AGGREGATE_MAX,
+  KVDB_AGGREGATE_SUM,
+  KVDB_AGGREGATE_AVG
+} kvdb_aggregate_type;
+
+/** Count objects matching the given query.
+ *
+ * Objects are not loaded; the count is computed entirely within the
+ * database. The query is not consumed (call kvdb_q_destroy, or
+ * kvdb_q_get_next, afterwards).
+ */
+bool kvdb_q_count(kvdb_query q, int64_t *count);
+
+/** Compute an aggregate over the values of an (integer) index.
+ *
+ * If the index is not within the query, it is matched (without
+ * bounds) just for this call, so only objects that have the key are
+ * considered; that fails if the query already has as many indexes as
+ * it can. The result is KVDB_INTEGER (KVDB_DOUBLE for
+ * KVDB_AGGREGATE_AVG), or KVDB_NULL if nothing matched. Like
+ * kvdb_q_count, the query is neither consumed nor changed; limit and
+ * cursor are not applied to either.
+ */
+bool kvdb_q_aggregate(kvdb_query q, kvdb_index i, kvdb_aggregate_type t,
+                      kvdb_typed_value result);
+
 /** Iterate through objects matching the given query.
  *
  * Return value is the next object matched by the query, or NULL (and
@@ -197,26 +468,215 @@ void kvdb_q_destroy(kvdb_query q);
 kvdb_o kvdb_create_o(kvdb k, kvdb_app app, kvdb_class cl);
 
 /** Retrieve single object from the kvdb.
+ *
+ * The values are loaded lazily (see kvdb_class_prefetch_key).
  */
 kvdb_o kvdb_get_o_by_id(kvdb k, const kvdb_oid oid);
 
 /** Get value. NULL is returned if the key does not exist in the given
- * object or it is of wrong type. */
+ * object or it is of wrong type. The pointers returned stay valid
+ * until the value is set again. */
 kvdb_typed_value kvdb_o_get(kvdb_o o, kvdb_key key);
 int64_t *kvdb_o_get_int64(kvdb_o o, kvdb_key key);
 char *kvdb_o_get_string(kvdb_o o, kvdb_key key);
 kvdb_o kvdb_o_get_object(kvdb_o o, kvdb_key key);
 
+/** Get a copy of the value instead, for when another thread may set it
+ * meanwhile (threadsafe mode; see also kvdb_o_get_buffer). The string
+ * is to be freed by the caller. */
+bool kvdb_o_copy_int64(kvdb_o o, kvdb_key key, int64_t *value);
+char *kvdb_o_copy_string(kvdb_o o, kvdb_key key);
+
 /** Set value. Setters return false if the set fails for some reason.*/
 bool kvdb_o_set(kvdb_o o, kvdb_key key, const kvdb_typed_value value);
 bool kvdb_o_set_int64(kvdb_o o, kvdb_key key, int64_t value);
 bool kvdb_o_set_string(kvdb_o o, kvdb_key key, const char *value);
 bool kvdb_o_set_object(kvdb_o o, kvdb_key key, kvdb_o o2);
 
-/** Commit changes to disk.
+/* Large values (kvdb_blob.c) */
+typedef struct kvdb_buffer_struct *kvdb_buffer;
+typedef struct kvdb_blob_stream_struct *kvdb_blob_stream;
+
+/** Reference counted buffer. A new one has one reference, and
+ * uninitialized content of len bytes. */
+kvdb_buffer kvdb_buffer_create(size_t len);
+kvdb_buffer kvdb_buffer_ref(kvdb_buffer b);
+void kvdb_buffer_unref(kvdb_buffer b);
+void *kvdb_buffer_data(kvdb_buffer b);
+size_t kvdb_buffer_len(kvdb_buffer b);
+
+/** Get a new reference to the (raw) value. Large binary values are
+ * shared with the object, not copied, and the reference stays valid
+ * even if the value is set again. */
+kvdb_buffer kvdb_o_get_buffer(kvdb_o o, kvdb_key key);
+
+/** Set a binary value; the object keeps a reference to b instead of
+ * copying it. b must not be modified afterwards. */
+bool kvdb_o_set_buffer(kvdb_o o, kvdb_key key, kvdb_buffer b);
+
+/** Open the value in the database (or the blob directory) for
+ * reading in pieces, without loading it to memory. The next set of
+ * the key (committed or not) invalidates the stream, as the value
+ * then lives in a new row of cs; reads fail after that, and the
+ * stream has to be opened again.
+ * The stream must be closed before the kvdb is destroyed. */
+kvdb_blob_stream kvdb_o_get_blob_stream(kvdb_o o, kvdb_key key);
+size_t kvdb_blob_stream_len(kvdb_blob_stream s);
+bool kvdb_blob_stream_read(kvdb_blob_stream s,
+                           void *p, size_t len, size_t offset);
+void kvdb_blob_stream_close(kvdb_blob_stream s);
+
+/* History (kvdb_history.c) */
+
+/** Get a new reference to the (raw) value key had at time t (see
+ * kvdb_time), from the log; NULL if it had none then. Where
+ * compaction (see log_keep_versions) has removed versions, this is
+ * the latest one still left, which is still exact at history
+ * checkpoints. Objects of the local app have no history; readers
+ * see the history within their snapshot. With the log table, this is
+ * a single index lookup; segment files have no index by object, so
+ * they are read from the start up to t, and the cost grows with the
+ * whole history before t. */
+kvdb_buffer kvdb_o_get_at(kvdb_o o, kvdb_key key, kvdb_time_t t);
+
+typedef struct kvdb_history_struct *kvdb_history;
+
+/** Open a cursor over the versions of key in the log, newest first;
+ * kvdb_history_next moves to the first one. With the log table, they
+ * are read from the database as the cursor moves (so changes made
+ * meanwhile may or may not be seen); segment files are scanned once,
+ * up front. Readers see the versions within their snapshot. The
+ * cursor must be closed before the kvdb is destroyed. */
+kvdb_history kvdb_o_history(kvdb_o o, kvdb_key key);
+
+/** Move to the next (older) version; false once there are no more. */
+bool kvdb_history_next(kvdb_history h);
+
+/** When the current version was set. */
+kvdb_time_t kvdb_history_time(kvdb_history h);
+
+/** Type of the current version; KVDB_NULL if the value was removed
+ * (or for versions from before values had a type). */
+kvdb_type kvdb_history_type(kvdb_history h);
+
+/** Get a new reference to the (raw) current version; NULL if it has
+ * none. */
+kvdb_buffer kvdb_history_value(kvdb_history h);
+
+void kvdb_history_close(kvdb_history h);
+
+/** Commit changes to disk. (For readers, refresh the snapshot
+ * instead.)
  */
 bool kvdb_commit(kvdb k);
 
+/** Commit, and then copy the whole database to the file in path
+ * (replacing what was there). The copy is an ordinary database that
+ * kvdb_create can open.
+ */
+bool kvdb_snapshot(kvdb k, const char *path);
+
+/** Commit, and then remove every entry of the log that the retention
+ * limits (log_keep_versions etc. in the options) no longer keep, and
+ * return the pages freed to the file system. */
+bool kvdb_compact(kvdb k);
+
+/* Read-only images (kvdb_image.c) */
+typedef struct kvdb_image_struct *kvdb_image;
+
+/** Commit, and then write the current state of every object to an
+ * image file in path (replacing what was there).
+ *
+ * An image is immutable, and meant to be opened with kvdb_image_open
+ * (which maps it to memory, and does very little else) for fast
+ * lookups of fields by oid. There are no indexes or queries.
+ */
+bool kvdb_image_write(kvdb k, const char *path);
+
+/** Open an image, or return NULL if it does not exist or is not a
+ * valid image. The image is not tied to any kvdb. */
+kvdb_image kvdb_image_open(const char *path);
+void kvdb_image_close(kvdb_image img);
+
+/** Number of objects in the image. */
+int64_t kvdb_image_count(kvdb_image img);
+
+/** Get the (raw) value of key within object oid. The value points
+ * within the image, and stays valid until kvdb_image_close. */
+bool kvdb_image_get(kvdb_image img, kvdb_oid oid, const char *key,
+                    const void **p, size_t *len, int64_t *last_modified);
+
+/** Typed convenience getters (NULL if not found, or of wrong size). */
+const int64_t *kvdb_image_get_int64(kvdb_image img, kvdb_oid oid,
+                                    const char *key);
+const char *kvdb_image_get_string(kvdb_image img, kvdb_oid oid,
+                                  const char *key);
+
+/* Columnar exports (kvdb_columns.c) */
+typedef struct kvdb_columns_struct *kvdb_columns;
+
+/** Commit, and then write the current state of the objects of every
+ * (app, class) to <app>.<class>.col within directory (replacing what
+ * was there), one column per key. '.', '/' and '%' within the names
+ * are escaped as %2E, %2F and %25, so every (app, class) gets a file
+ * of its own.
+ *
+ * Unlike kvdb_export, this is not for replaying elsewhere, but for
+ * scanning: reading one key of every object (of an app and class)
+ * reads just that column. Objects without an app and class are left
+ * out.
+ */
+bool kvdb_export_columns(kvdb k, const char *directory);
+
+/** Open a column file, or return NULL if it does not exist or is not
+ * a valid one. */
+kvdb_columns kvdb_columns_open(const char *path);
+void kvdb_columns_close(kvdb_columns c);
+
+/** Number of objects (rows) in the file. */
+int64_t kvdb_columns_count(kvdb_columns c);
+
+typedef bool (*kvdb_columns_cb)(void *context, kvdb_oid oid, kvdb_type t,
+                                const void *value, size_t len,
+                                int64_t last_modified);
+
+/** Call cb with the (raw) value of key of every object that has one,
+ * in oid order. The oid stays valid until kvdb_columns_close, the
+ * value only during the call. Fails if the column is corrupt, or if
+ * cb does (a key no object has is just empty). */
+bool kvdb_columns_scan(kvdb_columns c, const char *key,
+                       kvdb_columns_cb cb, void *context);
+
+/** Start bulk loading.
+ *
+ * Until kvdb_bulk_end, indexes that only serve reads (key lookups of
+ * cs, log export and duplicate checking, and the value side of
+ * search indexes) do not exist, and app/class membership is
+ * collected aside; kvdb_bulk_end then builds all of them in one go,
+ * in sorted order. Queries made in between are slow, and do not see
+ * objects' app/class; so are reads of history (kvdb_o_get_at,
+ * kvdb_o_history, kvdb_q_set_time), which scan the whole log, and
+ * log compaction waits until kvdb_bulk_end. (If the process dies in
+ * between, whatever was committed is sorted out on the next open.)
+ * Combine with KVDB_PRESET_BULK_LOAD for best results.
+ */
+bool kvdb_bulk_begin(kvdb k);
+
+/** End bulk loading (see kvdb_bulk_begin). */
+bool kvdb_bulk_end(kvdb k);
+
+typedef uint64_t kvdb_commit_ticket;
+
+/** Ask for the changes so far to be committed, without waiting for
+ * it to happen. The returned ticket (0 on failure) can be passed to
+ * kvdb_commit_wait. Without async_commit, this is kvdb_commit.
+ */
+kvdb_commit_ticket kvdb_commit_async(kvdb k);
+
+/** Wait until the commit identified by ticket t is on disk; false if
+ * the (group) commit that covered it failed. */
+bool kvdb_commit_wait(kvdb k, kvdb_commit_ticket t);
+
 /** Export log to a new file within the given directory. Implies one
  * or more commits as well. */
 bool kvdb_export(kvdb k, const char *directory, bool export_own_only);
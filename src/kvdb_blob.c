@@ -0,0 +1,474 @@
+/*
+ * $Id: kvdb_blob.c $
+ *
+ * Author: Markus Stenberg <fingon@iki.fi>
+ *
+ * Copyright (c) 2013 Markus Stenberg
+ *
+ */
+
+/* Large values: reference counted buffers shared between the object
+ * cache and the caller, streams that read values directly from cs
+ * (without going through the cache at all), and the blob directory.
+ *
+ * Binary values of at least blob_threshold bytes are written to
+ * <path>-blobs/xx/yyyy.., where xxyyyy.. is the hex SHA-256 digest of
+ * the content, and only the digest goes to cs and the log (with ext
+ * set). As the files are named by their content, a value that is set
+ * many times (or by many objects) is stored once, and is never
+ * modified in place. Blob files are written (and synced) before the
+ * transaction that refers to them commits; a blob that is no longer
+ * referred to is simply left behind.
+ */
+
+#define DEBUG
+
+#include "kvdb_i.h"
+
+#include <limits.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+
+kvdb_buffer kvdb_buffer_create(size_t len)
+{
+  kvdb_buffer b = malloc(sizeof(*b) + len);
+
+  if (!b)
+    {
+      KVDEBUG("malloc failed");
+      return NULL;
+    }
+  b->refcount = 1;
+  b->len = len;
+  return b;
+}
+
+kvdb_buffer kvdb_buffer_ref(kvdb_buffer b)
+{
+  __atomic_add_fetch(&b->refcount, 1, __ATOMIC_RELAXED);
+  return b;
+}
+
+void kvdb_buffer_unref(kvdb_buffer b)
+{
+  if (!__atomic_sub_fetch(&b->refcount, 1, __ATOMIC_ACQ_REL))
+    free(b);
+}
+
+void *kvdb_buffer_data(kvdb_buffer b)
+{
+  return b->data;
+}
+
+size_t kvdb_buffer_len(kvdb_buffer b)
+{
+  return b->len;
+}
+
+bool _kvdb_blob_init(kvdb k)
+{
+  char buf[256];
+
+  /* (Blob paths are built in fixed size buffers; see _kvdb_blob_put.) */
+  if (snprintf(buf, sizeof(buf), "%s-blobs", k->path) >= (int)sizeof(buf))
+    {
+      _kvdb_set_err(k, "path too long for the blob directory");
+      return false;
+    }
+  if (!(k->blob_dir = strdup(buf)))
+    {
+      _kvdb_set_err(k, "strdup failed");
+      return false;
+    }
+  return true;
+}
+
+/* May there be any blobs (and references to them)? */
+bool _kvdb_blob_in_use(kvdb k)
+{
+  return k->blob_dir
+    && (k->options.blob_threshold > 0 || access(k->blob_dir, F_OK) == 0);
+}
+
+static void _hex(const void *digest, char hex[2 * SHA256_SIZE + 1])
+{
+  const unsigned char *d = digest;
+  int i;
+
+  for (i = 0 ; i < SHA256_SIZE ; i++)
+    sprintf(hex + 2 * i, "%02x", d[i]);
+}
+
+void _kvdb_blob_path(kvdb k, const void *digest, char *buf, size_t len)
+{
+  char hex[2 * SHA256_SIZE + 1];
+
+  _hex(digest, hex);
+  snprintf(buf, len, "%s/%.2s/%s", k->blob_dir, hex, hex + 2);
+}
+
+/* Where exports keep blobs (next to the log files) */
+static void _export_path(const char *directory, const void *digest,
+                         char *buf, size_t len)
+{
+  char hex[2 * SHA256_SIZE + 1];
+
+  _hex(digest, hex);
+  snprintf(buf, len, "%s/%s.blob", directory, hex);
+}
+
+/* Make the entries of a directory durable (the files themselves are
+ * fsync'd separately). */
+static bool _sync_dir(const char *path)
+{
+  int fd = open(path, O_RDONLY);
+  bool r;
+
+  if (fd < 0)
+    return false;
+  r = fsync(fd) == 0;
+  close(fd);
+  return r;
+}
+
+/* Store the value (unless it is there already). The blob is on disk,
+ * directory entries included, before this returns, and so before the
+ * transaction referring to it can commit. */
+bool _kvdb_blob_put(kvdb k, const void *p, size_t len,
+                    unsigned char digest[SHA256_SIZE])
+{
+  bool sync = k->options.synchronous != KVDB_SYNC_OFF;
+  bool new_top = false, new_sub = false;
+  char path[320], tmp[330], dir[320];
+  FILE *f;
+
+  sha256(p, len, digest);
+  _kvdb_blob_path(k, digest, path, sizeof(path));
+  if (access(path, F_OK) == 0)
+    return true;
+
+  /* xx/ within blob_dir (and blob_dir itself) */
+  strcpy(dir, path);
+  *strrchr(dir, '/') = 0;
+  if (!mkdir(k->blob_dir, 0700))
+    new_top = true;
+  else if (errno != EEXIST)
+    goto mkdir_fail;
+  if (!mkdir(dir, 0700))
+    new_sub = true;
+  else if (errno != EEXIST)
+    goto mkdir_fail;
+  if (sync && new_top)
+    {
+      /* (The directory the database is in.) */
+      char *c;
+
+      strcpy(tmp, k->blob_dir);
+      if ((c = strrchr(tmp, '/')))
+        *(c == tmp ? c + 1 : c) = 0;
+      else
+        strcpy(tmp, ".");
+      if (!_sync_dir(tmp))
+        goto sync_fail;
+    }
+  if (sync && new_sub && !_sync_dir(k->blob_dir))
+    goto sync_fail;
+  snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+  if (!(f = fopen(tmp, "wb")))
+    {
+      _kvdb_set_err(k, "unable to create blob");
+      return false;
+    }
+  if (fwrite(p, 1, len, f) != len || fflush(f)
+      || (k->options.synchronous != KVDB_SYNC_OFF && fsync(fileno(f))))
+    {
+      fclose(f);
+      unlink(tmp);
+      _kvdb_set_err(k, "unable to write blob");
+      return false;
+    }
+  fclose(f);
+  if (rename(tmp, path))
+    {
+      unlink(tmp);
+      _kvdb_set_err(k, "unable to rename blob");
+      return false;
+    }
+  if (sync && !_sync_dir(dir))
+    goto sync_fail;
+  return true;
+
+ mkdir_fail:
+  _kvdb_set_err(k, "unable to create blob directory");
+  return false;
+
+ sync_fail:
+  _kvdb_set_err(k, "unable to sync blob directory");
+  return false;
+}
+
+/* Read the whole file to a new buffer, checking that its content
+ * matches the digest (if given). */
+static kvdb_buffer _read_file(kvdb k, const char *path, const void *digest)
+{
+  unsigned char d[SHA256_SIZE];
+  kvdb_buffer b = NULL;
+  struct stat st;
+  size_t done = 0;
+  ssize_t n;
+  int fd = open(path, O_RDONLY);
+
+  if (fd < 0 || fstat(fd, &st) || !(b = kvdb_buffer_create(st.st_size)))
+    {
+      _kvdb_set_err(k, "unable to open blob");
+      goto fail;
+    }
+  while (done < b->len)
+    {
+      if ((n = read(fd, b->data + done, b->len - done)) <= 0)
+        {
+          _kvdb_set_err(k, "unable to read blob");
+          goto fail;
+        }
+      done += n;
+    }
+  if (digest)
+    {
+      sha256(b->data, b->len, d);
+      if (memcmp(d, digest, SHA256_SIZE))
+        {
+          _kvdb_set_err(k, "corrupt blob");
+          goto fail;
+        }
+    }
+  close(fd);
+  return b;
+
+ fail:
+  if (b)
+    kvdb_buffer_unref(b);
+  if (fd >= 0)
+    close(fd);
+  return NULL;
+}
+
+/* Content of the blob the digest (from cs or the log) refers to. */
+kvdb_buffer _kvdb_blob_get(kvdb k, const void *digest, size_t len)
+{
+  char path[320];
+
+  if (len != SHA256_SIZE || !k->blob_dir)
+    {
+      _kvdb_set_err(k, "invalid blob reference");
+      return NULL;
+    }
+  _kvdb_blob_path(k, digest, path, sizeof(path));
+  return _read_file(k, path, NULL);
+}
+
+bool _kvdb_blob_export(kvdb k, const void *digest, const char *directory)
+{
+  char path[320], dst[320], tmp[330], buf[65536];
+  FILE *in, *out;
+  size_t n;
+  bool ok = true;
+
+  _export_path(directory, digest, dst, sizeof(dst));
+  if (access(dst, F_OK) == 0)
+    return true;
+  _kvdb_blob_path(k, digest, path, sizeof(path));
+  if (link(path, dst) == 0)
+    return true;
+
+  /* Different file system, probably; copy it. */
+  snprintf(tmp, sizeof(tmp), "%s.tmp", dst);
+  if (!(in = fopen(path, "rb")))
+    {
+      _kvdb_set_err(k, "unable to open blob");
+      return false;
+    }
+  if (!(out = fopen(tmp, "wb")))
+    {
+      fclose(in);
+      _kvdb_set_err(k, "unable to export blob");
+      return false;
+    }
+  while (ok && (n = fread(buf, 1, sizeof(buf), in)) > 0)
+    ok = fwrite(buf, 1, n, out) == n;
+  ok = ok && !ferror(in);
+  fclose(in);
+  if (fclose(out) || !ok || rename(tmp, dst))
+    {
+      unlink(tmp);
+      _kvdb_set_err(k, "unable to export blob");
+      return false;
+    }
+  return true;
+}
+
+kvdb_buffer _kvdb_blob_import(kvdb k, const void *digest,
+                              const char *directory)
+{
+  char path[320];
+
+  _export_path(directory, digest, path, sizeof(path));
+  return _read_file(k, path, digest);
+}
+
+kvdb_buffer kvdb_o_get_buffer(kvdb_o o, kvdb_key key)
+{
+  kvdb_buffer b = NULL;
+  kvdb_o_a a;
+  void *p;
+  size_t len;
+
+  _kvdb_o_lock(o);
+  a = _kvdb_o_get_a(o, key);
+  if (a && a->buf)
+    b = kvdb_buffer_ref(a->buf);
+  else if (a)
+    {
+      /* Small (or locally set) value; copy it */
+      _kvdb_tv_get_raw_value(&a->value, &p, &len);
+      if ((b = kvdb_buffer_create(len)))
+        memcpy(b->data, p, len);
+    }
+  _kvdb_o_unlock(o);
+  return b;
+}
+
+bool kvdb_o_set_buffer(kvdb_o o, kvdb_key key, kvdb_buffer b)
+{
+  struct kvdb_typed_value_struct ktv;
+
+  _kvdb_tv_set_binary(&ktv, b->data, b->len);
+  return _kvdb_o_set(o, key, &ktv, 0, b);
+}
+
+kvdb_blob_stream kvdb_o_get_blob_stream(kvdb_o o, kvdb_key key)
+{
+  kvdb k = o->k;
+  sqlite3_stmt *s = k->stmts[STMT_SELECT_CS_ROWID_BY_OID_KEY];
+  kvdb_blob_stream bs = NULL;
+  sqlite3_blob *blob = NULL;
+  char path[320];
+  struct stat st;
+  int64_t rowid;
+  int fd = -1;
+  int rc;
+
+  _kvdb_lock(k);
+  SQLITE_CALL2(sqlite3_reset(s), goto done);
+  SQLITE_CALL2(sqlite3_clear_bindings(s), goto done);
+  SQLITE_CALL2(sqlite3_bind_blob(s, 1, &o->oid, KVDB_OID_SIZE, SQLITE_STATIC),
+               goto done);
+  SQLITE_CALL2(sqlite3_bind_text(s, 2, key->name, -1, SQLITE_STATIC),
+               goto done);
+  rc = sqlite3_step(s);
+  if (rc != SQLITE_ROW)
+    {
+      if (rc != SQLITE_DONE)
+        _kvdb_set_err_from_sqlite2(k, "select from cs");
+      sqlite3_reset(s);
+      goto done;
+    }
+  rowid = sqlite3_column_int64(s, 0);
+  if (sqlite3_column_type(s, 1) != SQLITE_NULL)
+    {
+      /* In the blob directory */
+      if (sqlite3_column_bytes(s, 1) != SHA256_SIZE || !k->blob_dir)
+        {
+          _kvdb_set_err(k, "invalid blob reference");
+          sqlite3_reset(s);
+          goto done;
+        }
+      _kvdb_blob_path(k, sqlite3_column_blob(s, 1), path, sizeof(path));
+      sqlite3_reset(s);
+      if ((fd = open(path, O_RDONLY)) < 0 || fstat(fd, &st))
+        {
+          _kvdb_set_err(k, "unable to open blob");
+          goto done;
+        }
+    }
+  else
+    {
+      sqlite3_reset(s);
+      SQLITE_CALL2(sqlite3_blob_open(k->db, "main", "cs", "value", rowid, 0,
+                                     &blob), goto done);
+    }
+  if (!(bs = calloc(1, sizeof(*bs))))
+    {
+      KVDEBUG("calloc failed");
+      goto done;
+    }
+  bs->k = k;
+  bs->blob = blob;
+  bs->fd = fd;
+  bs->len = blob ? (size_t)sqlite3_blob_bytes(blob) : (size_t)st.st_size;
+  blob = NULL;
+  fd = -1;
+ done:
+  if (blob)
+    sqlite3_blob_close(blob);
+  if (fd >= 0)
+    close(fd);
+  _kvdb_unlock(k);
+  return bs;
+}
+
+size_t kvdb_blob_stream_len(kvdb_blob_stream s)
+{
+  return s->len;
+}
+
+bool kvdb_blob_stream_read(kvdb_blob_stream s,
+                           void *p, size_t len, size_t offset)
+{
+  kvdb k = s->k;
+  char *c = p;
+  bool r = true;
+
+  if (offset > s->len || len > s->len - offset)
+    return false;
+  if (!s->blob)
+    {
+      /* pread may read less than asked for (and at most SSIZE_MAX). */
+      while (len)
+        {
+          ssize_t got = pread(s->fd, c, len < INT_MAX ? len : INT_MAX,
+                              offset);
+
+          if (got < 0 && errno == EINTR)
+            continue;
+          if (got <= 0)
+            return false;
+          c += got;
+          len -= got;
+          offset += got;
+        }
+      return true;
+    }
+  /* (A value within the database is at most INT_MAX bytes.) */
+  _kvdb_lock(k);
+  SQLITE_CALL2(sqlite3_blob_read(s->blob, p, (int)len, (int)offset),
+               r = false);
+  _kvdb_unlock(k);
+  return r;
+}
+
+void kvdb_blob_stream_close(kvdb_blob_stream s)
+{
+  kvdb k = s->k;
+
+  if (s->blob)
+    {
+      _kvdb_lock(k);
+      sqlite3_blob_close(s->blob);
+      _kvdb_unlock(k);
+    }
+  else
+    close(s->fd);
+  free(s);
+}
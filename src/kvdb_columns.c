@@ -0,0 +1,893 @@
+/*
+ * $Id: kvdb_columns.c $
+ *
+ * Author: Markus Stenberg <fingon@iki.fi>
+ *
+ * Copyright (c) 2013 Markus Stenberg
+ *
+ */
+
+/* Columnar exports of the current state, for scanning (rather than
+ * replaying) it elsewhere.
+ *
+ * Each (app, class) goes to a file of its own, <app>.<class>.col ('.',
+ * '/' and '%' within the names are escaped as %2E, %2F and %25). The
+ * objects are its rows, in oid order, and each key is a column chunk
+ * of its own, so a scan of one key reads (and decodes) just that
+ * chunk. Values are in the log file encoding (see kvdb_io.c); blobs
+ * are copied in.
+ *
+ * Layout (numbers are varints unless noted):
+ *
+ * COLUMNS_MAGIC and a version byte
+ * oids: n_rows x 16 bytes, sorted
+ * column chunks, one per key, sorted by key
+ * footer: n_rows, app (length + name), class (length + name),
+ * n_columns, and for each column its key (length + name), type
+ * (KVDB_NULL if its values are of different types), offset and size
+ * offset of the footer (8 bytes, big-endian)
+ *
+ * A column chunk has the number of values in it (n), the encoding of
+ * the values, and the sizes of the row and value sections. The rows
+ * are the gaps (row - previous row - 1) between the rows that have a
+ * value, and left out if all of them do. The last modified times
+ * follow the values, as zigzag deltas from the previous one. Values
+ * are encoded whichever of these ways is the smallest:
+ *
+ * COL_PLAIN: type, length and data of each value
+ * COL_DELTA: (integers only) zigzag deltas from the previous value
+ * (modulo 2^64, so that any two values have one)
+ * COL_DICT: (one type only) the distinct values as length + data, and
+ * then runs of them, as (index, count)
+ */
+
+#define DEBUG
+
+#include "kvdb_i.h"
+#include "codec.h"
+#include "ihash.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define COLUMNS_MAGIC "KVDBCOL"
+#define COLUMNS_VERSION 1
+#define COLUMNS_HEADER_SIZE 8
+
+/* Give up on the dictionary if it has more entries than this */
+#define COLUMNS_DICT_MAX(n) ((n) / 2 + 1)
+
+enum {
+  COL_PLAIN,
+  COL_DELTA,
+  COL_DICT,
+  NUM_COL
+};
+
+/* Growable buffer; failed is set (and the content is junk) if it
+ * could not grow. */
+typedef struct {
+  unsigned char *p;
+  size_t len, size;
+  bool failed;
+} _buf_s;
+
+static void _buf_add(_buf_s *b, const void *p, size_t len)
+{
+  if (b->len + len > b->size)
+    {
+      size_t n = (b->len + len) * 2 + 64;
+      unsigned char *np = realloc(b->p, n);
+
+      if (!np)
+        {
+          b->failed = true;
+          return;
+        }
+      b->p = np;
+      b->size = n;
+    }
+  memcpy(b->p + b->len, p, len);
+  b->len += len;
+}
+
+static void _buf_uint(_buf_s *b, uint64_t v)
+{
+  unsigned char buf[VARINT_MAX_BYTES];
+  unsigned char *c = buf;
+  ssize_t left = sizeof(buf);
+
+  encode_varint_u64(v, &c, &left);
+  _buf_add(b, buf, c - buf);
+}
+
+static void _buf_sint(_buf_s *b, int64_t v)
+{
+  _buf_uint(b, zigzag_encode_s64(v));
+}
+
+/* Writing */
+
+/* A value of the column being collected */
+typedef struct {
+  int64_t row;
+  kvdb_type type;
+  int64_t i;
+  size_t offset, len;
+  kvdb_time_t last_modified;
+  int64_t dict;
+} _cell_s;
+
+typedef struct {
+  kvdb k;
+  FILE *f;
+  uint64_t pos;
+
+  /* Rows of the (app, class) being written */
+  struct kvdb_oid_struct *oids;
+  int64_t n_rows, rows_size;
+
+  /* Column being collected; the value data is in values */
+  char *key;
+  _cell_s *cells;
+  int64_t n_cells, cells_size;
+  _buf_s values;
+
+  /* Dictionary of it: the first cell with each distinct value */
+  int64_t *dict;
+  int64_t n_dict;
+
+  /* Column directory (for the footer) */
+  _buf_s columns;
+  int n_columns;
+} _columns_writer;
+
+static bool _write(_columns_writer *w, const void *p, size_t len)
+{
+  if (len && fwrite(p, 1, len, w->f) != len)
+    {
+      _kvdb_set_err(w->k, "i/o error while writing columns");
+      return false;
+    }
+  w->pos += len;
+  return true;
+}
+
+static uint64_t _cell_hash(void *o, void *ctx)
+{
+  _columns_writer *w = ctx;
+  _cell_s *c = o;
+  uint64_t h = 14695981039346656037ULL ^ c->type;
+  size_t i;
+
+  for (i = 0 ; i < c->len ; i++)
+    h = (h ^ w->values.p[c->offset + i]) * 1099511628211ULL;
+  return h;
+}
+
+static bool _cell_eq(void *o1, void *o2, void *ctx)
+{
+  _columns_writer *w = ctx;
+  _cell_s *c1 = o1, *c2 = o2;
+
+  return c1->type == c2->type && c1->len == c2->len
+    && !memcmp(w->values.p + c1->offset, w->values.p + c2->offset, c1->len);
+}
+
+/* Find the distinct values of the column; false if there are too
+ * many of them for a dictionary to pay off. */
+static bool _build_dict(_columns_writer *w)
+{
+  ihash ih = ihash_create(_cell_hash, _cell_eq, w);
+  int64_t *nd = realloc(w->dict, (COLUMNS_DICT_MAX(w->n_cells) + 1)
+                        * sizeof(w->dict[0]));
+  int64_t i;
+  bool ok = ih && nd;
+
+  if (nd)
+    w->dict = nd;
+  w->n_dict = 0;
+  for (i = 0 ; ok && i < w->n_cells ; i++)
+    {
+      _cell_s *found = ihash_get(ih, &w->cells[i]);
+
+      if (found)
+        w->cells[i].dict = found->dict;
+      else if (w->n_dict == COLUMNS_DICT_MAX(w->n_cells))
+        ok = false;
+      else
+        {
+          w->cells[i].dict = w->n_dict;
+          w->dict[w->n_dict++] = i;
+          ih = ihash_insert(ih, &w->cells[i]);
+        }
+    }
+  if (ih)
+    ihash_destroy(ih);
+  return ok;
+}
+
+static void _encode_values(_columns_writer *w, int encoding, _buf_s *b)
+{
+  int64_t i, prev = 0, run;
+
+  switch (encoding)
+    {
+    case COL_PLAIN:
+      for (i = 0 ; i < w->n_cells ; i++)
+        {
+          _buf_uint(b, w->cells[i].type);
+          _buf_uint(b, w->cells[i].len);
+          _buf_add(b, w->values.p + w->cells[i].offset, w->cells[i].len);
+        }
+      break;
+    case COL_DELTA:
+      for (i = 0 ; i < w->n_cells ; i++)
+        {
+          _buf_sint(b, (int64_t)((uint64_t)w->cells[i].i - (uint64_t)prev));
+          prev = w->cells[i].i;
+        }
+      break;
+    case COL_DICT:
+      _buf_uint(b, w->n_dict);
+      for (i = 0 ; i < w->n_dict ; i++)
+        {
+          _cell_s *c = &w->cells[w->dict[i]];
+
+          _buf_uint(b, c->len);
+          _buf_add(b, w->values.p + c->offset, c->len);
+        }
+      for (i = 0 ; i < w->n_cells ; i += run)
+        {
+          for (run = 1 ; i + run < w->n_cells
+                 && w->cells[i + run].dict == w->cells[i].dict ; run++);
+          _buf_uint(b, w->cells[i].dict);
+          _buf_uint(b, run);
+        }
+      break;
+    }
+}
+
+/* Write out the column collected so far (if any). */
+static bool _flush_column(_columns_writer *w)
+{
+  _buf_s rows = { .p = NULL }, lm = { .p = NULL }, chunk = { .p = NULL };
+  _buf_s encoded[NUM_COL];
+  kvdb_type type;
+  int64_t i, prev;
+  int e, best = COL_PLAIN;
+  bool ok;
+
+  if (!w->n_cells)
+    return true;
+  memset(encoded, 0, sizeof(encoded));
+  type = w->cells[0].type;
+  for (i = 1 ; i < w->n_cells ; i++)
+    if (w->cells[i].type != type)
+      type = KVDB_NULL;
+
+  /* Rows (unless every one has a value), and last modified times */
+  for (i = 0, prev = -1 ; w->n_cells < w->n_rows && i < w->n_cells ; i++)
+    {
+      _buf_uint(&rows, w->cells[i].row - prev - 1);
+      prev = w->cells[i].row;
+    }
+  for (i = 0, prev = 0 ; i < w->n_cells ; i++)
+    {
+      _buf_sint(&lm, (int64_t)((uint64_t)w->cells[i].last_modified
+                               - (uint64_t)prev));
+      prev = w->cells[i].last_modified;
+    }
+
+  /* Values, whichever way is the smallest */
+  _encode_values(w, COL_PLAIN, &encoded[COL_PLAIN]);
+  if (type == KVDB_INTEGER)
+    _encode_values(w, COL_DELTA, &encoded[COL_DELTA]);
+  if (type != KVDB_NULL && _build_dict(w))
+    _encode_values(w, COL_DICT, &encoded[COL_DICT]);
+  for (e = 0 ; e < NUM_COL ; e++)
+    if (encoded[e].len && encoded[e].len < encoded[best].len)
+      best = e;
+
+  KVDEBUG("column %s: %lld values, encoding %d (%d bytes)", w->key,
+          (long long)w->n_cells, best, (int)encoded[best].len);
+  _buf_uint(&chunk, w->n_cells);
+  _buf_uint(&chunk, best);
+  _buf_uint(&chunk, rows.len);
+  _buf_uint(&chunk, encoded[best].len);
+  ok = !rows.failed && !lm.failed && !chunk.failed && !encoded[best].failed;
+
+  /* Directory entry */
+  _buf_uint(&w->columns, strlen(w->key));
+  _buf_add(&w->columns, w->key, strlen(w->key));
+  _buf_uint(&w->columns, type);
+  _buf_uint(&w->columns, w->pos);
+  _buf_uint(&w->columns, chunk.len + rows.len + encoded[best].len + lm.len);
+  w->n_columns++;
+
+  if (!ok || w->columns.failed)
+    {
+      _kvdb_set_err(w->k, "out of memory");
+      ok = false;
+    }
+  ok = ok && _write(w, chunk.p, chunk.len) && _write(w, rows.p, rows.len)
+    && _write(w, encoded[best].p, encoded[best].len)
+    && _write(w, lm.p, lm.len);
+  for (e = 0 ; e < NUM_COL ; e++)
+    free(encoded[e].p);
+  free(chunk.p);
+  free(lm.p);
+  free(rows.p);
+  w->n_cells = 0;
+  w->values.len = 0;
+  return ok;
+}
+
+static bool _add_cell(_columns_writer *w, sqlite3_stmt *s)
+{
+  const void *oid = sqlite3_column_blob(s, 1);
+  struct kvdb_typed_value_struct ktv;
+  unsigned char vbuf[KVDB_LOG_VALUE_BUF];
+  kvdb_buffer buf = NULL;
+  _cell_s *c;
+  const void *p;
+  void *raw;
+  size_t len;
+
+  if (w->n_cells == w->cells_size)
+    {
+      int64_t n = w->cells_size ? w->cells_size * 2 : 64;
+      void *nc = realloc(w->cells, n * sizeof(w->cells[0]));
+
+      if (!nc)
+        {
+          _kvdb_set_err(w->k, "out of memory");
+          return false;
+        }
+      w->cells = nc;
+      w->cells_size = n;
+    }
+  c = &w->cells[w->n_cells];
+
+  /* Both are in oid order, so the row is at (or after) the previous
+   * one. */
+  c->row = w->n_cells ? w->cells[w->n_cells - 1].row + 1 : 0;
+  while (c->row < w->n_rows
+         && (sqlite3_column_bytes(s, 1) != KVDB_OID_SIZE
+             || memcmp(&w->oids[c->row], oid, KVDB_OID_SIZE)))
+    c->row++;
+  if (c->row == w->n_rows)
+    {
+      _kvdb_set_err(w->k, "object changed while writing columns");
+      return false;
+    }
+
+  if (sqlite3_column_type(s, 4) != SQLITE_NULL)
+    {
+      if (!(buf = _kvdb_blob_get(w->k, sqlite3_column_blob(s, 2),
+                                 sqlite3_column_bytes(s, 2))))
+        return false;
+      _kvdb_tv_set_binary(&ktv, buf->data, buf->len);
+    }
+  else if (!_kvdb_tv_column(&ktv, s, 2, 5))
+    {
+      _kvdb_set_err(w->k, "invalid value in cs");
+      return false;
+    }
+  c->type = _kvdb_tv_type(&ktv);
+  c->i = c->type == KVDB_INTEGER ? ktv.v.i : 0;
+  c->last_modified = sqlite3_column_int64(s, 3);
+  _kvdb_tv_get_raw_value(&ktv, &raw, &len);
+  p = _kvdb_log_encode_value(c->type, raw, &len, vbuf);
+  c->offset = w->values.len;
+  c->len = len;
+  _buf_add(&w->values, p, len);
+  if (buf)
+    kvdb_buffer_unref(buf);
+  if (w->values.failed)
+    {
+      _kvdb_set_err(w->k, "out of memory");
+      return false;
+    }
+  w->n_cells++;
+  return true;
+}
+
+static bool _write_rows(_columns_writer *w, int64_t app_id, int64_t class_id)
+{
+  kvdb k = w->k;
+  sqlite3_stmt *s;
+  int rc;
+
+  SQLITE_CALL(sqlite3_prepare_v2(k->db, "SELECT oid FROM app_class "
+                                 "WHERE app_id=?1 AND class_id=?2 "
+                                 "ORDER BY oid", -1, &s, NULL));
+  SQLITE_CALL2(sqlite3_bind_int64(s, 1, app_id), goto fail);
+  SQLITE_CALL2(sqlite3_bind_int64(s, 2, class_id), goto fail);
+  w->n_rows = 0;
+  while ((rc = sqlite3_step(s)) == SQLITE_ROW)
+    {
+      if (sqlite3_column_bytes(s, 0) != KVDB_OID_SIZE)
+        continue;
+      if (w->n_rows == w->rows_size)
+        {
+          int64_t n = w->rows_size ? w->rows_size * 2 : 64;
+          void *no = realloc(w->oids, n * sizeof(w->oids[0]));
+
+          if (!no)
+            {
+              _kvdb_set_err(k, "out of memory");
+              goto fail;
+            }
+          w->oids = no;
+          w->rows_size = n;
+        }
+      memcpy(&w->oids[w->n_rows++], sqlite3_column_blob(s, 0),
+             KVDB_OID_SIZE);
+    }
+  sqlite3_finalize(s);
+  if (rc != SQLITE_DONE)
+    {
+      _kvdb_set_err_from_sqlite2(k, "column rows");
+      return false;
+    }
+  return _write(w, w->oids, w->n_rows * sizeof(w->oids[0]));
+
+ fail:
+  sqlite3_finalize(s);
+  return false;
+}
+
+static bool _write_columns(_columns_writer *w,
+                           int64_t app_id, int64_t class_id)
+{
+  kvdb k = w->k;
+  sqlite3_stmt *s;
+  bool ok = true;
+  int rc;
+
+  SQLITE_CALL(sqlite3_prepare_v2(k->db, "SELECT cs.key, cs.oid, cs.value, "
+                                 "cs.last_modified, cs.ext, cs.type "
+                                 "FROM app_class ac, cs "
+                                 "WHERE ac.app_id=?1 AND ac.class_id=?2 "
+                                 "AND cs.oid=ac.oid "
+                                 "ORDER BY cs.key, cs.oid", -1, &s, NULL));
+  SQLITE_CALL2(sqlite3_bind_int64(s, 1, app_id), ok = false);
+  SQLITE_CALL2(sqlite3_bind_int64(s, 2, class_id), ok = false);
+  w->n_columns = 0;
+  w->columns.len = 0;
+  while (ok && (rc = sqlite3_step(s)) == SQLITE_ROW)
+    {
+      const char *key = (const char *)sqlite3_column_text(s, 0);
+
+      if (!key)
+        continue;
+      if (!w->key || strcmp(key, w->key))
+        {
+          ok = _flush_column(w);
+          free(w->key);
+          if (!(w->key = strdup(key)))
+            {
+              _kvdb_set_err(k, "out of memory");
+              ok = false;
+            }
+        }
+      ok = ok && _add_cell(w, s);
+    }
+  sqlite3_finalize(s);
+  if (ok && rc != SQLITE_DONE)
+    {
+      _kvdb_set_err_from_sqlite2(k, "column values");
+      ok = false;
+    }
+  ok = ok && _flush_column(w);
+  free(w->key);
+  w->key = NULL;
+  return ok;
+}
+
+static bool _write_footer(_columns_writer *w,
+                          const char *app, const char *cl)
+{
+  _buf_s footer = { .p = NULL };
+  unsigned char offset[8];
+  bool ok;
+  int i;
+
+  for (i = 0 ; i < 8 ; i++)
+    offset[i] = w->pos >> (56 - 8 * i);
+  _buf_uint(&footer, w->n_rows);
+  _buf_uint(&footer, strlen(app));
+  _buf_add(&footer, app, strlen(app));
+  _buf_uint(&footer, strlen(cl));
+  _buf_add(&footer, cl, strlen(cl));
+  _buf_uint(&footer, w->n_columns);
+  _buf_add(&footer, w->columns.p, w->columns.len);
+  if (footer.failed)
+    {
+      _kvdb_set_err(w->k, "out of memory");
+      ok = false;
+    }
+  else
+    ok = _write(w, footer.p, footer.len) && _write(w, offset, sizeof(offset));
+  free(footer.p);
+  return ok;
+}
+
+/* Escape name for use within a file name; the result is at most
+ * three times as long. */
+static void _escape_name(const char *name, char *buf)
+{
+  for ( ; *name ; name++)
+    if (*name == '.' || *name == '/' || *name == '%')
+      buf += sprintf(buf, "%%%02X", (unsigned char)*name);
+    else
+      *buf++ = *name;
+  *buf = 0;
+}
+
+static bool _write_file(_columns_writer *w, const char *directory,
+                        int64_t app_id, int64_t class_id,
+                        const char *app, const char *cl)
+{
+  unsigned char h[COLUMNS_HEADER_SIZE] = COLUMNS_MAGIC;
+  char path[256], tmp[270];
+  char *app_e, *cl_e;
+  int n;
+  bool ok;
+
+  app_e = malloc(strlen(app) * 3 + 1);
+  cl_e = malloc(strlen(cl) * 3 + 1);
+  if (!app_e || !cl_e)
+    {
+      free(app_e);
+      free(cl_e);
+      _kvdb_set_err(w->k, "out of memory");
+      return false;
+    }
+  _escape_name(app, app_e);
+  _escape_name(cl, cl_e);
+  n = snprintf(path, sizeof(path), "%s/%s.%s.col", directory, app_e, cl_e);
+  free(app_e);
+  free(cl_e);
+  if (n >= (int)sizeof(path))
+    {
+      KVDEBUG("skipping %s.%s - too long a filename", app, cl);
+      return true;
+    }
+  snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+  if (!(w->f = fopen(tmp, "wb")))
+    {
+      _kvdb_set_err(w->k, "unable to create column file");
+      return false;
+    }
+  h[COLUMNS_HEADER_SIZE - 1] = COLUMNS_VERSION;
+  w->pos = 0;
+  ok = _write(w, h, sizeof(h))
+    && _write_rows(w, app_id, class_id)
+    && _write_columns(w, app_id, class_id)
+    && _write_footer(w, app, cl);
+  if (fclose(w->f))
+    ok = false;
+  w->f = NULL;
+  if (ok && rename(tmp, path))
+    {
+      _kvdb_set_err(w->k, "unable to rename column file");
+      ok = false;
+    }
+  if (!ok)
+    unlink(tmp);
+  return ok;
+}
+
+bool kvdb_export_columns(kvdb k, const char *directory)
+{
+  _columns_writer w = { .k = k };
+  sqlite3_stmt *s;
+  bool ok = true;
+  int rc;
+
+  if (!kvdb_commit(k))
+    return false;
+  _kvdb_lock(k);
+  SQLITE_CALL2(sqlite3_prepare_v2(k->db, "SELECT ac.app_id, ac.class_id, "
+                                  "a.name, c.name FROM "
+                                  "(SELECT DISTINCT app_id, class_id "
+                                  "FROM app_class) ac, "
+                                  "app_names a, class_names c "
+                                  "WHERE a.id=ac.app_id AND c.id=ac.class_id",
+                                  -1, &s, NULL),
+               _kvdb_unlock(k); return false);
+  while (ok && (rc = sqlite3_step(s)) == SQLITE_ROW)
+    ok = _write_file(&w, directory,
+                     sqlite3_column_int64(s, 0), sqlite3_column_int64(s, 1),
+                     (const char *)sqlite3_column_text(s, 2),
+                     (const char *)sqlite3_column_text(s, 3));
+  sqlite3_finalize(s);
+  if (ok && rc != SQLITE_DONE)
+    {
+      _kvdb_set_err_from_sqlite2(k, "column groups");
+      ok = false;
+    }
+  _kvdb_unlock(k);
+  free(w.oids);
+  free(w.cells);
+  free(w.values.p);
+  free(w.dict);
+  free(w.columns.p);
+  return ok;
+}
+
+/* Reading */
+
+struct _column {
+  char *key;
+  kvdb_type type;
+  uint64_t offset, size;
+};
+
+struct kvdb_columns_struct {
+  unsigned char *base;
+  size_t size;
+  int64_t n_rows;
+  const unsigned char *oids;
+  struct _column *columns;
+  int n_columns;
+};
+
+static bool _get_uint(unsigned char **p, ssize_t *left, uint64_t *v,
+                      uint64_t max)
+{
+  return decode_varint_u64(p, left, v) && *v <= max;
+}
+
+static bool _get_name(unsigned char **p, ssize_t *left, char **name)
+{
+  uint64_t len;
+
+  if (!_get_uint(p, left, &len, *left) || !(*name = malloc(len + 1)))
+    return false;
+  memcpy(*name, *p, len);
+  (*name)[len] = 0;
+  *p += len;
+  *left -= len;
+  return true;
+}
+
+static bool _read_footer(kvdb_columns c)
+{
+  unsigned char *p;
+  ssize_t left;
+  uint64_t offset = 0, v;
+  char *name;
+  int i;
+
+  for (i = 0 ; i < 8 ; i++)
+    offset = offset << 8 | c->base[c->size - 8 + i];
+  if (offset < COLUMNS_HEADER_SIZE || offset > c->size - 8)
+    return false;
+  p = c->base + offset;
+  left = c->size - 8 - offset;
+  if (!_get_uint(&p, &left, &v, (offset - COLUMNS_HEADER_SIZE)
+                 / KVDB_OID_SIZE))
+    return false;
+  c->n_rows = v;
+  c->oids = c->base + COLUMNS_HEADER_SIZE;
+
+  /* (app and class) */
+  for (i = 0 ; i < 2 ; i++)
+    {
+      if (!_get_name(&p, &left, &name))
+        return false;
+      free(name);
+    }
+  if (!_get_uint(&p, &left, &v, left)
+      || !(c->columns = calloc(v + 1, sizeof(c->columns[0]))))
+    return false;
+  for (i = 0 ; i < (int)v ; i++)
+    {
+      struct _column *col = &c->columns[i];
+      uint64_t type;
+
+      if (!_get_name(&p, &left, &col->key))
+        return false;
+      c->n_columns++;
+      if (!_get_uint(&p, &left, &type, KVDB_BINARY_SMALL)
+          || !_get_uint(&p, &left, &col->offset, offset)
+          || !_get_uint(&p, &left, &col->size, offset - col->offset))
+        return false;
+      col->type = type;
+    }
+  return true;
+}
+
+kvdb_columns kvdb_columns_open(const char *path)
+{
+  kvdb_columns c;
+  struct stat st;
+  void *base;
+  int fd;
+
+  if ((fd = open(path, O_RDONLY)) < 0)
+    return NULL;
+  if (fstat(fd, &st) || st.st_size < COLUMNS_HEADER_SIZE + 8)
+    {
+      close(fd);
+      return NULL;
+    }
+  base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED)
+    return NULL;
+  if (!(c = calloc(1, sizeof(*c))))
+    {
+      munmap(base, st.st_size);
+      return NULL;
+    }
+  c->base = base;
+  c->size = st.st_size;
+  if (memcmp(base, COLUMNS_MAGIC, COLUMNS_HEADER_SIZE - 1)
+      || c->base[COLUMNS_HEADER_SIZE - 1] != COLUMNS_VERSION
+      || !_read_footer(c))
+    {
+      KVDEBUG("invalid column file %s", path);
+      kvdb_columns_close(c);
+      return NULL;
+    }
+  return c;
+}
+
+void kvdb_columns_close(kvdb_columns c)
+{
+  int i;
+
+  for (i = 0 ; i < c->n_columns ; i++)
+    free(c->columns[i].key);
+  free(c->columns);
+  munmap(c->base, c->size);
+  free(c);
+}
+
+int64_t kvdb_columns_count(kvdb_columns c)
+{
+  return c->n_rows;
+}
+
+static struct _column *_find_column(kvdb_columns c, const char *key)
+{
+  int lo = 0, hi = c->n_columns - 1;
+
+  while (lo <= hi)
+    {
+      int mid = (lo + hi) / 2;
+      int r = strcmp(c->columns[mid].key, key);
+
+      if (!r)
+        return &c->columns[mid];
+      if (r < 0)
+        lo = mid + 1;
+      else
+        hi = mid - 1;
+    }
+  return NULL;
+}
+
+/* Entry of a dictionary */
+typedef struct {
+  unsigned char *p;
+  size_t len;
+} _dict_entry;
+
+bool kvdb_columns_scan(kvdb_columns c, const char *key,
+                       kvdb_columns_cb cb, void *context)
+{
+  struct _column *col = _find_column(c, key);
+  unsigned char vbuf[KVDB_LOG_VALUE_BUF];
+  unsigned char *p, *rp, *vp, *lp;
+  ssize_t left, rleft, vleft, lleft;
+  uint64_t n, encoding, rows_len, values_len, i, v;
+  uint64_t n_dict = 0, index = 0, run = 0;
+  _dict_entry *dict = NULL;
+  int64_t value = 0, last_modified = 0, row;
+  bool ok = false;
+
+  if (!col)
+    return true;
+  p = c->base + col->offset;
+  left = col->size;
+  if (!_get_uint(&p, &left, &n, c->n_rows)
+      || !_get_uint(&p, &left, &encoding, NUM_COL - 1)
+      || !_get_uint(&p, &left, &rows_len, left)
+      || !_get_uint(&p, &left, &values_len, left - rows_len)
+      || (!rows_len && n != (uint64_t)c->n_rows))
+    goto corrupt;
+  rp = p;
+  rleft = rows_len;
+  vp = rp + rows_len;
+  vleft = values_len;
+  lp = vp + values_len;
+  lleft = left - rows_len - values_len;
+
+  if (encoding == COL_DICT)
+    {
+      if (!_get_uint(&vp, &vleft, &n_dict, vleft)
+          || !(dict = calloc(n_dict + 1, sizeof(dict[0]))))
+        goto corrupt;
+      for (i = 0 ; i < n_dict ; i++)
+        {
+          if (!_get_uint(&vp, &vleft, &v, vleft))
+            goto corrupt;
+          dict[i].p = vp;
+          dict[i].len = v;
+          vp += v;
+          vleft -= v;
+        }
+    }
+
+  for (i = 0, row = -1 ; i < n ; i++)
+    {
+      kvdb_type t = col->type;
+      const void *vv;
+      size_t len;
+
+      if (!rows_len)
+        row = i;
+      else if (row + 1 >= c->n_rows
+               || !_get_uint(&rp, &rleft, &v, c->n_rows - 2 - row))
+        goto corrupt;
+      else
+        row += v + 1;
+      switch (encoding)
+        {
+        case COL_PLAIN:
+          if (!_get_uint(&vp, &vleft, &v, KVDB_BINARY_SMALL))
+            goto corrupt;
+          t = v;
+          if (!_get_uint(&vp, &vleft, &v, vleft))
+            goto corrupt;
+          vv = vp;
+          len = v;
+          vp += v;
+          vleft -= v;
+          break;
+        case COL_DELTA:
+          if (!decode_varint_u64(&vp, &vleft, &v))
+            goto corrupt;
+          value = (int64_t)((uint64_t)value
+                            + (uint64_t)zigzag_decode_s64(v));
+          vv = &value;
+          len = sizeof(value);
+          t = KVDB_INTEGER;
+          break;
+        default:
+          if (!run
+              && (!n_dict || !_get_uint(&vp, &vleft, &index, n_dict - 1)
+                  || !_get_uint(&vp, &vleft, &run, n - i) || !run))
+            goto corrupt;
+          vv = dict[index].p;
+          len = dict[index].len;
+          run--;
+          break;
+        }
+      if (encoding != COL_DELTA
+          && !_kvdb_log_decode_value(KVDB_LOG_VERSION, t, &vv, &len, vbuf))
+        goto corrupt;
+      if (!decode_varint_u64(&lp, &lleft, &v))
+        goto corrupt;
+      last_modified = (int64_t)((uint64_t)last_modified
+                                + (uint64_t)zigzag_decode_s64(v));
+      if (!cb(context, (kvdb_oid)(c->oids + row * KVDB_OID_SIZE),
+              t, vv, len, last_modified))
+        goto done;
+    }
+  ok = true;
+  goto done;
+
+ corrupt:
+  KVDEBUG("corrupt column %s", key);
+ done:
+  free(dict);
+  return ok;
+}
@@ -0,0 +1,257 @@
+/*
+ * $Id: kvdb_flush.c $
+ *
+ * Author: Markus Stenberg <fingon@iki.fi>
+ *
+ * Copyright (c) 2013 Markus Stenberg
+ *
+ */
+
+/* Asynchronous group commit.
+ *
+ * Instead of each kvdb_commit doing COMMIT (and fsync) by itself, the
+ * callers just ask for a commit and get a ticket; a background thread
+ * then commits everything that has accumulated at once, either when
+ * commit_interval_ms has passed since the first pending change, or
+ * when commit_bytes worth of changes are pending. Tickets are
+ * sequence numbers; ticket t is durable once committed >= t, unless
+ * it is within one of the failed ranges.
+ */
+
+#define DEBUG
+
+#include "kvdb_i.h"
+
+#include <errno.h>
+
+struct kvdb_flusher_struct {
+  pthread_t thread;
+  pthread_mutex_t lock;
+
+  /* Signaled when there is something for the flusher to do */
+  pthread_cond_t work;
+
+  /* Signaled when committed increases */
+  pthread_cond_t done;
+
+  kvdb_commit_ticket requested;
+  kvdb_commit_ticket committed;
+
+  /* Ticket ranges (from, to] covered by commits that failed, in order */
+  struct {
+    kvdb_commit_ticket from, to;
+  } *failed;
+  int n_failed;
+
+  /* A commit that covered no new tickets failed; its changes belong
+   * to the next ticket requested, which fails too. */
+  bool lost;
+
+  /* When did we notice there was something pending (0 = nothing) */
+  kvdb_time_t pending_since;
+
+  bool stop;
+};
+
+static bool _flush_due(kvdb k, kvdb_flusher f, kvdb_time_t now)
+{
+  int64_t bytes = __atomic_load_n(&k->pending_bytes, __ATOMIC_RELAXED);
+
+  if (k->options.commit_bytes > 0 && bytes >= k->options.commit_bytes)
+    return true;
+  return now >= f->pending_since + k->options.commit_interval_ms;
+}
+
+/* Remember that the tickets (from, to] did not make it to disk.
+ * Consecutive failures extend the same range. */
+static void _flush_failed(kvdb_flusher f,
+                          kvdb_commit_ticket from, kvdb_commit_ticket to)
+{
+  void *p;
+
+  if (f->n_failed && f->failed[f->n_failed - 1].to >= from)
+    {
+      f->failed[f->n_failed - 1].to = to;
+      return;
+    }
+  p = realloc(f->failed, (f->n_failed + 1) * sizeof(*f->failed));
+  if (!p)
+    {
+      /* Better to claim an earlier failed range covers these too
+       * than that they are on disk. */
+      KVDEBUG("realloc failed");
+      if (f->n_failed)
+        f->failed[f->n_failed - 1].to = to;
+      return;
+    }
+  f->failed = p;
+  f->failed[f->n_failed].from = from;
+  f->failed[f->n_failed].to = to;
+  f->n_failed++;
+}
+
+static void *_flusher_main(void *arg)
+{
+  kvdb k = arg;
+  kvdb_flusher f = k->flusher;
+
+  pthread_mutex_lock(&f->lock);
+  while (1)
+    {
+      bool pending = f->requested > f->committed
+        || __atomic_load_n(&k->pending_bytes, __ATOMIC_RELAXED) > 0;
+      kvdb_time_t now = kvdb_time();
+
+      if (!pending)
+        {
+          f->pending_since = 0;
+          if (f->stop)
+            break;
+          pthread_cond_wait(&f->work, &f->lock);
+          continue;
+        }
+      if (!f->pending_since)
+        f->pending_since = now;
+      if (!f->stop && !_flush_due(k, f, now))
+        {
+          kvdb_time_t due = f->pending_since + k->options.commit_interval_ms;
+          struct timespec ts = {
+            .tv_sec = due / MS_PER_S,
+            .tv_nsec = (due % MS_PER_S) * (1000000000 / MS_PER_S)
+          };
+          pthread_cond_timedwait(&f->work, &f->lock, &ts);
+          continue;
+        }
+
+      /* Everything requested so far is within the transaction. */
+      kvdb_commit_ticket target = f->requested;
+
+      f->pending_since = 0;
+      pthread_mutex_unlock(&f->lock);
+      __atomic_store_n(&k->pending_bytes, 0, __ATOMIC_RELAXED);
+      KVDEBUG("group commit up to ticket %llu", (unsigned long long)target);
+      bool ok = _kvdb_commit(k);
+      pthread_mutex_lock(&f->lock);
+      if (!ok)
+        {
+          if (target > f->committed)
+            _flush_failed(f, f->committed, target);
+          else if (f->requested > target)
+            _flush_failed(f, target, target + 1);
+          else
+            f->lost = true;
+        }
+      if (target > f->committed)
+        f->committed = target;
+      pthread_cond_broadcast(&f->done);
+      if (f->stop && f->requested <= f->committed)
+        break;
+    }
+  pthread_mutex_unlock(&f->lock);
+  return NULL;
+}
+
+bool _kvdb_flush_init(kvdb k)
+{
+  kvdb_flusher f = calloc(1, sizeof(*f));
+
+  if (!f)
+    {
+      _kvdb_set_err(k, "calloc failed");
+      return false;
+    }
+  pthread_mutex_init(&f->lock, NULL);
+  pthread_cond_init(&f->work, NULL);
+  pthread_cond_init(&f->done, NULL);
+  k->flusher = f;
+  if (pthread_create(&f->thread, NULL, _flusher_main, k))
+    {
+      k->flusher = NULL;
+      pthread_cond_destroy(&f->done);
+      pthread_cond_destroy(&f->work);
+      pthread_mutex_destroy(&f->lock);
+      free(f);
+      _kvdb_set_err(k, "unable to start flusher thread");
+      return false;
+    }
+  return true;
+}
+
+void _kvdb_flush_stop(kvdb k)
+{
+  kvdb_flusher f = k->flusher;
+
+  if (!f)
+    return;
+  /* Whatever has been asked for is committed before the thread
+   * exits; the rest is rolled back, as usual. */
+  pthread_mutex_lock(&f->lock);
+  f->stop = true;
+  __atomic_store_n(&k->pending_bytes, 0, __ATOMIC_RELAXED);
+  pthread_cond_signal(&f->work);
+  pthread_mutex_unlock(&f->lock);
+  pthread_join(f->thread, NULL);
+  k->flusher = NULL;
+  pthread_cond_destroy(&f->done);
+  pthread_cond_destroy(&f->work);
+  pthread_mutex_destroy(&f->lock);
+  free(f->failed);
+  free(f);
+}
+
+void _kvdb_flush_note_write(kvdb k, size_t len)
+{
+  kvdb_flusher f = k->flusher;
+  int64_t old = __atomic_fetch_add(&k->pending_bytes, len, __ATOMIC_RELAXED);
+
+  /* Wake up the flusher only when the first change arrives (to start
+   * the interval), and when the byte limit is crossed. */
+  if (old == 0
+      || (k->options.commit_bytes > 0
+          && old < k->options.commit_bytes
+          && old + (int64_t)len >= k->options.commit_bytes))
+    {
+      pthread_mutex_lock(&f->lock);
+      pthread_cond_signal(&f->work);
+      pthread_mutex_unlock(&f->lock);
+    }
+}
+
+kvdb_commit_ticket kvdb_commit_async(kvdb k)
+{
+  kvdb_flusher f = k->flusher;
+  kvdb_commit_ticket t;
+
+  if (!f)
+    return kvdb_commit(k) ? 1 : 0;
+  pthread_mutex_lock(&f->lock);
+  t = ++f->requested;
+  if (f->lost)
+    {
+      f->lost = false;
+      _flush_failed(f, t - 1, t);
+    }
+  pthread_cond_signal(&f->work);
+  pthread_mutex_unlock(&f->lock);
+  return t;
+}
+
+bool kvdb_commit_wait(kvdb k, kvdb_commit_ticket t)
+{
+  kvdb_flusher f = k->flusher;
+  bool r = true;
+  int i;
+
+  if (!t)
+    return false;
+  if (!f)
+    return true;
+  pthread_mutex_lock(&f->lock);
+  while (f->committed < t)
+    pthread_cond_wait(&f->done, &f->lock);
+  for (i = f->n_failed - 1 ; i >= 0 && f->failed[i].to >= t ; i--)
+    if (f->failed[i].from < t)
+      r = false;
+  pthread_mutex_unlock(&f->lock);
+  return r;
+}
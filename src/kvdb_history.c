@@ -0,0 +1,258 @@
+/*
+ * $Id: kvdb_history.c $
+ *
+ * Author: Markus Stenberg <fingon@iki.fi>
+ *
+ * Copyright (c) 2013 Markus Stenberg
+ *
+ */
+
+/* Access to the history of values: reads as of a point in time, and
+ * cursors over the versions of a value.
+ *
+ * Every value set is in the log with the time it was set at (see
+ * _o_set_sql), so the value of a key at time t is that of its latest
+ * entry added at t or earlier. With the log table, that is a single
+ * seek in its (oid, key, last_modified) index, and the versions are
+ * read from the same index newest first, as the cursor moves. Other
+ * backends are scanned in time order; up to t, or (for cursors) all
+ * of it up front, keeping just the versions of the value.
+ *
+ * Compaction removes old versions, except the ones in effect at
+ * history checkpoints (see checkpoint_interval_ms in kvdb.h), so
+ * what is read is exact at the checkpoints, and from wherever
+ * compaction has not reached yet on.
+ */
+
+#define DEBUG
+
+#include "kvdb_i.h"
+
+typedef struct {
+  kvdb_type t;
+  kvdb_time_t time;
+
+  /* NULL if there is no value; ext values are the digest. */
+  kvdb_buffer b;
+  bool ext;
+} _version_s;
+
+struct kvdb_history_struct {
+  kvdb k;
+  struct kvdb_oid_struct oid;
+  const char *key;
+
+  /* Stepped through as the cursor moves (with the log table), or */
+  sqlite3_stmt *stmt;
+  bool done;
+
+  /* what the scan found, oldest first */
+  _version_s *versions;
+  int n_versions;
+  int size;
+
+  /* The current version */
+  _version_s v;
+};
+
+static void _version_clear(_version_s *v)
+{
+  if (v->b)
+    kvdb_buffer_unref(v->b);
+  v->b = NULL;
+}
+
+static bool _version_set(_version_s *v, kvdb_type t, const void *value,
+                         size_t value_len, bool ext, kvdb_time_t time_added)
+{
+  _version_clear(v);
+  v->t = t;
+  v->time = time_added;
+  v->ext = ext;
+  /* (Removal of the value; nothing to keep.) */
+  if (t == KVDB_NULL && !value_len)
+    return true;
+  if (!(v->b = kvdb_buffer_create(value_len)))
+    return false;
+  memcpy(kvdb_buffer_data(v->b), value, value_len);
+  return true;
+}
+
+/* Content of the value (of blob, if it is a reference to one). */
+static kvdb_buffer _version_value(kvdb k, _version_s *v)
+{
+  if (!v->b)
+    return NULL;
+  if (!v->ext)
+    return kvdb_buffer_ref(v->b);
+  return _kvdb_blob_get(k, kvdb_buffer_data(v->b), kvdb_buffer_len(v->b));
+}
+
+typedef struct {
+  kvdb_oid oid;
+  const char *key;
+  kvdb_time_t until;
+  _version_s v;
+
+  /* Did the scan go past until (instead of failing)? */
+  bool past;
+} _at_s;
+
+static bool _at_entry(void *context, kvdb_oid oid, const char *key,
+                      kvdb_type t, const void *value, size_t value_len,
+                      bool ext, kvdb_time_t time_added)
+{
+  _at_s *as = context;
+
+  if (time_added > as->until)
+    {
+      as->past = true;
+      return false;
+    }
+  if (memcmp(oid, as->oid, KVDB_OID_SIZE) || strcmp(key, as->key))
+    return true;
+  return _version_set(&as->v, t, value, value_len, ext, time_added);
+}
+
+kvdb_buffer kvdb_o_get_at(kvdb_o o, kvdb_key key, kvdb_time_t t)
+{
+  kvdb k = o->k;
+  _at_s as = { .oid = &o->oid, .key = key->name, .until = t };
+  kvdb_buffer b = NULL;
+  bool r;
+
+  _kvdb_lock(k);
+  if (k->log_ops->get_at)
+    r = k->log_ops->get_at(k, &o->oid, key->name, t, _at_entry, &as);
+  else
+    r = k->log_ops->iterate(k, 0, false, _at_entry, &as) || as.past;
+  _kvdb_unlock(k);
+  if (r)
+    b = _version_value(k, &as.v);
+  _version_clear(&as.v);
+  return b;
+}
+
+static bool _history_entry(void *context, kvdb_oid oid, const char *key,
+                           kvdb_type t, const void *value, size_t value_len,
+                           bool ext, kvdb_time_t time_added)
+{
+  kvdb_history h = context;
+  _version_s *v;
+
+  if (h->stmt)
+    return _version_set(&h->v, t, value, value_len, ext, time_added);
+  if (memcmp(oid, &h->oid, KVDB_OID_SIZE) || strcmp(key, h->key))
+    return true;
+  if (h->n_versions == h->size)
+    {
+      int size = h->size ? 2 * h->size : 8;
+
+      if (!(v = realloc(h->versions, size * sizeof(*v))))
+        {
+          _kvdb_set_err(h->k, "realloc failed");
+          return false;
+        }
+      h->versions = v;
+      h->size = size;
+    }
+  v = &h->versions[h->n_versions];
+  memset(v, 0, sizeof(*v));
+  if (!_version_set(v, t, value, value_len, ext, time_added))
+    return false;
+  h->n_versions++;
+  return true;
+}
+
+kvdb_history kvdb_o_history(kvdb_o o, kvdb_key key)
+{
+  kvdb k = o->k;
+  kvdb_history h = calloc(1, sizeof(*h));
+  bool r = true;
+
+  if (!h)
+    {
+      KVDEBUG("calloc failed");
+      return NULL;
+    }
+  h->k = k;
+  h->oid = o->oid;
+  h->key = key->name;
+  _kvdb_lock(k);
+  if (k->log_ops->history)
+    r = (h->stmt = k->log_ops->history(k, &o->oid, key->name)) != NULL;
+  else
+    r = k->log_ops->iterate(k, 0, false, _history_entry, h);
+  _kvdb_unlock(k);
+  if (!r)
+    {
+      kvdb_history_close(h);
+      return NULL;
+    }
+  return h;
+}
+
+bool kvdb_history_next(kvdb_history h)
+{
+  kvdb k = h->k;
+  bool r = false;
+  int rc;
+
+  if (!h->stmt)
+    {
+      /* (Moved, not copied.) */
+      _version_clear(&h->v);
+      if (!h->n_versions)
+        return false;
+      h->v = h->versions[--h->n_versions];
+      return true;
+    }
+  /* (Stepping once more would start over.) */
+  if (h->done)
+    return false;
+  _kvdb_lock(k);
+  rc = sqlite3_step(h->stmt);
+  if (rc == SQLITE_ROW)
+    r = _kvdb_log_sqlite_entry(k, h->stmt, _history_entry, h);
+  else if (rc != SQLITE_DONE)
+    _kvdb_set_err_from_sqlite2(k, "log");
+  _kvdb_unlock(k);
+  if (!r)
+    {
+      _version_clear(&h->v);
+      h->done = true;
+    }
+  return r;
+}
+
+kvdb_time_t kvdb_history_time(kvdb_history h)
+{
+  return h->v.time;
+}
+
+kvdb_type kvdb_history_type(kvdb_history h)
+{
+  return h->v.t;
+}
+
+kvdb_buffer kvdb_history_value(kvdb_history h)
+{
+  return _version_value(h->k, &h->v);
+}
+
+void kvdb_history_close(kvdb_history h)
+{
+  kvdb k = h->k;
+
+  if (h->stmt)
+    {
+      _kvdb_lock(k);
+      sqlite3_finalize(h->stmt);
+      _kvdb_unlock(k);
+    }
+  while (h->n_versions)
+    _version_clear(&h->versions[--h->n_versions]);
+  free(h->versions);
+  _version_clear(&h->v);
+  free(h);
+}
@@ -19,6 +19,7 @@
 #include "util.h"
 #include "stringset.h"
 #include "ihash.h"
+#include "sha256.h"
 
 /* stdc99 compatibility */
 #ifndef typeof
@@ -28,6 +29,8 @@
 #include <libubox/list.h>
 #include <libubox/utils.h>
 
+#include <pthread.h>
+
 #define SQLITE_CALL2(c,err)             \
 do {                                    \
   int rc = c;                           \
@@ -64,6 +67,131 @@ do {                                                    \
 /* apps */
 #define KVDB_LOCAL_APP_STRING "_kvdb_local"
 
+/* Reference counted buffer (kvdb_blob.c) */
+struct kvdb_buffer_struct {
+  int refcount;
+  size_t len;
+  unsigned char data[0];
+};
+
+/* Reads either from cs (blob), or from a blob file (fd). */
+struct kvdb_blob_stream_struct {
+  kvdb k;
+  sqlite3_blob *blob;
+  int fd;
+  size_t len;
+};
+
+/* How long to wait for a lock held by another connection */
+#define KVDB_BUSY_TIMEOUT_MS 5000
+
+/* Number of independently locked parts of the object cache */
+#define KVDB_CACHE_SHARDS 16
+
+typedef struct kvdb_flusher_struct *kvdb_flusher;
+typedef struct kvdb_log_struct *kvdb_log;
+
+/* Log files (exports, and log segments) start with the magic and a
+ * version byte; ones without are version 0, from before log entries
+ * had a type. (See kvdb_io.c for the format.) */
+#define KVDB_LOG_MAGIC "KVDBLOG"
+#define KVDB_LOG_VERSION 2
+#define KVDB_LOG_HEADER_SIZE 8
+
+/* Room for an integer or double in the log file encoding */
+#define KVDB_LOG_VALUE_BUF 10
+
+/* A log file, mapped for reading; p is at the next record, with left
+ * bytes to go. */
+typedef struct kvdb_log_file_struct {
+  unsigned char *base;
+  size_t size;
+  int version;
+  unsigned char *p;
+  ssize_t left;
+} kvdb_log_file_s;
+
+/* A record within one. The key (null terminated) is in buf, which
+ * grows as needed; the value is the raw one (so it may be in vbuf),
+ * or the digest of a blob if ext. It points to the file otherwise. */
+typedef struct kvdb_log_record_struct {
+  struct kvdb_oid_struct oid;
+  char *key;
+  kvdb_type type;
+  const void *value;
+  size_t value_len;
+  bool ext;
+  kvdb_time_t time_added;
+
+  char *buf;
+  size_t buf_size;
+  unsigned char vbuf[KVDB_LOG_VALUE_BUF];
+} kvdb_log_record_s;
+
+/* Log (history) backend. The log table (kvdb_log_sqlite.c) is the
+ * default; the other one is segment files (kvdb_log_segment.c). All
+ * of these are called with the db lock held.
+ *
+ * This covers the log only; it is not a general storage backend.
+ * cs, app_class, the search indexes, their statistics and queries
+ * still go to SQLite directly. */
+/* Values are passed as their type, and the raw value (see
+ * _kvdb_tv_get_raw_value); KVDB_NULL is the type of entries from
+ * before values had one. (If ext is set, the value is the digest of
+ * a blob; see kvdb_blob.c.) */
+typedef bool (*kvdb_log_cb)(void *context, kvdb_oid oid, const char *key,
+                            kvdb_type t, const void *value, size_t value_len,
+                            bool ext, kvdb_time_t time_added);
+
+typedef const struct kvdb_log_ops_struct {
+  /* Add an entry (within the current transaction). */
+  bool (*append)(kvdb k, kvdb_oid oid, const char *key,
+                 kvdb_type t, const void *p, size_t len, bool ext,
+                 kvdb_time_t time_added);
+
+  /* Optional: called before every commit. */
+  bool (*pre_commit)(kvdb k);
+
+  /* Call cb for every entry added at 'since' or later (only ones that
+   * originated here if own_only), oldest first. Fails if cb does. */
+  bool (*iterate)(kvdb k, int64_t since, bool own_only,
+                  kvdb_log_cb cb, void *context);
+
+  /* Optional: write what iterate would (own_only = false) to f, in
+   * the kvdb_export format, and set *count to the number of entries. */
+  bool (*export)(kvdb k, FILE *f, int64_t since, int *count);
+
+  /* Optional: call cb for the latest entry of oid and key added at
+   * 'until' or earlier, if there is one (see kvdb_history.c for what
+   * is done without this). */
+  bool (*get_at)(kvdb k, kvdb_oid oid, const char *key, int64_t until,
+                 kvdb_log_cb cb, void *context);
+
+  /* Optional: a statement with the entries of oid and key, newest
+   * first, as rows for _kvdb_log_sqlite_entry (see kvdb_history.c for
+   * what is done without this). The caller finalizes it. */
+  sqlite3_stmt *(*history)(kvdb k, kvdb_oid oid, const char *key);
+
+  /* Optional: remove entries added before 'before' that are not
+   * among the keep latest ones of their oid and key (0 = no such
+   * limit), looking at up to rows entries (0 = all) from where the
+   * previous call left off. *removed is set to the number of entries
+   * removed. Called between transactions. */
+  bool (*compact)(kvdb k, kvdb_time_t before, int keep, int rows,
+                  int64_t *removed);
+
+  /* Optional: release whatever the backend holds. */
+  void (*destroy)(kvdb k);
+} *kvdb_log_ops;
+
+typedef struct kvdb_cache_shard_struct {
+  /* oid -> o hash */
+  ihash ih;
+
+  /* Protects ih, and every object within it (threadsafe mode only). */
+  pthread_mutex_t lock;
+} kvdb_cache_shard_s;
+
 /* We employ same strategy for handling pretty much every type of
  * 'semi-static' data within kvdb object: We provide enums here for
  * indexing array that contains them, and then in kvdb.c we initialize
@@ -81,13 +209,21 @@ enum {
   STMT_INSERT_CS,
   STMT_INSERT_APP_CLASS,
 
+  /* app/class name <> id mapping */
+  STMT_SELECT_APP_ID,
+  STMT_INSERT_APP_ID,
+  STMT_SELECT_CLASS_ID,
+  STMT_INSERT_CLASS_ID,
+
   /* Delete stmt (XXX - would it be better to do update instead? We
    * _do_ know if it should be update after all). */
   STMT_DELETE_CS,
 
   /* Utilities for selecting objects */
   STMT_SELECT_CS_BY_OID,
-  STMT_SELECT_CS_BY_KEY,
+  STMT_SELECT_CS_KEYS_BY_OID,
+  STMT_SELECT_CS_BY_OID_KEY,
+  STMT_SELECT_CS_ROWID_BY_OID_KEY,
 
   /* Export-specific */
   STMT_SELECT_LOG_BY_TA,
@@ -96,6 +232,18 @@ enum {
   /* Import-specific (=duplicate check) */
   STMT_SELECT_LOG_BY_LM_OID_KEY_VALUE,
 
+  /* Log compaction and history (kvdb_log_sqlite.c) */
+  STMT_SELECT_LOG_ROWID_AFTER,
+  STMT_DELETE_LOG_SUPERSEDED,
+  STMT_SELECT_LOG_AT,
+  STMT_INSERT_LOG_CHECKPOINT,
+
+  /* Segment file log bookkeeping (kvdb_log_segment.c) */
+  STMT_UPDATE_LOG_SEGMENT,
+  STMT_INSERT_LOG_INDEX,
+  STMT_SELECT_LOG_INDEX_BY_TA,
+  STMT_SELECT_LOG_SEGMENTS,
+
   NUM_STMTS
 };
 
@@ -154,8 +302,68 @@ struct kvdb_struct {
   stringset ss_class;
   stringset ss_key;
 
-  /* oid -> o hash */
-  ihash oid_ih;
+  /* oid -> o hash, split to shards by hash of the oid */
+  kvdb_cache_shard_s cache[KVDB_CACHE_SHARDS];
+
+  /* In threadsafe mode, the (single) SQLite connection and its
+   * statements belong to whoever holds db_lock. Lock order is shard
+   * lock -> db_lock. (The stringsets are safe to use as-is.) */
+  pthread_mutex_t db_lock;
+
+  /* Every defined search index (kvdb_index_struct.klh) */
+  struct list_head indexes;
+
+  /* Where the database lives (readers open the same file). */
+  char *path;
+  struct kvdb_options_struct options;
+
+  /* Opened by kvdb_open_reader; all writes are refused. */
+  bool read_only;
+
+  /* Background group commit state (kvdb_flush.c), and how many bytes
+   * of values have been written since the last commit */
+  kvdb_flusher flusher;
+  int64_t pending_bytes;
+
+  /* Where the history goes, and the segment file log state
+   * (kvdb_log_segment.c) if that is used */
+  kvdb_log_ops log_ops;
+  kvdb_log log;
+
+  /* Commits since the last incremental vacuum */
+  int commits_since_vacuum;
+
+  /* Commits since the last log compaction batch, whether kvdb_compact
+   * asked for a full pass, and where the next batch starts (log rowid
+   * with the log table) */
+  int commits_since_compact;
+  bool compact_all;
+  int64_t compact_cursor;
+
+  /* When the latest history checkpoint was taken (0 = not looked up
+   * yet) */
+  kvdb_time_t checkpoint_time;
+
+  /* Where blobs live (kvdb_blob.c); NULL for in-memory databases */
+  char *blob_dir;
+
+  /* Between kvdb_bulk_begin and kvdb_bulk_end; app_class rows go to
+   * bulk_app_class instead */
+  bool bulk;
+  sqlite3_stmt *stmt_bulk_app_class;
+
+  /* Readers handed out by kvdb_thread_reader (reader_lh), one per
+   * thread; the thread's own is found via reader_key. Readers point
+   * back at their writer with parent. They may outlive kvdb_destroy
+   * of the writer (destroyed), which is then freed with the last of
+   * them. */
+  pthread_mutex_t readers_lock;
+  pthread_key_t reader_key;
+  bool reader_key_valid;
+  struct list_head readers;
+  struct list_head reader_lh;
+  kvdb parent;
+  bool destroyed;
 };
 
 struct kvdb_o_struct {
@@ -165,6 +373,9 @@ struct kvdb_o_struct {
   /* Where does the object live? */
   kvdb k;
 
+  /* Which k->cache shard (and therefore lock) the object is in */
+  int shard;
+
   /* These are from kvdb-owned stringsets -> no need to worry about
    * allocating them. */
   kvdb_app app;
@@ -182,8 +393,18 @@ typedef struct kvdb_o_a_struct {
   /* Owned by stringset in kvdb */
   kvdb_key key;
 
-  /* 'Owned' data for the value, stored here. */
+  /* 'Owned' data for the value, stored here. Large binary values
+   * (and strings they turn into) point to buf instead. */
   struct kvdb_typed_value_struct value;
+  kvdb_buffer buf;
+
+  /* Have value and last_modified been read from cs yet? (Objects are
+   * loaded with just the keys, see _kvdb_o_get_a.) */
+  bool loaded;
+
+  /* Is the value from a cs row without a type? It is then binary
+   * until a getter asks for something else (see _o_a_retype). */
+  bool untyped;
 
   /* When was it last modified (this might not need to be here,
    perhaps?)  (XXX - think about memory <> disk i/o tradeoffs in
@@ -191,12 +412,27 @@ typedef struct kvdb_o_a_struct {
   kvdb_time_t last_modified;
 } *kvdb_o_a;
 
-struct __packed kvdb_app_struct {
+/* (Apps and classes are not packed, so that the id is aligned;
+ * the stringset data is up to the name, so the name follows it
+ * regardless of padding.) */
+struct kvdb_app_struct {
+  /* Persistent id (within app_names) */
+  int64_t id;
+
   /* The rest is name within stringset */
   char name[0];
 };
 
-struct __packed kvdb_class_struct {
+struct kvdb_class_struct {
+  /* Persistent id (within class_names) */
+  int64_t id;
+
+  /* Keys whose values are loaded along with the object (or all of
+   * them, if prefetch_all); changed only with the db lock held. */
+  int n_prefetch;
+  bool prefetch_all;
+  kvdb_key prefetch[KVDB_CLASS_PREFETCH_SIZE];
+
   /* The rest is name within stringset */
   char name[0];
 };
@@ -212,10 +448,19 @@ struct __packed kvdb_key_struct {
   char name[0];
 };
 
+/* How many buckets the (equi-depth) value histogram of an index has. */
+#define KVDB_INDEX_HISTOGRAM_SIZE 16
+
+/* Room for the bounds of a cached probe (see kvdb_query.c). */
+#define KVDB_INDEX_PROBE_SIZE 128
+
 struct kvdb_index_struct {
   /* List header within kvdb_key */
   struct list_head lh;
 
+  /* List header within kvdb */
+  struct list_head klh;
+
   /* Associated key */
   kvdb_key key;
 
@@ -228,24 +473,59 @@ struct kvdb_index_struct {
   /* Prepared statement to insert oid + keyish */
   sqlite3_stmt *stmt_insert;
 
+  /* Statistics for the query planner. rows is kept up to date
+   * incrementally once known (-1 = unknown), and stored at commit if
+   * it changed; the histogram bounds are refreshed only by
+   * kvdb_analyze (n_histogram = 0 if none). */
+  int64_t rows;
+  bool stats_dirty;
+  int n_histogram;
+  int64_t histogram[KVDB_INDEX_HISTOGRAM_SIZE + 1];
+
+  /* Rows inserted + deleted so far, and the latest probe of the index
+   * by the query planner (probe_n = -1 if none): the bounds probed,
+   * how many rows matched, and changes at the time. */
+  int64_t changes;
+  char probe_bounds[KVDB_INDEX_PROBE_SIZE];
+  int64_t probe_n;
+  int64_t probe_changes;
+
   char name[KVDB_INDEX_NAME_SIZE];
 };
 
 /* Within kvdb.c */
 void _kvdb_set_err(kvdb k, char *err);
+bool _kvdb_writable(kvdb k);
+bool _kvdb_commit(kvdb k);
+int _kvdb_get_int(kvdb k, const char *q, int default_value);
+kvdb_o _kvdb_cache_get(kvdb k, const void *oid);
+kvdb_o _kvdb_cache_add(kvdb k, kvdb_o o);
 void _kvdb_set_err_from_sqlite(kvdb k);
 void _kvdb_set_err_from_sqlite2(kvdb k, const char *bonus);
 bool _kvdb_run_stmt(kvdb k, sqlite3_stmt *stmt);
 bool _kvdb_run_stmt_keep(kvdb k, sqlite3_stmt *stmt);
 
 /* Within kvdb_o.c */
+kvdb_o _kvdb_alloc_o(kvdb k, const void *oid);
 kvdb_o _kvdb_create_o(kvdb k, const void *oid);
+kvdb_oid _kvdb_o_get_oid(kvdb_o o, kvdb_key key);
 void _kvdb_o_free(kvdb_o o);
 kvdb_o_a _kvdb_o_get_a(kvdb_o o, kvdb_key key);
 bool _kvdb_o_set(kvdb_o o, kvdb_key key,
                  const kvdb_typed_value value,
-                 kvdb_time_t last_modified);
+                 kvdb_time_t last_modified, kvdb_buffer buf);
 void _kvdb_tv_get_raw_value(kvdb_typed_value value, void **p, size_t *len);
+bool _kvdb_tv_set_raw(kvdb_typed_value ktv, kvdb_type t,
+                      const void *p, size_t len);
+int _kvdb_tv_bind(sqlite3_stmt *s, int i, kvdb_typed_value ktv);
+bool _kvdb_tv_column(kvdb_typed_value ktv, sqlite3_stmt *s,
+                     int col, int type_col);
+
+/* The type stored for the value (small binaries are just binaries). */
+static inline kvdb_type _kvdb_tv_type(kvdb_typed_value ktv)
+{
+  return ktv->t == KVDB_BINARY_SMALL ? KVDB_BINARY : ktv->t;
+}
 
 static inline void _kvdb_tv_set_binary(kvdb_typed_value ktv,
                                       void *p, size_t len)
@@ -289,22 +569,97 @@ static inline int _kvdb_tv_cmp(kvdb_typed_value v1, kvdb_typed_value v2)
 
 /* Within kvdb_index.c */
 bool _kvdb_index_init(kvdb k);
+bool _kvdb_index_set_bulk(kvdb k, bool bulk);
 bool _kvdb_handle_delete_indexes(kvdb_o o, kvdb_key k);
 bool _kvdb_handle_insert_indexes(kvdb_o o, kvdb_key k);
+int64_t _kvdb_index_estimate_range(kvdb_index i, int64_t lo, int64_t hi);
+bool _kvdb_index_save_stats(kvdb k);
+bool _kvdb_index_upgrade_keys(kvdb k);
+
+/* Within kvdb_query.c */
+int _kvdb_q_driver(kvdb_query q);
+
+/* Within kvdb_flush.c */
+bool _kvdb_flush_init(kvdb k);
+void _kvdb_flush_stop(kvdb k);
+void _kvdb_flush_note_write(kvdb k, size_t len);
+
+/* Within kvdb_log_sqlite.c */
+extern const struct kvdb_log_ops_struct _kvdb_log_sqlite_ops;
+bool _kvdb_log_sqlite_entry(kvdb k, sqlite3_stmt *s,
+                            kvdb_log_cb cb, void *context);
+
+/* Within kvdb_log_segment.c */
+bool _kvdb_log_segment_init(kvdb k);
+
+/* Within kvdb_blob.c */
+bool _kvdb_blob_init(kvdb k);
+bool _kvdb_blob_in_use(kvdb k);
+void _kvdb_blob_path(kvdb k, const void *digest, char *buf, size_t len);
+bool _kvdb_blob_put(kvdb k, const void *p, size_t len,
+                    unsigned char digest[SHA256_SIZE]);
+kvdb_buffer _kvdb_blob_get(kvdb k, const void *digest, size_t len);
+bool _kvdb_blob_export(kvdb k, const void *digest, const char *directory);
+kvdb_buffer _kvdb_blob_import(kvdb k, const void *digest,
+                              const char *directory);
 
 /* Within kvdb_io.c */
 bool _kvdb_io_init(kvdb k);
 void _kvdb_io_pre_commit(kvdb k);
+kvdb_time_t _kvdb_io_export_time(kvdb k);
+bool _kvdb_log_write_header(FILE *f);
+bool _kvdb_log_open(const char *path, size_t size, kvdb_log_file_s *lf);
+void _kvdb_log_close(kvdb_log_file_s *lf);
+bool _kvdb_log_read_record(kvdb_log_file_s *lf, kvdb_log_record_s *r);
+ssize_t _kvdb_log_write_record(FILE *f, kvdb_log_record_s *r);
+const void *_kvdb_log_encode_value(kvdb_type t, const void *p, size_t *len,
+                                   unsigned char *buf);
+bool _kvdb_log_decode_value(int version, kvdb_type t,
+                            const void **p, size_t *len, unsigned char *buf);
 
 static inline kvdb_time_t kvdb_monotonous_time(kvdb k)
 {
   kvdb_time_t now = kvdb_time();
-
-  if (now < k->monotonous_time)
-    now = k->monotonous_time;
-  else
-    k->monotonous_time = now;
+  kvdb_time_t old = __atomic_load_n(&k->monotonous_time, __ATOMIC_RELAXED);
+
+  do {
+    if (now < old)
+      return old;
+  } while (!__atomic_compare_exchange_n(&k->monotonous_time, &old, now,
+                                        false,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED));
   return now;
 }
 
+/* (High bits, as ihash uses the low ones of the same hash.) */
+static inline int _kvdb_o_shard(const void *oid)
+{
+  return (hash_bytes(oid, KVDB_OID_SIZE) >> 32) % KVDB_CACHE_SHARDS;
+}
+
+/* Locking; these are no-ops unless the kvdb is in threadsafe mode. */
+static inline void _kvdb_lock(kvdb k)
+{
+  if (k->options.threadsafe)
+    pthread_mutex_lock(&k->db_lock);
+}
+
+static inline void _kvdb_unlock(kvdb k)
+{
+  if (k->options.threadsafe)
+    pthread_mutex_unlock(&k->db_lock);
+}
+
+static inline void _kvdb_o_lock(kvdb_o o)
+{
+  if (o->k->options.threadsafe)
+    pthread_mutex_lock(&o->k->cache[o->shard].lock);
+}
+
+static inline void _kvdb_o_unlock(kvdb_o o)
+{
+  if (o->k->options.threadsafe)
+    pthread_mutex_unlock(&o->k->cache[o->shard].lock);
+}
+
 #endif /* KVDB_I_H */
@@ -0,0 +1,698 @@
+/*
+ * $Id: kvdb_image.c $
+ *
+ * Author: Markus Stenberg <fingon@iki.fi>
+ *
+ * Copyright (c) 2013 Markus Stenberg
+ *
+ */
+
+/* Read-only images of the current state.
+ *
+ * An image is a single immutable file, used via mmap as-is: opening
+ * one costs a header check, and lookups are a couple of probes into
+ * the mapping, with values returned in place.
+ *
+ * Layout (native byte order; everything 8-byte aligned):
+ *
+ * header
+ * keys: n_keys x _image_key, sorted by name (+ the names)
+ * buckets: n_buckets x _image_bucket (displacements, see below)
+ * slots: n_slots x uint64_t record offset (0 = empty)
+ * records: one per object; _image_record, its fields sorted by key
+ * (_image_field), and then the values, each followed by a NUL
+ * (so strings can be used in place) and padded to 8 bytes.
+ *
+ * The oid directory is a perfect hash built with the hash and
+ * displace (CHD) approach: each oid hashes to a bucket, and to
+ * (f1, f2); every bucket has displacements (d0, d1) chosen (biggest
+ * buckets first) so that slot (f2 + d0 * f1 + d1) % n_slots of each
+ * of its oids is unique. Lookup is thus one bucket read and one slot
+ * read, and the oid stored within the record tells if it was a hit.
+ */
+
+#define DEBUG
+
+#include "kvdb_i.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define IMAGE_MAGIC "KVDBIMG"
+#define IMAGE_VERSION 1
+
+/* Average oids per bucket */
+#define IMAGE_BUCKET_SIZE 4
+
+/* How many seeds to try before giving up */
+#define IMAGE_SEEDS 16
+
+#define ALIGN8(x) (((x) + 7) & ~(uint64_t)7)
+
+struct _image_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t n_keys;
+  uint64_t n_objects;
+  uint64_t seed;
+  uint32_t n_buckets;
+  uint32_t n_slots;
+  uint64_t keys_offset;
+  uint64_t buckets_offset;
+  uint64_t slots_offset;
+  uint64_t size;
+};
+
+struct _image_key {
+  uint64_t name_offset;
+  uint32_t type;
+  uint32_t pad;
+};
+
+struct _image_bucket {
+  uint32_t d0;
+  uint32_t d1;
+};
+
+struct _image_record {
+  struct kvdb_oid_struct oid;
+  uint32_t n_fields;
+  uint32_t pad;
+};
+
+struct _image_field {
+  uint32_t key;
+  uint32_t len;
+  int64_t last_modified;
+  uint64_t value_offset;
+};
+
+struct kvdb_image_struct {
+  const unsigned char *base;
+  size_t size;
+  const struct _image_header *h;
+};
+
+static inline uint64_t _mix(uint64_t x)
+{
+  /* splitmix64 finalizer */
+  x ^= x >> 30;
+  x *= 0xbf58476d1ce4e5b9ULL;
+  x ^= x >> 27;
+  x *= 0x94d049bb133111ebULL;
+  x ^= x >> 31;
+  return x;
+}
+
+static void _hash(kvdb_oid oid, uint64_t seed,
+                  uint32_t n_buckets, uint32_t n_slots,
+                  uint32_t *bucket, uint32_t *f1, uint32_t *f2)
+{
+  uint64_t a, b, h1, h2;
+
+  memcpy(&a, oid->oid, sizeof(a));
+  memcpy(&b, oid->oid + sizeof(a), sizeof(b));
+  h1 = _mix(a ^ _mix(b ^ seed));
+  h2 = _mix(h1 ^ seed ^ 0x9e3779b97f4a7c15ULL);
+  *bucket = (h1 >> 32) % n_buckets;
+  *f1 = h1 % n_slots;
+  *f2 = h2 % n_slots;
+}
+
+/* Writing */
+
+typedef struct {
+  struct kvdb_oid_struct oid;
+  uint64_t offset;
+  uint32_t bucket, f1, f2;
+} _image_entry;
+
+typedef struct {
+  kvdb k;
+  FILE *f;
+  uint64_t pos;
+
+  /* Keys (sorted by name) */
+  char **names;
+  int n_keys;
+
+  /* Objects written so far */
+  _image_entry *entries;
+  uint64_t n_entries;
+
+  /* Object being collected: its fields, and their values */
+  struct kvdb_oid_struct oid;
+  struct _image_field *fields;
+  int n_fields, fields_size;
+  unsigned char *values;
+  size_t values_len, values_size;
+} _image_writer;
+
+static bool _write(_image_writer *w, const void *p, size_t len)
+{
+  if (len && fwrite(p, 1, len, w->f) != len)
+    {
+      _kvdb_set_err(w->k, "i/o error while writing image");
+      return false;
+    }
+  w->pos += len;
+  return true;
+}
+
+static bool _pad(_image_writer *w)
+{
+  static const char zeros[8];
+
+  return _write(w, zeros, ALIGN8(w->pos) - w->pos);
+}
+
+static int _key_index(_image_writer *w, const char *name)
+{
+  int lo = 0, hi = w->n_keys - 1;
+
+  while (lo <= hi)
+    {
+      int mid = (lo + hi) / 2;
+      int c = strcmp(w->names[mid], name);
+
+      if (!c)
+        return mid;
+      if (c < 0)
+        lo = mid + 1;
+      else
+        hi = mid - 1;
+    }
+  return -1;
+}
+
+/* Write out the object collected so far (if any). */
+static bool _flush_object(_image_writer *w)
+{
+  struct _image_record r = { .oid = w->oid, .n_fields = w->n_fields };
+  uint64_t values_offset;
+  int i;
+
+  if (!w->n_fields)
+    return true;
+  w->entries[w->n_entries].oid = w->oid;
+  w->entries[w->n_entries++].offset = w->pos;
+  values_offset = w->pos + sizeof(r) + w->n_fields * sizeof(w->fields[0]);
+  for (i = 0 ; i < w->n_fields ; i++)
+    w->fields[i].value_offset += values_offset;
+  if (!_write(w, &r, sizeof(r))
+      || !_write(w, w->fields, w->n_fields * sizeof(w->fields[0]))
+      || !_write(w, w->values, w->values_len))
+    return false;
+  w->n_fields = 0;
+  w->values_len = 0;
+  return true;
+}
+
+static bool _add_field(_image_writer *w, int key, const void *p, size_t len,
+                       int64_t last_modified)
+{
+  size_t need = w->values_len + ALIGN8(len + 1);
+
+  if (w->n_fields == w->fields_size)
+    {
+      int n = w->fields_size ? w->fields_size * 2 : 16;
+      void *nf = realloc(w->fields, n * sizeof(w->fields[0]));
+
+      if (!nf)
+        return false;
+      w->fields = nf;
+      w->fields_size = n;
+    }
+  if (need > w->values_size)
+    {
+      size_t n = need * 2;
+      void *nv = realloc(w->values, n);
+
+      if (!nv)
+        return false;
+      w->values = nv;
+      w->values_size = n;
+    }
+  w->fields[w->n_fields++] = (struct _image_field) {
+    .key = key, .len = len, .last_modified = last_modified,
+    .value_offset = w->values_len
+  };
+  memcpy(w->values + w->values_len, p, len);
+  memset(w->values + w->values_len + len, 0, need - w->values_len - len);
+  w->values_len = need;
+  return true;
+}
+
+/* Find displacements for every bucket; false if this seed does not
+ * work out. */
+static bool _displace(_image_entry *e, uint64_t n, uint64_t seed,
+                      uint32_t n_buckets, uint32_t n_slots,
+                      struct _image_bucket *buckets, uint64_t *slots)
+{
+  uint32_t *count = calloc(n_buckets + 1, sizeof(uint32_t));
+  uint32_t *start = calloc(n_buckets + 1, sizeof(uint32_t));
+  uint32_t *order = calloc(n_buckets, sizeof(uint32_t));
+  uint64_t *members = calloc(n + 1, sizeof(uint64_t));
+  uint32_t *pos = NULL;
+  bool ok = count && start && order && members;
+  uint64_t i;
+  uint32_t b, j, c, max = 0, n_order = 0;
+
+  for (i = 0 ; ok && i < n ; i++)
+    {
+      _hash(&e[i].oid, seed, n_buckets, n_slots,
+            &e[i].bucket, &e[i].f1, &e[i].f2);
+      count[e[i].bucket]++;
+    }
+  /* Members of each bucket, contiguously */
+  for (b = 0 ; ok && b < n_buckets ; b++)
+    {
+      start[b + 1] = start[b] + count[b];
+      if (count[b] > max)
+        max = count[b];
+    }
+  for (i = 0 ; ok && i < n ; i++)
+    members[start[e[i].bucket]++] = i;
+  for (b = 0 ; ok && b < n_buckets ; b++)
+    start[b] -= count[b];
+  ok = ok && (pos = calloc(max + 1, sizeof(uint32_t)));
+
+  /* Biggest buckets first (empty ones need nothing) */
+  for (c = max ; ok && c > 0 ; c--)
+    for (b = 0 ; b < n_buckets ; b++)
+      if (count[b] == c)
+        order[n_order++] = b;
+  memset(slots, 0, n_slots * sizeof(slots[0]));
+
+  for (b = 0 ; ok && b < n_order ; b++)
+    {
+      uint32_t bi = order[b];
+      uint32_t d0, d1;
+      bool found = false;
+
+      for (d0 = 0 ; !found && d0 < n_slots ; d0++)
+        for (d1 = 0 ; !found && d1 < n_slots ; d1++)
+          {
+            for (j = 0 ; j < count[bi] ; j++)
+              {
+                _image_entry *ee = &e[members[start[bi] + j]];
+                uint32_t k;
+
+                pos[j] = (ee->f2 + (uint64_t)d0 * ee->f1 + d1) % n_slots;
+                if (slots[pos[j]])
+                  break;
+                for (k = 0 ; k < j && pos[k] != pos[j] ; k++);
+                if (k < j)
+                  break;
+              }
+            if (j < count[bi])
+              continue;
+            for (j = 0 ; j < count[bi] ; j++)
+              slots[pos[j]] = e[members[start[bi] + j]].offset;
+            buckets[bi].d0 = d0;
+            buckets[bi].d1 = d1;
+            found = true;
+          }
+      ok = found;
+    }
+  free(pos);
+  free(members);
+  free(order);
+  free(start);
+  free(count);
+  return ok;
+}
+
+static bool _write_keys(_image_writer *w, struct _image_header *h)
+{
+  sqlite3_stmt *s;
+  kvdb k = w->k;
+  uint64_t name_offset;
+  int rc, i;
+
+  SQLITE_CALL(sqlite3_prepare_v2(k->db, "SELECT DISTINCT key FROM cs "
+                                 "ORDER BY key", -1, &s, NULL));
+  while ((rc = sqlite3_step(s)) == SQLITE_ROW)
+    {
+      char **nn = realloc(w->names, (w->n_keys + 1) * sizeof(char *));
+      char *name = strdup((const char *)sqlite3_column_text(s, 0));
+
+      if (!nn || !name)
+        {
+          free(name);
+          if (nn)
+            w->names = nn;
+          sqlite3_finalize(s);
+          _kvdb_set_err(k, "out of memory");
+          return false;
+        }
+      w->names = nn;
+      w->names[w->n_keys++] = name;
+    }
+  sqlite3_finalize(s);
+  if (rc != SQLITE_DONE)
+    {
+      _kvdb_set_err_from_sqlite2(k, "image keys");
+      return false;
+    }
+
+  h->n_keys = w->n_keys;
+  h->keys_offset = w->pos;
+  name_offset = w->pos + w->n_keys * sizeof(struct _image_key);
+  for (i = 0 ; i < w->n_keys ; i++)
+    {
+      struct _image_key ik = {
+        .name_offset = name_offset,
+        .type = kvdb_key_get_type(kvdb_define_key(k, w->names[i], KVDB_NULL))
+      };
+
+      if (!_write(w, &ik, sizeof(ik)))
+        return false;
+      name_offset += strlen(w->names[i]) + 1;
+    }
+  for (i = 0 ; i < w->n_keys ; i++)
+    if (!_write(w, w->names[i], strlen(w->names[i]) + 1))
+      return false;
+  return _pad(w);
+}
+
+static bool _write_records(_image_writer *w)
+{
+  sqlite3_stmt *s;
+  kvdb k = w->k;
+  int rc;
+  bool ok = true;
+
+  SQLITE_CALL(sqlite3_prepare_v2(k->db, "SELECT oid, key, value, "
+                                 "last_modified, ext, type FROM cs "
+                                 "ORDER BY oid, key", -1, &s, NULL));
+  while (ok && (rc = sqlite3_step(s)) == SQLITE_ROW)
+    {
+      const void *oid = sqlite3_column_blob(s, 0);
+      struct kvdb_typed_value_struct ktv;
+      kvdb_buffer buf = NULL;
+      void *p;
+      size_t len;
+
+      if (sqlite3_column_bytes(s, 0) != KVDB_OID_SIZE)
+        continue;
+      if (memcmp(oid, &w->oid, KVDB_OID_SIZE))
+        {
+          ok = _flush_object(w);
+          memcpy(&w->oid, oid, KVDB_OID_SIZE);
+        }
+      /* Values are stored raw. (Images are self-contained; blobs are
+       * copied in.) */
+      if (ok && sqlite3_column_type(s, 4) != SQLITE_NULL)
+        {
+          if ((buf = _kvdb_blob_get(k, sqlite3_column_blob(s, 2),
+                                    sqlite3_column_bytes(s, 2))))
+            {
+              p = buf->data;
+              len = buf->len;
+            }
+          else
+            ok = false;
+        }
+      else if (ok)
+        {
+          if (_kvdb_tv_column(&ktv, s, 2, 5))
+            _kvdb_tv_get_raw_value(&ktv, &p, &len);
+          else
+            {
+              _kvdb_set_err(k, "invalid value in cs");
+              ok = false;
+            }
+        }
+      ok = ok && _add_field(w, _key_index(w, (const char *)
+                                          sqlite3_column_text(s, 1)),
+                            p, len, sqlite3_column_int64(s, 3));
+      if (buf)
+        kvdb_buffer_unref(buf);
+    }
+  sqlite3_finalize(s);
+  if (ok && rc != SQLITE_DONE)
+    {
+      _kvdb_set_err_from_sqlite2(k, "image records");
+      return false;
+    }
+  return ok && _flush_object(w);
+}
+
+static bool _kvdb_image_write_locked(_image_writer *w, const char *path)
+{
+  kvdb k = w->k;
+  struct _image_header h = { .magic = IMAGE_MAGIC, .version = IMAGE_VERSION };
+  struct _image_bucket *buckets = NULL;
+  uint64_t *slots = NULL;
+  uint64_t data_offset;
+  bool ok = false;
+
+  h.n_objects = _kvdb_get_int(k, "SELECT count(DISTINCT oid) FROM cs", 0);
+  h.n_buckets = h.n_objects / IMAGE_BUCKET_SIZE + 1;
+  h.n_slots = h.n_objects + h.n_objects / 4 + 1;
+  if (!(w->entries = calloc(h.n_objects + 1, sizeof(w->entries[0])))
+      || !(buckets = calloc(h.n_buckets, sizeof(buckets[0])))
+      || !(slots = calloc(h.n_slots, sizeof(slots[0]))))
+    {
+      _kvdb_set_err(k, "out of memory");
+      goto done;
+    }
+
+  /* Header is written last; keys, then records after the directory. */
+  w->pos = sizeof(h);
+  if (fseek(w->f, w->pos, SEEK_SET) || !_write_keys(w, &h))
+    goto done;
+  h.buckets_offset = w->pos;
+  h.slots_offset = ALIGN8(h.buckets_offset
+                          + h.n_buckets * sizeof(buckets[0]));
+  data_offset = h.slots_offset + h.n_slots * sizeof(slots[0]);
+  w->pos = data_offset;
+  if (fseek(w->f, w->pos, SEEK_SET) || !_write_records(w))
+    goto done;
+  h.size = w->pos;
+  if (w->n_entries != h.n_objects)
+    {
+      _kvdb_set_err(k, "object count changed while writing image");
+      goto done;
+    }
+
+  for (h.seed = 0 ; h.seed < IMAGE_SEEDS ; h.seed++)
+    if (_displace(w->entries, w->n_entries, h.seed, h.n_buckets, h.n_slots,
+                  buckets, slots))
+      break;
+  if (h.seed == IMAGE_SEEDS)
+    {
+      _kvdb_set_err(k, "unable to build image directory");
+      goto done;
+    }
+  w->pos = 0;
+  if (fseek(w->f, 0, SEEK_SET)
+      || !_write(w, &h, sizeof(h))
+      || fseek(w->f, h.buckets_offset, SEEK_SET)
+      || !_write(w, buckets, h.n_buckets * sizeof(buckets[0]))
+      || fseek(w->f, h.slots_offset, SEEK_SET)
+      || !_write(w, slots, h.n_slots * sizeof(slots[0])))
+    goto done;
+  KVDEBUG("wrote image %s: %lld objects, %lld bytes", path,
+          (long long)h.n_objects, (long long)h.size);
+  ok = true;
+ done:
+  free(slots);
+  free(buckets);
+  return ok;
+}
+
+bool kvdb_image_write(kvdb k, const char *path)
+{
+  _image_writer w = { .k = k };
+  char tmp[256];
+  bool ok;
+  int i;
+
+  if (!kvdb_commit(k))
+    return false;
+  snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+  if (!(w.f = fopen(tmp, "wb")))
+    {
+      _kvdb_set_err(k, "unable to create image");
+      return false;
+    }
+  _kvdb_lock(k);
+  ok = _kvdb_image_write_locked(&w, path);
+  _kvdb_unlock(k);
+  if (fclose(w.f))
+    ok = false;
+  if (ok && rename(tmp, path))
+    {
+      _kvdb_set_err(k, "unable to rename image");
+      ok = false;
+    }
+  if (!ok)
+    unlink(tmp);
+  for (i = 0 ; i < w.n_keys ; i++)
+    free(w.names[i]);
+  free(w.names);
+  free(w.entries);
+  free(w.fields);
+  free(w.values);
+  return ok;
+}
+
+/* Reading */
+
+kvdb_image kvdb_image_open(const char *path)
+{
+  kvdb_image img;
+  const struct _image_header *h;
+  struct stat st;
+  void *base;
+  int fd;
+
+  if ((fd = open(path, O_RDONLY)) < 0)
+    return NULL;
+  if (fstat(fd, &st) || st.st_size < (off_t)sizeof(*h))
+    {
+      close(fd);
+      return NULL;
+    }
+  base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED)
+    return NULL;
+  h = base;
+  if (memcmp(h->magic, IMAGE_MAGIC, sizeof(h->magic))
+      || h->version != IMAGE_VERSION
+      || h->size != (uint64_t)st.st_size
+      || h->keys_offset + h->n_keys * sizeof(struct _image_key) > h->size
+      || h->buckets_offset
+      + h->n_buckets * sizeof(struct _image_bucket) > h->size
+      || h->slots_offset + h->n_slots * sizeof(uint64_t) > h->size
+      || !h->n_buckets || !h->n_slots)
+    {
+      KVDEBUG("invalid image %s", path);
+      munmap(base, st.st_size);
+      return NULL;
+    }
+  if (!(img = calloc(1, sizeof(*img))))
+    {
+      munmap(base, st.st_size);
+      return NULL;
+    }
+  img->base = base;
+  img->size = st.st_size;
+  img->h = h;
+  return img;
+}
+
+void kvdb_image_close(kvdb_image img)
+{
+  munmap((void *)img->base, img->size);
+  free(img);
+}
+
+int64_t kvdb_image_count(kvdb_image img)
+{
+  return img->h->n_objects;
+}
+
+static const struct _image_record *_image_lookup(kvdb_image img, kvdb_oid oid)
+{
+  const struct _image_header *h = img->h;
+  const struct _image_bucket *buckets =
+    (const void *)(img->base + h->buckets_offset);
+  const uint64_t *slots = (const void *)(img->base + h->slots_offset);
+  const struct _image_record *r;
+  uint32_t bucket, f1, f2;
+  uint64_t offset;
+
+  _hash(oid, h->seed, h->n_buckets, h->n_slots, &bucket, &f1, &f2);
+  offset = slots[(f2 + (uint64_t)buckets[bucket].d0 * f1
+                  + buckets[bucket].d1) % h->n_slots];
+  if (!offset || offset + sizeof(*r) > img->size)
+    return NULL;
+  r = (const void *)(img->base + offset);
+  if (memcmp(&r->oid, oid, KVDB_OID_SIZE))
+    return NULL;
+  return r;
+}
+
+static int _image_key_index(kvdb_image img, const char *key)
+{
+  const struct _image_key *keys =
+    (const void *)(img->base + img->h->keys_offset);
+  int lo = 0, hi = img->h->n_keys - 1;
+
+  while (lo <= hi)
+    {
+      int mid = (lo + hi) / 2;
+      int c = strcmp((const char *)img->base + keys[mid].name_offset, key);
+
+      if (!c)
+        return mid;
+      if (c < 0)
+        lo = mid + 1;
+      else
+        hi = mid - 1;
+    }
+  return -1;
+}
+
+bool kvdb_image_get(kvdb_image img, kvdb_oid oid, const char *key,
+                    const void **p, size_t *len, kvdb_time_t *last_modified)
+{
+  const struct _image_record *r = _image_lookup(img, oid);
+  const struct _image_field *fields;
+  int ki, lo, hi;
+
+  if (!r || (ki = _image_key_index(img, key)) < 0)
+    return false;
+  fields = (const void *)(r + 1);
+  lo = 0;
+  hi = r->n_fields - 1;
+  while (lo <= hi)
+    {
+      int mid = (lo + hi) / 2;
+
+      if (fields[mid].key == (uint32_t)ki)
+        {
+          *p = img->base + fields[mid].value_offset;
+          if (len)
+            *len = fields[mid].len;
+          if (last_modified)
+            *last_modified = fields[mid].last_modified;
+          return true;
+        }
+      if (fields[mid].key < (uint32_t)ki)
+        lo = mid + 1;
+      else
+        hi = mid - 1;
+    }
+  return false;
+}
+
+const int64_t *kvdb_image_get_int64(kvdb_image img, kvdb_oid oid,
+                                    const char *key)
+{
+  const void *p;
+  size_t len;
+
+  if (!kvdb_image_get(img, oid, key, &p, &len, NULL)
+      || len != sizeof(int64_t))
+    return NULL;
+  return p;
+}
+
+const char *kvdb_image_get_string(kvdb_image img, kvdb_oid oid,
+                                  const char *key)
+{
+  const void *p;
+  size_t len;
+
+  if (!kvdb_image_get(img, oid, key, &p, &len, NULL)
+      || !len || ((const char *)p)[len - 1])
+    return NULL;
+  return p;
+}
@@ -82,13 +82,76 @@ static kvdb_index _define_index(kvdb k,
       goto fail;
     }
   *added = true;
+  i->rows = -1;
+  i->probe_n = -1;
   list_add(&i->lh, &key->index_lh);
+  list_add(&i->klh, &k->indexes);
   return i;
  fail:
   free(i);
   return NULL;
 }
 
+/* SQL-side decoder used by the bulk index build; returns the int64
+ * stored within a value blob, or NULL if it does not look like one. */
+static void _sql_int64(sqlite3_context *ctx, int argc, sqlite3_value **argv)
+{
+  int64_t v;
+
+  if (sqlite3_value_type(argv[0]) != SQLITE_BLOB
+      || sqlite3_value_bytes(argv[0]) != sizeof(v))
+    {
+      sqlite3_result_null(ctx);
+      return;
+    }
+  memcpy(&v, sqlite3_value_blob(argv[0]), sizeof(v));
+  sqlite3_result_int64(ctx, v);
+}
+
+static kvdb_index _find_index(kvdb k, const char *name)
+{
+  kvdb_index i;
+
+  list_for_each_entry(i, &k->indexes, klh)
+    if (strcmp(i->name, name) == 0)
+      return i;
+  return NULL;
+}
+
+static bool _kvdb_index_load_stats(kvdb k)
+{
+  sqlite3_stmt *stmt;
+  int rc;
+
+  SQLITE_CALL(sqlite3_prepare_v2(k->db, "SELECT name,rows,histogram FROM search_index_stats", -1, &stmt, NULL));
+  rc = sqlite3_step(stmt);
+  while (rc == SQLITE_ROW)
+    {
+      KVASSERT(sqlite3_column_count(stmt)==3, "weird stmt count");
+      const char *name = (const char *)sqlite3_column_text(stmt, 0);
+      kvdb_index i = _find_index(k, name);
+      int len = sqlite3_column_bytes(stmt, 2);
+      if (i)
+        {
+          i->rows = sqlite3_column_int64(stmt, 1);
+          i->n_histogram = 0;
+          if (len == sizeof(i->histogram))
+            {
+              memcpy(i->histogram, sqlite3_column_blob(stmt, 2), len);
+              i->n_histogram = KVDB_INDEX_HISTOGRAM_SIZE;
+            }
+        }
+      rc = sqlite3_step(stmt);
+    }
+  sqlite3_finalize(stmt);
+  if (rc != SQLITE_DONE)
+    {
+      _kvdb_set_err_from_sqlite2(k, "select from search_index_stats");
+      return false;
+    }
+  return true;
+}
+
 bool _kvdb_index_init(kvdb k)
 {
   /* Go through search_index, and define those indexes to exist. */
@@ -97,6 +160,9 @@ bool _kvdb_index_init(kvdb k)
 
   KVDEBUG("_kvdb_index_init");
 
+  SQLITE_CALL(sqlite3_create_function(k->db, "kvdb_int64", 1, SQLITE_UTF8,
+                                      NULL, _sql_int64, NULL, NULL));
+
   SQLITE_CALL(sqlite3_prepare_v2(k->db, "SELECT name,type,keyname,keytype FROM search_index", -1, &stmt, NULL));
   rc = sqlite3_step(stmt);
   while (rc == SQLITE_ROW)
@@ -119,7 +185,7 @@ bool _kvdb_index_init(kvdb k)
       return false;
     }
   sqlite3_finalize(stmt);
-  return true;
+  return _kvdb_index_load_stats(k);
 }
 
 
@@ -133,7 +199,15 @@ static bool _kvdb_handle_delete_index(kvdb_o o, kvdb_index i)
   SQLITE_CALL(sqlite3_clear_bindings(s));
   SQLITE_CALL(sqlite3_bind_blob(s, 1, &o->oid, KVDB_OID_SIZE, SQLITE_STATIC));
   KVDEBUG("removed index %s for %p", i->name, o);
-  return _kvdb_run_stmt_keep(k, s);
+  if (!_kvdb_run_stmt_keep(k, s))
+    return false;
+  i->changes += sqlite3_changes(k->db);
+  if (i->rows >= 0)
+    {
+      i->rows -= sqlite3_changes(k->db);
+      i->stats_dirty = true;
+    }
+  return true;
 }
 
 /* Handle setting of single index on single object. */
@@ -157,10 +231,11 @@ static bool _kvdb_handle_insert_index(kvdb_o o, kvdb_index i)
       break;
     case KVDB_OBJECT_INDEX:
       {
-        kvdb_o ov = kvdb_o_get_object(o, i->key);
-        if (!ov)
+        /* (No need to load the object referred to.) */
+        kvdb_oid oid = _kvdb_o_get_oid(o, i->key);
+        if (!oid)
           return false;
-        SQLITE_CALL(sqlite3_bind_blob(s, 2, &ov->oid, KVDB_OID_SIZE,
+        SQLITE_CALL(sqlite3_bind_blob(s, 2, oid, KVDB_OID_SIZE,
                                       SQLITE_STATIC));
       }
       break;
@@ -168,74 +243,77 @@ static bool _kvdb_handle_insert_index(kvdb_o o, kvdb_index i)
       return false;
     }
   KVDEBUG("adding index %s for %p", i->name, o);
-  return _kvdb_run_stmt_keep(k, s);
+  if (!_kvdb_run_stmt_keep(k, s))
+    return false;
+  i->changes++;
+  if (i->rows >= 0)
+    {
+      i->rows++;
+      i->stats_dirty = true;
+    }
+  return true;
 }
 
-static bool _ih_handle_index(void *p, void *context)
+/* Populate s_<name> straight from cs, without loading any objects. */
+static bool _kvdb_index_populate(kvdb k, kvdb_index i)
 {
-  kvdb_o o = p;
-  kvdb_index i = context;
-  kvdb_o_a a = _kvdb_o_get_a(o, i->key);
+  char buf[256];
+  sqlite3_stmt *stmt;
 
-  if (a)
-    return _kvdb_handle_insert_index(o, i);
-  return true;
+  switch (i->type)
+    {
+    case KVDB_INTEGER_INDEX:
+      /* (Rows without a type have the integer in a blob.) */
+      sprintf(buf,
+              "INSERT INTO s_%s (oid, keyish) "
+              "SELECT oid, CASE WHEN type IS NULL "
+              "THEN kvdb_int64(value) ELSE value END FROM cs "
+              "WHERE key=?1 AND (type=%d "
+              "OR (type IS NULL AND length(value)=%d))",
+              i->name, KVDB_INTEGER, (int) sizeof(int64_t));
+      break;
+    case KVDB_OBJECT_INDEX:
+      sprintf(buf,
+              "INSERT INTO s_%s (oid, keyish) "
+              "SELECT oid, value FROM cs "
+              "WHERE key=?1 AND (type=%d OR type IS NULL) "
+              "AND length(value)=%d",
+              i->name, KVDB_OBJECT, (int) KVDB_OID_SIZE);
+      break;
+    default:
+      return false;
+    }
+  SQLITE_CALL(sqlite3_prepare_v2(k->db, buf, -1, &stmt, NULL));
+  SQLITE_CALL2(sqlite3_bind_text(stmt, 1, i->key->name, -1, SQLITE_STATIC),
+               sqlite3_finalize(stmt); return false);
+  return _kvdb_run_stmt(k, stmt);
 }
 
-kvdb_index kvdb_define_index(kvdb k,
-                             kvdb_key key,
-                             const char *name,
-                             kvdb_index_type index_type)
+static kvdb_index _kvdb_define_index_locked(kvdb k,
+                                            kvdb_key key,
+                                            const char *name,
+                                            kvdb_index_type index_type)
 {
   bool added;
   kvdb_index i;
   char buf[256];
-  int rc;
 
   i = _define_index(k, key, name, index_type, &added);
   if (!i || !added)
     return i;
+  if (!_kvdb_writable(k))
+    goto fail;
 
-  /* Create fake table s_name, and index i_s_name */
-  sprintf(buf,
-          "CREATE TABLE s_%s (keyish, oid);"
-          "CREATE INDEX i_s_%s_key ON s_%s(keyish);"
-          "CREATE INDEX i_s_%s_oid ON s_%s(oid);",
-          name, name, name, name, name);
+  /* Create fake table s_name; its indexes are created only once it
+   * has been populated, as building a B-tree in one go is much
+   * cheaper than maintaining it row by row. */
+  sprintf(buf, "CREATE TABLE s_%s (keyish, oid);", name);
   SQLITE_EXEC2(buf, goto fail);
 
   sprintf(buf,
           "INSERT INTO search_index (name, type, keyname, keytype) VALUES('%s', %d, '%s', %d)",
           name, index_type, key->name, key->type);
   SQLITE_EXEC2(buf, goto fail);
-  
-  /* Ok. Looks good. So all we need to do is just iterate through the
-   * database, and find every object that has this key set (and load
-   * them if already not loaded). Then iterate through every object in
-   * memory, and call population, and bob's your uncle(?). */
-  sqlite3_stmt *stmt = k->stmts[STMT_SELECT_CS_BY_KEY];
-  SQLITE_CALL2(sqlite3_reset(stmt), goto fail);
-  SQLITE_CALL2(sqlite3_clear_bindings(stmt), goto fail);
-  SQLITE_CALL2(sqlite3_bind_text(stmt, 1, key->name, -1, SQLITE_STATIC), goto fail);
-  rc = sqlite3_step(stmt);
-  while (rc == SQLITE_ROW)
-    {
-      KVASSERT(sqlite3_column_count(stmt)==1, "weird stmt count");
-      int len = sqlite3_column_bytes(stmt, 0);
-      void *p = (void *)sqlite3_column_blob(stmt, 0);
-      if (len != KVDB_OID_SIZE)
-        {
-          KVDEBUG("weird sized oid");
-          goto fail;
-        }
-      KVDEBUG("fetching oid");
-      kvdb_get_o_by_id(k, p);
-      rc = sqlite3_step(stmt);
-    }
-  if (rc != SQLITE_DONE)
-    {
-      _kvdb_set_err_from_sqlite2(k, "select from cs (by key)");
-    }
 
   /* Prepare insert + delete statements */
   sprintf(buf, "INSERT INTO s_%s (oid, keyish) VALUES (?1, ?2)", name);
@@ -249,17 +327,228 @@ kvdb_index kvdb_define_index(kvdb k,
                                    &i->stmt_delete, NULL),
                goto fail);
 
-
-  /* And then let 'er rip, go through every object in memory and
-   * insert them if applicable. */
-  ihash_iterate(k->oid_ih, _ih_handle_index, i);
+  /* cs reflects every set (committed or not) within this
+   * transaction, so the index can be filled in entirely within
+   * SQLite; objects are never materialized for this. */
+  if (!_kvdb_index_populate(k, i))
+    goto fail;
+  i->rows = sqlite3_changes(k->db);
+  i->changes += i->rows;
+  i->stats_dirty = true;
+
+  /* (In bulk mode, the keyish one is built only at kvdb_bulk_end.) */
+  if (!k->bulk)
+    {
+      sprintf(buf, "CREATE INDEX i_s_%s_key ON s_%s(keyish, oid);",
+              name, name);
+      SQLITE_EXEC2(buf, goto fail);
+    }
+  sprintf(buf, "CREATE INDEX i_s_%s_oid ON s_%s(oid);", name, name);
+  SQLITE_EXEC2(buf, goto fail);
   return i;
  fail:
+  sqlite3_finalize(i->stmt_insert);
+  sqlite3_finalize(i->stmt_delete);
   list_del(&i->lh);
+  list_del(&i->klh);
   free(i);
   return NULL;
 }
 
+kvdb_index kvdb_define_index(kvdb k,
+                             kvdb_key key,
+                             const char *name,
+                             kvdb_index_type index_type)
+{
+  kvdb_index i;
+
+  _kvdb_lock(k);
+  i = _kvdb_define_index_locked(k, key, name, index_type);
+  _kvdb_unlock(k);
+  return i;
+}
+
+/* Schema upgrade: databases made before the key indexes of search
+ * indexes covered oid too still have them on keyish only; recreate
+ * them. */
+bool _kvdb_index_upgrade_keys(kvdb k)
+{
+  sqlite3_stmt *stmt;
+  char *sql;
+  bool r = true;
+
+  /* The statements are collected first, as indexes cannot be dropped
+   * while search_index is being read. */
+  SQLITE_CALL(sqlite3_prepare_v2(k->db,
+                                 "SELECT group_concat("
+                                 "'DROP INDEX IF EXISTS i_s_' || name || '_key;"
+                                 "CREATE INDEX i_s_' || name || '_key "
+                                 "ON s_' || name || '(keyish, oid);', '') "
+                                 "FROM search_index", -1, &stmt, NULL));
+  if (sqlite3_step(stmt) != SQLITE_ROW)
+    {
+      _kvdb_set_err_from_sqlite2(k, "select from search_index");
+      sqlite3_finalize(stmt);
+      return false;
+    }
+  sql = sqlite3_column_type(stmt, 0) == SQLITE_NULL ? NULL
+    : strdup((const char *)sqlite3_column_text(stmt, 0));
+  sqlite3_finalize(stmt);
+  if (sql)
+    SQLITE_EXEC2(sql, r = false);
+  free(sql);
+  return r;
+}
+
+/* Replace the stored statistics of a single index. */
+static bool _kvdb_index_store_stats(kvdb k, kvdb_index i)
+{
+  sqlite3_stmt *stmt;
+
+  SQLITE_CALL(sqlite3_prepare_v2(k->db,
+                                 "DELETE FROM search_index_stats "
+                                 "WHERE name=?1", -1, &stmt, NULL));
+  SQLITE_CALL(sqlite3_bind_text(stmt, 1, i->name, -1, SQLITE_STATIC));
+  if (!_kvdb_run_stmt(k, stmt))
+    return false;
+  SQLITE_CALL(sqlite3_prepare_v2(k->db,
+                                 "INSERT INTO search_index_stats "
+                                 "(name, rows, histogram) VALUES (?1, ?2, ?3)",
+                                 -1, &stmt, NULL));
+  SQLITE_CALL(sqlite3_bind_text(stmt, 1, i->name, -1, SQLITE_STATIC));
+  SQLITE_CALL(sqlite3_bind_int64(stmt, 2, i->rows));
+  if (i->n_histogram)
+    SQLITE_CALL(sqlite3_bind_blob(stmt, 3, i->histogram,
+                                  sizeof(i->histogram), SQLITE_STATIC));
+  if (!_kvdb_run_stmt(k, stmt))
+    return false;
+  i->stats_dirty = false;
+  return true;
+}
+
+/* Drop (or rebuild) the keyish side of every search index. The oid
+ * side stays, as updates need it. */
+bool _kvdb_index_set_bulk(kvdb k, bool bulk)
+{
+  kvdb_index i;
+  char buf[256];
+
+  list_for_each_entry(i, &k->indexes, klh)
+    {
+      if (bulk)
+        sprintf(buf, "DROP INDEX IF EXISTS i_s_%s_key", i->name);
+      else
+        sprintf(buf,
+                "CREATE INDEX IF NOT EXISTS i_s_%s_key ON s_%s(keyish, oid)",
+                i->name, i->name);
+      SQLITE_EXEC(buf);
+    }
+  return true;
+}
+
+/* Recompute rows + histogram of a single index, and store them. */
+static bool _kvdb_index_analyze(kvdb k, kvdb_index i)
+{
+  char buf[256];
+  sqlite3_stmt *stmt;
+  int64_t pos = 0;
+  int n = 0;
+  int rc;
+
+  sprintf(buf, "SELECT count(*) FROM s_%s", i->name);
+  SQLITE_CALL(sqlite3_prepare_v2(k->db, buf, -1, &stmt, NULL));
+  if (sqlite3_step(stmt) != SQLITE_ROW)
+    {
+      _kvdb_set_err_from_sqlite2(k, "count from index");
+      sqlite3_finalize(stmt);
+      return false;
+    }
+  i->rows = sqlite3_column_int64(stmt, 0);
+  sqlite3_finalize(stmt);
+
+  /* Equi-depth histogram; bound n is the value at position
+   * n * (rows - 1) / KVDB_INDEX_HISTOGRAM_SIZE in keyish order. */
+  i->n_histogram = 0;
+  if (i->type == KVDB_INTEGER_INDEX && i->rows > 0)
+    {
+      sprintf(buf, "SELECT keyish FROM s_%s ORDER BY keyish", i->name);
+      SQLITE_CALL(sqlite3_prepare_v2(k->db, buf, -1, &stmt, NULL));
+      rc = sqlite3_step(stmt);
+      while (rc == SQLITE_ROW && n <= KVDB_INDEX_HISTOGRAM_SIZE)
+        {
+          while (n <= KVDB_INDEX_HISTOGRAM_SIZE
+                 && pos == n * (i->rows - 1) / KVDB_INDEX_HISTOGRAM_SIZE)
+            i->histogram[n++] = sqlite3_column_int64(stmt, 0);
+          pos++;
+          rc = sqlite3_step(stmt);
+        }
+      sqlite3_finalize(stmt);
+      if (n == KVDB_INDEX_HISTOGRAM_SIZE + 1)
+        i->n_histogram = KVDB_INDEX_HISTOGRAM_SIZE;
+    }
+  return _kvdb_index_store_stats(k, i);
+}
+
+/* Store the row counts that changed, along with the changes. */
+bool _kvdb_index_save_stats(kvdb k)
+{
+  kvdb_index i;
+
+  list_for_each_entry(i, &k->indexes, klh)
+    if (i->stats_dirty && !_kvdb_index_store_stats(k, i))
+      return false;
+  return true;
+}
+
+static bool _kvdb_analyze_locked(kvdb k)
+{
+  kvdb_index i;
+
+  /* SQLite's own statistics help it with the join itself. */
+  SQLITE_EXEC("ANALYZE");
+  list_for_each_entry(i, &k->indexes, klh)
+    if (!_kvdb_index_analyze(k, i))
+      return false;
+  return true;
+}
+
+bool kvdb_analyze(kvdb k)
+{
+  bool r;
+
+  if (!_kvdb_writable(k))
+    return false;
+  _kvdb_lock(k);
+  r = _kvdb_analyze_locked(k);
+  _kvdb_unlock(k);
+  return r;
+}
+
+int64_t _kvdb_index_estimate_range(kvdb_index i, int64_t lo, int64_t hi)
+{
+  double matches = 0;
+  int n;
+
+  if (!i->n_histogram || i->rows < 0)
+    return -1;
+  for (n = 0 ; n < i->n_histogram ; n++)
+    {
+      int64_t blo = i->histogram[n];
+      int64_t bhi = i->histogram[n + 1];
+
+      if (hi < blo || lo > bhi)
+        continue;
+      if (bhi == blo)
+        {
+          matches += 1;
+          continue;
+        }
+      /* Assume values are uniformly distributed within a bucket. */
+      matches += ((double) (hi < bhi ? hi : bhi) - (lo > blo ? lo : blo) + 1)
+        / ((double) bhi - blo + 1);
+    }
+  return (int64_t) (matches * i->rows / i->n_histogram);
+}
 
 bool _kvdb_handle_delete_indexes(kvdb_o o, kvdb_key k)
 {
@@ -288,12 +577,13 @@ bool _kvdb_handle_insert_indexes(kvdb_o o, kvdb_key key)
       /* Only insert to it when both app and cl are present in the object. */
       if (o->app && o->cl)
         {
-          sqlite3_stmt *s = o->k->stmts[STMT_INSERT_APP_CLASS];
+          sqlite3_stmt *s = k->bulk ? k->stmt_bulk_app_class
+            : k->stmts[STMT_INSERT_APP_CLASS];
 
           SQLITE_CALL(sqlite3_reset(s));
           SQLITE_CALL(sqlite3_clear_bindings(s));
-          SQLITE_CALL(sqlite3_bind_text(s, 1, o->app->name, -1, SQLITE_STATIC));
-          SQLITE_CALL(sqlite3_bind_text(s, 2, o->cl->name, -1, SQLITE_STATIC));
+          SQLITE_CALL(sqlite3_bind_int64(s, 1, o->app->id));
+          SQLITE_CALL(sqlite3_bind_int64(s, 2, o->cl->id));
           SQLITE_CALL(sqlite3_bind_blob(s, 3, &o->oid, KVDB_OID_SIZE, SQLITE_STATIC));
           if (!_kvdb_run_stmt_keep(k, s))
             {
@@ -19,17 +19,30 @@
  * that we have clocks _roughly_ in sync across the whole sync cloud
  * (but they need not be exactly in sync as such).
  *
- * Log file format is just binary encoding, with 4 fields repeated
- * until file ends:
+ * Log file format is just binary encoding: KVDB_LOG_MAGIC and a
+ * version byte (KVDB_LOG_VERSION), and then 5 fields repeated until
+ * file ends:
  *
  * oid data (assumed fixed length) +
  * signed varint len + key data +
+ * signed varint kvdb_type of the value +
  * signed varint len + value data +
  * signed varint last modified
  *
+ * Value data is the raw value (see _kvdb_tv_get_raw_value), except
+ * for integers, which are zigzag varints (most of them are small),
+ * and doubles, which are big-endian.
+ *
+ * Version 1 has host byte order integers and doubles instead. Files
+ * without the header are version 0, which has no type field either.
+ * Their values (and those with type KVDB_NULL) are imported as the
+ * type of their key, if it has one, and binary otherwise.
+ *
  * Note: The varints are used as canary to check sanity of the log
  * file. If they're below zero, something bad is going on and we can
- * abort reading that log.
+ * abort reading that log. The exception is value length: a negative
+ * one means the value is the SHA-256 digest of a blob, which is in
+ * <digest in hex>.blob within the same directory (see kvdb_blob.c).
  */
 
 /* XXX - gzip-encode these. */
@@ -40,7 +53,10 @@
 #include "codec.h"
 
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 #define APP k->apps[APP_LOCAL_KVDB]
 
@@ -71,134 +87,424 @@ void _kvdb_io_pre_commit(kvdb k)
 {
   kvdb_o o;
   int64_t *ip;
+  kvdb_time_t now = __atomic_load_n(&k->monotonous_time, __ATOMIC_RELAXED);
 
   kvdb_get_or_create_one(o, APP, IO_CLASS);
+  /* (Other threads may be committing too.) */
+  _kvdb_o_lock(o);
   ip = kvdb_o_get_int64(o, MONOTONOUS_TIME_KEY);
 
   /* If nothing to report changed, just avoid this. */
-  if (ip && *ip == k->monotonous_time)
-    return;
-  /* Something changed - store the new time */
-  kvdb_o_set_int64(o, MONOTONOUS_TIME_KEY, k->monotonous_time);
+  if (!ip || *ip != now)
+    {
+      /* Something changed - store the new time */
+      kvdb_o_set_int64(o, MONOTONOUS_TIME_KEY, now);
+    }
+  _kvdb_o_unlock(o);
 }
 
-/* Utility macros for writing to the log file 'f'. */
-
-#define PUSH_BINARY(p, len)             \
-if (fwrite(p, 1, len, f) != len) {      \
-  KVDEBUG("i/o error while writing");   \
-  return false;                         \
- }
-
-#define PUSH_INT(i)                                     \
-do {                                                    \
-  unsigned char buf[9];                                 \
-  unsigned char *c = buf;                               \
-  ssize_t left = sizeof(buf);                           \
-  size_t len;                                           \
-  encode_varint_s64(i, &c, &left);                      \
-  KVASSERT(left >= 0, "should not run out of buffer");  \
-  len = (int) (c-buf);                                  \
-  PUSH_BINARY(buf, len);                                \
- } while(0)
-
-bool kvdb_export(kvdb k, const char *directory, bool export_own_only)
+/* Entries added before this have been exported (0 if none). */
+kvdb_time_t _kvdb_io_export_time(kvdb k)
 {
   kvdb_o o;
   int64_t *ip;
-  int c = 0;
-  kvdb_time_t now = kvdb_monotonous_time(k);
-  kvdb_time_t now_real = kvdb_time();
-  FILE *f;
-  char filename_tmp[128];
-  char filename_final[128];
 
   kvdb_get_or_create_one(o, APP, IO_CLASS);
-  ip = kvdb_o_get_int64(o, EXPORT_TIME_KEY);
+  ip = o ? kvdb_o_get_int64(o, EXPORT_TIME_KEY) : NULL;
+  return ip ? *ip : 0;
+}
 
-  /* Export is relatively straightforward; pick unique-ish name
-   * (hostname + NON-monototnous time), and if it exists, increment time
-   * until it does not. Store the last export timestamp as well and
-   * commit.
-   */
+bool _kvdb_log_write_header(FILE *f)
+{
+  unsigned char h[KVDB_LOG_HEADER_SIZE] = KVDB_LOG_MAGIC;
 
-  /* Start off with a commit. */
-  if (!kvdb_commit(k))
-    return false;
+  h[KVDB_LOG_HEADER_SIZE - 1] = KVDB_LOG_VERSION;
+  return fwrite(h, 1, sizeof(h), f) == sizeof(h);
+}
+
+/* Map the log file at path (only its first size bytes, if size is
+ * nonzero) for reading, and move past the header. Fails if the file
+ * cannot be read, or is from the future. */
+bool _kvdb_log_open(const char *path, size_t size, kvdb_log_file_s *lf)
+{
+  struct stat st;
+  int fd = open(path, O_RDONLY);
+
+  memset(lf, 0, sizeof(*lf));
+  if (fd < 0 || fstat(fd, &st))
+    {
+      KVDEBUG("unable to open %s", path);
+      if (fd >= 0)
+        close(fd);
+      return false;
+    }
+  lf->size = size && size < (size_t)st.st_size ? size : (size_t)st.st_size;
+  if (lf->size)
+    lf->base = mmap(NULL, lf->size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (lf->base == MAP_FAILED)
+    {
+      KVDEBUG("unable to map %s", path);
+      lf->base = NULL;
+      return false;
+    }
+  lf->p = lf->base;
+  lf->left = lf->size;
+  if (lf->size < KVDB_LOG_HEADER_SIZE
+      || memcmp(lf->base, KVDB_LOG_MAGIC, KVDB_LOG_HEADER_SIZE - 1))
+    return true;
+  lf->version = lf->base[KVDB_LOG_HEADER_SIZE - 1];
+  if (lf->version > KVDB_LOG_VERSION)
+    {
+      KVDEBUG("unsupported log version %d", lf->version);
+      _kvdb_log_close(lf);
+      return false;
+    }
+  lf->p += KVDB_LOG_HEADER_SIZE;
+  lf->left -= KVDB_LOG_HEADER_SIZE;
+  return true;
+}
+
+void _kvdb_log_close(kvdb_log_file_s *lf)
+{
+  if (lf->base)
+    munmap(lf->base, lf->size);
+  lf->base = NULL;
+}
 
-  /* Start the query of log table. Dump every entry. */
-  sqlite3_stmt *stmt = k->stmts[export_own_only ? STMT_SELECT_LOG_BY_TA_OWN
-                                : STMT_SELECT_LOG_BY_TA];
-  SQLITE_CALL(sqlite3_reset(stmt));
-  SQLITE_CALL(sqlite3_clear_bindings(stmt));
-  SQLITE_CALL(sqlite3_bind_int64(stmt, 1, ip ? *ip : 0));
+/* Read the record at lf->p, and move past it. The file is parsed in
+ * place, so the varints are decoded straight from the mapping. Fails
+ * if the record is corrupt, or incomplete (or if there is none). */
+bool _kvdb_log_read_record(kvdb_log_file_s *lf, kvdb_log_record_s *r)
+{
+  unsigned char *c = lf->p;
+  ssize_t left = lf->left;
+  int64_t key_len, type = KVDB_NULL, value_len, time_added;
 
-  int rc = sqlite3_step(stmt);
-  while (rc == SQLITE_ROW)
+  if (left < (ssize_t)KVDB_OID_SIZE)
+    return false;
+  memcpy(&r->oid, c, KVDB_OID_SIZE);
+  c += KVDB_OID_SIZE;
+  left -= KVDB_OID_SIZE;
+  if (!decode_varint_s64(&c, &left, &key_len)
+      || key_len < 0 || key_len > left)
+    return false;
+  if (r->buf_size < (size_t)key_len + 1)
     {
-      /* oid, key, value, last_modified */
-      KVASSERT(sqlite3_column_count(stmt)==4, "weird stmt count");
+      char *nbuf = realloc(r->buf, key_len + 1);
+
+      if (!nbuf)
+        return false;
+      r->buf = nbuf;
+      r->buf_size = key_len + 1;
+    }
+  memcpy(r->buf, c, key_len);
+  r->buf[key_len] = 0;
+  r->key = r->buf;
+  c += key_len;
+  left -= key_len;
+  if ((lf->version > 0
+       && (!decode_varint_s64(&c, &left, &type)
+           || type < 0 || type > KVDB_BINARY_SMALL))
+      || !decode_varint_s64(&c, &left, &value_len))
+    return false;
+  r->type = type;
+  r->ext = value_len < 0;
+  if (r->ext)
+    value_len = -value_len;
+  if (value_len > left || (r->ext && value_len != SHA256_SIZE))
+    return false;
+  r->value = c;
+  r->value_len = value_len;
+  c += value_len;
+  left -= value_len;
+  if (!decode_varint_s64(&c, &left, &time_added) || time_added < 0)
+    return false;
+  r->time_added = time_added;
+  if (!r->ext
+      && !_kvdb_log_decode_value(lf->version, r->type,
+                                 &r->value, &r->value_len, r->vbuf))
+    return false;
+  lf->p = c;
+  lf->left = left;
+  return true;
+}
 
-      size_t oid_len = sqlite3_column_bytes(stmt, 0);
-      void *oid = (void *)sqlite3_column_blob(stmt, 0);
+/* Records are gathered here (unless they are big), so that each takes
+ * one fwrite instead of one per field. */
+#define LOG_WRITE_BUF 256
 
-      const char *key = (const char *)sqlite3_column_text(stmt, 1);
+typedef struct {
+  FILE *f;
+  unsigned char buf[LOG_WRITE_BUF];
+  unsigned char *c;
+  size_t written;
+} _writer_s;
 
-      size_t value_len = sqlite3_column_bytes(stmt, 2);
-      void *value = (void *)sqlite3_column_blob(stmt, 2);
+static bool _flush(_writer_s *w)
+{
+  size_t n = w->c - w->buf;
 
-      int64_t last_modified = sqlite3_column_int64(stmt, 3);
+  w->c = w->buf;
+  w->written += n;
+  return fwrite(w->buf, 1, n, w->f) == n;
+}
 
-      if (c == 0)
+static bool _put(_writer_s *w, const void *p, size_t len)
+{
+  if (len > (size_t)(w->buf + LOG_WRITE_BUF - w->c))
+    {
+      if (!_flush(w))
+        return false;
+      if (len > LOG_WRITE_BUF)
         {
-          /* Open file to dump stuff in. */
-          while (1)
-            {
-              sprintf(filename_final, "%s/%lld.log", directory, now_real);
-              struct stat st;
-              if (lstat(filename_final, &st))
-                break;
-              now_real++;
-            }
-          sprintf(filename_tmp, "%s.tmp", filename_final);
-          f = fopen(filename_tmp, "w");
-          if (!f)
-            {
-              KVDEBUG("unable to open logfile %s for writing", filename_tmp);
-              return false;
-            }
+          w->written += len;
+          return fwrite(p, 1, len, w->f) == len;
         }
+    }
+  memcpy(w->c, p, len);
+  w->c += len;
+  return true;
+}
 
-      KVASSERT(oid_len == KVDB_OID_SIZE, "invalid oid size");
-      PUSH_BINARY(oid, oid_len);
+static bool _put_int(_writer_s *w, int64_t v)
+{
+  ssize_t left = VARINT_MAX_BYTES;
 
-      PUSH_INT(strlen(key));
-      PUSH_BINARY(key, strlen(key));
+  if (w->buf + LOG_WRITE_BUF - w->c < VARINT_MAX_BYTES && !_flush(w))
+    return false;
+  encode_varint_s64(v, &w->c, &left);
+  return true;
+}
 
-      PUSH_INT(value_len);
-      PUSH_BINARY(value, value_len);
+/* Write the record to f in the current format; returns the number of
+ * bytes written, or -1 on error. */
+ssize_t _kvdb_log_write_record(FILE *f, kvdb_log_record_s *r)
+{
+  _writer_s w = { .f = f };
+  unsigned char vbuf[KVDB_LOG_VALUE_BUF];
+  size_t key_len = strlen(r->key);
+  size_t len = r->value_len;
+  const void *p = r->value;
+
+  w.c = w.buf;
+  if (!r->ext)
+    p = _kvdb_log_encode_value(r->type, p, &len, vbuf);
+  if (!_put(&w, &r->oid, KVDB_OID_SIZE)
+      || !_put_int(&w, key_len)
+      || !_put(&w, r->key, key_len)
+      || !_put_int(&w, r->type)
+      || !_put_int(&w, r->ext ? -(int64_t)len : (int64_t)len)
+      || !_put(&w, p, len)
+      || !_put_int(&w, r->time_added)
+      || !_flush(&w))
+    {
+      KVDEBUG("i/o error while writing");
+      return -1;
+    }
+  return w.written;
+}
 
-      PUSH_INT(last_modified);
+/* Value data of the raw value p (of *len bytes), which is either p
+ * itself, or within buf (KVDB_LOG_VALUE_BUF bytes). */
+const void *_kvdb_log_encode_value(kvdb_type t, const void *p, size_t *len,
+                                   unsigned char *buf)
+{
+  unsigned char *c = buf;
+  ssize_t left = KVDB_LOG_VALUE_BUF;
+  uint64_t u;
+  int64_t i;
+  int n;
 
-      c++;
-      rc = sqlite3_step(stmt);
+  switch (t)
+    {
+    case KVDB_INTEGER:
+      memcpy(&i, p, sizeof(i));
+      encode_varint_s64(i, &c, &left);
+      *len = c - buf;
+      return buf;
+    case KVDB_DOUBLE:
+      memcpy(&u, p, sizeof(u));
+      for (n = 0 ; n < 8 ; n++)
+        buf[n] = u >> (56 - 8 * n);
+      *len = 8;
+      return buf;
+    default:
+      return p;
     }
-  if (rc != SQLITE_DONE)
+}
+
+/* The reverse; *p and *len are replaced with the raw value (within
+ * buf, if it is not the same). Fails if the value data is invalid. */
+bool _kvdb_log_decode_value(int version, kvdb_type t,
+                            const void **p, size_t *len, unsigned char *buf)
+{
+  unsigned char *c = (unsigned char *)*p;
+  ssize_t left = *len;
+  uint64_t u = 0;
+  int64_t i;
+  int n;
+
+  if (version < 2)
+    return true;
+  switch (t)
     {
-      _kvdb_set_err_from_sqlite2(k, "export");
+    case KVDB_INTEGER:
+      if (!decode_varint_s64(&c, &left, &i) || left)
+        return false;
+      memcpy(buf, &i, sizeof(i));
+      break;
+    case KVDB_DOUBLE:
+      if (*len != 8)
+        return false;
+      for (n = 0 ; n < 8 ; n++)
+        u = u << 8 | c[n];
+      memcpy(buf, &u, sizeof(u));
+      break;
+    default:
+      return true;
+    }
+  *p = buf;
+  *len = 8;
+  return true;
+}
+
+/* Open a new (temporary) log file within directory; it is renamed
+ * to filename_final once complete. */
+static FILE *_open_log_file(const char *directory,
+                            char *filename_tmp, char *filename_final)
+{
+  kvdb_time_t now_real = kvdb_time();
+  FILE *f;
+
+  while (1)
+    {
+      sprintf(filename_final, "%s/%lld.log", directory, now_real);
+      struct stat st;
+      if (lstat(filename_final, &st))
+        break;
+      now_real++;
+    }
+  sprintf(filename_tmp, "%s.tmp", filename_final);
+  f = fopen(filename_tmp, "w");
+  if (!f)
+    KVDEBUG("unable to open logfile %s for writing", filename_tmp);
+  else if (!_kvdb_log_write_header(f))
+    {
+      KVDEBUG("unable to write logfile header");
+      fclose(f);
+      unlink(filename_tmp);
+      return NULL;
+    }
+  return f;
+}
+
+typedef struct {
+  kvdb k;
+  const char *directory;
+  FILE *f;
+  char filename_tmp[128];
+  char filename_final[128];
+  int count;
+} _export_s;
+
+static bool _export_entry(void *context, kvdb_oid oid, const char *key,
+                          kvdb_type t, const void *value, size_t value_len,
+                          bool ext, kvdb_time_t time_added)
+{
+  _export_s *es = context;
+  kvdb_log_record_s r = {
+    .oid = *oid, .key = (char *)key, .type = t,
+    .value = value, .value_len = value_len, .ext = ext,
+    .time_added = time_added
+  };
+
+  if (!es->f)
+    {
+      /* Open file to dump stuff in. */
+      es->f = _open_log_file(es->directory,
+                             es->filename_tmp, es->filename_final);
+      if (!es->f)
+        return false;
+    }
+  if (ext && !_kvdb_blob_export(es->k, value, es->directory))
+    return false;
+  if (_kvdb_log_write_record(es->f, &r) < 0)
+    return false;
+  es->count++;
+  return true;
+}
+
+/* Dump log entries added since 'since' to a new file within
+ * directory. *count is set to the number of entries dumped. */
+static bool _kvdb_export_log(kvdb k, const char *directory,
+                             bool export_own_only, int64_t since, int *count)
+{
+  _export_s es = { .k = k, .directory = directory };
+  bool r;
+
+  /* If the backend can do it in one go, let it. (Only the segment
+   * files can, and there every entry is our own anyway; blobs have to
+   * be shipped one entry at a time, though.) */
+  if (k->log_ops->export && !_kvdb_blob_in_use(k))
+    {
+      if (!(es.f = _open_log_file(directory,
+                                  es.filename_tmp, es.filename_final)))
+        return false;
+      r = k->log_ops->export(k, es.f, since, &es.count);
+    }
+  else
+    r = k->log_ops->iterate(k, since, export_own_only, _export_entry, &es);
+  *count = es.count;
+  if (!es.f)
+    return r;
+  fclose(es.f);
+  if (!r || !es.count)
+    {
+      unlink(es.filename_tmp);
+      return r;
+    }
+  if (rename(es.filename_tmp, es.filename_final))
+    {
+      KVDEBUG("rename of .tmp -> final failed");
       return false;
     }
+  return true;
+}
 
+bool kvdb_export(kvdb k, const char *directory, bool export_own_only)
+{
+  kvdb_o o;
+  int64_t *ip;
+  int c = 0;
+  kvdb_time_t now = kvdb_monotonous_time(k);
+  bool r;
+
+  if (!_kvdb_writable(k))
+    return false;
+
+  kvdb_get_or_create_one(o, APP, IO_CLASS);
+  ip = kvdb_o_get_int64(o, EXPORT_TIME_KEY);
+
+  /* Export is relatively straightforward; pick unique-ish name
+   * (hostname + NON-monototnous time), and if it exists, increment time
+   * until it does not. Store the last export timestamp as well and
+   * commit.
+   */
+
+  /* Start off with a commit. */
+  if (!kvdb_commit(k))
+    return false;
+
+  _kvdb_lock(k);
+  r = _kvdb_export_log(k, directory, export_own_only, ip ? *ip : 0, &c);
+  _kvdb_unlock(k);
+  if (!r)
+    return false;
 
   /* Do commit if we actually exported something. */
   if (c)
     {
-      fclose(f);
-      if (rename(filename_tmp, filename_final))
-        {
-          KVDEBUG("rename of .tmp -> final failed");
-          return false;
-        }
       kvdb_get_or_create_one(o, APP, IO_CLASS);
       kvdb_o_set_int64(o, EXPORT_TIME_KEY, now);
       return kvdb_commit(k);
@@ -206,71 +512,14 @@ bool kvdb_export(kvdb k, const char *directory, bool export_own_only)
   return true;
 }
 
-#define POP_INT(v)                                      \
-do {                                                    \
-  unsigned char buf[0];                                 \
-  unsigned char *c = buf;                               \
-  ssize_t left = sizeof(buf);                           \
-  while (1)                                             \
-    {                                                   \
-      if (fread(c, 1, 1, f) != 1)                       \
-        {                                               \
-          KVDEBUG("error reading int");                 \
-          goto err;                                     \
-        }                                               \
-      left--;                                           \
-      if (*c++ <= VARINT_HIGH_VALUE)                    \
-        {                                               \
-          /* The end. */                                \
-          break;                                        \
-        }                                               \
-      if (left == 0)                                    \
-        {                                               \
-          KVDEBUG("corrupted varint");                  \
-          goto err;                                     \
-        }                                               \
-    }                                                   \
-  left = c - buf;                                       \
-  c = buf;                                              \
-  if (!decode_varint_s64(&c, &left, &v) || left)        \
-    {                                                   \
-      KVDEBUG("decode error");                          \
-      goto err;                                         \
-    }                                                   \
-  if (v < 0)                                            \
-    {                                                   \
-      KVDEBUG("negative sint64 detected! problem?");    \
-      goto err;                                         \
-    }                                                   \
- } while(0)
-
-#define POP_BINARY_BASE(value, value_len, extra_len)            \
-do {                                                            \
-  POP_INT(value_len);                                           \
-  value = malloc(value_len + extra_len);                        \
-  if (!value)                                                   \
-    goto err;                                                   \
-  if ((int64_t)fread(value, 1, value_len, f) != value_len)      \
-    {                                                           \
-      KVDEBUG("error reading binary");                          \
-      goto err;                                                 \
-    }                                                           \
- } while(0)
-
-#define POP_BINARY(value, value_len) POP_BINARY_BASE(value, value_len, 0)
-
-#define POP_STRING(value)               \
-do {                                    \
-  int64_t value_len;                    \
-  POP_BINARY_BASE(value, value_len, 1); \
-  value[value_len] = 0;                 \
- } while(0)
-
 bool kvdb_import(kvdb k, const char *directory)
 {
-  DIR *d = opendir(directory);
+  DIR *d;
   struct dirent *de;
 
+  if (!_kvdb_writable(k))
+    return false;
+  d = opendir(directory);
   if (!d)
     {
       KVDEBUG("unable to open directory %s", directory);
@@ -282,9 +531,6 @@ bool kvdb_import(kvdb k, const char *directory)
         {
           struct stat st;
           char fullpath[128];
-          FILE *f;
-          struct kvdb_oid_struct oid;
-          size_t s;
 
           sprintf(fullpath, "%s/%s", directory, de->d_name);
           if (lstat(fullpath, &st))
@@ -316,55 +562,64 @@ bool kvdb_import(kvdb k, const char *directory)
             }
 
           /* NOT imported. So let's. */
-          f = fopen(fullpath, "r");
-          if (!f)
-            {
-              KVDEBUG("unable to open %s", fullpath);
-              return false;
-            }
+          kvdb_log_file_s lf;
+          kvdb_log_record_s r = { .buf = NULL };
           bool err = false;
-          while(1)
+
+          if (!_kvdb_log_open(fullpath, 0, &lf))
+            return false;
+          while (lf.left > 0)
             {
-              s = fread(&oid, 1, KVDB_OID_SIZE, f);
-              if (!s)
-                break;
-              if (s != KVDB_OID_SIZE)
+              struct kvdb_typed_value_struct ktv;
+              kvdb_buffer buf = NULL;
+              kvdb_key kk;
+
+              if (!_kvdb_log_read_record(&lf, &r))
+                {
+                  /* Guess we're done with this file for good? */
+                  KVDEBUG("corrupt log file %s", fullpath);
+                  err = true;
+                  break;
+                }
+              if (r.ext
+                  && !(buf = _kvdb_blob_import(k, r.value, directory)))
                 {
-                  KVDEBUG("invalid oid size detected - %d", (int)s);
-                  /* Hmm. Guess we're done with this file for good? */
-                err:
                   err = true;
                   break;
                 }
-              /* Looks good. */
-              char *key;
-
-              void *value;
-              int64_t value_len;
-
-              kvdb_time_t last_modified;
-              struct kvdb_typed_value_struct ktv;
-
-              POP_STRING(key);
-              POP_BINARY(value, value_len);
-              POP_INT(last_modified);
 
-              o = kvdb_get_o_by_id(k, &oid);
+              o = kvdb_get_o_by_id(k, &r.oid);
               if (!o)
                 {
-                  o = _kvdb_create_o(k, &oid);
+                  o = _kvdb_create_o(k, &r.oid);
                   if (!o)
                     return false;
                 }
 
               /* We haz o. Let's set the value. */
-              _kvdb_tv_set_binary(&ktv, value, value_len);
-              if (!_kvdb_o_set(o,
-                               kvdb_define_key(k, key, KVDB_NULL),
-                               &ktv, last_modified))
+              kk = kvdb_define_key(k, r.key, KVDB_NULL);
+              if (buf)
+                _kvdb_tv_set_binary(&ktv, buf->data, buf->len);
+              else if (r.type != KVDB_NULL)
+                {
+                  if (!_kvdb_tv_set_raw(&ktv, r.type, r.value, r.value_len))
+                    {
+                      KVDEBUG("invalid value for type %d", (int)r.type);
+                      err = true;
+                      break;
+                    }
+                }
+              else if (kvdb_key_get_type(kk) == KVDB_NULL
+                       || !_kvdb_tv_set_raw(&ktv, kvdb_key_get_type(kk),
+                                            r.value, r.value_len))
+                _kvdb_tv_set_binary(&ktv, (void *)r.value, r.value_len);
+              if (!_kvdb_o_set(o, kk, &ktv, r.time_added, buf))
                 return false;
+              if (buf)
+                kvdb_buffer_unref(buf);
             }
-          fclose(f);
+          free(r.buf);
+          _kvdb_log_close(&lf);
           /* Bail out if there was an error. We _did_ consume this
            * file anyway, to avoid annoying repetitions. */
           if (err)
@@ -0,0 +1,597 @@
+/*
+ * $Id: kvdb_log.c $
+ *
+ * Author: Markus Stenberg <fingon@iki.fi>
+ *
+ * Copyright (c) 2013 Markus Stenberg
+ *
+ */
+
+/* Segment file log backend (see kvdb_log_ops in kvdb_i.h).
+ *
+ * Instead of the log table, the history is appended to segment files
+ * (<path>-log/<seq>.seg) in the same record format that kvdb_export
+ * writes (see kvdb_io.c), so export is just a copy of the right byte
+ * range. Only bookkeeping lives within SQLite, and within the same
+ * transactions as the rest of the state:
+ *
+ * - log_segments has the committed size (and record count) of each
+ * segment; anything past it in a file is from a transaction that
+ * never committed, and is truncated away on the next open.
+ *
+ * - log_index is a sparse index of time_added -> (segment, offset),
+ * with an entry at the start of each segment and then roughly every
+ * KVDB_LOG_INDEX_BYTES.
+ *
+ * Segment data is written (and fsync'd, unless synchronous is OFF)
+ * before the SQLite commit that records its size.
+ *
+ * Time added and last modified are the same for every log entry
+ * (see _o_set_sql), and monotonous, so segments are in time order.
+ *
+ * References to blobs (ext) have their value length negated, as in
+ * exports.
+ *
+ * Segments start with the same header as exports, too. Ones in an
+ * older format are still read, but never appended to; export rewrites
+ * their entries in the current format.
+ *
+ * Readers (kvdb_open_reader) only read: they have no current segment,
+ * and see the segments up to the sizes within their snapshot.
+ */
+
+#define DEBUG
+
+#include "kvdb_i.h"
+
+#include <sys/stat.h>
+#include <unistd.h>
+#include <errno.h>
+
+/* Roll over to a new segment after this many bytes (by default) */
+#define KVDB_LOG_SEGMENT_SIZE (16 * 1024 * 1024)
+
+/* Distance (in bytes) between entries in the sparse index */
+#define KVDB_LOG_INDEX_BYTES (64 * 1024)
+
+struct kvdb_log_struct {
+  char *dir;
+
+  /* The segment being appended to (NULL for readers) */
+  FILE *f;
+  int64_t seq;
+  int64_t size;
+  int64_t records;
+
+  /* Offset of the latest sparse index entry within it */
+  int64_t indexed;
+
+  /* Has it changed since the last commit? */
+  bool dirty;
+};
+
+static const struct kvdb_log_ops_struct _segment_ops;
+static const struct kvdb_log_ops_struct _segment_reader_ops;
+
+static void _segment_path(kvdb_log l, int64_t seq, char *buf, size_t len)
+{
+  snprintf(buf, len, "%s/%lld.seg", l->dir, (long long)seq);
+}
+
+static bool _open_segment(kvdb k, int64_t seq, int64_t size, int64_t records)
+{
+  kvdb_log l = k->log;
+  char path[256];
+
+  _segment_path(l, seq, path, sizeof(path));
+  if (size)
+    {
+      /* Get rid of whatever did not make it to a commit. */
+      if (truncate(path, size) || !(l->f = fopen(path, "r+b")))
+        {
+          _kvdb_set_err(k, "unable to open log segment");
+          return false;
+        }
+      fseek(l->f, 0, SEEK_END);
+    }
+  else if (!(l->f = fopen(path, "w+b")))
+    {
+      _kvdb_set_err(k, "unable to create log segment");
+      return false;
+    }
+  l->seq = seq;
+  l->size = size;
+  l->records = records;
+  l->indexed = size;
+  if (!size)
+    {
+      if (!_kvdb_log_write_header(l->f))
+        {
+          _kvdb_set_err(k, "unable to write log segment");
+          return false;
+        }
+      l->size = l->indexed = KVDB_LOG_HEADER_SIZE;
+    }
+  return true;
+}
+
+/* Version of the segment (see _kvdb_log_open), or -1. */
+static int _segment_version(kvdb k, int64_t seq)
+{
+  kvdb_log_file_s lf;
+  char path[256];
+
+  _segment_path(k->log, seq, path, sizeof(path));
+  if (!_kvdb_log_open(path, KVDB_LOG_HEADER_SIZE, &lf))
+    return -1;
+  _kvdb_log_close(&lf);
+  return lf.version;
+}
+
+static bool _store_segment(kvdb k)
+{
+  kvdb_log l = k->log;
+  sqlite3_stmt *s = k->stmts[STMT_UPDATE_LOG_SEGMENT];
+
+  SQLITE_CALL(sqlite3_reset(s));
+  SQLITE_CALL(sqlite3_bind_int64(s, 1, l->seq));
+  SQLITE_CALL(sqlite3_bind_int64(s, 2, l->size));
+  SQLITE_CALL(sqlite3_bind_int64(s, 3, l->records));
+  return _kvdb_run_stmt_keep(k, s);
+}
+
+/* Push the current segment to disk, and record its size. */
+static bool _sync_segment(kvdb k)
+{
+  kvdb_log l = k->log;
+
+  if (fflush(l->f)
+      || (k->options.synchronous != KVDB_SYNC_OFF && fsync(fileno(l->f))))
+    {
+      _kvdb_set_err(k, "unable to write log segment");
+      return false;
+    }
+  if (!_store_segment(k))
+    return false;
+  l->dirty = false;
+  return true;
+}
+
+bool _kvdb_log_segment_init(kvdb k)
+{
+  kvdb_log l;
+  char buf[256];
+  sqlite3_stmt *s;
+  int64_t seq = 1, size = 0, records = 0;
+  int backend =
+    _kvdb_get_int(k, "SELECT value FROM db_state WHERE key='log_backend'",
+                  KVDB_LOG_SQLITE);
+  int rc;
+
+  /* The backend is chosen when the database is created; a log is not
+   * moved from one to the other. */
+  if (!k->read_only
+      && k->options.log_backend == KVDB_LOG_SEGMENTS
+      && backend != KVDB_LOG_SEGMENTS)
+    {
+      if (_kvdb_get_int(k, "SELECT count(*) FROM log", 0))
+        {
+          KVDEBUG("log table in use, ignoring segment log backend");
+          return true;
+        }
+      sprintf(buf, "INSERT INTO db_state VALUES ('log_backend', %d)",
+              KVDB_LOG_SEGMENTS);
+      SQLITE_EXEC(buf);
+      backend = KVDB_LOG_SEGMENTS;
+    }
+  if (backend != KVDB_LOG_SEGMENTS)
+    return true;
+
+  if (!(l = calloc(1, sizeof(*l))))
+    {
+      _kvdb_set_err(k, "calloc failed");
+      return false;
+    }
+  k->log = l;
+  snprintf(buf, sizeof(buf), "%s-log", k->path);
+  if (!(l->dir = strdup(buf)))
+    {
+      _kvdb_set_err(k, "strdup failed");
+      return false;
+    }
+  if (k->read_only)
+    {
+      k->log_ops = &_segment_reader_ops;
+      return true;
+    }
+  if (mkdir(l->dir, 0700) && errno != EEXIST)
+    {
+      _kvdb_set_err(k, "unable to create log directory");
+      return false;
+    }
+
+  /* Continue with the latest segment. */
+  SQLITE_CALL(sqlite3_prepare_v2(k->db,
+                                 "SELECT seq, size, records FROM log_segments "
+                                 "ORDER BY seq DESC LIMIT 1", -1, &s, NULL));
+  rc = sqlite3_step(s);
+  if (rc == SQLITE_ROW)
+    {
+      seq = sqlite3_column_int64(s, 0);
+      size = sqlite3_column_int64(s, 1);
+      records = sqlite3_column_int64(s, 2);
+    }
+  sqlite3_finalize(s);
+  if (rc != SQLITE_ROW && rc != SQLITE_DONE)
+    {
+      _kvdb_set_err_from_sqlite2(k, "log_segments");
+      return false;
+    }
+  /* Entries are not appended to ones in an older format. */
+  if (size && _segment_version(k, seq) != KVDB_LOG_VERSION)
+    {
+      seq++;
+      size = records = 0;
+    }
+  if (!_open_segment(k, seq, size, records))
+    return false;
+  k->log_ops = &_segment_ops;
+  return true;
+}
+
+static void _segment_destroy(kvdb k)
+{
+  kvdb_log l = k->log;
+
+  if (!l)
+    return;
+  if (l->f)
+    fclose(l->f);
+  free(l->dir);
+  free(l);
+  k->log = NULL;
+}
+
+static bool _segment_append(kvdb k, kvdb_oid oid, const char *key,
+                            kvdb_type t, const void *p, size_t len, bool ext,
+                            kvdb_time_t time_added)
+{
+  kvdb_log l = k->log;
+  kvdb_log_record_s r = {
+    .oid = *oid, .key = (char *)key, .type = t,
+    .value = p, .value_len = len, .ext = ext,
+    .time_added = time_added
+  };
+  ssize_t n;
+
+  if (l->size >= (k->options.log_segment_size > 0
+                  ? k->options.log_segment_size : KVDB_LOG_SEGMENT_SIZE))
+    {
+      /* Full; this one will not change anymore. */
+      if (!_sync_segment(k))
+        return false;
+      fclose(l->f);
+      l->f = NULL;
+      if (!_open_segment(k, l->seq + 1, 0, 0))
+        return false;
+    }
+  if (!l->records || l->size - l->indexed >= KVDB_LOG_INDEX_BYTES)
+    {
+      sqlite3_stmt *s = k->stmts[STMT_INSERT_LOG_INDEX];
+
+      SQLITE_CALL(sqlite3_reset(s));
+      SQLITE_CALL(sqlite3_bind_int64(s, 1, time_added));
+      SQLITE_CALL(sqlite3_bind_int64(s, 2, l->seq));
+      SQLITE_CALL(sqlite3_bind_int64(s, 3, l->size));
+      SQLITE_CALL(sqlite3_bind_int64(s, 4, l->records));
+      if (!_kvdb_run_stmt_keep(k, s))
+        return false;
+      l->indexed = l->size;
+    }
+  if ((n = _kvdb_log_write_record(l->f, &r)) < 0)
+    {
+      _kvdb_set_err(k, "unable to append to log");
+      return false;
+    }
+  l->size += n;
+  l->records++;
+  l->dirty = true;
+  return true;
+}
+
+static bool _segment_pre_commit(kvdb k)
+{
+  kvdb_log l = k->log;
+
+  return !l->dirty || _sync_segment(k);
+}
+
+/* Map the segment for reading, up to size, and move to offset (unless
+ * it is within the header). */
+static bool _open_read(kvdb k, int64_t seq, int64_t offset, int64_t size,
+                       kvdb_log_file_s *lf)
+{
+  char path[256];
+
+  _segment_path(k->log, seq, path, sizeof(path));
+  if (!_kvdb_log_open(path, size, lf))
+    {
+      _kvdb_set_err(k, "unable to read log segment");
+      return false;
+    }
+  if (offset > (int64_t)lf->size)
+    {
+      _kvdb_log_close(lf);
+      _kvdb_set_err(k, "corrupt log segment");
+      return false;
+    }
+  if (offset > lf->p - lf->base)
+    {
+      lf->p = lf->base + offset;
+      lf->left = lf->size - offset;
+    }
+  return true;
+}
+
+typedef bool (*_segment_fn)(kvdb k, int64_t seq,
+                            int64_t offset, int64_t size,
+                            int64_t record, int64_t records, void *context);
+
+/* Call fn for every segment (range) that may have entries added at
+ * 'since' or later, in order. The first range starts at the closest
+ * sparse index entry, so it may have older entries too; the rest do
+ * not. The current segment (if any) is included up to what has been
+ * appended so far. */
+static bool _for_each_segment(kvdb k, int64_t since,
+                              _segment_fn fn, void *context)
+{
+  kvdb_log l = k->log;
+  sqlite3_stmt *s = k->stmts[STMT_SELECT_LOG_INDEX_BY_TA];
+  int64_t seq = 0, offset = 0, record = 0;
+  int rc;
+
+  SQLITE_CALL(sqlite3_reset(s));
+  SQLITE_CALL(sqlite3_bind_int64(s, 1, since));
+  rc = sqlite3_step(s);
+  if (rc == SQLITE_ROW)
+    {
+      seq = sqlite3_column_int64(s, 0);
+      offset = sqlite3_column_int64(s, 1);
+      record = sqlite3_column_int64(s, 2);
+    }
+  SQLITE_CALL(sqlite3_reset(s));
+  if (rc != SQLITE_ROW && rc != SQLITE_DONE)
+    {
+      _kvdb_set_err_from_sqlite2(k, "log_index");
+      return false;
+    }
+  if (l->f && fflush(l->f))
+    {
+      _kvdb_set_err(k, "unable to write log segment");
+      return false;
+    }
+
+  s = k->stmts[STMT_SELECT_LOG_SEGMENTS];
+  SQLITE_CALL(sqlite3_reset(s));
+  SQLITE_CALL(sqlite3_bind_int64(s, 1, seq));
+  while ((rc = sqlite3_step(s)) == SQLITE_ROW)
+    {
+      int64_t sseq = sqlite3_column_int64(s, 0);
+
+      /* (The row of the current one may be out of date.) */
+      if (l->f && sseq >= l->seq)
+        break;
+      if (sseq != seq)
+        offset = record = 0;
+      if (!fn(k, sseq, offset, sqlite3_column_int64(s, 1),
+              record, sqlite3_column_int64(s, 2), context))
+        {
+          SQLITE_CALL(sqlite3_reset(s));
+          return false;
+        }
+      seq = sseq;
+    }
+  SQLITE_CALL(sqlite3_reset(s));
+  if (rc != SQLITE_ROW && rc != SQLITE_DONE)
+    {
+      _kvdb_set_err_from_sqlite2(k, "log_segments");
+      return false;
+    }
+  if (!l->f)
+    return true;
+  if (seq != l->seq)
+    offset = record = 0;
+  return fn(k, l->seq, offset, l->size, record, l->records, context);
+}
+
+typedef struct {
+  int64_t since;
+  kvdb_log_cb cb;
+  void *context;
+} _iterate_s;
+
+static bool _iterate_segment(kvdb k, int64_t seq,
+                             int64_t offset, int64_t size,
+                             int64_t record, int64_t records, void *context)
+{
+  _iterate_s *is = context;
+  kvdb_log_record_s r = { .buf = NULL };
+  kvdb_log_file_s lf;
+  bool ok = true;
+
+  if (offset >= size)
+    return true;
+  if (!_open_read(k, seq, offset, size, &lf))
+    return false;
+  while (ok && lf.left > 0)
+    {
+      if (!_kvdb_log_read_record(&lf, &r))
+        {
+          _kvdb_set_err(k, "corrupt log segment");
+          ok = false;
+        }
+      else if (r.time_added >= is->since)
+        ok = is->cb(is->context, &r.oid, r.key, r.type, r.value, r.value_len,
+                    r.ext, r.time_added);
+    }
+  free(r.buf);
+  _kvdb_log_close(&lf);
+  return ok;
+}
+
+/* (Every entry here is our own, as time_added == last_modified.) */
+static bool _segment_iterate(kvdb k, int64_t since, bool own_only,
+                             kvdb_log_cb cb, void *context)
+{
+  _iterate_s is = {
+    .since = since, .cb = cb, .context = context
+  };
+
+  return _for_each_segment(k, since, _iterate_segment, &is);
+}
+
+typedef struct {
+  int64_t since;
+  FILE *out;
+  int count;
+} _export_s;
+
+static bool _export_segment(kvdb k, int64_t seq,
+                            int64_t offset, int64_t size,
+                            int64_t record, int64_t records, void *context)
+{
+  _export_s *es = context;
+  kvdb_log_record_s r = { .buf = NULL };
+  kvdb_log_file_s lf;
+  bool ok = true;
+
+  if (offset >= size)
+    return true;
+  if (!_open_read(k, seq, offset, size, &lf))
+    return false;
+
+  /* Skip what was added before since (only within the first one). */
+  while (es->since && lf.left > 0)
+    {
+      kvdb_log_file_s next = lf;
+
+      if (!_kvdb_log_read_record(&next, &r))
+        {
+          _kvdb_set_err(k, "corrupt log segment");
+          ok = false;
+          break;
+        }
+      if (r.time_added >= es->since)
+        break;
+      lf = next;
+      record++;
+    }
+  es->since = 0;
+  es->count += records - record;
+
+  /* The rest is copied as-is, unless it is in an older format. */
+  while (ok && lf.version != KVDB_LOG_VERSION && lf.left > 0)
+    if (!_kvdb_log_read_record(&lf, &r)
+        || _kvdb_log_write_record(es->out, &r) < 0)
+      {
+        _kvdb_set_err(k, "i/o error while exporting log segment");
+        ok = false;
+      }
+  free(r.buf);
+  if (ok && lf.left > 0
+      && fwrite(lf.p, 1, lf.left, es->out) != (size_t)lf.left)
+    {
+      _kvdb_set_err(k, "i/o error while exporting log segment");
+      ok = false;
+    }
+  _kvdb_log_close(&lf);
+  return ok;
+}
+
+static bool _segment_export(kvdb k, FILE *f, int64_t since, int *count)
+{
+  _export_s es = { .since = since, .out = f };
+  bool r = _for_each_segment(k, since, _export_segment, &es);
+
+  *count = es.count;
+  return r;
+}
+
+/* Whole segments are removed, once a later one starts with an entry
+ * added before 'before' (as segments are in time order, every entry
+ * in them was, too). Which entries are the latest versions of their oid
+ * and key is not known without reading all later segments, so with
+ * keep, nothing is. The rows go first; a crash before the files are
+ * removed leaves just files nobody refers to. */
+static bool _segment_compact(kvdb k, kvdb_time_t before, int keep, int rows,
+                             int64_t *removed)
+{
+  kvdb_log l = k->log;
+  sqlite3_stmt *s = k->stmts[STMT_SELECT_LOG_INDEX_BY_TA];
+  int64_t seq = 0, first = -1;
+  char buf[256];
+  int rc;
+
+  *removed = 0;
+  if (keep)
+    return true;
+  SQLITE_CALL(sqlite3_reset(s));
+  SQLITE_CALL(sqlite3_bind_int64(s, 1, before - 1));
+  rc = sqlite3_step(s);
+  if (rc == SQLITE_ROW)
+    seq = sqlite3_column_int64(s, 0);
+  SQLITE_CALL(sqlite3_reset(s));
+  if (rc != SQLITE_ROW && rc != SQLITE_DONE)
+    {
+      _kvdb_set_err_from_sqlite2(k, "log_index");
+      return false;
+    }
+  if (seq > l->seq)
+    seq = l->seq;
+
+  s = k->stmts[STMT_SELECT_LOG_SEGMENTS];
+  SQLITE_CALL(sqlite3_reset(s));
+  SQLITE_CALL(sqlite3_bind_int64(s, 1, 0));
+  while ((rc = sqlite3_step(s)) == SQLITE_ROW
+         && sqlite3_column_int64(s, 0) < seq)
+    {
+      if (first < 0)
+        first = sqlite3_column_int64(s, 0);
+      *removed += sqlite3_column_int64(s, 2);
+    }
+  SQLITE_CALL(sqlite3_reset(s));
+  if (rc != SQLITE_ROW && rc != SQLITE_DONE)
+    {
+      _kvdb_set_err_from_sqlite2(k, "log_segments");
+      return false;
+    }
+  if (first < 0)
+    return true;
+
+  sprintf(buf, "DELETE FROM log_index WHERE seq < %lld", (long long)seq);
+  SQLITE_EXEC(buf);
+  sprintf(buf, "DELETE FROM log_segments WHERE seq < %lld", (long long)seq);
+  SQLITE_EXEC(buf);
+  for ( ; first < seq ; first++)
+    {
+      _segment_path(l, first, buf, sizeof(buf));
+      if (unlink(buf) && errno != ENOENT)
+        KVDEBUG("unable to remove %s", buf);
+    }
+  return true;
+}
+
+static const struct kvdb_log_ops_struct _segment_ops = {
+  .append = _segment_append,
+  .pre_commit = _segment_pre_commit,
+  .iterate = _segment_iterate,
+  .export = _segment_export,
+  .compact = _segment_compact,
+  .destroy = _segment_destroy
+};
+
+static const struct kvdb_log_ops_struct _segment_reader_ops = {
+  .iterate = _segment_iterate,
+  .export = _segment_export,
+  .destroy = _segment_destroy
+};
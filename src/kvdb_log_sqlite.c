@@ -0,0 +1,191 @@
+/*
+ * $Id: kvdb_log_sqlite.c $
+ *
+ * Author: Markus Stenberg <fingon@iki.fi>
+ *
+ * Copyright (c) 2013 Markus Stenberg
+ *
+ */
+
+/* Default log backend: the log table within the database itself (see
+ * kvdb_log_ops in kvdb_i.h). */
+
+#define DEBUG
+
+#include "kvdb_i.h"
+
+static bool _sqlite_append(kvdb k, kvdb_oid oid, const char *key,
+                           kvdb_type t, const void *p, size_t len, bool ext,
+                           kvdb_time_t time_added)
+{
+  sqlite3_stmt *s = k->stmts[STMT_INSERT_LOG];
+  struct kvdb_typed_value_struct ktv;
+
+  /* (Stored as in cs.) */
+  if (!_kvdb_tv_set_raw(&ktv, t, p, len))
+    {
+      _kvdb_set_err(k, "invalid value for its type");
+      return false;
+    }
+  SQLITE_CALL(sqlite3_reset(s));
+  SQLITE_CALL(sqlite3_clear_bindings(s));
+  SQLITE_CALL(sqlite3_bind_blob(s, 1, oid, KVDB_OID_SIZE, SQLITE_STATIC));
+  SQLITE_CALL(sqlite3_bind_text(s, 2, key, -1, SQLITE_STATIC));
+  SQLITE_CALL(_kvdb_tv_bind(s, 3, &ktv));
+  SQLITE_CALL(sqlite3_bind_int64(s, 4, time_added));
+  SQLITE_CALL(sqlite3_bind_int64(s, 5, time_added));
+  if (ext)
+    SQLITE_CALL(sqlite3_bind_int(s, 6, 1));
+  SQLITE_CALL(sqlite3_bind_int(s, 7, t));
+  if (!_kvdb_run_stmt_keep(k, s))
+    {
+      KVDEBUG("stmt_insert_log failed");
+      return false;
+    }
+  return true;
+}
+
+/* Call cb for the current row of s (oid, key, value, time_added, ext,
+ * type). */
+bool _kvdb_log_sqlite_entry(kvdb k, sqlite3_stmt *s,
+                            kvdb_log_cb cb, void *context)
+{
+  struct kvdb_typed_value_struct ktv;
+  void *p;
+  size_t len;
+
+  KVASSERT(sqlite3_column_count(s) == 6, "weird stmt count");
+  KVASSERT(sqlite3_column_bytes(s, 0) == KVDB_OID_SIZE, "invalid oid size");
+  if (!_kvdb_tv_column(&ktv, s, 2, 5))
+    {
+      _kvdb_set_err(k, "invalid value in log");
+      return false;
+    }
+  _kvdb_tv_get_raw_value(&ktv, &p, &len);
+  return cb(context,
+            (kvdb_oid)sqlite3_column_blob(s, 0),
+            (const char *)sqlite3_column_text(s, 1),
+            sqlite3_column_type(s, 5) == SQLITE_NULL
+            ? KVDB_NULL : _kvdb_tv_type(&ktv),
+            p, len,
+            sqlite3_column_type(s, 4) != SQLITE_NULL,
+            sqlite3_column_int64(s, 3));
+}
+
+/* Call cb for every row of s, which has its parameters bound
+ * already. */
+static bool _sqlite_run(kvdb k, sqlite3_stmt *s, kvdb_log_cb cb, void *context)
+{
+  bool ok = true;
+  int rc;
+
+  while (ok && (rc = sqlite3_step(s)) == SQLITE_ROW)
+    ok = _kvdb_log_sqlite_entry(k, s, cb, context);
+  if (ok && rc != SQLITE_DONE)
+    {
+      _kvdb_set_err_from_sqlite2(k, "log");
+      ok = false;
+    }
+  SQLITE_CALL(sqlite3_reset(s));
+  return ok;
+}
+
+static bool _sqlite_iterate(kvdb k, int64_t since, bool own_only,
+                            kvdb_log_cb cb, void *context)
+{
+  sqlite3_stmt *s = k->stmts[own_only ? STMT_SELECT_LOG_BY_TA_OWN
+                             : STMT_SELECT_LOG_BY_TA];
+
+  SQLITE_CALL(sqlite3_reset(s));
+  SQLITE_CALL(sqlite3_clear_bindings(s));
+  SQLITE_CALL(sqlite3_bind_int64(s, 1, since));
+  return _sqlite_run(k, s, cb, context);
+}
+
+/* A single seek in i_log_oid_key_lm. */
+static bool _sqlite_get_at(kvdb k, kvdb_oid oid, const char *key,
+                           int64_t until, kvdb_log_cb cb, void *context)
+{
+  sqlite3_stmt *s = k->stmts[STMT_SELECT_LOG_AT];
+
+  SQLITE_CALL(sqlite3_reset(s));
+  SQLITE_CALL(sqlite3_clear_bindings(s));
+  SQLITE_CALL(sqlite3_bind_blob(s, 1, oid, KVDB_OID_SIZE, SQLITE_STATIC));
+  SQLITE_CALL(sqlite3_bind_text(s, 2, key, -1, SQLITE_STATIC));
+  SQLITE_CALL(sqlite3_bind_int64(s, 3, until));
+  return _sqlite_run(k, s, cb, context);
+}
+
+/* Also served by i_log_oid_key_lm. Each cursor has a statement of its
+ * own, as there may be many open at once. */
+static sqlite3_stmt *_sqlite_history(kvdb k, kvdb_oid oid, const char *key)
+{
+  sqlite3_stmt *s;
+
+  SQLITE_CALLR2(sqlite3_prepare_v2(k->db,
+                                   "SELECT oid, key, value, time_added, ext, "
+                                   "type FROM log WHERE oid=?1 AND key=?2 "
+                                   "ORDER BY last_modified DESC, rowid DESC",
+                                   -1, &s, NULL), NULL);
+  SQLITE_CALL2(sqlite3_bind_blob(s, 1, oid, KVDB_OID_SIZE, SQLITE_TRANSIENT),
+               goto fail);
+  SQLITE_CALL2(sqlite3_bind_text(s, 2, key, -1, SQLITE_TRANSIENT),
+               goto fail);
+  return s;
+ fail:
+  sqlite3_finalize(s);
+  return NULL;
+}
+
+/* A batch is a range of rowids; the latest versions of each oid and
+ * key are found with i_log_oid_key_lm. */
+static bool _sqlite_compact(kvdb k, kvdb_time_t before, int keep, int rows,
+                            int64_t *removed)
+{
+  sqlite3_stmt *s = k->stmts[STMT_SELECT_LOG_ROWID_AFTER];
+  int64_t last = INT64_MAX;
+  int rc;
+
+  /* Where this batch ends; if there are no more than rows entries
+   * left, the next one starts over. */
+  if (rows)
+    {
+      SQLITE_CALL(sqlite3_reset(s));
+      SQLITE_CALL(sqlite3_bind_int64(s, 1, k->compact_cursor));
+      SQLITE_CALL(sqlite3_bind_int(s, 2, rows - 1));
+      rc = sqlite3_step(s);
+      if (rc == SQLITE_ROW)
+        last = sqlite3_column_int64(s, 0);
+      SQLITE_CALL(sqlite3_reset(s));
+      if (rc != SQLITE_ROW && rc != SQLITE_DONE)
+        {
+          _kvdb_set_err_from_sqlite2(k, "log");
+          return false;
+        }
+    }
+  else
+    k->compact_cursor = 0;
+
+  s = k->stmts[STMT_DELETE_LOG_SUPERSEDED];
+  SQLITE_CALL(sqlite3_reset(s));
+  SQLITE_CALL(sqlite3_bind_int64(s, 1, k->compact_cursor));
+  SQLITE_CALL(sqlite3_bind_int64(s, 2, last));
+  SQLITE_CALL(sqlite3_bind_int64(s, 3, before));
+  SQLITE_CALL(sqlite3_bind_int(s, 4, keep));
+  if (!_kvdb_run_stmt_keep(k, s))
+    {
+      KVDEBUG("stmt_delete_log_superseded failed");
+      return false;
+    }
+  *removed = sqlite3_changes(k->db);
+  k->compact_cursor = last == INT64_MAX ? 0 : last;
+  return true;
+}
+
+const struct kvdb_log_ops_struct _kvdb_log_sqlite_ops = {
+  .append = _sqlite_append,
+  .iterate = _sqlite_iterate,
+  .get_at = _sqlite_get_at,
+  .history = _sqlite_history,
+  .compact = _sqlite_compact
+};
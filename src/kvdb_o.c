@@ -27,9 +27,9 @@
 
 void _kvdb_tv_get_raw_value(kvdb_typed_value value, void **p, size_t *len)
 {
-  /* Simplified approach: Instead of the good old ways of dealing with
-   * various bind methods, all we need to do is find a pointer, and
-   * length, and use sqlite3_bind_blob. BIYU. */
+  /* The raw value is what log entries and images contain, and what
+   * values are compared by; SQLite gets them natively (see
+   * _kvdb_tv_bind). */
   switch (value->t)
     {
     case KVDB_NULL:
@@ -78,7 +78,108 @@ void _kvdb_tv_get_raw_value(kvdb_typed_value value, void **p, size_t *len)
     }
 }
 
-kvdb_o _kvdb_create_o(kvdb k, const void *oid)
+/* The reverse of the above; fails if the raw value cannot be of type
+ * t. Strings (and large binaries) point to p instead of being
+ * copied. */
+bool _kvdb_tv_set_raw(kvdb_typed_value ktv, kvdb_type t,
+                      const void *p, size_t len)
+{
+  switch (t)
+    {
+    case KVDB_NULL:
+      if (len)
+        return false;
+      break;
+    case KVDB_INTEGER:
+      if (len != sizeof(ktv->v.i))
+        return false;
+      memcpy(&ktv->v.i, p, len);
+      break;
+    case KVDB_DOUBLE:
+      if (len != sizeof(ktv->v.d))
+        return false;
+      memcpy(&ktv->v.d, p, len);
+      break;
+    case KVDB_STRING:
+      if (!len || ((const char *)p)[len - 1])
+        return false;
+      ktv->v.s = (char *)p;
+      break;
+    case KVDB_OBJECT:
+      if (len != KVDB_OID_SIZE)
+        return false;
+      memcpy(&ktv->v.oid, p, len);
+      break;
+    case KVDB_COORD:
+      if (len != sizeof(ktv->v.coord))
+        return false;
+      memcpy(&ktv->v.coord, p, len);
+      break;
+    case KVDB_BINARY:
+    case KVDB_BINARY_SMALL:
+      _kvdb_tv_set_binary(ktv, (void *)p, len);
+      return true;
+    default:
+      return false;
+    }
+  ktv->t = t;
+  return true;
+}
+
+/* Bind the value as the SQLite type closest to it (see
+ * _kvdb_tv_column for the other direction). */
+int _kvdb_tv_bind(sqlite3_stmt *s, int i, kvdb_typed_value ktv)
+{
+  void *p;
+  size_t len;
+
+  switch (ktv->t)
+    {
+    case KVDB_NULL:
+      return sqlite3_bind_null(s, i);
+    case KVDB_INTEGER:
+      return sqlite3_bind_int64(s, i, ktv->v.i);
+    case KVDB_DOUBLE:
+      return sqlite3_bind_double(s, i, ktv->v.d);
+    case KVDB_STRING:
+      return sqlite3_bind_text(s, i, ktv->v.s, -1, SQLITE_STATIC);
+    default:
+      _kvdb_tv_get_raw_value(ktv, &p, &len);
+      return sqlite3_bind_blob(s, i, p, len, SQLITE_STATIC);
+    }
+}
+
+/* Value in column col, with its type in type_col; without one, the
+ * value is binary. Strings and binaries point to the column, so they
+ * are valid only until the statement is stepped or reset. */
+bool _kvdb_tv_column(kvdb_typed_value ktv, sqlite3_stmt *s,
+                     int col, int type_col)
+{
+  kvdb_type t = sqlite3_column_type(s, type_col) == SQLITE_NULL
+    ? KVDB_BINARY : sqlite3_column_int(s, type_col);
+
+  switch (t)
+    {
+    case KVDB_INTEGER:
+      ktv->v.i = sqlite3_column_int64(s, col);
+      break;
+    case KVDB_DOUBLE:
+      ktv->v.d = sqlite3_column_double(s, col);
+      break;
+    case KVDB_STRING:
+      if (!(ktv->v.s = (char *)sqlite3_column_text(s, col)))
+        return false;
+      break;
+    default:
+      return _kvdb_tv_set_raw(ktv, t, sqlite3_column_blob(s, col),
+                              sqlite3_column_bytes(s, col));
+    }
+  ktv->t = t;
+  return true;
+}
+
+/* Create object that is not (yet) in the cache. */
+kvdb_o _kvdb_alloc_o(kvdb k, const void *oid)
 {
   kvdb_o o = calloc(1, sizeof(*o));
 
@@ -88,51 +189,61 @@ kvdb_o _kvdb_create_o(kvdb k, const void *oid)
       return NULL;
     }
   memcpy(&o->oid, oid, KVDB_OID_SIZE);
-  k->oid_ih = ihash_insert(k->oid_ih, o);
-  if (!k->oid_ih)
-    {
-      KVDEBUG("ihash_insert failed");
-      free(o);
-      return NULL;
-    }
   o->k = k;
+  o->shard = _kvdb_o_shard(oid);
   INIT_LIST_HEAD(&o->al);
   return o;
 }
 
-static bool _o_set_sql(kvdb_o o, kvdb_key key, const void *p, size_t len,
-                       bool historic, kvdb_time_t last_modified)
+kvdb_o _kvdb_create_o(kvdb k, const void *oid)
+{
+  kvdb_o o = _kvdb_alloc_o(k, oid);
+
+  if (!o)
+    return NULL;
+  o = _kvdb_cache_add(k, o);
+  if (!o)
+    KVDEBUG("_kvdb_cache_add failed");
+  return o;
+}
+
+static bool _o_set_sql(kvdb_o o, kvdb_key key, kvdb_typed_value value,
+                       bool ext, bool historic, kvdb_time_t last_modified)
 {
   kvdb k = o->k;
   KVASSERT(k, "missing o->k");
   kvdb_time_t now = kvdb_monotonous_time(k);
   const char *keyn = key->name;
+  unsigned char digest[SHA256_SIZE];
+  struct kvdb_typed_value_struct ref;
   sqlite3_stmt *s;
+  void *p;
+  size_t len;
 
   KVASSERT(*keyn, "null name is invalid");
 
+  /* Big values go to the blob directory; the rest refers to them. */
+  _kvdb_tv_get_raw_value(value, &p, &len);
+  if (ext)
+    {
+      if (!_kvdb_blob_put(k, p, len, digest))
+        return false;
+      p = digest;
+      len = SHA256_SIZE;
+      _kvdb_tv_set_binary(&ref, p, len);
+      value = &ref;
+    }
+
   /* Now we have to reflect the state in log+cs, by doing appropriate
    * deletes (if applicable) and insert. */
 
   /* Insert to log (almost) always */
   /* XXX - should local app be just this single one, or some other
      magic indicator (e.g. prefix character in app name?) Hmm.. */
-  if (o->app != k->apps[APP_LOCAL_KVDB])
-    {
-      s = k->stmts[STMT_INSERT_LOG];
-      SQLITE_CALL(sqlite3_reset(s));
-      SQLITE_CALL(sqlite3_clear_bindings(s));
-      SQLITE_CALL(sqlite3_bind_blob(s, 1, &o->oid, KVDB_OID_SIZE, SQLITE_STATIC));
-      SQLITE_CALL(sqlite3_bind_text(s, 2, keyn, -1, SQLITE_STATIC));
-      SQLITE_CALL(sqlite3_bind_blob(s, 3, p, len, SQLITE_STATIC));
-      SQLITE_CALL(sqlite3_bind_int64(s, 4, now));
-      SQLITE_CALL(sqlite3_bind_int64(s, 5, now));
-      if (!_kvdb_run_stmt_keep(k, s))
-        {
-          KVDEBUG("stmt_insert_log failed");
-          return false;
-        }
-    }
+  if (o->app != k->apps[APP_LOCAL_KVDB]
+      && !k->log_ops->append(k, &o->oid, keyn, _kvdb_tv_type(value),
+                             p, len, ext, now))
+    return false;
 
   /* Delete from cs if there was something there before. */
   s = k->stmts[STMT_DELETE_CS];
@@ -152,13 +263,18 @@ static bool _o_set_sql(kvdb_o o, kvdb_key key, const void *p, size_t len,
   SQLITE_CALL(sqlite3_clear_bindings(s));
   SQLITE_CALL(sqlite3_bind_blob(s, 1, &o->oid, KVDB_OID_SIZE, SQLITE_STATIC));
   SQLITE_CALL(sqlite3_bind_text(s, 2, keyn, -1, SQLITE_STATIC));
-  SQLITE_CALL(sqlite3_bind_blob(s, 3, p, len, SQLITE_STATIC));
+  SQLITE_CALL(_kvdb_tv_bind(s, 3, value));
   SQLITE_CALL(sqlite3_bind_int64(s, 4, now));
+  if (ext)
+    SQLITE_CALL(sqlite3_bind_int(s, 5, 1));
+  SQLITE_CALL(sqlite3_bind_int(s, 6, _kvdb_tv_type(value)));
   if (!_kvdb_run_stmt_keep(k, s))
     {
       KVDEBUG("stmt_insert_cs failed");
       return false;
     }
+  if (k->flusher)
+    _kvdb_flush_note_write(k, len);
   return true;
 }
 
@@ -166,11 +282,17 @@ static bool _o_set_sql(kvdb_o o, kvdb_key key, const void *p, size_t len,
 kvdb_o kvdb_create_o(kvdb k, kvdb_app app, kvdb_class cl)
 {
   kvdb_o o = NULL;
+  typeof(k->oidbase) oidbase;
+
+  if (!_kvdb_writable(k))
+    return NULL;
 
   /* First off, intern the app/cl if they're set - easy to recover
    * from failure here. */
-  k->oidbase.seq++;
-  o = _kvdb_create_o(k, &k->oidbase);
+  oidbase.boot = k->oidbase.boot;
+  memcpy(oidbase.name, k->oidbase.name, sizeof(oidbase.name));
+  oidbase.seq = __atomic_add_fetch(&k->oidbase.seq, 1, __ATOMIC_RELAXED);
+  o = _kvdb_create_o(k, &oidbase);
   if (!o)
     return NULL;
   if (app)
@@ -244,25 +366,125 @@ static void _free_kvdb_typed_value(kvdb_typed_value o)
     }
 }
 
+static void _o_a_free_value(kvdb_o_a a)
+{
+  if (a->buf)
+    {
+      kvdb_buffer_unref(a->buf);
+      a->buf = NULL;
+    }
+  else
+    _free_kvdb_typed_value(&a->value);
+}
+
+/* Binary values live in a kvdb_buffer (buf, if given, is shared
+ * rather than copied). */
+static bool _o_a_copy_value(kvdb_o_a a, const kvdb_typed_value value,
+                            kvdb_buffer buf)
+{
+  if (value->t != KVDB_BINARY)
+    return _copy_kvdb_typed_value(value, &a->value);
+  if (buf)
+    {
+      KVASSERT(value->v.binary.ptr == buf->data, "value not within buf");
+      a->buf = kvdb_buffer_ref(buf);
+    }
+  else
+    {
+      a->buf = kvdb_buffer_create(value->v.binary.ptr_size);
+      if (!a->buf)
+        return false;
+      memcpy(a->buf->data, value->v.binary.ptr, value->v.binary.ptr_size);
+    }
+  a->value.t = KVDB_BINARY;
+  a->value.v.binary.ptr = a->buf->data;
+  a->value.v.binary.ptr_size = a->buf->len;
+  return true;
+}
+
 void _kvdb_o_free(kvdb_o o)
 {
   kvdb_o_a a, an;
 
   list_for_each_entry_safe(a, an, &o->al, lh)
     {
-      _free_kvdb_typed_value(&a->value);
+      _o_a_free_value(a);
       free(a);
     }
   free(o);
 }
 
+/* Get the value in a cs row, from the blob directory if ext is set
+ * (*buf is then the buffer it is in, to be released by the caller). */
+static bool _o_row_value(kvdb k, sqlite3_stmt *s, int col, int ext_col,
+                         int type_col, kvdb_typed_value ktv,
+                         kvdb_buffer *buf)
+{
+  *buf = NULL;
+  if (sqlite3_column_type(s, ext_col) != SQLITE_NULL)
+    {
+      if (!(*buf = _kvdb_blob_get(k, sqlite3_column_blob(s, col),
+                                  sqlite3_column_bytes(s, col))))
+        return false;
+      _kvdb_tv_set_binary(ktv, (*buf)->data, (*buf)->len);
+      return true;
+    }
+  if (!_kvdb_tv_column(ktv, s, col, type_col))
+    {
+      _kvdb_set_err(k, "invalid value in cs");
+      return false;
+    }
+  return true;
+}
+
+/* Read the value of an attribute we know only the key of. */
+static bool _o_a_load(kvdb_o o, kvdb_o_a a)
+{
+  kvdb k = o->k;
+  sqlite3_stmt *s = k->stmts[STMT_SELECT_CS_BY_OID_KEY];
+  struct kvdb_typed_value_struct ktv;
+  kvdb_buffer buf;
+  bool r = false;
+  int rc;
+
+  _kvdb_lock(k);
+  SQLITE_CALL2(sqlite3_reset(s), goto done);
+  SQLITE_CALL2(sqlite3_clear_bindings(s), goto done);
+  SQLITE_CALL2(sqlite3_bind_blob(s, 1, &o->oid, KVDB_OID_SIZE, SQLITE_STATIC),
+               goto done);
+  SQLITE_CALL2(sqlite3_bind_text(s, 2, a->key->name, -1, SQLITE_STATIC),
+               goto done);
+  rc = sqlite3_step(s);
+  if (rc == SQLITE_ROW)
+    {
+      if (_o_row_value(k, s, 0, 2, 3, &ktv, &buf)
+          && _o_a_copy_value(a, &ktv, buf))
+        {
+          a->last_modified = sqlite3_column_int64(s, 1);
+          a->loaded = true;
+          a->untyped = sqlite3_column_type(s, 3) == SQLITE_NULL;
+          r = true;
+        }
+      if (buf)
+        kvdb_buffer_unref(buf);
+    }
+  else if (rc == SQLITE_DONE)
+    KVDEBUG("%s vanished from cs", a->key->name);
+  else
+    _kvdb_set_err_from_sqlite2(k, "select from cs");
+  sqlite3_reset(s);
+ done:
+  _kvdb_unlock(k);
+  return r;
+}
+
 kvdb_o_a _kvdb_o_get_a(kvdb_o o, kvdb_key key)
 {
   kvdb_o_a a;
 
   list_for_each_entry(a, &o->al, lh)
     if (a->key == key)
-      return a;
+      return a->loaded || _o_a_load(o, a) ? a : NULL;
   return NULL;
 }
 
@@ -270,7 +492,8 @@ static bool _o_a_set(kvdb_o o,
                      kvdb_o_a a,
                      kvdb_key key,
                      const kvdb_typed_value value,
-                     kvdb_time_t last_modified)
+                     kvdb_time_t last_modified,
+                     kvdb_buffer buf)
 {
   KVASSERT(value, "_o_a_set with null value");
 
@@ -329,24 +552,111 @@ static bool _o_a_set(kvdb_o o,
 
       /* Fill fields */
       a->key = key;
-      _copy_kvdb_typed_value(value, &a->value);
+      if (!_o_a_copy_value(a, value, buf))
+        {
+          free(a);
+          return false;
+        }
 
       /* Add it to attribute list */
       list_add(&a->lh, &o->al);
     }
   else
     {
-      _free_kvdb_typed_value(&a->value);
-      _copy_kvdb_typed_value(value, &a->value);
+      _o_a_free_value(a);
+      if (!_o_a_copy_value(a, value, buf))
+        {
+          /* Forget the value; it is reloaded if needed */
+          a->value.t = KVDB_NULL;
+          a->loaded = false;
+          return false;
+        }
     }
   a->last_modified = last_modified;
+  a->loaded = true;
+  a->untyped = false;
   return true;
 }
 
-kvdb_o _select_object_by_oid(kvdb k, const void *oid)
+/* Add an attribute whose value is read only when needed. */
+static bool _o_a_add_unloaded(kvdb_o o, kvdb_key key)
 {
-  kvdb_o r = NULL;
+  kvdb_o_a a = calloc(1, sizeof(*a));
+
+  if (!a)
+    return false;
+  a->key = key;
+  a->value.t = KVDB_NULL;
+  list_add(&a->lh, &o->al);
+  return true;
+}
+
+/* Load every value of the object (that is not loaded yet) at once. */
+static bool _o_load_all(kvdb_o o)
+{
+  kvdb k = o->k;
   sqlite3_stmt *stmt = k->stmts[STMT_SELECT_CS_BY_OID];
+  bool r = true;
+  int rc = SQLITE_DONE;
+
+  SQLITE_CALL(sqlite3_reset(stmt));
+  SQLITE_CALL(sqlite3_clear_bindings(stmt));
+  SQLITE_CALL(sqlite3_bind_blob(stmt, 1, &o->oid, KVDB_OID_SIZE, SQLITE_STATIC));
+  while (r && (rc = sqlite3_step(stmt)) == SQLITE_ROW)
+    {
+      KVASSERT(sqlite3_column_count(stmt)==5, "weird stmt count");
+      /* key, value, last_modified, ext, type */
+      kvdb_key key = kvdb_define_key(k,
+                                     (const char *)
+                                     sqlite3_column_text(stmt, 0),
+                                     KVDB_NULL);
+      struct kvdb_typed_value_struct ktv;
+      kvdb_buffer buf;
+      kvdb_o_a a;
+
+      list_for_each_entry(a, &o->al, lh)
+        if (a->key == key && !a->loaded)
+          {
+            /* (A failure ends the loop, and the load with it.) */
+            r = _o_row_value(k, stmt, 1, 3, 4, &ktv, &buf)
+              && _o_a_set(o, a, key, &ktv, sqlite3_column_int64(stmt, 2),
+                          buf);
+            if (r)
+              a->untyped = sqlite3_column_type(stmt, 4) == SQLITE_NULL;
+            if (buf)
+              kvdb_buffer_unref(buf);
+            break;
+          }
+    }
+  if (r && rc != SQLITE_DONE)
+    {
+      _kvdb_set_err_from_sqlite2(k, "select from cs");
+      r = false;
+    }
+  sqlite3_reset(stmt);
+  return r;
+}
+
+/* Load values of the keys the object's class wants up front. */
+static bool _o_prefetch(kvdb_o o)
+{
+  kvdb_class cl = o->cl;
+  int i;
+
+  if (cl->prefetch_all)
+    return _o_load_all(o);
+  for (i = 0 ; i < cl->n_prefetch ; i++)
+    _kvdb_o_get_a(o, cl->prefetch[i]);
+  return true;
+}
+
+/* Load object from cs; the result is not in the cache. Apart from
+ * the app and class, only the keys are read (values are loaded by
+ * _kvdb_o_get_a, or _o_prefetch). */
+static kvdb_o _select_object_by_oid_locked(kvdb k, const void *oid)
+{
+  kvdb_o r = NULL;
+  sqlite3_stmt *stmt = k->stmts[STMT_SELECT_CS_KEYS_BY_OID];
   SQLITE_CALLR2(sqlite3_reset(stmt), NULL);
   SQLITE_CALLR2(sqlite3_clear_bindings(stmt), NULL);
   SQLITE_CALLR2(sqlite3_bind_blob(stmt, 1, oid, KVDB_OID_SIZE, SQLITE_STATIC), NULL);
@@ -354,10 +664,10 @@ kvdb_o _select_object_by_oid(kvdb k, const void *oid)
   while (rc == SQLITE_ROW)
     {
       KVASSERT(sqlite3_column_count(stmt)==3, "weird stmt count");
-      /* key, value */
+      /* key, value and type (of app/class) */
       if (!r)
         {
-          r = _kvdb_create_o(k, oid);
+          r = _kvdb_alloc_o(k, oid);
           if (!r)
             return NULL;
         }
@@ -366,118 +676,193 @@ kvdb_o _select_object_by_oid(kvdb k, const void *oid)
                                      (const char *)
                                      sqlite3_column_text(stmt, 0),
                                      KVDB_NULL);
-      /* XXX - handle the value better than this ;) */
-      struct kvdb_typed_value_struct ktv;
-      int len = sqlite3_column_bytes(stmt, 1);
-      void *p = (void *)sqlite3_column_blob(stmt, 1);
-      int64_t last_modified = sqlite3_column_int64(stmt, 2);
+      bool ok;
+
+      if (key == k->keys[KEY_APP] || key == k->keys[KEY_CLASS])
+        {
+          struct kvdb_typed_value_struct ktv;
 
-      _kvdb_tv_set_binary(&ktv, p, len);
-      if (!_o_a_set(r, _kvdb_o_get_a(r, key), key, &ktv, last_modified))
-        return NULL;
+          ok = _kvdb_tv_column(&ktv, stmt, 1, 2)
+            && _o_a_set(r, NULL, key, &ktv, 0, NULL);
+        }
+      else
+        ok = _o_a_add_unloaded(r, key);
+      if (!ok)
+        {
+          _kvdb_o_free(r);
+          return NULL;
+        }
       rc = sqlite3_step(stmt);
 
     }
   if (rc != SQLITE_DONE)
     {
       _kvdb_set_err_from_sqlite2(k, "select from cs");
+      if (r)
+        _kvdb_o_free(r);
+      return NULL;
+    }
+  if (r && r->cl && !_o_prefetch(r))
+    {
+      _kvdb_o_free(r);
+      return NULL;
     }
   return r;
 }
 
 kvdb_o kvdb_get_o_by_id(kvdb k, kvdb_oid oid)
 {
-  struct kvdb_o_struct dummy;
+  kvdb_o o;
 
   if (!oid)
     return NULL;
-  dummy.oid = *oid;
-  void *v = ihash_get(k->oid_ih, &dummy);
-  if (v)
-    return (kvdb_o) v;
-  return _select_object_by_oid(k, oid);
+  o = _kvdb_cache_get(k, oid);
+  if (o)
+    return o;
+  _kvdb_lock(k);
+  o = _select_object_by_oid_locked(k, oid);
+  _kvdb_unlock(k);
+  return o ? _kvdb_cache_add(k, o) : NULL;
 }
 
 kvdb_typed_value kvdb_o_get(kvdb_o o, kvdb_key key)
 {
-  kvdb_o_a a = _kvdb_o_get_a(o, key);
+  kvdb_o_a a;
+
+  _kvdb_o_lock(o);
+  a = _kvdb_o_get_a(o, key);
+  _kvdb_o_unlock(o);
   if (a)
     return &a->value;
   return NULL;
 }
 
-int64_t *kvdb_o_get_int64(kvdb_o o, kvdb_key key)
+/* Values written before cs had a type column are loaded as binary;
+ * the first getter that asks for them as something else retypes them
+ * in place, if they look like one. (Typed values never get here.) */
+static void _o_a_retype(kvdb_o_a a, kvdb_type t)
 {
-  const kvdb_typed_value ktv = kvdb_o_get(o, key);
-  if (ktv)
+  struct kvdb_typed_value_struct ktv;
+  void *p;
+  size_t len;
+
+  _kvdb_tv_get_raw_value(&a->value, &p, &len);
+  if (!_kvdb_tv_set_raw(&ktv, t, p, len))
+    return;
+  if (t == KVDB_STRING && !a->buf && !(ktv.v.s = strdup(ktv.v.s)))
+    return;
+  if (t != KVDB_STRING && a->buf)
     {
-      if (ktv->t == KVDB_BINARY_SMALL
-          && ktv->v.binary_small[0] == sizeof(ktv->v.i))
-        {
-          int64_t v = *((int64_t *)&ktv->v.binary_small[1]);
-          ktv->t = KVDB_INTEGER;
-          ktv->v.i = v;
-        }
-      if (ktv->t == KVDB_INTEGER)
-        return &ktv->v.i;
+      kvdb_buffer_unref(a->buf);
+      a->buf = NULL;
     }
-  return NULL;
+  a->value = ktv;
+  a->untyped = false;
 }
 
-kvdb_o kvdb_o_get_object(kvdb_o o, kvdb_key key)
+/* The getters below hold the object lock for their duration. The
+ * returned pointers stay valid until the attribute is set again. */
+
+static int64_t *_kvdb_o_get_int64(kvdb_o o, kvdb_key key)
 {
-  const kvdb_typed_value ktv = kvdb_o_get(o, key);
+  kvdb_o_a a = _kvdb_o_get_a(o, key);
 
-  if (ktv)
+  if (!a)
+    return NULL;
+  if (a->untyped)
+    _o_a_retype(a, KVDB_INTEGER);
+  return a->value.t == KVDB_INTEGER ? &a->value.v.i : NULL;
+}
+
+int64_t *kvdb_o_get_int64(kvdb_o o, kvdb_key key)
+{
+  int64_t *r;
+
+  _kvdb_o_lock(o);
+  r = _kvdb_o_get_int64(o, key);
+  _kvdb_o_unlock(o);
+  return r;
+}
+
+kvdb_oid _kvdb_o_get_oid(kvdb_o o, kvdb_key key)
+{
+  kvdb_o_a a;
+  kvdb_oid r = NULL;
+
+  _kvdb_o_lock(o);
+  a = _kvdb_o_get_a(o, key);
+  if (a)
     {
-      if (ktv->t == KVDB_BINARY_SMALL
-          && ktv->v.binary_small[0] == KVDB_OID_SIZE)
-        {
-          struct kvdb_oid_struct oid =
-            *((kvdb_oid) (ktv->v.binary_small + 1));
-          ktv->v.oid = oid;
-          ktv->t = KVDB_OBJECT;
-        }
-      if (ktv->t == KVDB_OBJECT)
-        return kvdb_get_o_by_id(o->k, &ktv->v.oid);
+      if (a->untyped)
+        _o_a_retype(a, KVDB_OBJECT);
+      if (a->value.t == KVDB_OBJECT)
+        r = &a->value.v.oid;
     }
-  return NULL;
+  _kvdb_o_unlock(o);
+  return r;
+}
+
+kvdb_o kvdb_o_get_object(kvdb_o o, kvdb_key key)
+{
+  struct kvdb_oid_struct oid;
+  kvdb_oid p;
+
+  /* Copy the oid, as the other object's shard lock must not be taken
+   * while holding ours. */
+  _kvdb_o_lock(o);
+  p = _kvdb_o_get_oid(o, key);
+  if (p)
+    oid = *p;
+  _kvdb_o_unlock(o);
+  return p ? kvdb_get_o_by_id(o->k, &oid) : NULL;
+}
+
+static char *_kvdb_o_get_string(kvdb_o o, kvdb_key key)
+{
+  kvdb_o_a a = _kvdb_o_get_a(o, key);
+
+  if (!a)
+    return NULL;
+  if (a->untyped)
+    _o_a_retype(a, KVDB_STRING);
+  return a->value.t == KVDB_STRING ? a->value.v.s : NULL;
 }
 
 char *kvdb_o_get_string(kvdb_o o, kvdb_key key)
 {
-  const kvdb_typed_value ktv = kvdb_o_get(o, key);
-  if (ktv)
-    {
-      char *r;
-      int len;
+  char *r;
 
-      if (ktv->t == KVDB_BINARY_SMALL)
-        {
-          if ((len=ktv->v.binary_small[0]) &&
-              !ktv->v.binary_small[len])
-            {
-              /* No need to change type, perhaps. */
-              return (char *)ktv->v.binary_small + 1;
-            }
-        }
-      if (ktv->t == KVDB_BINARY && (r = ktv->v.binary.ptr) && (len=ktv->v.binary.ptr_size) > 0)
-        {
-          /* Make sure it ends with '0'; if not, it's probably not a string. */
-          if (r[ktv->v.binary.ptr_size-1] == 0)
-            {
-              ktv->t = KVDB_STRING;
-              ktv->v.s = ktv->v.binary.ptr;
-            }
-          else
-            {
-              KVDEBUG("non-null terminated string?");
-            }
-        }
-      if (ktv->t == KVDB_STRING)
-        return ktv->v.s;
-    }
-  return NULL;
+  _kvdb_o_lock(o);
+  r = _kvdb_o_get_string(o, key);
+  _kvdb_o_unlock(o);
+  return r;
+}
+
+/* The copying getters are the same, except that the value is copied
+ * out before the lock is released. */
+
+bool kvdb_o_copy_int64(kvdb_o o, kvdb_key key, int64_t *value)
+{
+  int64_t *r;
+
+  _kvdb_o_lock(o);
+  r = _kvdb_o_get_int64(o, key);
+  if (r)
+    *value = *r;
+  _kvdb_o_unlock(o);
+  return r != NULL;
+}
+
+char *kvdb_o_copy_string(kvdb_o o, kvdb_key key)
+{
+  char *r;
+
+  _kvdb_o_lock(o);
+  r = _kvdb_o_get_string(o, key);
+  if (r)
+    r = strdup(r);
+  _kvdb_o_unlock(o);
+  return r;
 }
 
 bool kvdb_o_set_int64(kvdb_o o, kvdb_key key, int64_t value)
@@ -510,17 +895,18 @@ bool kvdb_o_set_object(kvdb_o o, kvdb_key key, kvdb_o o2)
   return kvdb_o_set(o, key, &ktv);
 }
 
-bool _kvdb_o_set(kvdb_o o, kvdb_key key,
-                 const kvdb_typed_value value,
-                 kvdb_time_t last_modified)
+static bool _kvdb_o_set_locked(kvdb_o o, kvdb_key key,
+                               const kvdb_typed_value value,
+                               kvdb_time_t last_modified, kvdb_buffer buf)
 {
   /* If the set fails, we don't do anything to the SQL database. */
   kvdb_o_a a;
-  void *p;
-  size_t len;
   bool r;
   bool historic = false;
+  bool ext;
 
+  if (!_kvdb_writable(o->k))
+    return false;
   if (!last_modified)
     last_modified = kvdb_monotonous_time(o->k);
 
@@ -540,6 +926,18 @@ bool _kvdb_o_set(kvdb_o o, kvdb_key key,
           historic = true;
         }
     }
+  else if ((key == o->k->keys[KEY_APP] && o->app)
+           || (key == o->k->keys[KEY_CLASS] && o->cl))
+    {
+      void *name;
+
+      /* App and class never change, so setting them again (e.g. by
+       * an import of overlapping logs) has nothing to record. */
+      _kvdb_tv_get_raw_value(value, &name, NULL);
+      if (strcmp(key == o->k->keys[KEY_APP] ? o->app->name : o->cl->name,
+                 (const char *)name) == 0)
+        return true;
+    }
 
   KVDEBUG("kvdb_o_set %p/%s", o, key->name);
 
@@ -551,7 +949,7 @@ bool _kvdb_o_set(kvdb_o o, kvdb_key key,
           KVDEBUG("index removal failed (how?!?)");
           return false;
         }
-      if (!_o_a_set(o, a, key, value, last_modified))
+      if (!_o_a_set(o, a, key, value, last_modified, buf))
         {
           /* Restore indexes (as if it could work, but we can try) */
           _kvdb_handle_insert_indexes(o, key);
@@ -559,20 +957,35 @@ bool _kvdb_o_set(kvdb_o o, kvdb_key key,
         }
     }
 
-  _kvdb_tv_get_raw_value(value, &p, &len);
-  KVDEBUG("playing with sql %p/%d", p, (int)len);
-  r = _o_set_sql(o, key, p, len, historic, last_modified);
+  ext = value->t == KVDB_BINARY && o->k->blob_dir
+    && o->k->options.blob_threshold > 0
+    && (int64_t)value->v.binary.ptr_size >= o->k->options.blob_threshold;
+  r = _o_set_sql(o, key, value, ext, historic, last_modified);
 
   /* If it succeeded, we may have indexes to update. */
   return r && (historic || _kvdb_handle_insert_indexes(o, key));
 }
 
+bool _kvdb_o_set(kvdb_o o, kvdb_key key,
+                 const kvdb_typed_value value,
+                 kvdb_time_t last_modified, kvdb_buffer buf)
+{
+  bool r;
+
+  _kvdb_o_lock(o);
+  _kvdb_lock(o->k);
+  r = _kvdb_o_set_locked(o, key, value, last_modified, buf);
+  _kvdb_unlock(o->k);
+  _kvdb_o_unlock(o);
+  return r;
+}
+
 bool kvdb_o_set(kvdb_o o, kvdb_key key, const kvdb_typed_value value)
 {
-  return _kvdb_o_set(o, key, value, 0);
+  return _kvdb_o_set(o, key, value, 0, NULL);
 }
 
 kvdb_type kvdb_key_get_type(kvdb_key k)
 {
-  return k->type;
+  return __atomic_load_n(&k->type, __ATOMIC_RELAXED);
 }
@@ -31,6 +31,17 @@ struct kvdb_query_struct {
   kvdb_app app;
   kvdb_class cl;
 
+  /* Probed size of the app_class match (-1 = not probed yet) */
+  int64_t app_class_n;
+
+  /* Pagination; limit 0 = no limit. The cursor is owned by the caller. */
+  int limit;
+  int offset;
+  kvdb_q_cursor cursor;
+
+  /* Match the state as of this time instead (0 = current state) */
+  kvdb_time_t time;
+
   sqlite3_stmt *stmt;
 };
 
@@ -42,6 +53,7 @@ kvdb_query kvdb_create_q(kvdb k)
     return NULL;
   /* Do whatever init is needed here. */
   q->order_by = -1;
+  q->app_class_n = -1;
   q->k = k;
   return q;
 }
@@ -62,6 +74,40 @@ void kvdb_q_set_match_app_class(kvdb_query q, kvdb_app app, kvdb_class cl)
 {
   q->app = app;
   q->cl = cl;
+  q->app_class_n = -1;
+}
+
+void kvdb_q_set_limit(kvdb_query q, int limit, int offset)
+{
+  q->limit = limit;
+  q->offset = offset;
+}
+
+void kvdb_q_set_cursor(kvdb_query q, kvdb_q_cursor c)
+{
+  q->cursor = c;
+}
+
+bool kvdb_q_set_time(kvdb_query q, kvdb_time_t t)
+{
+  kvdb k = q->k;
+  bool r = true;
+
+  /* The past is matched in SQL over the log table, which segment
+   * files leave empty. (Readers do not load the backend, so ask the
+   * database.) */
+  _kvdb_lock(k);
+  if (t && _kvdb_get_int(k, "SELECT value FROM db_state "
+                         "WHERE key='log_backend'",
+                         KVDB_LOG_SQLITE) == KVDB_LOG_SEGMENTS)
+    {
+      _kvdb_set_err(k, "time queries need the log table");
+      r = false;
+    }
+  else
+    q->time = t;
+  _kvdb_unlock(k);
+  return r;
 }
 
 void kvdb_q_add_index(kvdb_query q, kvdb_index idx,
@@ -76,7 +122,8 @@ void kvdb_q_add_index(kvdb_query q, kvdb_index idx,
   q->bound2[i] = *end;
 }
 
-void kvdb_q_order_by(kvdb_query q, kvdb_index idx, bool ascending)
+/* Find index within the query; add it (without bounds) if missing. */
+static int _q_get_index(kvdb_query q, kvdb_index idx)
 {
   int i;
 
@@ -89,7 +136,12 @@ void kvdb_q_order_by(kvdb_query q, kvdb_index idx, bool ascending)
       memset(&s, 0, sizeof(s));
       kvdb_q_add_index(q, idx, &s, NULL);
     }
-  q->order_by = i;
+  return i;
+}
+
+void kvdb_q_order_by(kvdb_query q, kvdb_index idx, bool ascending)
+{
+  q->order_by = _q_get_index(q, idx);
   q->order_by_asc = ascending;
 }
 
@@ -161,101 +213,530 @@ static char *_sql_dump(char *buf, kvdb_typed_value tv)
 
 #define SQL_BOUND(tv) _sql_dump(alloca(_sql_bound_size(tv)), tv)
 
+/* Quoted string literal (e.g. key names, which may contain anything) */
+#define SQL_STRING_SIZE(s) (2 * strlen(s) + 3)
+#define SQL_STRING(s) \
+  sqlite3_snprintf(SQL_STRING_SIZE(s), alloca(SQL_STRING_SIZE(s)), "%Q", s)
+
 #define WHERE_OR_AND()          \
 do                              \
   {                             \
     if (first)                  \
       {                         \
-        APPEND("WHERE ");       \
+        APPEND2(e, "WHERE ");   \
         first = false;          \
       }                         \
     else                        \
-      APPEND("AND ");           \
+      APPEND2(e, "AND ");       \
   } while(0)
 
-kvdb_o kvdb_q_get_next(kvdb_query q)
+/* Query planning.
+ *
+ * Every index in the query, and the app_class match, is a source of
+ * oids. The one expected to produce the fewest rows drives the query,
+ * and the rest are only probed by oid (through their oid indexes),
+ * which amounts to intersecting the oid sets. The order is forced on
+ * SQLite with CROSS JOIN.
+ *
+ * Estimates come from a capped probe of the actual index (exact for
+ * selective criteria, which are the ones that matter), and the
+ * statistics gathered by kvdb_analyze for the rest. The latest probe
+ * of an index is kept within it, and reused for the same bounds until
+ * the index has changed too much for it to be accurate. */
+
+/* How many rows a probe looks at, at most. */
+#define PLAN_PROBE_LIMIT 1000
+
+/* How many index rows may change before a probe is redone. */
+#define PLAN_PROBE_REUSE (PLAN_PROBE_LIMIT / 10)
+
+/* Pseudo-index number used for the app_class match. */
+#define PLAN_APP_CLASS -1
+
+typedef struct {
+  int i;
+  int64_t estimate;
+} kvdb_plan_source_s;
+
+static const char *_q_alias(int i, char *buf)
 {
-  kvdb k;
+  if (i == PLAN_APP_CLASS)
+    strcpy(buf, "app_class");
+  else
+    sprintf(buf, "i%d", i);
+  return buf;
+}
 
-  if (!q)
-    return NULL;
-  k = q->k;
-  if (!q->stmt)
+/* Bounds of index #i on the keyish column col. */
+static char *_q_append_bound(kvdb_query q, int i, const char *col,
+                             char *c, char *e)
+{
+  if (_kvdb_tv_cmp(&q->bound1[i], &q->bound2[i]) == 0)
     {
-      char buf[512];
-      char *c = buf;
-      int i;
+      APPEND2(e, "%s=%s ", col, SQL_BOUND(&q->bound1[i]));
+    }
+  else
+    {
+      APPEND2(e, "%s>=%s ", col, SQL_BOUND(&q->bound1[i]));
+      APPEND2(e, "AND ");
+      APPEND2(e, "%s<=%s ", col, SQL_BOUND(&q->bound2[i]));
+    }
+  return c;
+ err:
+  return NULL;
+}
+
+/* Count rows of table matching where, up to PLAN_PROBE_LIMIT. */
+static int64_t _q_probe_table(kvdb k, const char *table, const char *where)
+{
+  char buf[512];
+  char *c = buf;
+  sqlite3_stmt *stmt;
+  int64_t n = -1;
+
+  APPEND("SELECT count(*) FROM (SELECT 1 FROM %s WHERE %sLIMIT %d)",
+         table, where, PLAN_PROBE_LIMIT);
+  KVDEBUG("probing with %s", buf);
+  SQLITE_CALLR2(sqlite3_prepare_v2(k->db, buf, -1, &stmt, NULL), -1);
+  if (sqlite3_step(stmt) == SQLITE_ROW)
+    n = sqlite3_column_int64(stmt, 0);
+  sqlite3_finalize(stmt);
+ err:
+  return n;
+}
 
-      /* Start the query. */
-      if (q->first_free_index == 0)
+static int64_t _q_probe(kvdb_query q, int i)
+{
+  char table[KVDB_INDEX_NAME_SIZE + 8];
+  char where[512];
+  kvdb_index idx;
+  int64_t n;
+
+  if (i == PLAN_APP_CLASS)
+    {
+      if (q->app_class_n < 0)
         {
-          if (q->app && q->cl)
-            {
-              /* Just match app + class == select from app_class. */
-              APPEND("SELECT oid FROM app_class WHERE ");
-              APPEND("app='%s' AND class='%s'", q->app->name, q->cl->name);
-            }
-          else
-            {
-              /* Trivial case - just ALL oids in database */
-              strcpy(buf, "SELECT DISTINCT oid FROM cs");
-            }
+          sprintf(where, "app_id=%lld AND class_id=%lld ",
+                  (long long) q->app->id, (long long) q->cl->id);
+          q->app_class_n = _q_probe_table(q->k, "app_class", where);
+        }
+      return q->app_class_n;
+    }
+  idx = q->i[i];
+  if (!_q_append_bound(q, i, "keyish", where, where + sizeof(where)))
+    return -1;
+  if (idx->probe_n >= 0
+      && idx->changes - idx->probe_changes < PLAN_PROBE_REUSE
+      && !strcmp(idx->probe_bounds, where))
+    return idx->probe_n;
+  sprintf(table, "s_%s", idx->name);
+  n = _q_probe_table(q->k, table, where);
+  if (n >= 0 && strlen(where) < sizeof(idx->probe_bounds))
+    {
+      strcpy(idx->probe_bounds, where);
+      idx->probe_n = n;
+      idx->probe_changes = idx->changes;
+    }
+  return n;
+}
+
+static int64_t _q_estimate(kvdb_query q, int i)
+{
+  kvdb_index idx;
+  int64_t n, h;
+
+  if (i != PLAN_APP_CLASS && q->bound1[i].t == KVDB_NULL)
+    {
+      /* Ordering-only index; matches everything it contains. */
+      idx = q->i[i];
+      return idx->rows >= 0 ? idx->rows : INT64_MAX;
+    }
+  n = _q_probe(q, i);
+  if (n < 0)
+    return INT64_MAX;
+  if (n < PLAN_PROBE_LIMIT || i == PLAN_APP_CLASS)
+    return n;
+  /* The probe saturated; the histogram (if any) knows better. */
+  idx = q->i[i];
+  if (q->bound1[i].t == KVDB_INTEGER && q->bound2[i].t == KVDB_INTEGER)
+    {
+      h = _kvdb_index_estimate_range(idx,
+                                     q->bound1[i].v.i, q->bound2[i].v.i);
+      if (h > n)
+        return h;
+    }
+  return n;
+}
+
+/* Fill src with the sources of the query, cheapest first. */
+static int _q_plan(kvdb_query q, kvdb_plan_source_s *src)
+{
+  int n = 0;
+  int i, j;
+
+  for (i = 0 ; i < q->first_free_index ; i++)
+    src[n++].i = i;
+  if (q->app && q->cl)
+    src[n++].i = PLAN_APP_CLASS;
+  for (i = 0 ; i < n ; i++)
+    src[i].estimate = n > 1 ? _q_estimate(q, src[i].i) : 0;
+
+  /* Stable insertion sort; ties keep the order indexes were added in. */
+  for (i = 1 ; i < n ; i++)
+    {
+      kvdb_plan_source_s s = src[i];
+
+      for (j = i ; j > 0 && src[j - 1].estimate > s.estimate ; j--)
+        src[j] = src[j - 1];
+      src[j] = s;
+    }
+  for (i = 0 ; i < n ; i++)
+    KVDEBUG("plan #%d: source %d, estimate %lld",
+            i, src[i].i, (long long) src[i].estimate);
+  return n;
+}
+
+/* Which source would drive the query now: the index number within
+ * it, or -1 for the app_class match (or if there are no sources). */
+int _kvdb_q_driver(kvdb_query q)
+{
+  kvdb_plan_source_s src[MAX_INDEXES + 1];
+  int r = -1;
+
+  _kvdb_lock(q->k);
+  if (_q_plan(q, src))
+    r = src[0].i;
+  _kvdb_unlock(q->k);
+  return r;
+}
+
+/* Produce the SQL for the query. What is selected depends on what;
+ * either oids of the matching objects (QUERY_OIDS), or one of the
+ * aggregate functions over index #what_i. */
+
+#define QUERY_OIDS -1
+
+/* The keyish of index #i of object alias.oid as of the query time, or
+ * NULL if it had no value (of the right type) then; the search index
+ * tables have just the current ones, so it comes from the log (as in
+ * kvdb_o_get_at). */
+static char *_q_append_keyish_at(kvdb_query q, int i, const char *alias,
+                                 char *c, char *e)
+{
+  kvdb_index idx = q->i[i];
+
+  APPEND2(e, "(SELECT CASE ");
+  if (idx->type == KVDB_INTEGER_INDEX)
+    APPEND2(e, "WHEN type=%d THEN value "
+            "WHEN type IS NULL AND length(value)=%d THEN kvdb_int64(value) ",
+            KVDB_INTEGER, (int) sizeof(int64_t));
+  else
+    APPEND2(e, "WHEN (type=%d OR type IS NULL) AND length(value)=%d "
+            "THEN value ", KVDB_OBJECT, (int) KVDB_OID_SIZE);
+  APPEND2(e, "END FROM log WHERE oid=%s.oid AND key=%s "
+          "AND last_modified<=%lld "
+          "ORDER BY last_modified DESC, rowid DESC LIMIT 1) ",
+          alias, SQL_STRING(idx->key->name), (long long) q->time);
+  return c;
+ err:
+  return NULL;
+}
+
+/* As of q->time. Candidates are objects of the app and class, or
+ * ones that have a value for the key of the first index (every object
+ * that has ever had one has a cs row for it); their keyish as of then
+ * (h<index>) is computed for every index, and matched as usual. The
+ * search indexes are of no help here, so there is no planning. */
+static bool _q_build_sql_at(kvdb_query q, int what, int what_i,
+                            char *buf, size_t size)
+{
+  char *c = buf;
+  char *e = buf + size;
+  kvdb_q_cursor cursor = what == QUERY_OIDS ? q->cursor : NULL;
+  struct kvdb_typed_value_struct cursor_oid;
+  bool first = true;
+  int i;
+
+  if (cursor && cursor->valid)
+    kvdb_tv_set_oid(&cursor_oid, &cursor->oid);
+  switch (what)
+    {
+    case QUERY_OIDS:
+      APPEND2(e, "SELECT oid");
+      if (cursor && q->order_by >= 0)
+        APPEND2(e, ", h%d", q->order_by);
+      break;
+    case KVDB_AGGREGATE_COUNT:
+      APPEND2(e, "SELECT count(*)");
+      break;
+    default:
+      APPEND2(e, "SELECT %s(h%d)",
+              (what == KVDB_AGGREGATE_MIN ? "min"
+               : what == KVDB_AGGREGATE_MAX ? "max"
+               : what == KVDB_AGGREGATE_SUM ? "sum"
+               : "avg"), what_i);
+      break;
+    }
+  APPEND2(e, " FROM (SELECT s.oid AS oid");
+  for (i = 0 ; i < q->first_free_index ; i++)
+    {
+      APPEND2(e, ", ");
+      if (!(c = _q_append_keyish_at(q, i, "s", c, e)))
+        goto err;
+      APPEND2(e, "AS h%d", i);
+    }
+  if (q->app && q->cl)
+    APPEND2(e, " FROM app_class s WHERE app_id=%lld AND class_id=%lld "
+            "AND EXISTS (SELECT 1 FROM log WHERE oid=s.oid "
+            "AND key='" CLASS_STRING "' AND last_modified<=%lld)) ",
+            (long long) q->app->id, (long long) q->cl->id,
+            (long long) q->time);
+  else if (q->first_free_index)
+    APPEND2(e, " FROM cs s WHERE key=%s) ",
+            SQL_STRING(q->i[0]->key->name));
+  else
+    APPEND2(e, " FROM (SELECT DISTINCT oid FROM cs) s "
+            "WHERE EXISTS (SELECT 1 FROM log WHERE oid=s.oid "
+            "AND last_modified<=%lld)) ", (long long) q->time);
+
+  /* Having no value then does not match, as with the current state. */
+  for (i = 0 ; i < q->first_free_index ; i++)
+    {
+      char col[32];
+
+      WHERE_OR_AND();
+      APPEND2(e, "h%d IS NOT NULL ", i);
+      sprintf(col, "h%d", i);
+      if (q->bound1[i].t != KVDB_NULL)
+        {
+          APPEND2(e, "AND ");
+          if (!(c = _q_append_bound(q, i, col, c, e)))
+            goto err;
+        }
+    }
+  if (cursor && q->order_by >= 0)
+    {
+      const char *op = q->order_by_asc ? ">" : "<";
+
+      if (cursor->valid)
+        {
+          WHERE_OR_AND();
+          APPEND2(e, "(h%d%s%s ", q->order_by, op,
+                  SQL_BOUND(&cursor->keyish));
+          APPEND2(e, "OR (h%d=%s ", q->order_by,
+                  SQL_BOUND(&cursor->keyish));
+          APPEND2(e, "AND oid%s%s)) ", op, SQL_BOUND(&cursor_oid));
+        }
+      APPEND2(e, "ORDER BY h%d %s, oid %s ", q->order_by,
+              q->order_by_asc ? "ASC" : "DESC",
+              q->order_by_asc ? "ASC" : "DESC");
+    }
+  else if (cursor)
+    {
+      if (cursor->valid)
+        {
+          WHERE_OR_AND();
+          APPEND2(e, "oid>%s ", SQL_BOUND(&cursor_oid));
+        }
+      APPEND2(e, "ORDER BY oid ");
+    }
+  else if (q->order_by >= 0 && what == QUERY_OIDS)
+    APPEND2(e, "ORDER BY h%d %s ", q->order_by,
+            q->order_by_asc ? "ASC" : "DESC");
+  if (q->limit > 0 && what == QUERY_OIDS)
+    APPEND2(e, "LIMIT %d OFFSET %d", q->limit, q->offset);
+  return true;
+ err:
+  return false;
+}
+
+static bool _q_build_sql(kvdb_query q, int what, int what_i,
+                         char *buf, size_t size)
+{
+  char *c = buf;
+  char *e = buf + size;
+  const char *sel;
+  /* Limit and cursor apply only when listing objects. */
+  kvdb_q_cursor cursor = what == QUERY_OIDS ? q->cursor : NULL;
+  struct kvdb_typed_value_struct cursor_oid;
+  bool first = true;
+
+  if (q->time)
+    return _q_build_sql_at(q, what, what_i, buf, size);
+  if (cursor && cursor->valid)
+    kvdb_tv_set_oid(&cursor_oid, &cursor->oid);
+  if (q->first_free_index == 0)
+    {
+      KVASSERT(what == QUERY_OIDS || what == KVDB_AGGREGATE_COUNT,
+               "aggregate over nothing");
+      if (q->app && q->cl)
+        {
+          /* Just match app + class == select from app_class. */
+          APPEND2(e, "SELECT %s FROM app_class WHERE ",
+                  what == QUERY_OIDS ? "oid" : "count(*)");
+          APPEND2(e, "app_id=%lld AND class_id=%lld ",
+             (long long) q->app->id, (long long) q->cl->id);
+          first = false;
         }
       else
         {
-          /* Somewhat more complex cases; there may be criteria, or
-           * ordering.. */
-          APPEND("SELECT i0.oid FROM ");
-          for (i = 0 ; i < q->first_free_index ; i++)
-            {
-              if (i)
-                APPEND(", ");
-              APPEND("s_%s i%d ", q->i[i]->name, i);
-            }
-          if (q->app && q->cl)
-            {
-              APPEND(", app_class ");
-            }
-          bool first = true;
-          for (i = 0 ; i < q->first_free_index ; i++)
-            {
-              /* No need to insert criteria for first null index */
-              if (i == 0 && q->bound1[i].t == KVDB_NULL)
-                continue;
-              if (q->bound1[i].t != KVDB_NULL)
-                {
-                  WHERE_OR_AND();
-                  if (_kvdb_tv_cmp(&q->bound1[i], &q->bound2[i]) == 0)
-                    {
-                      APPEND("i%d.keyish=%s ", i, SQL_BOUND(&q->bound1[i]));
-                    }
-                  else
-                    {
-                      APPEND("i%d.keyish>=%s ", i, SQL_BOUND(&q->bound1[i]));
-                      APPEND("AND ");
-                      APPEND("i%d.keyish<=%s ", i, SQL_BOUND(&q->bound2[i]));
-                    }
-                }
-              if (i)
-                {
-                  WHERE_OR_AND();
-                  APPEND("i0.oid=i%d.oid ", i);
-                }
-            }
-          if (q->app && q->cl)
+          /* Trivial case - just ALL oids in database */
+          APPEND2(e, "SELECT %s FROM cs ",
+                  what == QUERY_OIDS ? "DISTINCT oid" : "count(DISTINCT oid)");
+        }
+      /* Both have an index starting with (or after app+class
+       * equality) oid, so resuming from cursor is a seek. */
+      if (cursor)
+        {
+          if (cursor->valid)
             {
               WHERE_OR_AND();
-              APPEND("app='%s' AND class='%s' ", q->app->name, q->cl->name);
-              APPEND("AND ");
-              APPEND("i0.oid==app_class.oid ");
-            }
-          if (q->order_by >= 0)
-            {
-              APPEND(" ORDER BY i%d.keyish %s",
-                     q->order_by,
-                     q->order_by_asc ? "ASC" : "DESC");
+              APPEND2(e, "oid>%s ", SQL_BOUND(&cursor_oid));
             }
+          APPEND2(e, "ORDER BY oid ");
+        }
+      goto tail;
+    }
+
+  /* Somewhat more complex cases; there may be criteria, or
+   * ordering.. */
+  kvdb_plan_source_s src[MAX_INDEXES + 1];
+  char alias[16], drv_alias[16];
+  int i, j, n;
+
+  n = _q_plan(q, src);
+  _q_alias(src[0].i, drv_alias);
+  switch (what)
+    {
+    case QUERY_OIDS:
+      APPEND2(e, "SELECT %s.oid", drv_alias);
+      /* The cursor needs the ordering keyish too. */
+      if (cursor && q->order_by >= 0)
+        APPEND2(e, ", i%d.keyish", q->order_by);
+      APPEND2(e, " FROM ");
+      break;
+    case KVDB_AGGREGATE_COUNT:
+      APPEND2(e, "SELECT count(*) FROM ");
+      break;
+    default:
+      sel = (what == KVDB_AGGREGATE_MIN ? "min"
+             : what == KVDB_AGGREGATE_MAX ? "max"
+             : what == KVDB_AGGREGATE_SUM ? "sum"
+             : "avg");
+      APPEND2(e, "SELECT %s(i%d.keyish) FROM ", sel, what_i);
+      break;
+    }
+  for (j = 0 ; j < n ; j++)
+    {
+      if (j)
+        APPEND2(e, "CROSS JOIN ");
+      if (src[j].i == PLAN_APP_CLASS)
+        APPEND2(e, "app_class ");
+      else
+        APPEND2(e, "s_%s i%d ", q->i[src[j].i]->name, src[j].i);
+    }
+  for (j = 0 ; j < n ; j++)
+    {
+      i = src[j].i;
+      if (i == PLAN_APP_CLASS)
+        {
+          WHERE_OR_AND();
+          APPEND2(e, "app_id=%lld AND class_id=%lld ",
+                  (long long) q->app->id, (long long) q->cl->id);
+        }
+      else if (q->bound1[i].t != KVDB_NULL)
+        {
+          char col[32];
+
+          WHERE_OR_AND();
+          sprintf(col, "i%d.keyish", i);
+          if (!(c = _q_append_bound(q, i, col, c, e)))
+            goto err;
+        }
+      if (j)
+        {
+          WHERE_OR_AND();
+          APPEND2(e, "%s.oid=%s.oid ", _q_alias(i, alias), drv_alias);
+        }
+    }
+  if (cursor && q->order_by >= 0)
+    {
+      /* Keyset pagination: continue after (keyish, oid) of the
+       * cursor, in the same order. */
+      const char *op = q->order_by_asc ? ">" : "<";
+
+      if (cursor->valid)
+        {
+          WHERE_OR_AND();
+          APPEND2(e, "(i%d.keyish%s%s ", q->order_by, op,
+                  SQL_BOUND(&cursor->keyish));
+          APPEND2(e, "OR (i%d.keyish=%s ", q->order_by,
+                  SQL_BOUND(&cursor->keyish));
+          APPEND2(e, "AND i%d.oid%s%s)) ", q->order_by, op,
+                  SQL_BOUND(&cursor_oid));
+        }
+      APPEND2(e, "ORDER BY i%d.keyish %s, i%d.oid %s ",
+              q->order_by, q->order_by_asc ? "ASC" : "DESC",
+              q->order_by, q->order_by_asc ? "ASC" : "DESC");
+    }
+  else if (cursor)
+    {
+      if (cursor->valid)
+        {
+          WHERE_OR_AND();
+          APPEND2(e, "%s.oid>%s ", drv_alias, SQL_BOUND(&cursor_oid));
+        }
+      APPEND2(e, "ORDER BY %s.oid ", drv_alias);
+    }
+  else if (q->order_by >= 0 && what == QUERY_OIDS)
+    {
+      APPEND2(e, " ORDER BY i%d.keyish %s",
+              q->order_by,
+              q->order_by_asc ? "ASC" : "DESC");
+    }
+ tail:
+  if (q->limit > 0 && what == QUERY_OIDS)
+    APPEND2(e, " LIMIT %d OFFSET %d", q->limit, q->offset);
+  return true;
+ err:
+  return false;
+}
+
+/* Record the current row of the query within the cursor. */
+static void _q_update_cursor(kvdb_query q, void *oid)
+{
+  kvdb_q_cursor cursor = q->cursor;
+
+  memcpy(&cursor->oid, oid, KVDB_OID_SIZE);
+  cursor->keyish.t = KVDB_NULL;
+  if (sqlite3_column_count(q->stmt) > 1)
+    {
+      if (sqlite3_column_type(q->stmt, 1) == SQLITE_INTEGER)
+        kvdb_tv_set_int64(&cursor->keyish,
+                          sqlite3_column_int64(q->stmt, 1));
+      else
+        {
+          int len = sqlite3_column_bytes(q->stmt, 1);
+
+          KVASSERT(len <= KVDB_BINARY_SMALL_SIZE, "too long keyish");
+          _kvdb_tv_set_binary(&cursor->keyish,
+                              (void *)sqlite3_column_blob(q->stmt, 1), len);
         }
+    }
+  cursor->valid = true;
+}
+
+/* Step the query; true (and the oid) if there was a result. */
+static bool _q_step(kvdb_query q, kvdb_oid oid)
+{
+  kvdb k = q->k;
+
+  if (!q->stmt)
+    {
+      char buf[2048];
+
+      if (!_q_build_sql(q, QUERY_OIDS, 0, buf, sizeof(buf)))
+        goto err;
       KVDEBUG("produced query %s", buf);
       SQLITE_CALL2(sqlite3_prepare_v2(k->db, buf, -1, &q->stmt, NULL),
                    goto err);
@@ -263,7 +744,7 @@ kvdb_o kvdb_q_get_next(kvdb_query q)
   int rc = sqlite3_step(q->stmt);
   if (rc == SQLITE_ROW)
     {
-      KVASSERT(sqlite3_column_count(q->stmt)==1, "weird stmt count");
+      KVASSERT(sqlite3_column_count(q->stmt)>=1, "weird stmt count");
       int len = sqlite3_column_bytes(q->stmt, 0);
       void *p = (void *)sqlite3_column_blob(q->stmt, 0);
       if (len != KVDB_OID_SIZE)
@@ -271,8 +752,10 @@ kvdb_o kvdb_q_get_next(kvdb_query q)
           KVDEBUG("weird sized oid");
           goto err;
         }
-      KVDEBUG("fetching oid");
-      return kvdb_get_o_by_id(k, p);
+      if (q->cursor)
+        _q_update_cursor(q, p);
+      memcpy(oid, p, KVDB_OID_SIZE);
+      return true;
     }
   else if (rc == SQLITE_DONE)
     {
@@ -283,12 +766,126 @@ kvdb_o kvdb_q_get_next(kvdb_query q)
       _kvdb_set_err_from_sqlite2(k, "query");
     }
  err:
+  return false;
+}
+
+kvdb_o kvdb_q_get_next(kvdb_query q)
+{
+  struct kvdb_oid_struct oid;
+  kvdb k;
+  bool r;
+
+  if (!q)
+    return NULL;
+  k = q->k;
+  /* The object is fetched only once the connection is released; see
+   * the lock order in kvdb_i.h. */
+  _kvdb_lock(k);
+  r = _q_step(q, &oid);
+  _kvdb_unlock(k);
+  if (r)
+    {
+      KVDEBUG("fetching oid");
+      return kvdb_get_o_by_id(k, &oid);
+    }
   kvdb_q_destroy(q);
   return NULL;
 }
 
+static bool _q_aggregate_locked(kvdb_query q, int what, int what_i,
+                                kvdb_typed_value result)
+{
+  kvdb k = q->k;
+  sqlite3_stmt *stmt;
+  char buf[2048];
+  int rc;
+
+  if (!_q_build_sql(q, what, what_i, buf, sizeof(buf)))
+    return false;
+  KVDEBUG("produced aggregate query %s", buf);
+  SQLITE_CALL(sqlite3_prepare_v2(k->db, buf, -1, &stmt, NULL));
+  rc = sqlite3_step(stmt);
+  if (rc != SQLITE_ROW)
+    {
+      _kvdb_set_err_from_sqlite2(k, "aggregate query");
+      sqlite3_finalize(stmt);
+      return false;
+    }
+  if (sqlite3_column_type(stmt, 0) == SQLITE_NULL)
+    result->t = KVDB_NULL;
+  else if (what == KVDB_AGGREGATE_AVG)
+    {
+      result->t = KVDB_DOUBLE;
+      result->v.d = sqlite3_column_double(stmt, 0);
+    }
+  else
+    kvdb_tv_set_int64(result, sqlite3_column_int64(stmt, 0));
+  sqlite3_finalize(stmt);
+  return true;
+}
+
+static bool _q_aggregate(kvdb_query q, int what, int what_i,
+                         kvdb_typed_value result)
+{
+  bool r;
+
+  _kvdb_lock(q->k);
+  r = _q_aggregate_locked(q, what, what_i, result);
+  _kvdb_unlock(q->k);
+  return r;
+}
+
+bool kvdb_q_count(kvdb_query q, int64_t *count)
+{
+  struct kvdb_typed_value_struct tv;
+
+  if (!_q_aggregate(q, KVDB_AGGREGATE_COUNT, 0, &tv))
+    return false;
+  *count = tv.v.i;
+  return true;
+}
+
+bool kvdb_q_aggregate(kvdb_query q, kvdb_index idx, kvdb_aggregate_type t,
+                      kvdb_typed_value result)
+{
+  kvdb k = q->k;
+  int i;
+  bool r;
+
+  if (t == KVDB_AGGREGATE_COUNT)
+    return _q_aggregate(q, t, 0, result);
+  if (idx->type != KVDB_INTEGER_INDEX)
+    {
+      _kvdb_lock(k);
+      _kvdb_set_err(k, "aggregate over non-integer index");
+      _kvdb_unlock(k);
+      return false;
+    }
+  for (i = 0 ; i < q->first_free_index ; i++)
+    if (q->i[i] == idx)
+      return _q_aggregate(q, t, i, result);
+
+  /* Add the index (without bounds) just for this. */
+  if (i == MAX_INDEXES)
+    {
+      _kvdb_lock(k);
+      _kvdb_set_err(k, "too many indexes in query for aggregate");
+      _kvdb_unlock(k);
+      return false;
+    }
+  memset(&q->bound1[i], 0, sizeof(q->bound1[i]));
+  q->bound2[i] = q->bound1[i];
+  q->i[i] = idx;
+  q->first_free_index++;
+  r = _q_aggregate(q, t, i, result);
+  q->first_free_index--;
+  return r;
+}
+
 void kvdb_q_destroy(kvdb_query q)
 {
+  _kvdb_lock(q->k);
   sqlite3_finalize(q->stmt);
+  _kvdb_unlock(q->k);
   free(q);
 }
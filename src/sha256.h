@@ -0,0 +1,35 @@
+/*
+ * $Id: sha256.h $
+ *
+ * Author: Markus Stenberg <fingon@iki.fi>
+ *
+ * Copyright (c) 2013 Markus Stenberg
+ *
+ */
+
+#ifndef SHA256_H
+#define SHA256_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Plain (FIPS 180-4) SHA-256, used to name content-addressed blobs
+ * (see kvdb_blob.c). */
+
+#define SHA256_SIZE 32
+
+typedef struct {
+  uint32_t h[8];
+  uint64_t len;
+  unsigned char buf[64];
+  size_t buf_len;
+} sha256_ctx;
+
+void sha256_init(sha256_ctx *c);
+void sha256_update(sha256_ctx *c, const void *p, size_t len);
+void sha256_final(sha256_ctx *c, unsigned char digest[SHA256_SIZE]);
+
+/* All of the above at once. */
+void sha256(const void *p, size_t len, unsigned char digest[SHA256_SIZE]);
+
+#endif /* SHA256_H */
@@ -12,33 +12,64 @@
  */
 
 #include "stringset.h"
-#include "ihash.h"
 #include "util.h"
 #include <string.h>
+#include <pthread.h>
 #include <libubox/utils.h>
 
+/* Lookups do not lock at all: the table is an open addressing
+ * (linear probing) array of entry pointers, and both the slots and
+ * the table pointer are only ever written with release semantics,
+ * once what they point at is complete. Entries are never removed.
+ * Inserts are serialized by the lock; when a table fills up, a copy
+ * twice its size is published instead, and the old one is kept
+ * around (readers may still be using it) until destroy. */
+
+#define INITIAL_SIZE 16
+
+/* Grow when more than 3/4 full */
+#define FULL(t) ((t)->used * 4 >= (t)->size * 3)
+
+typedef struct stringset_table_struct {
+  /* Retired tables (the current one is not on this list) */
+  struct stringset_table_struct *next;
+  size_t size;
+  size_t used;
+  void *slots[];
+} *stringset_table;
+
 struct stringset_struct {
-  ihash ih;
+  stringset_table table;
+  stringset_table retired;
+  pthread_mutex_t lock;
   int extra_data_len;
   stringset_produce_extra_data_callback cb;
   void *ctx;
 };
 
-
-static uint64_t _string_hash(void *o, void *ctx)
+static stringset_table _table_create(size_t size)
 {
-  stringset ss = ctx;
-  const char *s = (const char *) o + ss->extra_data_len;
-  return hash_string(s);
+  stringset_table t = calloc(1, sizeof(*t) + size * sizeof(void *));
+
+  if (t)
+    t->size = size;
+  return t;
 }
 
-static bool _string_equal(void *o1, void *o2, void *ctx)
+/* Slot where s is, or where it would go */
+static void **_table_find(stringset ss, stringset_table t, const char *s)
 {
-  if (o1 == o2) return true;
-  stringset ss = ctx;
-  const char *s1 = (const char *) o1 + ss->extra_data_len;
-  const char *s2 = (const char *) o2 + ss->extra_data_len;
-  return strcmp(s1, s2) == 0;
+  size_t mask = t->size - 1;
+  size_t i = hash_string(s) & mask;
+  void *p;
+
+  while ((p = __atomic_load_n(&t->slots[i], __ATOMIC_ACQUIRE)))
+    {
+      if (strcmp((const char *)p + ss->extra_data_len, s) == 0)
+        break;
+      i = (i + 1) & mask;
+    }
+  return &t->slots[i];
 }
 
 stringset stringset_create(int extra_data_len,
@@ -50,49 +81,90 @@ stringset stringset_create(int extra_data_len,
   ss->extra_data_len = extra_data_len;
   ss->cb = cb;
   ss->ctx = ctx;
-  ss->ih = ihash_create(_string_hash, _string_equal, ss);
-  if (!ss->ih)
+  ss->table = _table_create(INITIAL_SIZE);
+  if (!ss->table)
     {
       free(ss);
       return NULL;
     }
+  pthread_mutex_init(&ss->lock, NULL);
   return ss;
 }
 
-static bool _free_string(void *o, void *context)
-{
-  free(o);
-  return true;
-}
-
 void stringset_destroy(stringset ss)
 {
-  ihash_iterate(ss->ih, _free_string, NULL);
-  ihash_destroy(ss->ih);
+  stringset_table t = ss->table, nt;
+  size_t i;
+
+  for (i = 0 ; i < t->size ; i++)
+    if (t->slots[i])
+      free(t->slots[i]);
+  free(t);
+  for (t = ss->retired ; t ; t = nt)
+    {
+      nt = t->next;
+      free(t);
+    }
+  pthread_mutex_destroy(&ss->lock);
   free(ss);
 }
 
 const char *stringset_get(stringset ss, const char *s)
 {
-  void *r = ihash_get(ss->ih, (void *)s - ss->extra_data_len);
+  stringset_table t = __atomic_load_n(&ss->table, __ATOMIC_ACQUIRE);
+  void *r = __atomic_load_n(_table_find(ss, t, s), __ATOMIC_ACQUIRE);
   return r ? ((const char *)r + ss->extra_data_len) : NULL;
 }
 
+/* Replace the table with one twice the size. Called with lock held. */
+static bool _grow(stringset ss)
+{
+  stringset_table t = ss->table;
+  stringset_table nt = _table_create(t->size * 2);
+  size_t i;
+
+  if (!nt)
+    return false;
+  for (i = 0 ; i < t->size ; i++)
+    if (t->slots[i])
+      {
+        *_table_find(ss, nt, (const char *)t->slots[i] + ss->extra_data_len)
+          = t->slots[i];
+        nt->used++;
+      }
+  t->next = ss->retired;
+  ss->retired = t;
+  __atomic_store_n(&ss->table, nt, __ATOMIC_RELEASE);
+  return true;
+}
+
 const char *stringset_get_or_insert(stringset ss, const char *s)
 {
   const char *r = stringset_get(ss, s);
+  void **slot;
   if (r) return r;
+  pthread_mutex_lock(&ss->lock);
+  /* Someone else may have inserted it meanwhile. */
+  if ((r = stringset_get(ss, s)))
+    goto done;
+  if (FULL(ss->table) && !_grow(ss))
+    goto done;
   void *p = malloc(ss->extra_data_len + strlen(s) + 1);
+  if (!p) goto done;
   char *ns = p + ss->extra_data_len;
-  if (!p) return NULL;
   if (ss->extra_data_len)
     memset(p, 0, ss->extra_data_len);
   strcpy(ns, s);
-  /* Call the callback if any */
+  /* Call the callback if any (before anyone else can see the string) */
   if (ss->cb)
     ss->cb(ns, ss->ctx);
-  ss->ih = ihash_insert(ss->ih, p);
-  return ns;
+  slot = _table_find(ss, ss->table, ns);
+  __atomic_store_n(slot, p, __ATOMIC_RELEASE);
+  ss->table->used++;
+  r = ns;
+ done:
+  pthread_mutex_unlock(&ss->lock);
+  return r;
 }
 
 void *stringset_get_data_from_string(stringset ss, const char *s)
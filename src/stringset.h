@@ -17,7 +17,13 @@
 /* This module provides for internalized set of strings. By having
    these, there is no need to handle allocation or freeing of these
    strings; they are 'always' valid for the lifetime of the string
-   set. */
+   set.
+
+   Stringsets may be used from multiple threads at once. Lookups of
+   strings that are already in the set never lock (or contend); only
+   insertion of new ones is serialized. The callback is called
+   (under the insertion lock) before the string becomes visible to
+   others. */
 
 typedef struct stringset_struct *stringset;
 
@@ -27,7 +33,7 @@ stringset stringset_create(int extra_data_len,
                            stringset_produce_extra_data_callback cb,
                            void *Ctx);
 
-void stringset_destroy();
+void stringset_destroy(stringset ss);
 const char *stringset_get(stringset ss, const char *s);
 const char *stringset_get_or_insert(stringset ss, const char *s);
 
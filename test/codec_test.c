@@ -107,6 +107,63 @@ static void test_endecode_s64(int64_t v, int buf_bytes,
     }
 }
 
+/* Back-to-back varints of every length, decoded with (and without)
+ * plenty of buffer left after each. */
+static void test_decode_stream(void)
+{
+  unsigned char buf[256];
+  unsigned char *c = buf;
+  ssize_t left = sizeof(buf);
+  uint64_t values[24], v;
+  int i, n = 0;
+
+  for (i = 0 ; i < 64 ; i += VARINT_BITS_PER_BYTE)
+    {
+      values[n++] = ((uint64_t)1 << i) - 1;
+      values[n++] = (uint64_t)1 << i;
+    }
+  values[n++] = UINT64_MAX;
+  for (i = 0 ; i < n ; i++)
+    encode_varint_u64(values[i], &c, &left);
+  KVASSERT(left > 0, "out of buffer");
+  left = c - buf;
+  c = buf;
+  for (i = 0 ; i < n ; i++)
+    {
+      KVASSERT(decode_varint_u64(&c, &left, &v), "decode %d failed", i);
+      KVASSERT(v == values[i], "wrong value %d", i);
+    }
+  KVASSERT(!left, "leftovers");
+  KVASSERT(!decode_varint_u64(&c, &left, &v), "decoded nothing");
+
+  /* Unterminated, and too long */
+  memset(buf, 0xff, sizeof(buf));
+  for (i = 1 ; i < 12 ; i++)
+    {
+      c = buf;
+      left = i;
+      KVASSERT(!decode_varint_u64(&c, &left, &v), "unterminated decoded");
+    }
+  buf[10] = 1;
+  c = buf;
+  left = sizeof(buf);
+  KVASSERT(!decode_varint_u64(&c, &left, &v), "11 bytes decoded");
+
+  /* 10 bytes, but more than 64 bits */
+  buf[9] = 2;
+  for (i = 0 ; i < 2 ; i++)
+    {
+      c = buf;
+      left = i ? (ssize_t)sizeof(buf) : 10;
+      KVASSERT(!decode_varint_u64(&c, &left, &v), "65 bits decoded");
+    }
+  buf[9] = 1;
+  c = buf;
+  left = sizeof(buf);
+  KVASSERT(decode_varint_u64(&c, &left, &v) && v == UINT64_MAX,
+           "64 bits not decoded");
+}
+
 int main(int argc, char **argv)
 {
   test_endecode_u64(1, 3, true, 1);
@@ -128,5 +185,11 @@ int main(int argc, char **argv)
 
   test_endecode_s64(23467742135246, 10, true, 7);
 
+  test_endecode_u64(UINT64_MAX, 10, true, 10);
+  test_endecode_s64(INT64_MAX, 10, true, 10);
+  test_endecode_s64(INT64_MIN, 10, true, 10);
+
+  test_decode_stream();
+
   return 0;
 }
@@ -0,0 +1,232 @@
+/*
+ * $Id: kvdb_columns_test.c $
+ *
+ * Author: Markus Stenberg <fingon@iki.fi>
+ *
+ * Copyright (c) 2013 Markus Stenberg
+ *
+ */
+
+/* Unit test for kvdb_columns.c: export objects of two classes, and
+ * make sure scanning each column gives back exactly the values that
+ * were set (dense, sparse, repetitive and mixed ones). */
+
+#define DEBUG
+
+#include "kvdb.h"
+#include "kvdb_i.h"
+
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define FILENAME "kvdb-columns-test.dat"
+#define DIRNAME "kvdb-columns-test.d"
+#define COLNAME DIRNAME "/app.cl.col"
+#define COLNAME2 DIRNAME "/app.cl2.col"
+#define COLNAME_EXT DIRNAME "/app.ext.col"
+#define N_OBJECTS_EXT 20
+#define N_OBJECTS 1000
+#define N_OBJECTS2 10
+
+#define APP kvdb_define_app(k, "app")
+#define CL kvdb_define_class(k, "cl")
+#define CL2 kvdb_define_class(k, "cl2")
+#define KEY kvdb_define_key(k, "key", KVDB_INTEGER)
+#define KEYS kvdb_define_key(k, "str", KVDB_STRING)
+#define KEYM kvdb_define_key(k, "mixed", KVDB_NULL)
+
+static const char *colors[] = { "red", "green", "blue" };
+
+static struct kvdb_oid_struct oids[N_OBJECTS];
+static struct kvdb_oid_struct ext_oids[N_OBJECTS_EXT];
+
+typedef struct {
+  const char *key;
+  int calls;
+  int stop_at;
+  struct kvdb_oid_struct last;
+} _scan_s;
+
+static int _index(kvdb_oid oid)
+{
+  int i;
+
+  for (i = 0 ; i < N_OBJECTS ; i++)
+    if (!memcmp(&oids[i], oid, KVDB_OID_SIZE))
+      return i;
+  return -1;
+}
+
+static bool _check(void *context, kvdb_oid oid, kvdb_type t,
+                   const void *value, size_t len, int64_t last_modified)
+{
+  _scan_s *s = context;
+  int i = _index(oid);
+  int64_t v;
+
+  KVASSERT(i >= 0, "unknown object");
+  KVASSERT(!s->calls || memcmp(&s->last, oid, KVDB_OID_SIZE) < 0,
+           "not in oid order");
+  KVASSERT(last_modified > 0 && last_modified <= kvdb_time(),
+           "wrong last modified");
+  s->last = *oid;
+  if (++s->calls == s->stop_at)
+    return false;
+  if (!strcmp(s->key, "key"))
+    {
+      KVASSERT(t == KVDB_INTEGER && len == sizeof(v), "not an integer");
+      memcpy(&v, value, sizeof(v));
+      KVASSERT(v == i * 3 - 100, "wrong value %lld for %d", (long long)v, i);
+    }
+  else if (!strcmp(s->key, "str"))
+    {
+      KVASSERT(i % 2 == 0, "value where there is none");
+      KVASSERT(t == KVDB_STRING && !strcmp(value, colors[i / 2 % 3]),
+               "wrong string for %d", i);
+    }
+  else if (!strcmp(s->key, "mixed"))
+    {
+      KVASSERT(i % 3 != 2, "value where there is none");
+      if (i % 3)
+        KVASSERT(t == KVDB_STRING && !strcmp(value, "x"), "wrong string");
+      else
+        {
+          KVASSERT(t == KVDB_INTEGER && len == sizeof(v), "not an integer");
+          memcpy(&v, value, sizeof(v));
+          KVASSERT(v == -i, "wrong integer");
+        }
+    }
+  else if (!strcmp(s->key, "_class"))
+    KVASSERT(t == KVDB_STRING && !strcmp(value, "cl"), "wrong class");
+  return true;
+}
+
+/* Integers on both sides of the wrap from INT64_MAX to INT64_MIN, so
+ * that the deltas between them overflow int64 */
+static int64_t _ext_value(int i)
+{
+  return (int64_t)((uint64_t)INT64_MAX - N_OBJECTS_EXT / 2 + i);
+}
+
+static bool _check_ext(void *context, kvdb_oid oid, kvdb_type t,
+                       const void *value, size_t len, int64_t last_modified)
+{
+  int *calls = context;
+  int64_t v;
+  int i;
+
+  for (i = 0 ; i < N_OBJECTS_EXT ; i++)
+    if (!memcmp(&ext_oids[i], oid, KVDB_OID_SIZE))
+      break;
+  KVASSERT(i < N_OBJECTS_EXT, "unknown object");
+  KVASSERT(t == KVDB_INTEGER && len == sizeof(v), "not an integer");
+  memcpy(&v, value, sizeof(v));
+  KVASSERT(v == _ext_value(i), "wrong extreme value for %d", i);
+  (*calls)++;
+  return true;
+}
+
+static int _scan(kvdb_columns c, const char *key)
+{
+  _scan_s s = { .key = key };
+
+  KVASSERT(kvdb_columns_scan(c, key, _check, &s), "scan of %s failed", key);
+  return s.calls;
+}
+
+int main(int argc, char **argv)
+{
+  _scan_s s = { .key = "key", .stop_at = 10 };
+  kvdb_columns c;
+  kvdb k;
+  kvdb_o o;
+  int i;
+  bool r;
+
+  unlink(FILENAME);
+  KVASSERT(system("rm -rf '" DIRNAME "'") == 0, "rm failed");
+  KVASSERT(mkdir(DIRNAME, 0700) == 0, "mkdir failed");
+  r = kvdb_init();
+  KVASSERT(r, "kvdb_init failed");
+  r = kvdb_create(FILENAME, &k);
+  KVASSERT(r, "kvdb_create failed: %s", kvdb_strerror(k));
+
+  for (i = 0 ; i < N_OBJECTS ; i++)
+    {
+      o = kvdb_create_o(k, APP, CL);
+      KVASSERT(o, "kvdb_create_o failed");
+      oids[i] = o->oid;
+      KVASSERT(kvdb_o_set_int64(o, KEY, i * 3 - 100), "set failed");
+      if (i % 2 == 0)
+        KVASSERT(kvdb_o_set_string(o, KEYS, (char *)colors[i / 2 % 3]),
+                 "set failed");
+      if (i % 3 == 0)
+        KVASSERT(kvdb_o_set_int64(o, KEYM, -i), "set failed");
+      else if (i % 3 == 1)
+        KVASSERT(kvdb_o_set_string(o, KEYM, "x"), "set failed");
+    }
+  for (i = 0 ; i < N_OBJECTS2 ; i++)
+    {
+      o = kvdb_create_o(k, APP, CL2);
+      KVASSERT(o, "kvdb_create_o failed");
+      KVASSERT(kvdb_o_set_int64(o, KEY, i), "set failed");
+    }
+  for (i = 0 ; i < N_OBJECTS_EXT ; i++)
+    {
+      o = kvdb_create_o(k, APP, kvdb_define_class(k, "ext"));
+      KVASSERT(o, "kvdb_create_o failed");
+      ext_oids[i] = o->oid;
+      KVASSERT(kvdb_o_set_int64(o, KEY, _ext_value(i)), "set failed");
+    }
+  /* Names that would map to the same file unless escaped */
+  o = kvdb_create_o(k, kvdb_define_app(k, "a.b"), kvdb_define_class(k, "c"));
+  KVASSERT(o, "kvdb_create_o failed");
+  o = kvdb_create_o(k, kvdb_define_app(k, "a"), kvdb_define_class(k, "b.c"));
+  KVASSERT(o, "kvdb_create_o failed");
+  o = kvdb_create_o(k, kvdb_define_app(k, "../x"), CL);
+  KVASSERT(o, "kvdb_create_o failed");
+  r = kvdb_export_columns(k, DIRNAME);
+  KVASSERT(r, "kvdb_export_columns failed: %s", kvdb_strerror(k));
+  kvdb_destroy(k);
+
+  c = kvdb_columns_open(COLNAME);
+  KVASSERT(c, "kvdb_columns_open failed");
+  KVASSERT(kvdb_columns_count(c) == N_OBJECTS, "wrong # of rows");
+  KVASSERT(_scan(c, "key") == N_OBJECTS, "wrong # of integers");
+  KVASSERT(_scan(c, "str") == N_OBJECTS / 2, "wrong # of strings");
+  KVASSERT(_scan(c, "mixed") == N_OBJECTS - N_OBJECTS / 3,
+           "wrong # of mixed values");
+  KVASSERT(_scan(c, "_class") == N_OBJECTS, "wrong # of classes");
+  KVASSERT(_scan(c, "nonexistent") == 0, "nonexistent column scanned");
+  KVASSERT(!kvdb_columns_scan(c, "key", _check, &s), "scan did not stop");
+  KVASSERT(s.calls == 10, "scan went on");
+  kvdb_columns_close(c);
+
+  c = kvdb_columns_open(COLNAME2);
+  KVASSERT(c, "kvdb_columns_open failed");
+  KVASSERT(kvdb_columns_count(c) == N_OBJECTS2, "wrong # of rows");
+  kvdb_columns_close(c);
+
+  c = kvdb_columns_open(COLNAME_EXT);
+  KVASSERT(c, "kvdb_columns_open failed");
+  i = 0;
+  KVASSERT(kvdb_columns_scan(c, "key", _check_ext, &i), "scan failed");
+  KVASSERT(i == N_OBJECTS_EXT, "wrong # of extreme values");
+  kvdb_columns_close(c);
+
+  c = kvdb_columns_open(DIRNAME "/a%2Eb.c.col");
+  KVASSERT(c && kvdb_columns_count(c) == 1, "escaped app not written");
+  kvdb_columns_close(c);
+  c = kvdb_columns_open(DIRNAME "/a.b%2Ec.col");
+  KVASSERT(c && kvdb_columns_count(c) == 1, "escaped class not written");
+  kvdb_columns_close(c);
+  c = kvdb_columns_open(DIRNAME "/%2E%2E%2Fx.cl.col");
+  KVASSERT(c && kvdb_columns_count(c) == 1, "escaped path not written");
+  kvdb_columns_close(c);
+
+  /* Anything else is not a column file */
+  KVASSERT(!kvdb_columns_open(DIRNAME "/nonexistent.col"),
+           "nonexistent file opened");
+  KVASSERT(!kvdb_columns_open(FILENAME), "database opened as columns");
+  return 0;
+}
@@ -0,0 +1,296 @@
+/*
+ * $Id: kvdb_history_test.c $
+ *
+ * Author: Markus Stenberg <fingon@iki.fi>
+ *
+ * Copyright (c) 2013 Markus Stenberg
+ *
+ */
+
+/* Unit test for kvdb_history.c: values (and queries) as of a point in
+ * time, and the versions of a value, with both log backends, and across
+ * compaction. */
+
+#define DEBUG
+
+#include "kvdb.h"
+#include "kvdb_i.h"
+
+#include <unistd.h>
+
+#define FILENAME "kvdb-history-test.dat"
+#define FILENAME_SEG "kvdb-history-test-seg.dat"
+#define N_OBJECTS 20
+#define N_OBJECTS2 5
+
+#define APP kvdb_define_app(k, "app")
+#define CL kvdb_define_class(k, "cl")
+#define KEY kvdb_define_key(k, "key", KVDB_INTEGER)
+#define INDEX kvdb_define_index(k, KEY, "i64", KVDB_INTEGER_INDEX)
+
+static kvdb_o objects[N_OBJECTS + N_OBJECTS2];
+
+/* Time between two sets of changes */
+static kvdb_time_t _pause(void)
+{
+  kvdb_time_t t;
+
+  usleep(2000);
+  t = kvdb_time();
+  usleep(2000);
+  return t;
+}
+
+/* Value of key at t, or -1 if it had none. */
+static int64_t _get_at(kvdb_o o, kvdb_key key, kvdb_time_t t)
+{
+  kvdb_buffer b = kvdb_o_get_at(o, key, t);
+  int64_t v;
+
+  if (!b)
+    return -1;
+  KVASSERT(kvdb_buffer_len(b) == sizeof(v), "wrong size");
+  memcpy(&v, kvdb_buffer_data(b), sizeof(v));
+  kvdb_buffer_unref(b);
+  return v;
+}
+
+/* Versions of key newest first (as in v[]); how many there were. */
+static int _history(kvdb_o o, kvdb_key key, const int64_t *v, int n)
+{
+  kvdb_history h = kvdb_o_history(o, key);
+  kvdb_time_t prev = kvdb_time();
+  int i;
+
+  KVASSERT(h, "kvdb_o_history failed");
+  for (i = 0 ; kvdb_history_next(h) ; i++)
+    {
+      kvdb_buffer b = kvdb_history_value(h);
+      int64_t got;
+
+      KVASSERT(i < n, "too many versions");
+      KVASSERT(kvdb_history_time(h) <= prev, "not newest first");
+      prev = kvdb_history_time(h);
+      KVASSERT(kvdb_history_type(h) == KVDB_INTEGER, "wrong type");
+      KVASSERT(b && kvdb_buffer_len(b) == sizeof(got), "wrong size");
+      memcpy(&got, kvdb_buffer_data(b), sizeof(got));
+      kvdb_buffer_unref(b);
+      KVASSERT(got == v[i], "wrong version %d", i);
+    }
+  /* (Stays at the end.) */
+  KVASSERT(!kvdb_history_next(h), "history started over");
+  kvdb_history_close(h);
+  return i;
+}
+
+static void test_history(kvdb k, int n)
+{
+  int i;
+
+  for (i = 0 ; i < n ; i++)
+    {
+      int64_t v[2] = { i % 2 ? i : i + 100, i };
+
+      KVASSERT(_history(objects[i], KEY, v, 2) == (i % 2 ? 1 : 2),
+               "wrong # of versions");
+    }
+}
+
+static int64_t _count(kvdb k, kvdb_time_t t, int64_t lo, int64_t hi)
+{
+  struct kvdb_typed_value_struct tv1, tv2;
+  kvdb_query q = kvdb_create_q(k);
+  int64_t n;
+
+  kvdb_tv_set_int64(&tv1, lo);
+  kvdb_tv_set_int64(&tv2, hi);
+  kvdb_q_add_index(q, INDEX, &tv1, &tv2);
+  KVASSERT(kvdb_q_set_time(q, t), "kvdb_q_set_time failed");
+  KVASSERT(kvdb_q_count(q, &n), "kvdb_q_count failed");
+  kvdb_q_destroy(q);
+  return n;
+}
+
+static void _set_all(kvdb k, int n, int64_t add, bool even_only)
+{
+  int i;
+
+  for (i = 0 ; i < n ; i++)
+    if (!even_only || i % 2 == 0)
+      KVASSERT(kvdb_o_set_int64(objects[i], KEY, i + add), "set failed");
+  KVASSERT(kvdb_commit(k), "kvdb_commit failed");
+}
+
+static void test_queries(kvdb k, kvdb_time_t t1, kvdb_time_t t2)
+{
+  struct kvdb_typed_value_struct tv;
+  struct kvdb_q_cursor_struct cursor;
+  kvdb_query q;
+  kvdb_o o;
+  int64_t n, prev = -1;
+  int i, pages = 0;
+
+  KVASSERT(_count(k, t1, 0, 9) == 10, "wrong count at t1");
+  KVASSERT(_count(k, t2, 0, 9) == 5, "wrong count at t2");
+  /* (Odd ones created later have no value at all.) */
+  KVASSERT(_count(k, t2, 100, 1000) == (N_OBJECTS + N_OBJECTS2 + 1) / 2,
+           "wrong count at t2");
+  KVASSERT(_count(k, t1 - 1000, 0, 1000) == 0, "objects before creation");
+
+  /* Objects of the app and class that existed then */
+  q = kvdb_create_q(k);
+  kvdb_q_set_match_app_class(q, APP, CL);
+  KVASSERT(kvdb_q_set_time(q, t1), "kvdb_q_set_time failed");
+  KVASSERT(kvdb_q_count(q, &n) && n == N_OBJECTS, "wrong # of objects");
+  kvdb_q_destroy(q);
+
+  q = kvdb_create_q(k);
+  KVASSERT(kvdb_q_set_time(q, t1), "kvdb_q_set_time failed");
+  KVASSERT(kvdb_q_aggregate(q, INDEX, KVDB_AGGREGATE_SUM, &tv)
+           && tv.v.i == N_OBJECTS * (N_OBJECTS - 1) / 2, "wrong sum");
+  kvdb_q_destroy(q);
+
+  /* Ordered by the value then, a page at a time */
+  kvdb_q_cursor_init(&cursor);
+  for (i = 0 ; ; pages++)
+    {
+      int got = 0;
+
+      q = kvdb_create_q(k);
+      kvdb_q_order_by(q, INDEX, true);
+      KVASSERT(kvdb_q_set_time(q, t1), "kvdb_q_set_time failed");
+      kvdb_q_set_limit(q, 7, 0);
+      kvdb_q_set_cursor(q, &cursor);
+      while ((o = kvdb_q_get_next(q)))
+        {
+          n = _get_at(o, KEY, t1);
+          KVASSERT(n > prev, "not in order");
+          prev = n;
+          got++;
+        }
+      i += got;
+      if (!got)
+        break;
+    }
+  KVASSERT(i == N_OBJECTS && pages == 3, "wrong # of results");
+}
+
+/* A reader sees the same history as the writer: as of t1 (at which
+ * object i had i), and all the versions (as in test_history). */
+static void test_reader(kvdb k, kvdb_time_t t1)
+{
+  kvdb r_k;
+  kvdb_key key;
+  kvdb_o o;
+  bool r;
+  int i;
+
+  r = kvdb_open_reader(k, &r_k);
+  KVASSERT(r, "kvdb_open_reader failed: %s", kvdb_strerror(r_k));
+  key = kvdb_define_key(r_k, "key", KVDB_INTEGER);
+  for (i = 0 ; i < N_OBJECTS ; i++)
+    {
+      int64_t v[2] = { i % 2 ? i : i + 100, i };
+
+      o = kvdb_get_o_by_id(r_k, &objects[i]->oid);
+      KVASSERT(o, "reader lookup failed");
+      KVASSERT(_get_at(o, key, t1) == i, "wrong value at t1 (reader)");
+      KVASSERT(_history(o, key, v, 2) == (i % 2 ? 1 : 2),
+               "wrong # of versions (reader)");
+    }
+  kvdb_destroy(r_k);
+}
+
+int main(int argc, char **argv)
+{
+  struct kvdb_options_struct options;
+  kvdb_time_t t0, t1, t2;
+  kvdb_query q;
+  kvdb k;
+  int i;
+  bool r;
+
+  unlink(FILENAME);
+  r = kvdb_init();
+  KVASSERT(r, "kvdb_init failed");
+  kvdb_options_init(&options, KVDB_PRESET_DEFAULT);
+  options.checkpoint_interval_ms = 1;
+  r = kvdb_create_with_options(FILENAME, &options, &k);
+  KVASSERT(r, "kvdb_create failed: %s", kvdb_strerror(k));
+  KVASSERT(INDEX, "index creation failed");
+
+  t0 = _pause();
+  for (i = 0 ; i < N_OBJECTS ; i++)
+    KVASSERT((objects[i] = kvdb_create_o(k, APP, CL)), "create failed");
+  _set_all(k, N_OBJECTS, 0, false);
+  t1 = _pause();
+  for (i = N_OBJECTS ; i < N_OBJECTS + N_OBJECTS2 ; i++)
+    KVASSERT((objects[i] = kvdb_create_o(k, APP, CL)), "create failed");
+  _set_all(k, N_OBJECTS + N_OBJECTS2, 100, true);
+  t2 = _pause();
+
+  for (i = 0 ; i < N_OBJECTS ; i++)
+    {
+      KVASSERT(_get_at(objects[i], KEY, t0) == -1, "value before set");
+      KVASSERT(_get_at(objects[i], KEY, t1) == i, "wrong value at t1");
+      KVASSERT(_get_at(objects[i], KEY, t2) == (i % 2 ? i : i + 100),
+               "wrong value at t2");
+    }
+  KVASSERT(_get_at(objects[N_OBJECTS], KEY, t1) == -1, "value before set");
+  test_queries(k, t1, t2);
+  test_history(k, N_OBJECTS);
+
+  /* The versions in effect at checkpoints survive compaction... */
+  k->options.log_keep_versions = 1;
+  KVASSERT(kvdb_compact(k), "kvdb_compact failed");
+  for (i = 0 ; i < N_OBJECTS ; i++)
+    KVASSERT(_get_at(objects[i], KEY, t1) == i, "wrong value at t1");
+  test_queries(k, t1, t2);
+  test_history(k, N_OBJECTS);
+
+  /* ...and without them, only the latest version is left. */
+  k->options.checkpoint_interval_ms = 0;
+  KVASSERT(sqlite3_exec(k->db, "DELETE FROM log_checkpoints", NULL, NULL,
+                        NULL) == SQLITE_OK, "delete failed");
+  KVASSERT(kvdb_compact(k), "kvdb_compact failed");
+  KVASSERT(_get_at(objects[0], KEY, t1) == -1, "old version left");
+  KVASSERT(_get_at(objects[1], KEY, t1) == 1, "latest version gone");
+  KVASSERT(_get_at(objects[0], KEY, t2) == 100, "latest version gone");
+  {
+    int64_t v = 100;
+
+    KVASSERT(_history(objects[0], KEY, &v, 1) == 1, "old version left");
+  }
+  kvdb_destroy(k);
+
+  /* Segment files are scanned instead. */
+  unlink(FILENAME_SEG);
+  unlink(FILENAME_SEG "-wal");
+  unlink(FILENAME_SEG "-shm");
+  KVASSERT(system("rm -rf '" FILENAME_SEG "-log'") == 0, "rm failed");
+  kvdb_options_init(&options, KVDB_PRESET_DEFAULT);
+  options.log_backend = KVDB_LOG_SEGMENTS;
+  options.journal_mode = KVDB_JOURNAL_WAL;
+  r = kvdb_create_with_options(FILENAME_SEG, &options, &k);
+  KVASSERT(r, "kvdb_create failed: %s", kvdb_strerror(k));
+  KVASSERT(k->log, "no segment log");
+  for (i = 0 ; i < N_OBJECTS ; i++)
+    KVASSERT((objects[i] = kvdb_create_o(k, APP, CL)), "create failed");
+  _set_all(k, N_OBJECTS, 0, false);
+  t1 = _pause();
+  _set_all(k, N_OBJECTS, 100, true);
+  for (i = 0 ; i < N_OBJECTS ; i++)
+    {
+      KVASSERT(_get_at(objects[i], KEY, t1) == i, "wrong value at t1");
+      KVASSERT(_get_at(objects[i], KEY, kvdb_time())
+               == (i % 2 ? i : i + 100), "wrong current value");
+    }
+  test_history(k, N_OBJECTS);
+  test_reader(k, t1);
+  /* Time queries are SQL over the log table, though. */
+  q = kvdb_create_q(k);
+  KVASSERT(!kvdb_q_set_time(q, t1), "time query over segment files");
+  kvdb_q_destroy(q);
+  kvdb_destroy(k);
+  return 0;
+}
@@ -0,0 +1,113 @@
+/*
+ * $Id: kvdb_image_test.c $
+ *
+ * Author: Markus Stenberg <fingon@iki.fi>
+ *
+ * Copyright (c) 2013 Markus Stenberg
+ *
+ */
+
+/* Unit test for kvdb_image.c: write an image, and make sure every
+ * field of every object can be found within it (and nothing else). */
+
+#define DEBUG
+
+#include "kvdb.h"
+#include "kvdb_i.h"
+
+#include <unistd.h>
+
+#define FILENAME "kvdb-image-test.dat"
+#define IMAGENAME "kvdb-image-test.img"
+#define N_OBJECTS 1000
+
+#define APP kvdb_define_app(k, "app")
+#define CL kvdb_define_class(k, "cl")
+#define KEY kvdb_define_key(k, "key", KVDB_INTEGER)
+#define KEYS kvdb_define_key(k, "str", KVDB_STRING)
+
+static struct kvdb_oid_struct oids[N_OBJECTS];
+
+void test_empty(kvdb k)
+{
+  kvdb_image img;
+  bool r;
+
+  r = kvdb_image_write(k, IMAGENAME);
+  KVASSERT(r, "kvdb_image_write failed: %s", kvdb_strerror(k));
+  img = kvdb_image_open(IMAGENAME);
+  KVASSERT(img, "kvdb_image_open failed");
+  /* (Just the kvdb_io singleton.) */
+  KVASSERT(kvdb_image_count(img) == 1, "objects in an empty image");
+  KVASSERT(!kvdb_image_get_int64(img, &oids[0], "key"), "found something");
+  kvdb_image_close(img);
+}
+
+void test_objects(kvdb k)
+{
+  struct kvdb_oid_struct missing;
+  kvdb_image img;
+  const int64_t *ip;
+  const char *s;
+  char buf[32];
+  int i;
+  bool r;
+
+  for (i = 0 ; i < N_OBJECTS ; i++)
+    {
+      kvdb_o o = kvdb_create_o(k, APP, CL);
+
+      KVASSERT(o, "kvdb_create_o failed");
+      oids[i] = o->oid;
+      KVASSERT(kvdb_o_set_int64(o, KEY, i), "set failed");
+      sprintf(buf, "s%d", i);
+      if (i % 2)
+        KVASSERT(kvdb_o_set_string(o, KEYS, buf), "set failed");
+    }
+  r = kvdb_image_write(k, IMAGENAME);
+  KVASSERT(r, "kvdb_image_write failed: %s", kvdb_strerror(k));
+
+  img = kvdb_image_open(IMAGENAME);
+  KVASSERT(img, "kvdb_image_open failed");
+  KVASSERT(kvdb_image_count(img) == N_OBJECTS + 1, "wrong # of objects");
+  for (i = 0 ; i < N_OBJECTS ; i++)
+    {
+      ip = kvdb_image_get_int64(img, &oids[i], "key");
+      KVASSERT(ip && *ip == i, "wrong int value for %d", i);
+      KVASSERT(((uintptr_t)ip % sizeof(int64_t)) == 0, "unaligned value");
+      s = kvdb_image_get_string(img, &oids[i], "str");
+      sprintf(buf, "s%d", i);
+      KVASSERT(i % 2 ? s && strcmp(s, buf) == 0 : !s, "wrong string");
+      s = kvdb_image_get_string(img, &oids[i], "_class");
+      KVASSERT(s && strcmp(s, "cl") == 0, "wrong class");
+      KVASSERT(!kvdb_image_get_int64(img, &oids[i], "nonexistent"),
+               "nonexistent key found");
+    }
+  missing = oids[0];
+  missing.oid[KVDB_OID_SIZE - 1] ^= 0xff;
+  KVASSERT(!kvdb_image_get_int64(img, &missing, "key"),
+           "nonexistent object found");
+  kvdb_image_close(img);
+}
+
+int main(int argc, char **argv)
+{
+  kvdb k;
+  bool r;
+
+  unlink(FILENAME);
+  unlink(IMAGENAME);
+  r = kvdb_init();
+  KVASSERT(r, "kvdb_init failed");
+  r = kvdb_create(FILENAME, &k);
+  KVASSERT(r, "kvdb_create failed: %s", kvdb_strerror(k));
+
+  KVASSERT(!kvdb_image_open(IMAGENAME), "nonexistent image opened");
+  test_empty(k);
+  test_objects(k);
+  kvdb_destroy(k);
+
+  /* Anything else is not an image */
+  KVASSERT(!kvdb_image_open(FILENAME), "database opened as image");
+  return 0;
+}
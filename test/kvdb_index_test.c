@@ -31,6 +31,8 @@
 #define KEYO kvdb_define_key(k, "key2", KVDB_OBJECT)
 #define INDEX kvdb_define_index(k, KEY, "i64", KVDB_INTEGER_INDEX)
 #define INDEXO kvdb_define_index(k, KEYO, "o", KVDB_OBJECT_INDEX)
+#define KEY3 kvdb_define_key(k, "key3", KVDB_INTEGER)
+#define INDEX3 kvdb_define_index(k, KEY3, "i3", KVDB_INTEGER_INDEX)
 
 /* There is a number of different combinations of things we should check:
 
@@ -60,13 +62,18 @@ void add_dummies(kvdb k, int start, int end)
     }
 }
 
-kvdb create_test_db()
+kvdb create_test_db(bool bulk)
 {
   kvdb k;
   bool r;
 
   r = kvdb_create(FILENAME, &k);
   KVASSERT(r, "kvdb_create call failed: %s", kvdb_strerror(k));
+  if (bulk)
+    {
+      r = kvdb_bulk_begin(k);
+      KVASSERT(r, "kvdb_bulk_begin failed: %s", kvdb_strerror(k));
+    }
   add_dummies(k, N_OBJECTS, 3 * N_OBJECTS / 2);
 
   kvdb_index i = INDEX;
@@ -88,11 +95,60 @@ kvdb create_test_db()
   kvdb_o_set_int64(o, KEY, 42);
   kvdb_o_set_object(o, KEYO, o2);
 
+  if (bulk)
+    {
+      r = kvdb_bulk_end(k);
+      KVASSERT(r, "kvdb_bulk_end failed: %s", kvdb_strerror(k));
+    }
   r = kvdb_commit(k);
   KVASSERT(r, "kvdb_commit failed");
   return k;
 }
 
+/* Go through the query in pages of page_size, each with a new query
+ * resuming from the cursor. */
+void test_pages(kvdb k, kvdb_index i,
+                kvdb_typed_value v1, kvdb_typed_value v2,
+                bool asc, int page_size, int expected)
+{
+  struct kvdb_q_cursor_struct cursor;
+  kvdb_query q;
+  kvdb_o o;
+  int c = 0, pc;
+  int64_t lv = 0, v;
+
+  kvdb_q_cursor_init(&cursor);
+  do
+    {
+      q = kvdb_create_q(k);
+      if (i)
+        {
+          kvdb_q_add_index(q, i, v1, v2);
+          kvdb_q_order_by(q, i, asc);
+        }
+      else
+        {
+          kvdb_q_set_match_app_class(q, APP, CL);
+        }
+      kvdb_q_set_limit(q, page_size, 0);
+      kvdb_q_set_cursor(q, &cursor);
+      pc = 0;
+      while ((o = kvdb_q_get_next(q)))
+        {
+          if (i)
+            {
+              v = *kvdb_o_get_int64(o, KEY);
+              KVASSERT(!c || (asc ? lv < v : lv > v), "ordering error");
+              lv = v;
+            }
+          pc++;
+          c++;
+        }
+      KVASSERT(pc <= page_size, "too large page");
+    } while (pc == page_size);
+  KVASSERT(c == expected, "wrong # of paged results: %d", c);
+}
+
 void run_tests(kvdb k)
 {
   int64_t bi, lv;
@@ -102,6 +158,7 @@ void run_tests(kvdb k)
   int c;
   kvdb_o o, o42, o43;
   struct kvdb_oid_struct oid_43;
+  bool r;
   kvdb_index i = INDEX;
   KVASSERT(i, "index definition failed");
 
@@ -216,11 +273,204 @@ void run_tests(kvdb k)
   }
   KVASSERT(c == 11, "wrong # of matches");
 
+  /* Counts and aggregates (without loading objects) */
+  int64_t n;
+  q = kvdb_create_q(k);
+  kvdb_q_set_match_app_class(q, APP, CL);
+  kvdb_q_add_index(q, i, &v1, &v2);
+  r = kvdb_q_count(q, &n);
+  KVASSERT(r && n == 11, "wrong count");
+  r = kvdb_q_aggregate(q, i, KVDB_AGGREGATE_MIN, &v);
+  KVASSERT(r && v.t == KVDB_INTEGER && v.v.i == v1.v.i, "wrong min");
+  r = kvdb_q_aggregate(q, i, KVDB_AGGREGATE_MAX, &v);
+  KVASSERT(r && v.t == KVDB_INTEGER && v.v.i == v2.v.i, "wrong max");
+  r = kvdb_q_aggregate(q, i, KVDB_AGGREGATE_SUM, &v);
+  KVASSERT(r && v.t == KVDB_INTEGER
+           && v.v.i == (v1.v.i + v2.v.i) * 11 / 2, "wrong sum");
+  r = kvdb_q_aggregate(q, i, KVDB_AGGREGATE_AVG, &v);
+  KVASSERT(r && v.t == KVDB_DOUBLE
+           && v.v.d == (v1.v.i + v2.v.i) / 2.0, "wrong avg");
+  r = kvdb_q_aggregate(q, io, KVDB_AGGREGATE_SUM, &v);
+  KVASSERT(!r && strstr(kvdb_strerror(k), "non-integer"),
+           "aggregate over object index should fail");
+  kvdb_q_destroy(q);
+
+  /* No room for the index to aggregate over */
+  q = kvdb_create_q(k);
+  kvdb_tv_set_oid(&v, &oid_43);
+  for (c = 0 ; c < 4 ; c++)
+    kvdb_q_add_index(q, io, &v, NULL);
+  r = kvdb_q_aggregate(q, i, KVDB_AGGREGATE_MAX, &v);
+  KVASSERT(!r, "aggregate over too many indexes should fail");
+  kvdb_q_destroy(q);
+
+  q = kvdb_create_q(k);
+  kvdb_q_set_match_app_class(q, APP2, CL2);
+  r = kvdb_q_count(q, &n);
+  KVASSERT(r && n == 1, "wrong count");
+  r = kvdb_q_aggregate(q, i, KVDB_AGGREGATE_MAX, &v);
+  KVASSERT(r && v.t == KVDB_INTEGER && v.v.i == 44, "wrong max");
+  kvdb_q_destroy(q);
+
+  q = kvdb_create_q(k);
+  kvdb_q_add_index(q, i, &v2, &v1);
+  r = kvdb_q_aggregate(q, i, KVDB_AGGREGATE_MIN, &v);
+  KVASSERT(r && v.t == KVDB_NULL, "min of nothing should be null");
+  kvdb_q_destroy(q);
+
+  /* Limit + offset */
+  q = kvdb_create_q(k);
+  kvdb_q_add_index(q, i, &v1, &v2);
+  kvdb_q_order_by(q, i, true);
+  kvdb_q_set_limit(q, 5, 3);
+  c = 0;
+  while ((o = kvdb_q_get_next(q)))
+    {
+      KVASSERT(*kvdb_o_get_int64(o, KEY) == v1.v.i + 3 + c, "wrong order");
+      c++;
+    }
+  KVASSERT(c == 5, "wrong # of matches");
+
+  /* Keyset pagination, both with and without ordering */
+  test_pages(k, i, &v1, &v2, true, 4, 11);
+  test_pages(k, i, &v1, &v2, false, 4, 11);
+  test_pages(k, NULL, NULL, NULL, true, 50, N_OBJECTS + 1);
+
   o = NULL;
   kvdb_get_or_create_one(o, APP2, CL2);
   KVASSERT(o && *kvdb_o_get_int64(o, KEY) == 44, "wrong key");
 }
 
+/* Row count of the index i3 as stored in the database. */
+int64_t stored_rows(kvdb k)
+{
+  sqlite3_stmt *stmt;
+  int64_t n = -1;
+  int rc;
+
+  rc = sqlite3_prepare_v2(k->db, "SELECT rows FROM search_index_stats "
+                          "WHERE name='i3'", -1, &stmt, NULL);
+  KVASSERT(rc == SQLITE_OK, "prepare failed");
+  if (sqlite3_step(stmt) == SQLITE_ROW)
+    n = sqlite3_column_int64(stmt, 0);
+  sqlite3_finalize(stmt);
+  return n;
+}
+
+/* The most selective source drives the query, whatever the order. */
+void test_plan(kvdb k)
+{
+  struct kvdb_typed_value_struct all1, all2, v1, v2;
+  kvdb_index i = INDEX;
+  kvdb_query q;
+
+  kvdb_tv_set_int64(&all1, 0);
+  kvdb_tv_set_int64(&all2, 2 * N_OBJECTS);
+  kvdb_tv_set_int64(&v1, 3 * N_OBJECTS / 2 + 2);
+  kvdb_tv_set_int64(&v2, 3 * N_OBJECTS / 2 + 12);
+
+  q = kvdb_create_q(k);
+  kvdb_q_add_index(q, i, &all1, &all2);
+  kvdb_q_add_index(q, i, &v1, &v2);
+  KVASSERT(_kvdb_q_driver(q) == 1, "wide range drives");
+  kvdb_q_destroy(q);
+
+  q = kvdb_create_q(k);
+  kvdb_q_set_match_app_class(q, APP, CL);
+  kvdb_q_add_index(q, i, &v1, &v2);
+  KVASSERT(_kvdb_q_driver(q) == 0, "app_class drives");
+  kvdb_q_destroy(q);
+
+  q = kvdb_create_q(k);
+  kvdb_q_add_index(q, i, &all1, &all2);
+  kvdb_q_set_match_app_class(q, APP2, CL2);
+  KVASSERT(_kvdb_q_driver(q) == -1, "index drives");
+  kvdb_q_destroy(q);
+}
+
+void test_analyze(kvdb k)
+{
+  kvdb_index i = INDEX;
+  kvdb_o o = NULL;
+  int64_t e;
+  bool r;
+
+  r = kvdb_analyze(k);
+  KVASSERT(r, "kvdb_analyze failed: %s", kvdb_strerror(k));
+  KVASSERT(i->rows == N_OBJECTS + N_FIXED_OBJECTS, "wrong # of rows: %d",
+           (int) i->rows);
+  KVASSERT(i->n_histogram, "no histogram");
+
+  /* Range with 11 matches should be estimated to be somewhat small */
+  e = _kvdb_index_estimate_range(i, 3 * N_OBJECTS / 2 + 2,
+                                 3 * N_OBJECTS / 2 + 12);
+  KVASSERT(e > 0 && e < 30, "bad estimate %d", (int) e);
+  e = _kvdb_index_estimate_range(i, 0, 2 * N_OBJECTS);
+  KVASSERT(e > N_OBJECTS, "bad estimate %d", (int) e);
+  r = kvdb_commit(k);
+  KVASSERT(r, "kvdb_commit failed");
+  test_plan(k);
+
+  /* Row counts are stored at commit even without kvdb_analyze */
+  KVASSERT(INDEX3, "index creation failed");
+  r = kvdb_commit(k);
+  KVASSERT(r, "kvdb_commit failed");
+  KVASSERT(stored_rows(k) == 0, "row count not stored");
+  kvdb_get_or_create_one(o, APP2, CL2);
+  KVASSERT(o && kvdb_o_set_int64(o, KEY3, 1), "set failed");
+  r = kvdb_commit(k);
+  KVASSERT(r, "kvdb_commit failed");
+  KVASSERT(stored_rows(k) == 1, "row count not stored");
+}
+
+/* Key indexes of search indexes made before they covered oid are
+ * recreated by the schema upgrade. */
+void test_upgrade(kvdb k)
+{
+  sqlite3_stmt *stmt;
+  bool r;
+  int rc;
+
+  rc = sqlite3_exec(k->db,
+                    "DROP INDEX i_s_i64_key;"
+                    "CREATE INDEX i_s_i64_key ON s_i64(keyish);",
+                    NULL, NULL, NULL);
+  KVASSERT(rc == SQLITE_OK, "downgrade failed");
+  r = _kvdb_index_upgrade_keys(k);
+  KVASSERT(r, "upgrade failed: %s", kvdb_strerror(k));
+  rc = sqlite3_prepare_v2(k->db, "SELECT sql FROM sqlite_master "
+                          "WHERE name='i_s_i64_key'", -1, &stmt, NULL);
+  KVASSERT(rc == SQLITE_OK, "prepare failed");
+  KVASSERT(sqlite3_step(stmt) == SQLITE_ROW
+           && strstr((const char *)sqlite3_column_text(stmt, 0),
+                     "keyish, oid"), "key index not upgraded");
+  sqlite3_finalize(stmt);
+  run_tests(k);
+}
+
+/* After a bulk load, every index should be there again. */
+void test_bulk_indexes(kvdb k)
+{
+  const char *names[] = {"i_cs_key", "i_log_ta", "i_log_lm_oid_key",
+                         "i_s_i64_key", "i_s_i64_oid",
+                         "i_s_o_key", "i_s_o_oid", NULL};
+  sqlite3_stmt *stmt;
+  int i, rc;
+
+  rc = sqlite3_prepare_v2(k->db, "SELECT count(*) FROM sqlite_master "
+                          "WHERE type='index' AND name=?", -1, &stmt, NULL);
+  KVASSERT(rc == SQLITE_OK, "prepare failed");
+  for (i = 0 ; names[i] ; i++)
+    {
+      sqlite3_reset(stmt);
+      sqlite3_bind_text(stmt, 1, names[i], -1, SQLITE_STATIC);
+      rc = sqlite3_step(stmt);
+      KVASSERT(rc == SQLITE_ROW && sqlite3_column_int(stmt, 0) == 1,
+               "index %s missing", names[i]);
+    }
+  sqlite3_finalize(stmt);
+}
+
 int main(int argc, char **argv)
 {
   kvdb k;
@@ -233,14 +483,26 @@ int main(int argc, char **argv)
   KVASSERT(r, "kvdb_init failed");
 
   /* First run tests on 'fresh' database */
-  k = create_test_db();
+  k = create_test_db(false);
   run_tests(k);
+  test_analyze(k);
   kvdb_destroy(k);
 
   /* Then with 'old' database */
   KVDEBUG("retrying with 'old' database");
   r = kvdb_create(FILENAME, &k);
   KVASSERT(r, "kvdb_create call failed: %s", kvdb_strerror(k));
+  KVASSERT(INDEX->n_histogram, "statistics not persisted");
+  KVASSERT(INDEX3->rows == 1, "row count not persisted");
+  run_tests(k);
+  test_upgrade(k);
+  kvdb_destroy(k);
+
+  /* And finally with one that was bulk loaded */
+  KVDEBUG("retrying with bulk loaded database");
+  unlink(FILENAME);
+  k = create_test_db(true);
+  test_bulk_indexes(k);
   run_tests(k);
   kvdb_destroy(k);
 
@@ -23,9 +23,24 @@
 #include <unistd.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <pthread.h>
 
 #define FILENAME "kvdb-test.dat"
+#define FILENAME_WAL "kvdb-test-wal.dat"
+#define FILENAME_SEG "kvdb-test-seg.dat"
+#define FILENAME_SNAPSHOT "kvdb-test-snapshot.dat"
+#define FILENAME_LAZY "kvdb-test-lazy.dat"
+#define FILENAME_BLOB "kvdb-test-blob.dat"
+#define FILENAME_BLOBS "kvdb-test-blobs.dat"
+#define FILENAME_BLOBS2 "kvdb-test-blobs2.dat"
+#define FILENAME_TYPES "kvdb-test-types.dat"
+#define FILENAME_COMPACT "kvdb-test-compact.dat"
+#define FILENAME_COMPACT_SEG "kvdb-test-compact-seg.dat"
 #define LOGDIR "/tmp/kvdb-logs"
+#define LOGDIR_SEG "/tmp/kvdb-logs-seg"
+#define LOGDIR_BLOBS "/tmp/kvdb-logs-blobs"
+#define LOGDIR_TYPES "/tmp/kvdb-logs-types"
+#define LOGDIR_COMPACT "/tmp/kvdb-logs-compact"
 
 #define APP kvdb_define_app(k, "app")
 #define CL kvdb_define_class(k, "cl")
@@ -38,6 +53,9 @@
 
 #define KEYO kvdb_define_key(k, "key3", KVDB_OBJECT)
 
+#define KEYD kvdb_define_key(k, "key4", KVDB_DOUBLE)
+#define KEYI kvdb_define_key(k, "key5", KVDB_INTEGER)
+
 void check_db(kvdb k, kvdb_oid oid, kvdb_oid oid2)
 {
   kvdb_o o, o2;
@@ -69,6 +87,925 @@ void check_db(kvdb k, kvdb_oid oid, kvdb_oid oid2)
 
 }
 
+/* Writer + reader on the same (WAL mode) file; the reader should see
+ * only what has been committed when it last refreshed. */
+void test_reader(void)
+{
+  struct kvdb_options_struct options = { .journal_mode = KVDB_JOURNAL_WAL };
+  kvdb k, r_k;
+  kvdb_o o;
+  struct kvdb_oid_struct oid;
+  int64_t *v;
+  bool r;
+
+  unlink(FILENAME_WAL);
+  unlink(FILENAME_WAL "-wal");
+  unlink(FILENAME_WAL "-shm");
+
+  r = kvdb_create(FILENAME_WAL, &k);
+  KVASSERT(r, "kvdb_create call failed: %s", kvdb_strerror(k));
+  r = kvdb_open_reader(k, &r_k);
+  KVASSERT(!r && !r_k, "kvdb_open_reader should fail without WAL");
+  kvdb_destroy(k);
+
+  r = kvdb_create_with_options(FILENAME_WAL, &options, &k);
+  KVASSERT(r, "kvdb_create_with_options failed: %s", kvdb_strerror(k));
+  o = kvdb_create_o(k, APP, CL);
+  KVASSERT(o, "kvdb_create_o failed");
+  oid = o->oid;
+  r = kvdb_o_set_int64(o, KEY, VALUE);
+  KVASSERT(r, "kvdb_o_set_int64 failed");
+  r = kvdb_commit(k);
+  KVASSERT(r, "kvdb_commit failed");
+
+  r = kvdb_open_reader(k, &r_k);
+  KVASSERT(r, "kvdb_open_reader failed: %s", kvdb_strerror(r_k));
+
+  /* Uncommitted change is invisible to the reader */
+  r = kvdb_o_set_int64(o, KEY, VALUE + 1);
+  KVASSERT(r, "kvdb_o_set_int64 failed");
+  o = kvdb_get_o_by_id(r_k, &oid);
+  KVASSERT(o, "reader did not find the object");
+  v = kvdb_o_get_int64(o, kvdb_define_key(r_k, "key", KVDB_INTEGER));
+  KVASSERT(v && *v == VALUE, "reader saw uncommitted value");
+
+  /* .. and so is a committed one until the reader refreshes */
+  r = kvdb_commit(k);
+  KVASSERT(r, "kvdb_commit failed");
+  v = kvdb_o_get_int64(o, kvdb_define_key(r_k, "key", KVDB_INTEGER));
+  KVASSERT(v && *v == VALUE, "reader snapshot changed");
+  r = kvdb_commit(r_k);
+  KVASSERT(r, "reader refresh failed: %s", kvdb_strerror(r_k));
+  o = kvdb_get_o_by_id(r_k, &oid);
+  KVASSERT(o, "reader did not find the object after refresh");
+  v = kvdb_o_get_int64(o, kvdb_define_key(r_k, "key", KVDB_INTEGER));
+  KVASSERT(v && *v == VALUE + 1, "reader did not see new value");
+
+  /* Writes through the reader are refused */
+  r = kvdb_o_set_int64(o, kvdb_define_key(r_k, "key", KVDB_INTEGER), 0);
+  KVASSERT(!r, "reader write should fail");
+  KVASSERT(!kvdb_create_o(r_k, NULL, NULL), "reader create should fail");
+
+  kvdb_destroy(r_k);
+  kvdb_destroy(k);
+}
+
+#define THREADS 4
+#define THREAD_OBJECTS 100
+
+static kvdb thread_k;
+static kvdb_o thread_o;
+
+static void *_thread_main(void *arg)
+{
+  kvdb k = thread_k;
+  kvdb r_k;
+  kvdb_o o, o2 = NULL;
+  kvdb_query q;
+  int64_t v;
+  int64_t count;
+  char *s;
+  int i;
+
+  for (i = 0 ; i < THREAD_OBJECTS ; i++)
+    {
+      o = kvdb_create_o(k, APP, CL);
+      KVASSERT(o, "kvdb_create_o failed");
+      KVASSERT(kvdb_o_set_int64(o, KEY, i), "kvdb_o_set_int64 failed");
+      if (o2)
+        KVASSERT(kvdb_o_set_object(o, KEYO, o2), "kvdb_o_set_object failed");
+      KVASSERT(kvdb_get_o_by_id(k, &o->oid) == o, "cache lookup failed");
+      KVASSERT(kvdb_o_copy_int64(o, KEY, &v) && v == i,
+               "kvdb_o_copy_int64 failed");
+      o2 = o;
+
+      /* Everyone sets this one; copies are of some complete value */
+      KVASSERT(kvdb_o_set_string(thread_o, KEYS, i % 2 ? VALUES : VALUES2),
+               "kvdb_o_set_string failed");
+      s = kvdb_o_copy_string(thread_o, KEYS);
+      KVASSERT(s && (!strcmp(s, VALUES) || !strcmp(s, VALUES2)),
+               "kvdb_o_copy_string failed");
+      free(s);
+    }
+
+  /* Own reader sees (at least) what was committed before it opened */
+  KVASSERT(kvdb_commit(k), "kvdb_commit failed");
+  r_k = kvdb_thread_reader(k);
+  KVASSERT(r_k, "kvdb_thread_reader failed: %s", kvdb_strerror(k));
+  KVASSERT(kvdb_thread_reader(k) == r_k, "reader should be reused");
+  KVASSERT(kvdb_commit(r_k), "reader refresh failed");
+  q = kvdb_create_q(r_k);
+  kvdb_q_set_match_app_class(q, kvdb_define_app(r_k, "app"),
+                             kvdb_define_class(r_k, "cl"));
+  KVASSERT(kvdb_q_count(q, &count), "kvdb_q_count failed");
+  KVASSERT(count >= THREAD_OBJECTS, "reader missed objects: %d",
+           (int)count);
+  kvdb_q_destroy(q);
+  return NULL;
+}
+
+static pthread_mutex_t outlive_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t outlive_cond = PTHREAD_COND_INITIALIZER;
+static int outlive_state;
+
+static void _outlive_set(int state)
+{
+  pthread_mutex_lock(&outlive_lock);
+  outlive_state = state;
+  pthread_cond_broadcast(&outlive_cond);
+  pthread_mutex_unlock(&outlive_lock);
+}
+
+static void _outlive_wait(int state)
+{
+  pthread_mutex_lock(&outlive_lock);
+  while (outlive_state < state)
+    pthread_cond_wait(&outlive_cond, &outlive_lock);
+  pthread_mutex_unlock(&outlive_lock);
+}
+
+/* Keep using the thread's reader after the writer is destroyed. */
+static void *_outlive_main(void *arg)
+{
+  kvdb r_k = kvdb_thread_reader(thread_k);
+  kvdb_query q;
+  int64_t count;
+
+  KVASSERT(r_k, "kvdb_thread_reader failed");
+  _outlive_set(1);
+  _outlive_wait(2);
+  q = kvdb_create_q(r_k);
+  kvdb_q_set_match_app_class(q, kvdb_define_app(r_k, "app"),
+                             kvdb_define_class(r_k, "cl"));
+  KVASSERT(kvdb_q_count(q, &count), "kvdb_q_count failed");
+  KVASSERT(count == THREADS * THREAD_OBJECTS + 1, "wrong count %d",
+           (int)count);
+  kvdb_q_destroy(q);
+  return NULL;
+}
+
+/* Several threads hammering one threadsafe kvdb at once. */
+void test_threads(void)
+{
+  struct kvdb_options_struct options = { .journal_mode = KVDB_JOURNAL_WAL,
+                                         .threadsafe = true };
+  pthread_t threads[THREADS];
+  kvdb_query q;
+  int64_t count;
+  int i;
+  bool r;
+
+  unlink(FILENAME_WAL);
+  unlink(FILENAME_WAL "-wal");
+  unlink(FILENAME_WAL "-shm");
+  r = kvdb_create_with_options(FILENAME_WAL, &options, &thread_k);
+  KVASSERT(r, "kvdb_create_with_options failed: %s", kvdb_strerror(thread_k));
+  kvdb k = thread_k;
+  thread_o = kvdb_create_o(k, APP, CL);
+  KVASSERT(thread_o, "kvdb_create_o failed");
+
+  for (i = 0 ; i < THREADS ; i++)
+    KVASSERT(!pthread_create(&threads[i], NULL, _thread_main, NULL),
+             "pthread_create failed");
+  for (i = 0 ; i < THREADS ; i++)
+    pthread_join(threads[i], NULL);
+
+  /* No oid may have been handed out twice */
+  q = kvdb_create_q(k);
+  kvdb_q_set_match_app_class(q, APP, CL);
+  KVASSERT(kvdb_q_count(q, &count), "kvdb_q_count failed");
+  KVASSERT(count == THREADS * THREAD_OBJECTS + 1, "wrong count %d",
+           (int)count);
+  kvdb_q_destroy(q);
+  KVASSERT(kvdb_commit(k), "kvdb_commit failed");
+
+  /* Readers of other threads outlive the writer */
+  KVASSERT(!pthread_create(&threads[0], NULL, _outlive_main, NULL),
+           "pthread_create failed");
+  _outlive_wait(1);
+  kvdb_destroy(k);
+  _outlive_set(2);
+  pthread_join(threads[0], NULL);
+}
+
+static int _refuse_commit(void *arg)
+{
+  return 1;
+}
+
+/* Group commit; tickets, and the interval for changes without one. */
+void test_async(void)
+{
+  struct kvdb_options_struct options = { .journal_mode = KVDB_JOURNAL_WAL,
+                                         .async_commit = true,
+                                         .commit_interval_ms = 10 };
+  kvdb k, r_k;
+  kvdb_o o;
+  kvdb_query q;
+  kvdb_commit_ticket t, t2;
+  int64_t count;
+  bool r;
+
+  unlink(FILENAME_WAL);
+  unlink(FILENAME_WAL "-wal");
+  unlink(FILENAME_WAL "-shm");
+  r = kvdb_create_with_options(FILENAME_WAL, &options, &k);
+  KVASSERT(r, "kvdb_create_with_options failed: %s", kvdb_strerror(k));
+  r = kvdb_open_reader(k, &r_k);
+  KVASSERT(r, "kvdb_open_reader failed: %s", kvdb_strerror(k));
+
+  o = kvdb_create_o(k, APP, CL);
+  KVASSERT(o, "kvdb_create_o failed");
+  t = kvdb_commit_async(k);
+  o = kvdb_create_o(k, APP, CL);
+  KVASSERT(o, "kvdb_create_o failed");
+  t2 = kvdb_commit_async(k);
+  KVASSERT(t && t2 > t, "bad tickets");
+  KVASSERT(kvdb_commit_wait(k, t2), "kvdb_commit_wait failed");
+  KVASSERT(kvdb_commit_wait(k, t), "kvdb_commit_wait (old) failed");
+
+  KVASSERT(kvdb_commit(r_k), "reader refresh failed");
+  q = kvdb_create_q(r_k);
+  kvdb_q_set_match_app_class(q, kvdb_define_app(r_k, "app"),
+                             kvdb_define_class(r_k, "cl"));
+  KVASSERT(kvdb_q_count(q, &count) && count == 2, "wrong count");
+  kvdb_q_destroy(q);
+
+  /* No ticket, but still committed within the interval */
+  o = kvdb_create_o(k, APP, CL);
+  KVASSERT(o, "kvdb_create_o failed");
+  usleep(200 * 1000);
+  KVASSERT(kvdb_commit(r_k), "reader refresh failed");
+  q = kvdb_create_q(r_k);
+  kvdb_q_set_match_app_class(q, kvdb_define_app(r_k, "app"),
+                             kvdb_define_class(r_k, "cl"));
+  KVASSERT(kvdb_q_count(q, &count) && count == 3, "wrong count %d",
+           (int)count);
+  kvdb_q_destroy(q);
+
+  /* A failed group commit fails the tickets it covered (or, if the
+   * interval got there first, the next one), but not the ones before
+   * or after it. */
+  sqlite3_commit_hook(k->db, _refuse_commit, NULL);
+  o = kvdb_create_o(k, APP, CL);
+  KVASSERT(o, "kvdb_create_o failed");
+  t = kvdb_commit_async(k);
+  KVASSERT(!kvdb_commit_wait(k, t), "failed commit succeeded");
+  KVASSERT(kvdb_commit_wait(k, t2), "kvdb_commit_wait (old) failed");
+  sqlite3_commit_hook(k->db, NULL, NULL);
+  t2 = kvdb_commit_async(k);
+  KVASSERT(kvdb_commit_wait(k, t2), "kvdb_commit_wait failed");
+  KVASSERT(!kvdb_commit_wait(k, t), "failed commit succeeded later");
+
+  kvdb_destroy(r_k);
+  kvdb_destroy(k);
+}
+
+static int64_t _pragma(kvdb k, const char *q)
+{
+  sqlite3_stmt *stmt;
+  int64_t v = -1;
+
+  KVASSERT(sqlite3_prepare_v2(k->db, q, -1, &stmt, NULL) == SQLITE_OK,
+           "prepare failed");
+  if (sqlite3_step(stmt) == SQLITE_ROW)
+    v = sqlite3_column_int64(stmt, 0);
+  sqlite3_finalize(stmt);
+  return v;
+}
+
+/* Presets (and tweaks on top of them) reach SQLite. */
+void test_options(void)
+{
+  struct kvdb_options_struct options;
+  kvdb k;
+  int i;
+  bool r;
+
+  unlink(FILENAME_WAL);
+  unlink(FILENAME_WAL "-wal");
+  unlink(FILENAME_WAL "-shm");
+  kvdb_options_init(&options, KVDB_PRESET_MOBILE);
+  options.page_size = 8192;
+  options.vacuum_interval = 1;
+  r = kvdb_create_with_options(FILENAME_WAL, &options, &k);
+  KVASSERT(r, "kvdb_create_with_options failed: %s", kvdb_strerror(k));
+  KVASSERT(_pragma(k, "PRAGMA page_size") == 8192, "wrong page_size");
+  KVASSERT(_pragma(k, "PRAGMA synchronous") == 1, "wrong synchronous");
+  KVASSERT(_pragma(k, "PRAGMA cache_size") == -1024, "wrong cache_size");
+  KVASSERT(_pragma(k, "PRAGMA auto_vacuum") == 2, "wrong auto_vacuum");
+
+  /* Free pages go away at (the next) commit */
+  for (i = 0 ; i < 500 ; i++)
+    KVASSERT(kvdb_o_set_string(kvdb_create_o(k, APP, CL), KEYS, VALUES2),
+             "set failed");
+  KVASSERT(kvdb_commit(k), "kvdb_commit failed");
+  KVASSERT(sqlite3_exec(k->db, "DELETE FROM log", NULL, NULL, NULL)
+           == SQLITE_OK, "delete failed");
+  KVASSERT(kvdb_commit(k), "kvdb_commit failed");
+  KVASSERT(_pragma(k, "PRAGMA freelist_count") == 0, "pages left in freelist");
+  kvdb_destroy(k);
+}
+
+static bool _count_entry(void *context, kvdb_oid oid, const char *key,
+                         kvdb_type t, const void *value, size_t value_len,
+                         bool ext, kvdb_time_t time_added)
+{
+  int *count = context;
+
+  (*count)++;
+  return true;
+}
+
+static int _log_count(kvdb k)
+{
+  int count = 0;
+  bool r = k->log_ops->iterate(k, 0, false, _count_entry, &count);
+
+  KVASSERT(r, "log iterate failed: %s", kvdb_strerror(k));
+  return count;
+}
+
+/* Segment file log: committed history survives (and is exported),
+ * the rest is discarded on the next open. */
+void test_segments(void)
+{
+  struct kvdb_options_struct options;
+  struct kvdb_oid_struct oids[60];
+  struct stat st;
+  kvdb k;
+  kvdb_o o;
+  int i;
+  bool r;
+
+  unlink(FILENAME_SEG);
+  KVASSERT(system("rm -rf '" FILENAME_SEG "-log' '" LOGDIR_SEG "'") == 0,
+           "rm failed");
+  KVASSERT(mkdir(LOGDIR_SEG, 0700) == 0, "mkdir failed");
+  kvdb_options_init(&options, KVDB_PRESET_DEFAULT);
+  options.log_backend = KVDB_LOG_SEGMENTS;
+  options.log_segment_size = 1024;
+  r = kvdb_create_with_options(FILENAME_SEG, &options, &k);
+  KVASSERT(r, "kvdb_create_with_options failed: %s", kvdb_strerror(k));
+  KVASSERT(k->log, "no segment log");
+  for (i = 0 ; i < 50 ; i++)
+    {
+      o = kvdb_create_o(k, APP, CL);
+      oids[i] = o->oid;
+      KVASSERT(kvdb_o_set_int64(o, KEY, i), "set failed");
+      KVASSERT(kvdb_o_set_string(o, KEYS, VALUES2), "set failed");
+    }
+  KVASSERT(kvdb_commit(k), "kvdb_commit failed");
+  KVASSERT(_pragma(k, "SELECT count(*) FROM log") == 0, "log table used");
+  KVASSERT(_pragma(k, "SELECT count(*) FROM log_segments") > 1,
+           "segments not rolled over");
+  KVASSERT(lstat(FILENAME_SEG "-log/2.seg", &st) == 0, "no second segment");
+
+  /* Not committed; should not be there afterwards. */
+  o = kvdb_create_o(k, APP, CL);
+  KVASSERT(kvdb_o_set_int64(o, KEY, 1234), "set failed");
+  kvdb_destroy(k);
+
+  /* The backend sticks with the database. */
+  r = kvdb_create(FILENAME_SEG, &k);
+  KVASSERT(r, "kvdb_create failed: %s", kvdb_strerror(k));
+  KVASSERT(k->log, "no segment log");
+  KVASSERT(_log_count(k) == 4 * 50, "wrong # of log entries");
+  r = kvdb_export(k, LOGDIR_SEG, false);
+  KVASSERT(r, "kvdb_export failed: %s", kvdb_strerror(k));
+
+  /* The next export has only what was added after the first one. */
+  for (i = 50 ; i < 60 ; i++)
+    {
+      o = kvdb_create_o(k, APP, CL);
+      oids[i] = o->oid;
+      KVASSERT(kvdb_o_set_int64(o, KEY, i), "set failed");
+      KVASSERT(kvdb_o_set_string(o, KEYS, VALUES2), "set failed");
+    }
+  KVASSERT(kvdb_commit(k), "kvdb_commit failed");
+  r = kvdb_export(k, LOGDIR_SEG, false);
+  KVASSERT(r, "kvdb_export failed: %s", kvdb_strerror(k));
+  kvdb_destroy(k);
+
+  /* Import it to a database with the log table. */
+  unlink(FILENAME_SEG);
+  r = kvdb_create(FILENAME_SEG, &k);
+  KVASSERT(r, "kvdb_create failed: %s", kvdb_strerror(k));
+  KVASSERT(!k->log, "segment log without asking for it");
+  r = kvdb_import(k, LOGDIR_SEG);
+  KVASSERT(r, "kvdb_import failed");
+  for (i = 0 ; i < 60 ; i++)
+    {
+      o = kvdb_get_o_by_id(k, &oids[i]);
+      KVASSERT(o, "object %d missing", i);
+      KVASSERT(*kvdb_o_get_int64(o, KEY) == i, "wrong value");
+      KVASSERT(strcmp(kvdb_o_get_string(o, KEYS), VALUES2) == 0,
+               "wrong string");
+    }
+  /* (_app, _class, and the two keys, for every object) */
+  KVASSERT(_pragma(k, "SELECT count(*) FROM log") == 4 * 60,
+           "wrong # of log entries");
+  KVASSERT(_log_count(k) == 4 * 60, "wrong # of log entries");
+  kvdb_destroy(k);
+}
+
+/* In-memory database, with snapshots to (and from) disk. */
+void test_memory(void)
+{
+  struct kvdb_options_struct options;
+  struct kvdb_oid_struct oid;
+  kvdb k, r;
+  kvdb_o o;
+  bool rv;
+
+  unlink(FILENAME_SNAPSHOT);
+  kvdb_options_init(&options, KVDB_PRESET_SERVER);
+  options.snapshot_path = FILENAME_SNAPSHOT;
+  rv = kvdb_create_with_options(KVDB_MEMORY, &options, &k);
+  KVASSERT(rv, "kvdb_create_with_options failed: %s", kvdb_strerror(k));
+  KVASSERT(!kvdb_open_reader(k, &r), "in-memory reader should fail");
+  o = kvdb_create_o(k, APP, CL);
+  oid = o->oid;
+  KVASSERT(kvdb_o_set_int64(o, KEY, VALUE), "set failed");
+  KVASSERT(kvdb_commit(k), "kvdb_commit failed");
+  /* Not committed, not in the snapshot either */
+  KVASSERT(kvdb_o_set_int64(kvdb_create_o(k, APP, CL), KEY, 1), "set failed");
+  kvdb_destroy(k);
+
+  /* The snapshot is a normal database.. */
+  rv = kvdb_create(FILENAME_SNAPSHOT, &k);
+  KVASSERT(rv, "kvdb_create failed: %s", kvdb_strerror(k));
+  o = kvdb_get_o_by_id(k, &oid);
+  KVASSERT(o && *kvdb_o_get_int64(o, KEY) == VALUE, "snapshot missing data");
+  KVASSERT(_pragma(k, "SELECT count(*) FROM cs WHERE key='key'") == 1,
+           "uncommitted data in snapshot");
+  kvdb_destroy(k);
+
+  /* ..and where the next in-memory database starts from. */
+  rv = kvdb_create_with_options(KVDB_MEMORY, &options, &k);
+  KVASSERT(rv, "kvdb_create_with_options failed: %s", kvdb_strerror(k));
+  o = kvdb_get_o_by_id(k, &oid);
+  KVASSERT(o && *kvdb_o_get_int64(o, KEY) == VALUE, "snapshot not loaded");
+  rv = kvdb_snapshot(k, FILENAME_SNAPSHOT ".2");
+  KVASSERT(rv, "kvdb_snapshot failed: %s", kvdb_strerror(k));
+  kvdb_destroy(k);
+  unlink(FILENAME_SNAPSHOT ".2");
+}
+
+static int _loaded_count(kvdb_o o)
+{
+  kvdb_o_a a;
+  int count = 0;
+
+  list_for_each_entry(a, &o->al, lh)
+    count += a->loaded;
+  return count;
+}
+
+/* Values are read from cs only when asked for (or prefetched). */
+void test_lazy(void)
+{
+  struct kvdb_oid_struct oid, oid2;
+  kvdb k;
+  kvdb_o o;
+  char blob[4096];
+  struct kvdb_typed_value_struct ktv;
+  kvdb_key kb;
+  bool r;
+
+  unlink(FILENAME_LAZY);
+  r = kvdb_create(FILENAME_LAZY, &k);
+  KVASSERT(r, "kvdb_create failed: %s", kvdb_strerror(k));
+  kb = kvdb_define_key(k, "blob", KVDB_BINARY);
+  memset(blob, 42, sizeof(blob));
+  _kvdb_tv_set_binary(&ktv, blob, sizeof(blob));
+  o = kvdb_create_o(k, APP, CL);
+  oid = o->oid;
+  KVASSERT(kvdb_o_set_int64(o, KEY, VALUE), "set failed");
+  KVASSERT(kvdb_o_set_string(o, KEYS, VALUES), "set failed");
+  KVASSERT(kvdb_o_set(o, kb, &ktv), "set failed");
+  o = kvdb_create_o(k, APP, CL);
+  oid2 = o->oid;
+  KVASSERT(kvdb_o_set_int64(o, KEY, VALUE), "set failed");
+  KVASSERT(kvdb_o_set(o, kb, &ktv), "set failed");
+  KVASSERT(kvdb_commit(k), "kvdb_commit failed");
+  kvdb_destroy(k);
+
+  r = kvdb_create(FILENAME_LAZY, &k);
+  KVASSERT(r, "kvdb_create failed: %s", kvdb_strerror(k));
+  o = kvdb_get_o_by_id(k, &oid);
+  KVASSERT(o, "kvdb_get_o_by_id failed");
+  KVASSERT(o->app == APP && o->cl == CL, "app/class not loaded");
+  KVASSERT(_loaded_count(o) == 0, "values loaded too early");
+  KVASSERT(*kvdb_o_get_int64(o, KEY) == VALUE, "wrong value");
+  KVASSERT(_loaded_count(o) == 1, "more than one value loaded");
+  KVASSERT(!kvdb_o_get(o, KEYO), "nonexistent key found");
+  KVASSERT(_loaded_count(o) == 1, "more than one value loaded");
+
+  /* Setting an unloaded value works */
+  KVASSERT(kvdb_o_set_string(o, KEYS, VALUES2), "set failed");
+  KVASSERT(_loaded_count(o) == 2, "value not loaded by set");
+  KVASSERT(strcmp(kvdb_o_get_string(o, KEYS), VALUES2) == 0, "wrong value");
+
+  /* Prefetched keys are there right away */
+  r = kvdb_class_prefetch_key(k, CL, KEY);
+  KVASSERT(r, "kvdb_class_prefetch_key failed");
+  o = kvdb_get_o_by_id(k, &oid2);
+  KVASSERT(o && _loaded_count(o) == 1, "prefetch failed");
+  kb = kvdb_define_key(k, "blob", KVDB_BINARY);
+  KVASSERT(kvdb_o_get(o, kb)->v.binary.ptr_size == sizeof(blob),
+           "wrong blob");
+  KVASSERT(kvdb_commit(k), "kvdb_commit failed");
+  kvdb_destroy(k);
+
+  r = kvdb_create(FILENAME_LAZY, &k);
+  KVASSERT(r, "kvdb_create failed: %s", kvdb_strerror(k));
+  r = kvdb_class_prefetch_key(k, CL, NULL);
+  KVASSERT(r, "kvdb_class_prefetch_key failed");
+  o = kvdb_get_o_by_id(k, &oid);
+  KVASSERT(o && _loaded_count(o) == 3, "prefetch of everything failed");
+  KVASSERT(strcmp(kvdb_o_get_string(o, KEYS), VALUES2) == 0, "wrong value");
+  kvdb_destroy(k);
+}
+
+/* Large values are shared with the caller, or streamed from cs. */
+void test_blob(void)
+{
+  struct kvdb_oid_struct oid;
+  size_t len = 1024 * 1024;
+  kvdb_buffer b, b2, b3;
+  kvdb_blob_stream bs;
+  char buf[4096];
+  kvdb k;
+  kvdb_o o;
+  kvdb_key kb;
+  bool r;
+
+  unlink(FILENAME_BLOB);
+  r = kvdb_create(FILENAME_BLOB, &k);
+  KVASSERT(r, "kvdb_create failed: %s", kvdb_strerror(k));
+  kb = kvdb_define_key(k, "blob", KVDB_BINARY);
+  b = kvdb_buffer_create(len);
+  KVASSERT(b, "kvdb_buffer_create failed");
+  memset(kvdb_buffer_data(b), 42, len);
+  o = kvdb_create_o(k, APP, CL);
+  oid = o->oid;
+  KVASSERT(kvdb_o_set_buffer(o, kb, b), "kvdb_o_set_buffer failed");
+  KVASSERT(kvdb_o_set_int64(o, KEY, VALUE), "set failed");
+  KVASSERT(kvdb_o_get(o, kb)->v.binary.ptr == kvdb_buffer_data(b),
+           "buffer copied");
+  b2 = kvdb_o_get_buffer(o, kb);
+  KVASSERT(b2 == b, "buffer not shared");
+  kvdb_buffer_unref(b2);
+  KVASSERT(kvdb_commit(k), "kvdb_commit failed");
+
+  bs = kvdb_o_get_blob_stream(o, kb);
+  KVASSERT(bs, "kvdb_o_get_blob_stream failed: %s", kvdb_strerror(k));
+  KVASSERT(kvdb_blob_stream_len(bs) == len, "wrong stream length");
+  r = kvdb_blob_stream_read(bs, buf, sizeof(buf), len - sizeof(buf));
+  KVASSERT(r, "kvdb_blob_stream_read failed: %s", kvdb_strerror(k));
+  KVASSERT(buf[0] == 42 && buf[sizeof(buf) - 1] == 42, "wrong content");
+  KVASSERT(!kvdb_blob_stream_read(bs, buf, sizeof(buf), len),
+           "read past the end");
+  KVASSERT(!kvdb_blob_stream_read(bs, buf, sizeof(buf), SIZE_MAX),
+           "read past the end (wrapping)");
+  KVASSERT(!kvdb_o_get_blob_stream(o, KEYO), "stream of nonexistent key");
+  /* Streams survive commits */
+  KVASSERT(kvdb_o_set_int64(o, KEY, VALUE + 1), "set failed");
+  KVASSERT(kvdb_commit(k), "kvdb_commit failed: %s", kvdb_strerror(k));
+  r = kvdb_blob_stream_read(bs, buf, sizeof(buf), 0);
+  KVASSERT(r, "kvdb_blob_stream_read failed: %s", kvdb_strerror(k));
+
+  /* Setting the value again does not affect existing references.. */
+  b3 = kvdb_buffer_create(len);
+  memset(kvdb_buffer_data(b3), 7, len);
+  KVASSERT(kvdb_o_set_buffer(o, kb, b3), "kvdb_o_set_buffer failed");
+  kvdb_buffer_unref(b3);
+  KVASSERT(((char *)kvdb_buffer_data(b))[len - 1] == 42, "buffer changed");
+  kvdb_buffer_unref(b);
+  /* ..but streams are invalidated. */
+  KVASSERT(!kvdb_blob_stream_read(bs, buf, sizeof(buf), 0),
+           "stale stream read succeeded");
+  kvdb_blob_stream_close(bs);
+  KVASSERT(kvdb_commit(k), "kvdb_commit failed");
+  kvdb_destroy(k);
+
+  r = kvdb_create(FILENAME_BLOB, &k);
+  KVASSERT(r, "kvdb_create failed: %s", kvdb_strerror(k));
+  kb = kvdb_define_key(k, "blob", KVDB_BINARY);
+  o = kvdb_get_o_by_id(k, &oid);
+  KVASSERT(o, "kvdb_get_o_by_id failed");
+  b = kvdb_o_get_buffer(o, kb);
+  b2 = kvdb_o_get_buffer(o, kb);
+  KVASSERT(b && b == b2 && kvdb_buffer_len(b) == len, "buffer not shared");
+  KVASSERT(((char *)kvdb_buffer_data(b))[0] == 7, "wrong content");
+  kvdb_buffer_unref(b);
+  kvdb_buffer_unref(b2);
+  b = kvdb_o_get_buffer(o, KEY);
+  KVASSERT(b && kvdb_buffer_len(b) == sizeof(int64_t)
+           && *(int64_t *)kvdb_buffer_data(b) == VALUE + 1,
+           "wrong small value");
+  kvdb_buffer_unref(b);
+  kvdb_destroy(k);
+}
+
+/* Big values are stored once in the blob directory, and shipped once
+ * by export. */
+void test_blobs(void)
+{
+  struct kvdb_options_struct options;
+  struct kvdb_oid_struct oid, oid2;
+  struct kvdb_typed_value_struct ktv;
+  unsigned char digest[SHA256_SIZE];
+  char blob[65536], buf[256], path[320];
+  kvdb_blob_stream bs;
+  kvdb_buffer b;
+  kvdb k;
+  kvdb_o o;
+  kvdb_key kb;
+  bool r;
+  int i;
+
+  sprintf(buf, "rm -rf %s* %s* '%s'",
+          FILENAME_BLOBS, FILENAME_BLOBS2, LOGDIR_BLOBS);
+  system(buf);
+  KVASSERT(!mkdir(LOGDIR_BLOBS, 0700), "mkdir failed");
+  for (i = 0 ; i < (int)sizeof(blob) ; i++)
+    blob[i] = i * 7;
+  _kvdb_tv_set_binary(&ktv, blob, sizeof(blob));
+
+  kvdb_options_init(&options, KVDB_PRESET_DEFAULT);
+  options.log_backend = KVDB_LOG_SEGMENTS;
+  options.blob_threshold = 1024;
+  r = kvdb_create_with_options(FILENAME_BLOBS, &options, &k);
+  KVASSERT(r, "kvdb_create_with_options failed: %s", kvdb_strerror(k));
+  kb = kvdb_define_key(k, "blob", KVDB_BINARY);
+  o = kvdb_create_o(k, APP, CL);
+  oid = o->oid;
+  KVASSERT(kvdb_o_set(o, kb, &ktv), "set failed");
+  KVASSERT(kvdb_o_set_string(o, KEYS, VALUES2), "set failed");
+  o = kvdb_create_o(k, APP, CL);
+  oid2 = o->oid;
+  KVASSERT(kvdb_o_set(o, kb, &ktv), "set failed");
+  KVASSERT(kvdb_commit(k), "kvdb_commit failed");
+  KVASSERT(_pragma(k, "SELECT count(*) FROM cs WHERE ext AND length(value)=32")
+           == 2, "blobs within cs");
+  sha256(blob, sizeof(blob), digest);
+  _kvdb_blob_path(k, digest, path, sizeof(path));
+  KVASSERT(access(path, R_OK) == 0, "no blob file");
+  kvdb_destroy(k);
+
+  r = kvdb_create_with_options(FILENAME_BLOBS, &options, &k);
+  KVASSERT(r, "kvdb_create_with_options failed: %s", kvdb_strerror(k));
+  kb = kvdb_define_key(k, "blob", KVDB_BINARY);
+  o = kvdb_get_o_by_id(k, &oid);
+  KVASSERT(o, "kvdb_get_o_by_id failed");
+  b = kvdb_o_get_buffer(o, kb);
+  KVASSERT(b && kvdb_buffer_len(b) == sizeof(blob)
+           && memcmp(kvdb_buffer_data(b), blob, sizeof(blob)) == 0,
+           "wrong blob content");
+  kvdb_buffer_unref(b);
+  bs = kvdb_o_get_blob_stream(kvdb_get_o_by_id(k, &oid2), kb);
+  KVASSERT(bs && kvdb_blob_stream_len(bs) == sizeof(blob),
+           "kvdb_o_get_blob_stream failed: %s", kvdb_strerror(k));
+  KVASSERT(kvdb_blob_stream_read(bs, buf, sizeof(buf), 1000)
+           && memcmp(buf, blob + 1000, sizeof(buf)) == 0, "wrong stream read");
+  kvdb_blob_stream_close(bs);
+  r = kvdb_export(k, LOGDIR_BLOBS, false);
+  KVASSERT(r, "kvdb_export failed: %s", kvdb_strerror(k));
+  kvdb_destroy(k);
+  for (i = 0 ; i < SHA256_SIZE ; i++)
+    sprintf(buf + 2 * i, "%02x", digest[i]);
+  sprintf(path, "%s/%s.blob", LOGDIR_BLOBS, buf);
+  KVASSERT(access(path, R_OK) == 0, "blob not exported");
+
+  /* The importer decides for itself (here: inline) */
+  r = kvdb_create(FILENAME_BLOBS2, &k);
+  KVASSERT(r, "kvdb_create failed: %s", kvdb_strerror(k));
+  r = kvdb_import(k, LOGDIR_BLOBS);
+  KVASSERT(r, "kvdb_import failed: %s", kvdb_strerror(k));
+  kb = kvdb_define_key(k, "blob", KVDB_BINARY);
+  o = kvdb_get_o_by_id(k, &oid2);
+  KVASSERT(o && kvdb_o_get(o, kb)->v.binary.ptr_size == sizeof(blob)
+           && memcmp(kvdb_o_get(o, kb)->v.binary.ptr, blob, sizeof(blob)) == 0,
+           "wrong imported blob");
+  KVASSERT(strcmp(kvdb_o_get_string(kvdb_get_o_by_id(k, &oid), KEYS),
+                  VALUES2) == 0, "wrong imported value");
+  KVASSERT(_pragma(k, "SELECT count(*) FROM cs WHERE ext") == 0,
+           "import used blobs");
+  kvdb_destroy(k);
+}
+
+/* Values are loaded with their type, stored natively in cs, and
+ * keep it across export + import; rows from before types are
+ * retyped by the getters. */
+void test_types(void)
+{
+  struct kvdb_typed_value_struct ktv;
+  struct kvdb_oid_struct oid;
+  unsigned char vbuf[KVDB_LOG_VALUE_BUF];
+  const void *p;
+  size_t len;
+  double d = 1.0;
+  sqlite3 *db;
+  sqlite3_stmt *s;
+  int64_t v = VALUE;
+  kvdb k;
+  kvdb_o o;
+  char buf[128];
+  bool r;
+
+  /* Log files have zigzag varint integers, and big-endian doubles */
+  len = sizeof(v);
+  p = _kvdb_log_encode_value(KVDB_INTEGER, &v, &len, vbuf);
+  KVASSERT(len == 1 && *(unsigned char *)p == 2 * VALUE, "wrong encoding");
+  KVASSERT(_kvdb_log_decode_value(KVDB_LOG_VERSION, KVDB_INTEGER,
+                                  &p, &len, vbuf), "decode failed");
+  KVASSERT(len == sizeof(v) && *(int64_t *)p == VALUE, "wrong decoding");
+  len = sizeof(d);
+  p = _kvdb_log_encode_value(KVDB_DOUBLE, &d, &len, vbuf);
+  KVASSERT(len == sizeof(d) && memcmp(p, "\x3f\xf0\0\0\0\0\0\0", len) == 0,
+           "wrong double encoding");
+  len = 3;
+  p = vbuf;
+  KVASSERT(!_kvdb_log_decode_value(KVDB_LOG_VERSION, KVDB_DOUBLE,
+                                   &p, &len, vbuf), "short double decoded");
+
+  unlink(FILENAME_TYPES);
+  sprintf(buf, "rm -rf '%s'", LOGDIR_TYPES);
+  system(buf);
+  KVASSERT(!mkdir(LOGDIR_TYPES, 0700), "mkdir failed");
+
+  r = kvdb_create(FILENAME_TYPES, &k);
+  KVASSERT(r, "kvdb_create failed: %s", kvdb_strerror(k));
+  o = kvdb_create_o(k, APP, CL);
+  oid = o->oid;
+  KVASSERT(kvdb_o_set_int64(o, KEY, VALUE), "set failed");
+  KVASSERT(kvdb_o_set_string(o, KEYS, VALUES), "set failed");
+  KVASSERT(kvdb_o_set_object(o, KEYO, o), "set failed");
+  ktv.t = KVDB_DOUBLE;
+  ktv.v.d = -0.25;
+  KVASSERT(kvdb_o_set(o, KEYD, &ktv), "set failed");
+  KVASSERT(kvdb_o_set_int64(o, KEYI, INT64_MIN), "set failed");
+  KVASSERT(kvdb_commit(k), "kvdb_commit failed");
+  kvdb_destroy(k);
+
+  r = kvdb_create(FILENAME_TYPES, &k);
+  KVASSERT(r, "kvdb_create failed: %s", kvdb_strerror(k));
+  o = kvdb_get_o_by_id(k, &oid);
+  KVASSERT(o, "kvdb_get_o_by_id failed");
+  KVASSERT(kvdb_o_get(o, KEY)->t == KVDB_INTEGER, "integer not typed");
+  KVASSERT(kvdb_o_get(o, KEYS)->t == KVDB_STRING, "string not typed");
+  KVASSERT(kvdb_o_get(o, KEYO)->t == KVDB_OBJECT, "object not typed");
+  KVASSERT(_pragma(k, "SELECT count(*) FROM cs "
+                   "WHERE key='key' AND value BETWEEN 40 AND 50") == 1,
+           "integer not comparable in SQL");
+  KVASSERT(_pragma(k, "SELECT count(*) FROM cs "
+                   "WHERE key='key2' AND value='" VALUES "'") == 1,
+           "string not text in SQL");
+  KVASSERT(kvdb_export(k, LOGDIR_TYPES, false), "kvdb_export failed");
+  kvdb_destroy(k);
+
+  /* Make the rows look like they are from before types */
+  KVASSERT(sqlite3_open(FILENAME_TYPES, &db) == SQLITE_OK, "open failed");
+  KVASSERT(sqlite3_prepare_v2(db, "UPDATE cs SET type=NULL, value=?1 "
+                              "WHERE key=?2", -1, &s, NULL) == SQLITE_OK,
+           "prepare failed");
+  sqlite3_bind_blob(s, 1, &v, sizeof(v), SQLITE_STATIC);
+  sqlite3_bind_text(s, 2, "key", -1, SQLITE_STATIC);
+  KVASSERT(sqlite3_step(s) == SQLITE_DONE, "update failed");
+  sqlite3_reset(s);
+  sqlite3_bind_blob(s, 1, VALUES, sizeof(VALUES), SQLITE_STATIC);
+  sqlite3_bind_text(s, 2, "key2", -1, SQLITE_STATIC);
+  KVASSERT(sqlite3_step(s) == SQLITE_DONE, "update failed");
+  sqlite3_finalize(s);
+  sqlite3_close(db);
+
+  r = kvdb_create(FILENAME_TYPES, &k);
+  KVASSERT(r, "kvdb_create failed: %s", kvdb_strerror(k));
+  o = kvdb_get_o_by_id(k, &oid);
+  KVASSERT(o, "kvdb_get_o_by_id failed");
+  KVASSERT(kvdb_o_get(o, KEY)->t == KVDB_BINARY_SMALL, "untyped row typed");
+  KVASSERT(*kvdb_o_get_int64(o, KEY) == VALUE, "wrong untyped integer");
+  KVASSERT(kvdb_o_get(o, KEY)->t == KVDB_INTEGER, "not retyped");
+  KVASSERT(strcmp(kvdb_o_get_string(o, KEYS), VALUES) == 0,
+           "wrong untyped string");
+  kvdb_destroy(k);
+
+  /* Imported values have their type without a key telling it */
+  unlink(FILENAME_TYPES);
+  r = kvdb_create(FILENAME_TYPES, &k);
+  KVASSERT(r, "kvdb_create failed: %s", kvdb_strerror(k));
+  KVASSERT(kvdb_import(k, LOGDIR_TYPES), "kvdb_import failed");
+  o = kvdb_get_o_by_id(k, &oid);
+  KVASSERT(o, "imported object missing");
+  KVASSERT(kvdb_o_get(o, kvdb_define_key(k, "key", KVDB_NULL))->t
+           == KVDB_INTEGER, "imported integer not typed");
+  KVASSERT(kvdb_o_get(o, kvdb_define_key(k, "key2", KVDB_NULL))->t
+           == KVDB_STRING, "imported string not typed");
+  KVASSERT(*kvdb_o_get_int64(o, KEY) == VALUE, "wrong imported value");
+  KVASSERT(*kvdb_o_get_int64(o, KEYI) == INT64_MIN, "wrong imported value");
+  KVASSERT(kvdb_o_get(o, KEYD)->t == KVDB_DOUBLE
+           && kvdb_o_get(o, KEYD)->v.d == -0.25, "wrong imported double");
+  kvdb_destroy(k);
+}
+
+/* Log compaction keeps what the retention limits ask for, and
+ * nothing else. */
+void test_compact(void)
+{
+  struct kvdb_options_struct options;
+  kvdb k;
+  kvdb_o o;
+  int i, n;
+  bool r;
+
+  unlink(FILENAME_COMPACT);
+  KVASSERT(system("rm -rf '" LOGDIR_COMPACT "'") == 0, "rm failed");
+  KVASSERT(mkdir(LOGDIR_COMPACT, 0700) == 0, "mkdir failed");
+  kvdb_options_init(&options, KVDB_PRESET_DEFAULT);
+  options.log_keep_versions = 2;
+  options.compact_interval = 20;
+  options.compact_rows = 10;
+  r = kvdb_create_with_options(FILENAME_COMPACT, &options, &k);
+  KVASSERT(r, "kvdb_create_with_options failed: %s", kvdb_strerror(k));
+
+  /* In batches along with the commits... */
+  o = kvdb_create_o(k, APP, CL);
+  for (i = 0 ; i < 100 ; i++)
+    {
+      KVASSERT(kvdb_o_set_int64(o, KEY, i), "set failed");
+      KVASSERT(kvdb_commit(k), "kvdb_commit failed");
+    }
+  n = _pragma(k, "SELECT count(*) FROM log WHERE key='key'");
+  KVASSERT(n > 2 && n < 100, "wrong # of versions left: %d", n);
+
+  /* ...or all at once. */
+  r = kvdb_compact(k);
+  KVASSERT(r, "kvdb_compact failed: %s", kvdb_strerror(k));
+  KVASSERT(_pragma(k, "SELECT count(*) FROM log WHERE key='key'") == 2,
+           "wrong # of versions left");
+  KVASSERT(_pragma(k, "SELECT min(value) FROM log WHERE key='key'") == 98,
+           "wrong versions left");
+  KVASSERT(_pragma(k, "SELECT count(*) FROM log") == 4,
+           "_app and _class gone");
+  KVASSERT(_pragma(k, "PRAGMA freelist_count") == 0, "pages left in freelist");
+  KVASSERT(*kvdb_o_get_int64(o, KEY) == 99, "wrong value");
+
+  /* Only what has been exported goes. */
+  k->options.log_keep_versions = 0;
+  k->options.log_keep_unexported = true;
+  for (i = 100 ; i < 110 ; i++)
+    KVASSERT(kvdb_o_set_int64(o, KEY, i), "set failed");
+  KVASSERT(kvdb_compact(k), "kvdb_compact failed");
+  KVASSERT(_pragma(k, "SELECT count(*) FROM log") == 14,
+           "unexported entries gone");
+  /* (Entries added within the same millisecond as an export are
+   * exported again by the next one, so they stay.) */
+  usleep(2000);
+  r = kvdb_export(k, LOGDIR_COMPACT, false);
+  KVASSERT(r, "kvdb_export failed: %s", kvdb_strerror(k));
+  KVASSERT(kvdb_o_set_int64(o, KEY, 110), "set failed");
+  KVASSERT(kvdb_compact(k), "kvdb_compact failed");
+  KVASSERT(_pragma(k, "SELECT count(*) FROM log") == 1,
+           "exported entries left");
+  KVASSERT(_pragma(k, "SELECT value FROM log") == 110, "wrong entry left");
+  kvdb_destroy(k);
+
+  /* The segment backend drops whole segments. */
+  unlink(FILENAME_COMPACT_SEG);
+  KVASSERT(system("rm -rf '" FILENAME_COMPACT_SEG "-log' '"
+                  LOGDIR_COMPACT "'") == 0, "rm failed");
+  KVASSERT(mkdir(LOGDIR_COMPACT, 0700) == 0, "mkdir failed");
+  kvdb_options_init(&options, KVDB_PRESET_DEFAULT);
+  options.log_backend = KVDB_LOG_SEGMENTS;
+  options.log_segment_size = 1024;
+  options.log_keep_unexported = true;
+  r = kvdb_create_with_options(FILENAME_COMPACT_SEG, &options, &k);
+  KVASSERT(r, "kvdb_create_with_options failed: %s", kvdb_strerror(k));
+  for (i = 0 ; i < 50 ; i++)
+    KVASSERT(kvdb_o_set_string(kvdb_create_o(k, APP, CL), KEYS, VALUES2),
+             "set failed");
+  KVASSERT(kvdb_compact(k), "kvdb_compact failed");
+  n = _log_count(k);
+  KVASSERT(n == 3 * 50, "unexported entries gone");
+  r = kvdb_export(k, LOGDIR_COMPACT, false);
+  KVASSERT(r, "kvdb_export failed: %s", kvdb_strerror(k));
+  for (i = 0 ; i < 10 ; i++)
+    KVASSERT(kvdb_o_set_string(kvdb_create_o(k, APP, CL), KEYS, VALUES2),
+             "set failed");
+  KVASSERT(kvdb_compact(k), "kvdb_compact failed");
+  KVASSERT(access(FILENAME_COMPACT_SEG "-log/1.seg", F_OK) != 0,
+           "first segment left");
+  i = _log_count(k);
+  KVASSERT(i >= 3 * 10 && i < n, "wrong # of log entries: %d", i);
+
+  /* What is left is still exported. */
+  r = kvdb_export(k, LOGDIR_COMPACT, false);
+  KVASSERT(r, "kvdb_export failed: %s", kvdb_strerror(k));
+  kvdb_destroy(k);
+}
+
 int main(int argc, char **argv)
 {
   kvdb k;
@@ -168,5 +1105,27 @@ int main(int argc, char **argv)
 
   kvdb_destroy(k);
 
+  test_reader();
+
+  test_threads();
+
+  test_async();
+
+  test_options();
+
+  test_segments();
+
+  test_memory();
+
+  test_lazy();
+
+  test_blob();
+
+  test_blobs();
+
+  test_types();
+
+  test_compact();
+
   return 0;
 }
@@ -0,0 +1,63 @@
+/*
+ * $Id: sha256_test.c $
+ *
+ * Author: Markus Stenberg <fingon@iki.fi>
+ *
+ * Copyright (c) 2013 Markus Stenberg
+ *
+ */
+
+#define DEBUG
+
+#include "sha256.h"
+#include "util.h"
+
+#include <stdio.h>
+
+static void test_vector(const char *s, size_t len, size_t chunk,
+                        const char *exp_hex)
+{
+  unsigned char digest[SHA256_SIZE];
+  char hex[2 * SHA256_SIZE + 1];
+  sha256_ctx c;
+  size_t i;
+
+  sha256_init(&c);
+  for (i = 0 ; i < len ; i += chunk)
+    sha256_update(&c, s + i, len - i < chunk ? len - i : chunk);
+  sha256_final(&c, digest);
+  for (i = 0 ; i < SHA256_SIZE ; i++)
+    sprintf(hex + 2 * i, "%02x", digest[i]);
+  KVASSERT(strcmp(hex, exp_hex) == 0, "wrong digest %s (chunk %d)",
+           hex, (int)chunk);
+}
+
+int main(int argc, char **argv)
+{
+  static char million[1000000];
+  const char *s56 =
+    "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq";
+  size_t chunks[] = { 1, 3, 63, 64, 65, 1000000 };
+  unsigned char digest[SHA256_SIZE];
+  unsigned int i;
+
+  for (i = 0 ; i < sizeof(chunks) / sizeof(chunks[0]) ; i++)
+    {
+      test_vector("", 0, chunks[i],
+                  "e3b0c44298fc1c149afbf4c8996fb924"
+                  "27ae41e4649b934ca495991b7852b855");
+      test_vector("abc", 3, chunks[i],
+                  "ba7816bf8f01cfea414140de5dae2223"
+                  "b00361a396177a9cb410ff61f20015ad");
+      test_vector(s56, strlen(s56), chunks[i],
+                  "248d6a61d20638b8e5c026930c3e6039"
+                  "a33ce45964ff2167f6ecedd419db06c1");
+    }
+  memset(million, 'a', sizeof(million));
+  test_vector(million, sizeof(million), 4096,
+              "cdc76e5c9914fb9281a1c7e284d73e67"
+              "f1809a48a497200e046d39ccc7112cd0");
+  sha256("abc", 3, digest);
+  KVASSERT(digest[0] == 0xba && digest[31] == 0xad, "sha256() differs");
+  return 0;
+}
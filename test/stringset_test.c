@@ -16,6 +16,7 @@
 #endif /* !DEBUG */
 #include "stringset.h"
 #include "util.h"
+#include <pthread.h>
 
 typedef struct {
   stringset ss;
@@ -34,6 +35,55 @@ void produce_extra_data_callback(const char *key, void *ctx)
 }
 
 
+#define THREADS 4
+#define THREAD_STRINGS 1000
+
+static stringset thread_ss;
+static int thread_created;
+
+void count_callback(const char *key, void *ctx)
+{
+  /* Called only under the insertion lock */
+  thread_created++;
+}
+
+static void *_thread_main(void *arg)
+{
+  char buf[16];
+  int i, j;
+
+  /* Everyone inserts (and looks up) the same strings, while the
+   * table keeps growing underneath. */
+  for (i = 0 ; i < THREAD_STRINGS ; i++)
+    {
+      sprintf(buf, "s%d", i);
+      const char *s = stringset_get_or_insert(thread_ss, buf);
+      KVASSERT(s && strcmp(s, buf) == 0, "insert broken");
+      for (j = 0 ; j <= i ; j += 37)
+        {
+          sprintf(buf, "s%d", j);
+          KVASSERT(stringset_get(thread_ss, buf), "lost %s", buf);
+        }
+    }
+  return NULL;
+}
+
+void test_threads(void)
+{
+  pthread_t threads[THREADS];
+  int i;
+
+  thread_ss = stringset_create(0, count_callback, NULL);
+  for (i = 0 ; i < THREADS ; i++)
+    KVASSERT(!pthread_create(&threads[i], NULL, _thread_main, NULL),
+             "pthread_create failed");
+  for (i = 0 ; i < THREADS ; i++)
+    pthread_join(threads[i], NULL);
+  KVASSERT(thread_created == THREAD_STRINGS, "duplicates: %d",
+           thread_created);
+  stringset_destroy(thread_ss);
+}
+
 int main(int argc, char **argv)
 {
   stringset ss = stringset_create(0, NULL, NULL);
@@ -65,5 +115,7 @@ int main(int argc, char **argv)
   KVASSERT(*((char *)stringset_get_data_from_string(ss, stringset_get(ss, bar)))
            == 42+1, "wrong magic");
   stringset_destroy(ss);
+
+  test_threads();
   return 0;
 }